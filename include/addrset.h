@@ -0,0 +1,20 @@
+#ifndef ADDRSET_H
+#define ADDRSET_H
+
+#include <stddef.h>
+#include <stdbool.h>
+
+#include <netinet/in.h>
+
+struct addrset;
+
+struct addrset *addrset_new(size_t hint);
+void addrset_free(struct addrset *set);
+
+bool addrset_add(struct addrset *set, const struct in6_addr *addr);
+bool addrset_mark(struct addrset *set, const struct in6_addr *addr);
+bool addrset_marked(const struct addrset *set, const struct in6_addr *addr);
+
+size_t addrset_count(const struct addrset *set);
+
+#endif /* ADDRSET_H */
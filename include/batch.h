@@ -0,0 +1,25 @@
+#ifndef BATCH_H
+#define BATCH_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include <netinet/in.h>
+
+#include "conf.h"
+#include "loop.h"
+
+// Maximum number of RRs sent in a single UPDATE packet
+#define BATCH_MAX_RRS 64
+
+struct batch *batch_new(conf_serv *servconf, struct loop *loop);
+void batch_free(struct batch *batch);
+
+void batch_add(conf_if *ifconf, const struct sockaddr_in6 *addr, bool delete, uint32_t ttl);
+void batch_add_at(conf_if *ifconf, const struct sockaddr_in6 *addr, bool delete,
+        uint32_t ttl, int64_t time, uint64_t event);
+void batch_requeue(conf_if *ifconf, const struct sockaddr_in6 *addr, bool delete,
+        uint32_t ttl, uint64_t seq);
+void batch_flush(struct batch *batch);
+
+#endif /* BATCH_H */
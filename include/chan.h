@@ -0,0 +1,31 @@
+#ifndef CHAN_H
+#define CHAN_H
+
+#include <ldns/ldns.h>
+
+#include "loop.h"
+#include "tsig.h"
+
+struct chan;
+
+// Called once per request, with the (verified) reply or NULL on failure.
+// The reply is freed after the callback returns.
+typedef void (*chan_cb)(ldns_pkt *reply, ldns_status status, void *arg);
+
+// Requests go over UDP, or TCP if the resolver is set to use it. TCP connections
+// are kept open until they have been idle for `idle` milliseconds. Requests
+// are signed with `tsig` if it isn't NULL.
+struct chan *chan_new(ldns_resolver *resolv, struct tsig *tsig, struct loop *loop, uint32_t idle);
+void chan_free(struct chan *chan);
+
+bool chan_set_nameservers(struct chan *chan, const struct sockaddr_storage *addrs, size_t naddrs);
+
+struct loop *chan_loop(const struct chan *chan);
+size_t chan_inflight(const struct chan *chan);
+
+ldns_status chan_send_wire(struct chan *chan, const uint8_t *wire, size_t len,
+        chan_cb cb, void *arg);
+ldns_status chan_send(struct chan *chan, ldns_pkt *pkt, chan_cb cb, void *arg);
+void chan_cancel(struct chan *chan, chan_cb cb);
+
+#endif /* CHAN_H */
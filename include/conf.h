@@ -1,4 +1,8 @@
+#ifndef CONF_H
+#define CONF_H
+
 #include <stdint.h>
+#include <stdbool.h>
 
 #include <ldns/resolver.h>
 #include <ini.h>
@@ -8,27 +12,80 @@
 #define CONF_OPT_IFACE_DELETE_EXISTING (1 << 0)
 #define CONF_OPT_IFACE_RESPECT_TTL     (1 << 1)
 
+#define CONF_OPT_SERVER_TCP (1 << 0)
+
+#define CONF_OPT_GLOBAL_THREADED    (1 << 0)
+#define CONF_OPT_GLOBAL_STATE_TRUST (1 << 1)
+
+#define CONF_DEFAULT_RING_SIZE 1024
+#define CONF_DEFAULT_SYNC_TIMEOUT 10000
+#define CONF_DEFAULT_TCP_IDLE 30000
+#define CONF_DEFAULT_RETRY_BACKLOG 1024
+
 typedef struct conf_serv {
+    const char *name;
     ldns_rdf *server;
     ldns_rdf *zone;
     ldns_rdf *record;
     ldns_resolver *resolv;
     ldns_tsig_credentials cred;
+    struct tsig *tsig;
+    struct chan *chan;
+    struct batch *batch;
+    struct worker *worker;
+    struct shadow *shadow;
+    struct nscache *nscache;
+    struct retry *retry;
+    struct verify *verify;
+    struct metrics_serv *metrics;
+    // Lowest TTL of the nameserver addresses resolved for `server`
+    uint32_t ns_ttl;
+    uint32_t batch_window;
+    uint32_t tcp_idle;
+    // Failed changes kept around to be sent again, 0 disables retrying
+    uint32_t retry_backlog;
+    // Percentage of successful UPDATEs whose records are queried again
+    uint8_t verify_ratio;
     uint8_t opts;
 } conf_serv;
 
 typedef struct conf_if {
+    const char *name;
     conf_serv *server;
     ldns_rdf *zone;
     ldns_rdf *record;
+    // Hashes of the names above, computed once for the maps keyed by them
+    uint64_t zonehash, rechash;
     uint32_t ttl;
+    // Current interface index, 0 while the interface does not exist
+    int ifidx;
     uint8_t opts;
 } conf_if;
 
 struct conf {
+    // Read again on SIGHUP
+    char *path;
     map(conf_serv) *servers;
     map(conf_if) *ifaces;
+    uint32_t ringsize;
+    uint32_t nlrcvbuf;
+    uint32_t synctimeout;
+    char *statefile;
+    char *metricssock;
+    uint8_t opts;
 };
 
 struct conf conf_read(FILE *, const char *);
+int conf_load(FILE *, const char *, struct conf *);
 void conf_free(struct conf);
+
+void conf_resolve(conf_serv *servconf);
+void conf_cancel_serv(conf_serv *servconf);
+
+bool conf_serv_equal(const conf_serv *a, const conf_serv *b);
+bool conf_if_equal(const conf_if *a, const conf_if *b);
+
+void conf_keep_serv(struct conf *fresh, struct conf *live, const char *key);
+void conf_keep_if(struct conf *fresh, struct conf *live, const char *key);
+
+#endif /* CONF_H */
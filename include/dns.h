@@ -3,18 +3,52 @@
 
 #include <ldns/ldns.h>
 
+#include "chan.h"
+
+// Header plus the largest possible zone section
+#define DNS_WIRE_HDR_SIZE 12
+#define DNS_WIRE_UPDATE_INIT_MAX (DNS_WIRE_HDR_SIZE + 255 + 4)
+
+// Used by ldns for RRs without an explicit TTL
+#define DNS_DEFAULT_TTL 3600
+
+// TTL an RR is actually sent with, 0 standing for the default
+static inline uint32_t dns_update_ttl(bool delete, uint32_t ttl)
+{
+    if (delete)
+        return 0;
+
+    return ttl ? ttl : DNS_DEFAULT_TTL;
+}
+
 ldns_resolver *dns_sys_resolver(void);
 void dns_free_sys_resolver(void);
 
+uint64_t dns_dname_hash(const ldns_rdf *dname);
+
 const char *dns_get_errorstr_by_rcode(ldns_pkt_rcode rcode);
 
-ldns_resolver *dns_resolver_init_frm_dname(ldns_resolver *resolv, ldns_rdf *server);
+uint32_t dns_resolver_init_frm_dname(ldns_resolver *resolv, ldns_rdf *server);
+void dns_resolver_set_nameservers(ldns_resolver *resolv,
+        const struct sockaddr_storage *addrs, size_t naddrs);
 
 ldns_status dns_tsig_credentials_validate(ldns_tsig_credentials cred);
-void dns_resolver_set_tsig_credentials(ldns_resolver *resolv, ldns_tsig_credentials cred);
 
-void dns_send_update(ldns_rdf *zone, ldns_rr_list *uprrlist, ldns_resolver *resolv);
-void dns_do_update(ldns_resolver *resolv, ldns_rdf *zone, ldns_rdf *record,
+ldns_rr *dns_prepare_update_rr(ldns_rdf *record,
+        const struct sockaddr *addr, bool delete, uint32_t ttl);
+
+bool dns_reply_ok(const ldns_pkt *reply, ldns_status status);
+
+size_t dns_wire_update_init(uint8_t *wire, const ldns_rdf *zone);
+size_t dns_wire_update_push(uint8_t *wire, size_t len, size_t size, const ldns_rdf *record,
+        const struct in6_addr *addr, bool delete, uint32_t ttl);
+
+// Called once the server has answered an UPDATE, `ok` is false on any failure
+typedef void (*dns_update_done)(bool ok, void *arg);
+
+void dns_send_update(ldns_rdf *zone, ldns_rr_list *uprrlist, struct chan *chan,
+        dns_update_done cb, void *arg);
+void dns_do_update(struct chan *chan, ldns_rdf *zone, ldns_rdf *record,
         const struct sockaddr *addr, bool delete, uint32_t ttl);
 
 #endif /* DNS_H */
@@ -0,0 +1,14 @@
+#ifndef FILTER_H
+#define FILTER_H
+
+#include <stddef.h>
+
+#include <linux/filter.h>
+
+// Past this many interfaces, the filter no longer checks the interface index
+#define FILTER_MAX_IFACES 1024
+
+struct sock_filter *filter_build(const int *ifidx, size_t count, size_t *len);
+int filter_attach(int fd, const int *ifidx, size_t count);
+
+#endif /* FILTER_H */
@@ -1,10 +1,15 @@
+#ifndef HASH_H
+#define HASH_H
+
 #include <string.h>
+#include <stddef.h>
 #include <stdint.h>
 
-static uint64_t murmurhash64a(const char *key)
-{
-    size_t len = strlen(key);
+// None of these hashes are meant to be stable across builds or platforms,
+// they only spread keys over the slots of in-memory tables
 
+static inline uint64_t murmurhash64a_len(const void *key, size_t len)
+{
     const uint64_t m = 0xc6a4a7935bd1e995LLU;
     const int r = 47;
 
@@ -28,14 +33,12 @@ static uint64_t murmurhash64a(const char *key)
         data += 8;
     }
 
-    switch (len & 7) {
-        case 7: h ^= (uint64_t)data[6] << 48;
-        case 6: h ^= (uint64_t)data[5] << 40;
-        case 5: h ^= (uint64_t)data[4] << 32;
-        case 4: h ^= (uint64_t)data[3] << 24;
-        case 3: h ^= (uint64_t)data[2] << 16;
-        case 2: h ^= (uint64_t)data[1] << 8;
-        case 1: h ^= (uint64_t)data[0];
+    // Same as reading the tail byte by byte, on little-endian machines
+    if (len & 7) {
+        uint64_t k = 0;
+        memcpy(&k, data, len & 7);
+
+        h ^= k;
         h *= m;
     }
 
@@ -45,3 +48,142 @@ static uint64_t murmurhash64a(const char *key)
 
     return h;
 }
+
+static inline uint64_t murmurhash64a(const char *key)
+{
+    return murmurhash64a_len(key, strlen(key));
+}
+
+// 64x64 -> 128-bit multiplication, low half in `a` and high half in `b`
+static inline void wyhash_mum(uint64_t *a, uint64_t *b)
+{
+#ifdef __SIZEOF_INT128__
+    __extension__ unsigned __int128 r = (unsigned __int128)*a * *b;
+
+    *a = (uint64_t)r;
+    *b = (uint64_t)(r >> 64);
+#else
+    uint64_t ha = *a >> 32, hb = *b >> 32, la = (uint32_t)*a, lb = (uint32_t)*b;
+    uint64_t rh = ha * hb, rm0 = ha * lb, rm1 = hb * la, rl = la * lb;
+
+    uint64_t t = rl + (rm0 << 32), c = t < rl;
+    uint64_t lo = t + (rm1 << 32);
+
+    c += lo < t;
+
+    *a = lo;
+    *b = rh + (rm0 >> 32) + (rm1 >> 32) + c;
+#endif
+}
+
+static inline uint64_t wyhash_mix(uint64_t a, uint64_t b)
+{
+    wyhash_mum(&a, &b);
+    return a ^ b;
+}
+
+static inline uint64_t wyhash_r8(const uint8_t *p)
+{
+    uint64_t v;
+    memcpy(&v, p, sizeof v);
+
+    return v;
+}
+
+static inline uint64_t wyhash_r4(const uint8_t *p)
+{
+    uint32_t v;
+    memcpy(&v, p, sizeof v);
+
+    return v;
+}
+
+// wyhash final version 4, by Wang Yi (public domain)
+static inline uint64_t wyhash(const void *key, size_t len, uint64_t seed)
+{
+    static const uint64_t secret[4] = {
+        0x2d358dccaa6c78a5LLU, 0x8bb84b93962eacc9LLU,
+        0x4b33a62ed433d4a3LLU, 0x4d5a2da51de1aa47LLU
+    };
+
+    const uint8_t *p = (const uint8_t *)key;
+    uint64_t a, b;
+
+    seed ^= wyhash_mix(seed ^ secret[0], secret[1]);
+
+    if (len <= 16) {
+        if (len >= 4) {
+            a = (wyhash_r4(p) << 32) | wyhash_r4(p + ((len >> 3) << 2));
+            b = (wyhash_r4(p + len - 4) << 32) | wyhash_r4(p + len - 4 - ((len >> 3) << 2));
+        } else if (len > 0) {
+            a = ((uint64_t)p[0] << 16) | ((uint64_t)p[len >> 1] << 8) | p[len - 1];
+            b = 0;
+        } else {
+            a = b = 0;
+        }
+    } else {
+        size_t i = len;
+
+        if (i >= 48) {
+            uint64_t see1 = seed, see2 = seed;
+
+            do {
+                seed = wyhash_mix(wyhash_r8(p) ^ secret[1], wyhash_r8(p + 8) ^ seed);
+                see1 = wyhash_mix(wyhash_r8(p + 16) ^ secret[2], wyhash_r8(p + 24) ^ see1);
+                see2 = wyhash_mix(wyhash_r8(p + 32) ^ secret[3], wyhash_r8(p + 40) ^ see2);
+
+                p += 48;
+                i -= 48;
+            } while (i >= 48);
+
+            seed ^= see1 ^ see2;
+        }
+
+        while (i > 16) {
+            seed = wyhash_mix(wyhash_r8(p) ^ secret[1], wyhash_r8(p + 8) ^ seed);
+
+            p += 16;
+            i -= 16;
+        }
+
+        a = wyhash_r8(p + i - 16);
+        b = wyhash_r8(p + i - 8);
+    }
+
+    a ^= secret[1];
+    b ^= seed;
+
+    wyhash_mum(&a, &b);
+
+    return wyhash_mix(a ^ secret[0] ^ len, b ^ secret[1]);
+}
+
+// Used for all variable-length keys, selected with the `hash` build option
+static inline uint64_t hash_bytes(const void *key, size_t len)
+{
+#ifdef HASH_WYHASH
+    return wyhash(key, len, 0);
+#else
+    return murmurhash64a_len(key, len);
+#endif
+}
+
+static inline uint64_t hash_str(const char *key)
+{
+    return hash_bytes(key, strlen(key));
+}
+
+// Finalizer of MurmurHash3, used for integer and pointer keys. Pointers
+// share their low bits due to alignment, and maps only look at those.
+static inline uint64_t hash_int(uint64_t key)
+{
+    key ^= key >> 33;
+    key *= 0xff51afd7ed558ccdLLU;
+    key ^= key >> 33;
+    key *= 0xc4ceb9fe1a85ec53LLU;
+    key ^= key >> 33;
+
+    return key;
+}
+
+#endif /* HASH_H */
@@ -13,9 +13,21 @@ enum log_mode {
     LOG_MODE_SYSLOG
 };
 
+// Messages above this priority are compiled out, see the `log-level` option
+#ifndef LOG_LEVEL
+#define LOG_LEVEL LOG_INFO
+#endif
+
 void log_init(const char *ident, enum log_mode mode);
 void log_close(void);
-void log_mask(uint8_t prio);
+void log_mask(uint8_t mask);
+
+// Priorities dropped at runtime, as in `1 << LOG_INFO`
+extern uint8_t log_dropmask;
+
+// Checked before the message is formatted, or its arguments evaluated
+#define log_enabled(prio) \
+    ((prio) <= LOG_LEVEL && !(log_dropmask & 1 << (prio)))
 
 #define S_LOG_ERR     "ERR"
 #define S_LOG_WARNING "WARN"
@@ -24,8 +36,11 @@ void log_mask(uint8_t prio);
 
 void slog(int prio, const char *fmt, ...);
 
-#define log(prio, ...) \
-    slog(prio, "[" S_##prio "] " __VA_ARGS__)
+#define log(prio, ...)  \
+    do {                \
+        if (log_enabled(prio))  \
+            slog(prio, "[" S_##prio "] " __VA_ARGS__);  \
+    } while (0)
 
 #define die(code, ...)  \
     do {                \
@@ -0,0 +1,68 @@
+#ifndef LOOP_H
+#define LOOP_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include <sys/epoll.h>
+
+struct loop;
+struct loop_io;
+struct loop_timer;
+
+typedef void (*loop_io_cb)(struct loop_io *io, uint32_t events);
+typedef void (*loop_timer_cb)(struct loop_timer *timer);
+typedef void (*loop_signal_cb)(struct loop *loop, int signo, void *arg);
+
+// File descriptor watcher, usually embedded in the owner's struct
+struct loop_io {
+    int fd;
+    uint32_t events;
+    loop_io_cb cb;
+    void *arg;
+};
+
+// One-shot timer, deadline in milliseconds on the monotonic clock
+struct loop_timer {
+    int64_t deadline;
+    size_t idx;
+    loop_timer_cb cb;
+    void *arg;
+};
+
+#define LOOP_TIMER_INACTIVE SIZE_MAX
+
+struct loop *loop_new(void);
+void loop_free(struct loop *loop);
+
+void loop_io_init(struct loop_io *io, int fd, loop_io_cb cb, void *arg);
+void loop_io_start(struct loop *loop, struct loop_io *io, uint32_t events);
+void loop_io_stop(struct loop *loop, struct loop_io *io);
+
+void loop_timer_init(struct loop_timer *timer, loop_timer_cb cb, void *arg);
+void loop_timer_arm(struct loop *loop, struct loop_timer *timer, int64_t deadline);
+void loop_timer_disarm(struct loop *loop, struct loop_timer *timer);
+
+static inline bool loop_timer_armed(const struct loop_timer *timer)
+{
+    return timer->idx != LOOP_TIMER_INACTIVE;
+}
+
+void loop_signal(struct loop *loop, int signo, loop_signal_cb cb, void *arg);
+
+void loop_defer_free(struct loop *loop, void *ptr);
+
+// Outstanding work (in-flight requests, pending batches) keeps `loop_drain` running
+void loop_ref(struct loop *loop);
+void loop_unref(struct loop *loop);
+bool loop_idle(const struct loop *loop);
+
+void loop_run(struct loop *loop);
+void loop_once(struct loop *loop);
+void loop_drain(struct loop *loop);
+bool loop_drain_until(struct loop *loop, int64_t deadline);
+void loop_stop(struct loop *loop);
+bool loop_stopped(const struct loop *loop);
+
+#endif /* LOOP_H */
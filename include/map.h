@@ -2,14 +2,30 @@
 #define MAP_H
 
 #include <stdlib.h>
+#include <string.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <stdbool.h>
 
+#include "hash.h"
 #include "xalloc.h"
 
 #define MAP_LOAD_FACTOR 0.85
 
+// Entries are stored in a dense array, in insertion order, and found through
+// a power-of-two index using linear probing and Robin Hood insertion: a slot
+// is taken from any entry that is closer to its home slot, so probe sequences
+// stay short and lookups can stop at the first slot closer to its home than
+// the key being looked up would be. Index slots keep the full hash, so most
+// mismatches are rejected without touching the entries, and resizing never
+// calls the hash function. Deletions shift the following slots back instead
+// of leaving tombstones.
+//
+// Keys are hashed with `hash_int` if the map has no hash function.
+//
+// Deleting moves the last entry into the hole, unless `ordered` is set, in
+// which case the following entries are shifted down to keep insertion order.
+
 #define map_decl_ops(name, Th, Tk, Tv) \
 struct map_ops_##name { \
     Th (*hash)(Tk key); \
@@ -17,15 +33,22 @@ struct map_ops_##name { \
     Tk (*key_alloc)(Tk key); \
     void (*key_free)(Tk key); \
     void (*val_free)(Tv val); \
+    bool ordered; \
 }
 
+// `dist` is one more than the distance to the home slot, 0 if the slot is empty
 #define map_bucket(name, Th, Tk, Tv) \
 struct map_bucket_##name {    \
-    uint8_t opts; \
+    Th hash; \
+    uint32_t idx; \
+    uint32_t dist; \
+}
+
+#define map_entry(name, Th, Tk, Tv) \
+struct map_entry_##name { \
+    Th hash; \
     Tk key; \
     Tv val; \
-    struct map_bucket_##name *next; \
-    Th hash; \
 }
 
 #define map_struct(name, Th, Tk, Tv) \
@@ -33,186 +56,240 @@ struct map_##name { \
     size_t used, size; \
     struct map_ops_##name ops; \
     struct map_bucket_##name *buckets; \
+    struct map_entry_##name *entries; \
 }
 
-#define MATCH(O, B, H, K) \
-    (B->hash == H && ((O.compare && O.compare(B->key, K) == 0) || (B->key == K)))
+#define MATCH(O, B, E, H, K) \
+    (B->hash == H && ((O.compare && O.compare(E->key, K) == 0) || (E->key == K)))
 
 #define map_decl(name, Th, Tk, Tv) \
 map_decl_ops(name, Th, Tk, Tv); \
 map_bucket(name, Th, Tk, Tv); \
+map_entry(name, Th, Tk, Tv); \
 map_struct(name, Th, Tk, Tv); \
 \
 static struct map_##name *map_new_##name(size_t size, struct map_ops_##name ops) \
 { \
     struct map_##name *map = xcalloc(1, sizeof *map); \
     \
-    map->size = size; \
-    map->ops = ops; \
+    map->size = 1; \
+    while (map->size < size) \
+        map->size <<= 1; \
     \
-    map->buckets = xcalloc(size, sizeof *map->buckets); \
+    map->ops = ops; \
+    map->buckets = xcalloc(map->size, sizeof *map->buckets); \
+    map->entries = xreallocarray(NULL, map->size, sizeof *map->entries); \
     \
     return map; \
 } \
 \
-static struct map_bucket_##name *map_alloc_bucket_##name(struct map_bucket_##name *bucket) \
+static void map_free_##name(struct map_##name *map) \
 { \
-    struct map_bucket_##name *new = xcalloc(1, sizeof *new); \
-    \
-    while (bucket->next && bucket->next->opts) \
-        bucket = bucket->next; \
+    for (size_t i = 0; i < map->used; i++) { \
+        if (map->ops.key_free) \
+            map->ops.key_free(map->entries[i].key); \
+        if (map->ops.val_free) \
+            map->ops.val_free(map->entries[i].val); \
+    } \
     \
-    return bucket->next = new; \
+    free(map->buckets); \
+    free(map->entries); \
+    free(map); \
 } \
 \
-static void map_free_buckets_##name(struct map_##name *map, bool deep_free) \
+static uintmax_t map_hash_##name(struct map_##name *map, Tk key) \
 { \
-    for (size_t i = 0, j = 0; i < map->size && j < map->used; i++) { \
-        struct map_bucket_##name *old = &map->buckets[i]; \
+    return map->ops.hash ? (uintmax_t)map->ops.hash(key) : hash_int((uintmax_t)key); \
+} \
+\
+static struct map_bucket_##name *map_find_##name(struct map_##name *map, Tk key, uintmax_t hash) \
+{ \
+    size_t mask = map->size - 1; \
+    size_t i = hash & mask; \
+    \
+    for (uint32_t dist = 1; ; dist++) { \
+        struct map_bucket_##name *bucket = &map->buckets[i]; \
         \
-        if (!old->opts) \
-            continue; \
+        /* The key would have taken this slot */ \
+        if (bucket->dist < dist) \
+            return NULL; \
         \
-        if (deep_free) {\
-            if (map->ops.key_free) \
-                map->ops.key_free(old->key); \
-            if (map->ops.val_free) \
-                map->ops.val_free(old->val); \
-        } \
+        struct map_entry_##name *entry = &map->entries[bucket->idx]; \
         \
-        old = old->next; \
-        j++; \
+        if (MATCH(map->ops, bucket, entry, hash, key)) \
+            return bucket; \
         \
-        while (old) { \
-            struct map_bucket_##name *tmp = old->next; \
-            \
-            if (deep_free) {\
-                if (map->ops.key_free) \
-                    map->ops.key_free(old->key); \
-                if (map->ops.val_free) \
-                    map->ops.val_free(old->val); \
-            } \
-            \
-            free(old); \
-            old = tmp; \
-            j++; \
-        } \
+        i = (i + 1) & mask; \
     } \
-    \
-    free(map->buckets); \
 } \
 \
-static void map_free_##name(struct map_##name *map) \
+/* Finds the slot pointing to the entry at `idx` */ \
+static struct map_bucket_##name *map_slot_##name(struct map_##name *map, size_t idx) \
 { \
-    map_free_buckets_##name(map, true);  \
-    free(map); \
+    size_t mask = map->size - 1; \
+    size_t i = map->entries[idx].hash & mask; \
+    \
+    while (map->buckets[i].idx != idx || !map->buckets[i].dist) \
+        i = (i + 1) & mask; \
+    \
+    return &map->buckets[i]; \
 } \
 \
 static bool map_get_##name(struct map_##name *map, Tk key, Tv *res) \
 { \
-    uintmax_t hash = map->ops.hash ? (uintmax_t)map->ops.hash(key) : (uintmax_t)key; \
-    struct map_bucket_##name *bucket = &map->buckets[hash % map->size]; \
+    uintmax_t hash = map_hash_##name(map, key); \
+    struct map_bucket_##name *bucket = map_find_##name(map, key, hash); \
     \
-    while (bucket && bucket->opts) { \
-        if (MATCH(map->ops, bucket, hash, key)) { \
-            *res = bucket->val; \
-            return true; \
+    if (!bucket) \
+        return false; \
+    \
+    *res = map->entries[bucket->idx].val; \
+    return true; \
+} \
+\
+/* Takes a slot that is not in the index yet, with `dist` set to 1 */ \
+static void map_place_##name(struct map_##name *map, struct map_bucket_##name slot) \
+{ \
+    size_t mask = map->size - 1; \
+    size_t i = slot.hash & mask; \
+    \
+    while (1) { \
+        struct map_bucket_##name *bucket = &map->buckets[i]; \
+        \
+        if (!bucket->dist) { \
+            *bucket = slot; \
+            return; \
         } \
         \
-        bucket = bucket->next; \
+        if (bucket->dist < slot.dist) { \
+            struct map_bucket_##name tmp = *bucket; \
+            *bucket = slot; \
+            slot = tmp; \
+        } \
+        \
+        i = (i + 1) & mask; \
+        slot.dist++; \
     } \
-    \
-    return false; \
 } \
 \
 static bool map_resize_##name(struct map_##name *map, size_t size) \
 { \
-    struct map_bucket_##name *buckets = xcalloc(size, sizeof *buckets); \
- \
-    for (size_t i = 0, j = 0; i < map->size && j < map->used; i++) { \
-        struct map_bucket_##name *old = &map->buckets[i]; \
-        struct map_bucket_##name *base = old; \
-        \
-        if (!old->opts) \
+    struct map_bucket_##name *old = map->buckets; \
+    size_t oldsize = map->size; \
+    \
+    map->buckets = xcalloc(size, sizeof *map->buckets); \
+    map->entries = xreallocarray(map->entries, size, sizeof *map->entries); \
+    map->size = size; \
+    \
+    for (size_t i = 0; i < oldsize; i++) { \
+        if (!old[i].dist) \
             continue; \
         \
-        while (old) { \
-            struct map_bucket_##name *new = &buckets[old->hash % size]; \
-            \
-            /* Need to allocate a new bucket */ \
-            if (new->opts && !(new = map_alloc_bucket_##name(new))) { \
-                map_free_buckets_##name(&(struct map_##name) { \
-                    .size = size, \
-                    .used = j, \
-                    .buckets = buckets \
-                }, false); \
-                \
-                return false; \
-            } \
-            \
-            /* The keys are reused for the new entries */ \
-            *new = *old; \
-            new->next = NULL; \
-            j++; \
-            \
-            struct map_bucket_##name *tmp = old->next; \
-            if (old != base) \
-                free(old); \
-            old = tmp; \
-        } \
+        old[i].dist = 1; \
+        map_place_##name(map, old[i]); \
     } \
     \
-    free(map->buckets); \
-    map->buckets = buckets; \
-    map->size = size; \
+    free(old); \
     \
     return true; \
 } \
 \
+/* Makes room for `count` entries in total, without resizing on the way */ \
+static bool map_reserve_##name(struct map_##name *map, size_t count) \
+{ \
+    size_t size = map->size; \
+    \
+    while ((double)(count + 1)/size >= MAP_LOAD_FACTOR) \
+        size <<= 1; \
+    \
+    return size == map->size || map_resize_##name(map, size); \
+} \
+\
 static bool map_set_##name(struct map_##name *map, Tk key, Tv val) \
 { \
-    if ((double)(map->used + 1)/map->size >= MAP_LOAD_FACTOR) \
-        map_resize_##name(map, map->size * 2); \
-    \
-    uintmax_t hash = map->ops.hash ? (uintmax_t)map->ops.hash(key) : (uintmax_t)key; \
-    struct map_bucket_##name *bucket = &map->buckets[hash % map->size]; \
-    struct map_bucket_##name *prev = bucket; \
-                                       \
-    while (bucket->next && bucket->next->opts) { \
-        if (MATCH(map->ops, bucket, hash, key)) { \
-            bucket->val = val; \
-            return true; \
-        } \
-        \
-        prev = bucket; \
-        bucket = bucket->next; \
+    uintmax_t hash = map_hash_##name(map, key); \
+    struct map_bucket_##name *bucket = map_find_##name(map, key, hash); \
+    \
+    if (bucket) { \
+        map->entries[bucket->idx].val = val; \
+        return true; \
     } \
     \
-    if ((bucket->key || bucket == prev->next) && !(bucket = map_alloc_bucket_##name(bucket))) \
+    if ((double)(map->used + 1)/map->size >= MAP_LOAD_FACTOR && \
+            !map_resize_##name(map, map->size * 2)) \
         return false; \
     \
-    bucket->hash = hash; \
-    bucket->val = val; \
-    bucket->key = map->ops.key_alloc ? map->ops.key_alloc(key) : key; \
-    bucket->opts = 1; \
+    map->entries[map->used] = (struct map_entry_##name) { \
+        .hash = hash, \
+        .key = map->ops.key_alloc ? map->ops.key_alloc(key) : key, \
+        .val = val \
+    }; \
+    \
+    map_place_##name(map, (struct map_bucket_##name) { \
+        .hash = hash, \
+        .idx = map->used, \
+        .dist = 1 \
+    }); \
     \
     map->used++; \
     return true; \
 } \
 \
-static bool map_foreach_##name(struct map_##name *map, bool (*func)(Tk key, Tv val, void *arg), void *arg) \
+/* Removes the entry for `key` and frees it, returns false if there is none */ \
+static bool map_del_##name(struct map_##name *map, Tk key) \
 { \
-    for (size_t i = 0; i < map->size; i++) { \
-        struct map_bucket_##name *bucket = &map->buckets[i]; \
+    uintmax_t hash = map_hash_##name(map, key); \
+    struct map_bucket_##name *bucket = map_find_##name(map, key, hash); \
+    \
+    if (!bucket) \
+        return false; \
+    \
+    size_t mask = map->size - 1; \
+    size_t i = bucket - map->buckets; \
+    size_t idx = bucket->idx; \
+    \
+    /* Pull the following slots back until one is empty or already home */ \
+    while (1) { \
+        struct map_bucket_##name *next = &map->buckets[(i + 1) & mask]; \
         \
-        while (bucket && bucket->opts) { \
-            if (!func(bucket->key, bucket->val, arg)) \
-                return false; \
-            \
-            bucket = bucket->next; \
+        if (next->dist <= 1) { \
+            map->buckets[i].dist = 0; \
+            break; \
         } \
+        \
+        map->buckets[i] = *next; \
+        map->buckets[i].dist--; \
+        i = (i + 1) & mask; \
     } \
     \
+    struct map_entry_##name *entry = &map->entries[idx]; \
+    \
+    if (map->ops.key_free) \
+        map->ops.key_free(entry->key); \
+    if (map->ops.val_free) \
+        map->ops.val_free(entry->val); \
+    \
+    size_t last = --map->used; \
+    \
+    if (map->ops.ordered) { \
+        for (size_t j = idx + 1; j <= last; j++) \
+            map_slot_##name(map, j)->idx = j - 1; \
+        \
+        memmove(entry, entry + 1, (last - idx) * sizeof *entry); \
+    } else if (idx != last) { \
+        map_slot_##name(map, last)->idx = idx; \
+        *entry = map->entries[last]; \
+    } \
+    \
+    return true; \
+} \
+\
+static bool map_foreach_##name(struct map_##name *map, bool (*func)(Tk key, Tv val, void *arg), void *arg) \
+{ \
+    for (size_t i = 0; i < map->used; i++) \
+        if (!func(map->entries[i].key, map->entries[i].val, arg)) \
+            return false; \
+    \
     return true; \
 } \
 struct map_##name
@@ -0,0 +1,109 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdatomic.h>
+
+#include "conf.h"
+#include "loop.h"
+
+// Durations are kept in log-linear histograms, like HdrHistogram: each power
+// of two of microseconds is split into METRICS_HIST_SUB buckets, so that any
+// value is known to within 1/METRICS_HIST_SUB of itself. Values above
+// 2^METRICS_HIST_MAX_BITS microseconds (about 19 hours) go into the last bucket.
+#define METRICS_HIST_SUB_BITS 3
+#define METRICS_HIST_SUB (1 << METRICS_HIST_SUB_BITS)
+#define METRICS_HIST_MAX_BITS 36
+#define METRICS_HIST_BUCKETS ((METRICS_HIST_MAX_BITS - METRICS_HIST_SUB_BITS + 1) << METRICS_HIST_SUB_BITS)
+
+// Replies are counted by rcode, requests that got none (timed out, failed to
+// be sent or with a bad signature) in the last slot
+#define METRICS_RCODE_NONE 16
+#define METRICS_RCODES 17
+
+// Every counter is only ever written by a single thread, the one reading from
+// Netlink or the worker of a server, so increments are a relaxed load and
+// store rather than a locked read-modify-write. Readers may see a counter a
+// little behind, but never a torn value.
+typedef atomic_uint_fast64_t metrics_counter;
+
+struct metrics_hist {
+    // Microseconds, each bucket holds values up to metrics_hist_upper()
+    metrics_counter counts[METRICS_HIST_BUCKETS];
+    metrics_counter sum;
+};
+
+struct metrics_serv {
+    // UPDATEs, not the changes they carry
+    metrics_counter sent, succeeded, failed;
+    metrics_counter rcodes[METRICS_RCODES];
+    // Changes handed back by the retry queue
+    metrics_counter retried;
+
+    // From sending an UPDATE to its answer, and from an address change to
+    // the answer to the UPDATE that carried it
+    struct metrics_hist rtt, ack;
+};
+
+struct metrics {
+    // Messages read from the Netlink socket, and address events that were
+    // ignored (duplicates, other scopes, IPv4, unmonitored interfaces),
+    // passed on to be sent, or left to a resynchronization because the
+    // worker's ring was full
+    metrics_counter nl_received, nl_ignored, nl_queued, nl_deferred;
+    // Time taken by the startup synchronization, in nanoseconds
+    metrics_counter sync_ns;
+};
+
+extern struct metrics metrics;
+
+static inline void metrics_add(metrics_counter *counter, uint64_t n)
+{
+    atomic_store_explicit(counter, atomic_load_explicit(counter, memory_order_relaxed) + n,
+            memory_order_relaxed);
+}
+
+static inline void metrics_inc(metrics_counter *counter)
+{
+    metrics_add(counter, 1);
+}
+
+static inline size_t metrics_hist_index(uint64_t us)
+{
+    // Buckets hold (lower, upper], which keeps the upper bounds round
+    uint64_t val = us ? us - 1 : 0;
+
+    if (val < METRICS_HIST_SUB)
+        return val;
+
+    unsigned int top = 63 - __builtin_clzll(val);
+    size_t idx = (size_t)(top - METRICS_HIST_SUB_BITS + 1) << METRICS_HIST_SUB_BITS
+            | (val >> (top - METRICS_HIST_SUB_BITS) & (METRICS_HIST_SUB - 1));
+
+    return idx < METRICS_HIST_BUCKETS ? idx : METRICS_HIST_BUCKETS - 1;
+}
+
+static inline void metrics_hist_add(struct metrics_hist *hist, int64_t ns)
+{
+    uint64_t us = ns > 0 ? ((uint64_t)ns + 999) / 1000 : 0;
+
+    metrics_inc(&hist->counts[metrics_hist_index(us)]);
+    metrics_add(&hist->sum, us);
+}
+
+uint64_t metrics_hist_upper(size_t idx);
+uint64_t metrics_hist_quantile(const struct metrics_hist *hist, double q);
+
+struct metrics_serv *metrics_serv_new(void);
+void metrics_serv_free(struct metrics_serv *serv);
+
+void metrics_write(FILE *file, struct conf *conf);
+void metrics_log(struct conf *conf);
+
+// Serves metrics_write() on a Unix socket, to anything that connects and
+// either sends an HTTP GET request or shuts down its side of the connection
+struct metrics_sock *metrics_sock_new(const char *path, struct conf *conf, struct loop *loop);
+void metrics_sock_free(struct metrics_sock *sock);
+
+#endif /* METRICS_H */
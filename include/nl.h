@@ -1,12 +1,13 @@
 #ifndef NL_H
 #define NL_H
 
-// Forward declaration needed to silence warning
+// Forward declarations needed to silence warning
 struct conf;
+struct loop;
 
-struct nl_cache_mngr *nl_sync(struct conf *);
+struct nl_cache_mngr *nl_sync(struct conf *, struct loop *);
 
-void nl_run(struct nl_cache_mngr *);
+void nl_run(struct nl_cache_mngr *, struct loop *, struct conf *);
 void nl_free(struct nl_cache_mngr *);
 
 #endif /* NL_H */
@@ -0,0 +1,13 @@
+#ifndef NSCACHE_H
+#define NSCACHE_H
+
+#include <stdint.h>
+
+#include "conf.h"
+#include "loop.h"
+
+struct nscache *nscache_new(conf_serv *servconf, struct loop *loop);
+void nscache_free(struct nscache *nscache);
+void nscache_cancel(struct nscache *nscache);
+
+#endif /* NSCACHE_H */
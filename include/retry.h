@@ -0,0 +1,30 @@
+#ifndef RETRY_H
+#define RETRY_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include <netinet/in.h>
+
+#include "conf.h"
+#include "loop.h"
+
+// Called when a queued change is due to be sent again, `seq` is the number
+// the change was given by the batch
+typedef void (*retry_cb)(conf_if *ifconf, const struct sockaddr_in6 *addr, bool delete,
+        uint32_t ttl, uint64_t seq);
+
+struct retry *retry_new(struct loop *loop, size_t max, retry_cb cb);
+void retry_free(struct retry *retry);
+
+void retry_set_loop(struct retry *retry, struct loop *loop);
+
+bool retry_add(struct retry *retry, conf_if *ifconf, const struct sockaddr_in6 *addr,
+        bool delete, uint32_t ttl, uint64_t seq);
+void retry_done(struct retry *retry, ldns_rdf *record, const struct sockaddr_in6 *addr,
+        uint64_t seq);
+void retry_forget(struct retry *retry, const conf_if *ifconf);
+
+size_t retry_count(const struct retry *retry);
+
+#endif /* RETRY_H */
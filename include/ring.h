@@ -0,0 +1,30 @@
+#ifndef RING_H
+#define RING_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+struct ring;
+
+struct ring_stats {
+    size_t size;
+    size_t depth;
+    size_t highwater;
+    uint64_t pushed;
+    uint64_t dropped;
+};
+
+struct ring *ring_new(size_t size, size_t elemsize);
+void ring_free(struct ring *ring);
+
+bool ring_push(struct ring *ring, const void *elem);
+bool ring_pop(struct ring *ring, void *elem);
+
+int ring_fd(const struct ring *ring);
+bool ring_arm(struct ring *ring);
+void ring_wake(struct ring *ring);
+
+void ring_stats(const struct ring *ring, struct ring_stats *stats);
+
+#endif /* RING_H */
@@ -0,0 +1,61 @@
+#ifndef SHADOW_H
+#define SHADOW_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include <netinet/in.h>
+
+#include <ldns/ldns.h>
+
+// Used when the serial of the zone was not known when the RRset was learned
+#define SHADOW_NO_SERIAL (-1)
+
+struct shadow;
+
+// Last known state of a single address in a record
+struct shadow_addr {
+    struct in6_addr addr;
+    uint32_t ttl;
+    bool present;
+};
+
+struct shadow_rrset {
+    struct shadow_addr *addrs;
+    size_t used, size;
+
+    // Whether the whole RRset is known, in which case addresses
+    // that are not listed are known to be absent
+    bool complete;
+
+    // Changed since the last snapshot, and UPDATEs not answered yet
+    bool dirty;
+    size_t inflight;
+
+    int64_t serial;
+};
+
+struct shadow *shadow_new(void);
+void shadow_free(struct shadow *shadow);
+
+struct shadow_rrset *shadow_reset(struct shadow *shadow, ldns_rdf *record, int64_t serial);
+void shadow_rrset_set(struct shadow_rrset *rrset, const struct in6_addr *addr,
+        bool present, uint32_t ttl);
+
+void shadow_learn(struct shadow *shadow, ldns_rdf *record, const ldns_rr_list *answer, int64_t serial);
+void shadow_forget(struct shadow *shadow, ldns_rdf *record);
+
+struct shadow_rrset *shadow_get(struct shadow *shadow, ldns_rdf *record);
+
+bool shadow_redundant(struct shadow *shadow, ldns_rdf *record,
+        const struct in6_addr *addr, bool delete, uint32_t ttl);
+void shadow_apply(struct shadow *shadow, ldns_rdf *record,
+        const struct in6_addr *addr, bool delete, uint32_t ttl);
+
+bool shadow_sent(struct shadow *shadow, ldns_rdf *record);
+void shadow_done(struct shadow *shadow, ldns_rdf *record, bool ok);
+
+bool shadow_foreach(struct shadow *shadow,
+        bool (*func)(ldns_rdf *record, struct shadow_rrset *rrset, void *arg), void *arg);
+
+#endif /* SHADOW_H */
@@ -0,0 +1,50 @@
+#ifndef SNAP_H
+#define SNAP_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include <ldns/ldns.h>
+
+#include "conf.h"
+
+#define SNAP_MAGIC   0x70757069 // "ipup"
+#define SNAP_VERSION 1
+
+#define SNAP_HAS_SERIAL (1 << 0)
+
+struct snap_hdr {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t size;
+    uint64_t checksum;
+    uint32_t count;
+    uint32_t pad;
+};
+
+// Followed by the server name, the record name in wire format and
+// `naddrs` addresses, the whole record padded to 8 bytes
+struct snap_rec {
+    uint32_t serial;
+    uint16_t naddrs;
+    uint8_t servlen;
+    uint8_t namelen;
+    uint8_t flags;
+    uint8_t pad[7];
+};
+
+struct snap_addr {
+    uint8_t addr[16];
+    uint32_t ttl;
+};
+
+void snap_open(const char *path);
+void snap_close(void);
+
+const struct snap_rec *snap_lookup(const char *server, const ldns_rdf *record);
+const struct snap_addr *snap_rec_addrs(const struct snap_rec *rec);
+
+void snap_journal(const char *server, const ldns_rdf *record);
+void snap_save(struct conf *conf);
+
+#endif /* SNAP_H */
@@ -0,0 +1,42 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+// Statically defined tracing points (USDT), under the `ipup` provider. Each
+// is a single nop until a tracer such as bpftrace or perf attaches to it, so
+// they are left in release builds. Without <sys/sdt.h> they compile away.
+//
+// Address changes are numbered as they are read from Netlink, and that
+// number follows a change through the batch. The UPDATE that carries it is
+// identified by the pointer passed along as the channel's callback argument.
+//
+//   nl_change(event, action, ifidx)          Netlink address message
+//   nl_ignored(event)                        Not sent (duplicate, scope, family, interface)
+//   nl_queued(event, ifidx, delete, ttl)     Handed to the batch or to a worker
+//   batch_rr(event, update)                  RR written into an UPDATE
+//   batch_ack(event, update, ok)             Answer to the UPDATE that carried the change
+//   tsig_sign(update, len)                   Before signing
+//   tsig_signed(update, len)                 After signing, 0 if it failed
+//   chan_send(update, msgid, len, tcp)       Request written to a socket
+//   chan_recv(update, msgid, len, tcp)       Reply matched to a request
+//   chan_timeout(update, msgid, attempts)    No reply in time
+//   dns_update_rr(ttl, delete)               RR built with ldns (not batched)
+//   sync_start(records)                      Startup synchronization, after the dump
+//   sync_queried(pending)                    Queries sent
+//   sync_answered(pending)                   Answers received or given up on
+//   sync_done(ns)                            Updates queued, with the time taken
+
+#if defined(HAVE_SDT)
+#include <sys/sdt.h>
+#elif !defined(NO_SDT) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#endif
+#endif
+
+#ifdef STAP_PROBEV
+#define TRACE(name, ...) STAP_PROBEV(ipup, name, __VA_ARGS__)
+#else
+#define TRACE(name, ...) do { } while (0)
+#endif
+
+#endif /* TRACE_H */
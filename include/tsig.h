@@ -0,0 +1,26 @@
+#ifndef TSIG_H
+#define TSIG_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include <ldns/ldns.h>
+
+// Large enough for a SHA-512 MAC
+#define TSIG_MAX_MAC 64
+
+// Upper bound on the size of the TSIG RR appended to a message
+#define TSIG_MAX_SIZE (2 * 255 + 10 + 16 + TSIG_MAX_MAC)
+
+struct tsig;
+
+struct tsig *tsig_new(ldns_tsig_credentials cred);
+void tsig_free(struct tsig *tsig);
+
+size_t tsig_sign(struct tsig *tsig, uint8_t *wire, size_t len, size_t size,
+        uint8_t *mac, size_t *maclen);
+bool tsig_verify(struct tsig *tsig, const uint8_t *wire, size_t len,
+        const uint8_t *reqmac, size_t reqmaclen);
+
+#endif /* TSIG_H */
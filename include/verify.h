@@ -0,0 +1,15 @@
+#ifndef VERIFY_H
+#define VERIFY_H
+
+#include <stdbool.h>
+
+#include "conf.h"
+#include "loop.h"
+
+struct verify *verify_new(conf_serv *servconf, struct loop *loop);
+void verify_free(struct verify *verify);
+
+bool verify_sample(const struct verify *verify);
+void verify_add(struct verify *verify, conf_if *ifconf);
+
+#endif /* VERIFY_H */
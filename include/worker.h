@@ -0,0 +1,30 @@
+#ifndef WORKER_H
+#define WORKER_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include <netinet/in.h>
+
+#include "conf.h"
+
+// Compact address change, handed from the Netlink thread to a server's worker
+struct addr_event {
+    conf_if *ifconf;
+    struct sockaddr_in6 addr;
+    uint32_t ttl;
+    bool delete;
+    // When it was read from Netlink (clock_ns), and its number for tracing
+    int64_t time;
+    uint64_t event;
+};
+
+void worker_start(struct conf *conf);
+void worker_stop(struct conf *conf, bool drain);
+
+bool worker_push(conf_if *ifconf, const struct sockaddr_in6 *addr, bool delete,
+        uint32_t ttl, uint64_t event);
+
+void worker_log_stats(struct conf *conf);
+
+#endif /* WORKER_H */
@@ -0,0 +1,145 @@
+#include <string.h>
+#include <stdint.h>
+
+#include "addrset.h"
+#include "xalloc.h"
+
+#define ADDRSET_USED   (1 << 0)
+#define ADDRSET_MARKED (1 << 1)
+
+// Open addressing with linear probing, kept at most half full so that
+// probe sequences stay short. Addresses are compared as two 64-bit words.
+struct addrset_entry {
+    uint64_t hi, lo;
+    uint8_t opts;
+};
+
+struct addrset {
+    size_t used, mask;
+    struct addrset_entry *entries;
+};
+
+static uint64_t addrset_hash(uint64_t hi, uint64_t lo)
+{
+    // Interface identifiers vary the most, so mix both halves
+    uint64_t h = hi * 0x9e3779b97f4a7c15LLU ^ lo;
+
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdLLU;
+    h ^= h >> 33;
+
+    return h;
+}
+
+static struct addrset_entry *addrset_find(const struct addrset *set, uint64_t hi, uint64_t lo)
+{
+    size_t i = addrset_hash(hi, lo) & set->mask;
+
+    while (1) {
+        struct addrset_entry *entry = &set->entries[i];
+
+        if (!entry->opts || (entry->hi == hi && entry->lo == lo))
+            return entry;
+
+        i = (i + 1) & set->mask;
+    }
+}
+
+static void addrset_split(const struct in6_addr *addr, uint64_t *hi, uint64_t *lo)
+{
+    memcpy(hi, addr->s6_addr, sizeof *hi);
+    memcpy(lo, addr->s6_addr + sizeof *hi, sizeof *lo);
+}
+
+struct addrset *addrset_new(size_t hint)
+{
+    struct addrset *set = xcalloc(1, sizeof *set);
+
+    size_t size = 8;
+    while (size < hint * 2)
+        size <<= 1;
+
+    set->mask = size - 1;
+    set->entries = xcalloc(size, sizeof *set->entries);
+
+    return set;
+}
+
+void addrset_free(struct addrset *set)
+{
+    if (!set)
+        return;
+
+    free(set->entries);
+    free(set);
+}
+
+static void addrset_grow(struct addrset *set)
+{
+    struct addrset old = *set;
+    size_t size = (old.mask + 1) * 2;
+
+    set->mask = size - 1;
+    set->entries = xcalloc(size, sizeof *set->entries);
+
+    for (size_t i = 0; i <= old.mask; i++) {
+        struct addrset_entry *entry = &old.entries[i];
+
+        if (entry->opts)
+            *addrset_find(set, entry->hi, entry->lo) = *entry;
+    }
+
+    free(old.entries);
+}
+
+// Returns false if the address was already present
+bool addrset_add(struct addrset *set, const struct in6_addr *addr)
+{
+    if ((set->used + 1) * 2 > set->mask + 1)
+        addrset_grow(set);
+
+    uint64_t hi, lo;
+    addrset_split(addr, &hi, &lo);
+
+    struct addrset_entry *entry = addrset_find(set, hi, lo);
+
+    if (entry->opts)
+        return false;
+
+    entry->hi = hi;
+    entry->lo = lo;
+    entry->opts = ADDRSET_USED;
+
+    set->used++;
+
+    return true;
+}
+
+// Returns false if the address is not present
+bool addrset_mark(struct addrset *set, const struct in6_addr *addr)
+{
+    uint64_t hi, lo;
+    addrset_split(addr, &hi, &lo);
+
+    struct addrset_entry *entry = addrset_find(set, hi, lo);
+
+    if (!entry->opts)
+        return false;
+
+    entry->opts |= ADDRSET_MARKED;
+
+    return true;
+}
+
+bool addrset_marked(const struct addrset *set, const struct in6_addr *addr)
+{
+    uint64_t hi, lo;
+    addrset_split(addr, &hi, &lo);
+
+    return addrset_find(set, hi, lo)->opts & ADDRSET_MARKED;
+}
+
+size_t addrset_count(const struct addrset *set)
+{
+    return set->used;
+}
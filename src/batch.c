@@ -0,0 +1,435 @@
+#include <string.h>
+#include <stdatomic.h>
+
+#include "log.h"
+#include "dns.h"
+#include "chan.h"
+#include "util.h"
+#include "snap.h"
+#include "batch.h"
+#include "retry.h"
+#include "trace.h"
+#include "shadow.h"
+#include "verify.h"
+#include "xalloc.h"
+#include "metrics.h"
+
+struct batch_op {
+    conf_if *ifconf;
+    ldns_rdf *record;
+    struct sockaddr_in6 addr;
+    uint32_t ttl;
+    bool delete;
+    // When the oldest change coalesced into this one was seen (clock_ns),
+    // and the number of the newest, for tracing (0 if not from Netlink)
+    int64_t time;
+    uint64_t event;
+    // Newer changes have higher numbers, so that late results for an
+    // address can be told apart from those of its latest change
+    uint64_t seq;
+};
+
+// Changes outlive the batch they were queued in, and are numbered across
+// every server and thread
+static atomic_uint_fast64_t batch_seq;
+
+// Leaves room for the TSIG RR within the largest possible message
+#define BATCH_WIRE_SIZE (65535 - TSIG_MAX_SIZE)
+
+// Pending operations for a single zone
+struct batch_zone {
+    ldns_rdf *zone;
+    struct batch_op *ops;
+    size_t used, size;
+
+    // Header and zone section shared by every UPDATE for the zone
+    uint8_t tmpl[DNS_WIRE_UPDATE_INIT_MAX];
+    size_t tmpllen;
+};
+
+struct batch {
+    conf_serv *server;
+    struct loop *loop;
+    struct loop_timer timer;
+    struct batch_zone *zones;
+    size_t used, size;
+
+    // UPDATEs are assembled here before being handed to the channel
+    uint8_t *wire;
+};
+
+static struct batch_zone *batch_get_zone(struct batch *batch, ldns_rdf *zone)
+{
+    for (size_t i = 0; i < batch->used; i++) {
+        struct batch_zone *bzone = &batch->zones[i];
+
+        if (bzone->zone == zone || ldns_dname_compare(bzone->zone, zone) == 0)
+            return bzone;
+    }
+
+    if (batch->used == batch->size) {
+        batch->size = batch->size ? batch->size * 2 : 2;
+        batch->zones = xreallocarray(batch->zones, batch->size, sizeof *batch->zones);
+    }
+
+    struct batch_zone *bzone = &batch->zones[batch->used++];
+    *bzone = (struct batch_zone) { .zone = zone };
+
+    bzone->tmpllen = dns_wire_update_init(bzone->tmpl, zone);
+
+    return bzone;
+}
+
+static void batch_timer_cb(struct loop_timer *timer);
+
+static bool batch_op_match(const struct batch_op *op, ldns_rdf *record, const struct sockaddr_in6 *addr)
+{
+    if (memcmp(&op->addr.sin6_addr, &addr->sin6_addr, sizeof addr->sin6_addr) != 0)
+        return false;
+
+    return op->record == record || ldns_dname_compare(op->record, record) == 0;
+}
+
+struct batch *batch_new(conf_serv *servconf, struct loop *loop)
+{
+    struct batch *batch = xcalloc(1, sizeof *batch);
+
+    batch->server = servconf;
+    batch->loop = loop;
+    batch->wire = xmalloc(BATCH_WIRE_SIZE);
+
+    loop_timer_init(&batch->timer, batch_timer_cb, batch);
+
+    return batch;
+}
+
+static void batch_queue(conf_if *ifconf, const struct sockaddr_in6 *addr, bool delete,
+        uint32_t ttl, int64_t time, uint64_t event, uint64_t seq, bool requeue)
+{
+    conf_serv *servconf = ifconf->server;
+    struct batch *batch = servconf->batch;
+
+    // As it will be sent, so that the shadow compares it with what the server holds
+    ttl = dns_update_ttl(delete, ttl);
+
+    struct batch_zone *bzone = batch_get_zone(batch, ifconf->zone);
+
+    for (size_t i = 0; i < bzone->used; i++) {
+        struct batch_op *op = &bzone->ops[i];
+
+        if (!batch_op_match(op, ifconf->record, addr))
+            continue;
+
+        // A change made since the failed one is already on its way
+        if (requeue) {
+            retry_done(servconf->retry, ifconf->record, addr, op->seq);
+            return;
+        }
+
+        // An address that was added and deleted (or vice versa) within
+        // the same window cancels out, otherwise the newest state wins
+        if (op->delete != delete) {
+            *op = bzone->ops[--bzone->used];
+        } else {
+            op->ttl = ttl;
+            op->event = event;
+            op->seq = seq;
+        }
+
+        return;
+    }
+
+    if (bzone->used == bzone->size) {
+        bzone->size = bzone->size ? bzone->size * 2 : 4;
+        bzone->ops = xreallocarray(bzone->ops, bzone->size, sizeof *bzone->ops);
+    }
+
+    bzone->ops[bzone->used++] = (struct batch_op) {
+        .ifconf = ifconf,
+        .record = ifconf->record,
+        .addr = *addr,
+        .ttl = ttl,
+        .delete = delete,
+        .time = time,
+        .event = event,
+        .seq = seq
+    };
+
+    // Pending changes count as outstanding work for the loop
+    if (!loop_timer_armed(&batch->timer)) {
+        loop_ref(batch->loop);
+        loop_timer_arm(batch->loop, &batch->timer, clock_ms() + servconf->batch_window);
+    }
+}
+
+// `time` is when the change was seen, for measuring how long it takes to get
+// it acknowledged, and `event` the number it was given then, for tracing
+void batch_add_at(conf_if *ifconf, const struct sockaddr_in6 *addr, bool delete,
+        uint32_t ttl, int64_t time, uint64_t event)
+{
+    struct retry *retry = ifconf->server->retry;
+    uint64_t seq = atomic_fetch_add_explicit(&batch_seq, 1, memory_order_relaxed) + 1;
+
+    // Anything still waiting to be retried for this address is out of date
+    if (retry)
+        retry_done(retry, ifconf->record, addr, seq);
+
+    batch_queue(ifconf, addr, delete, ttl, time, event, seq, false);
+}
+
+void batch_add(conf_if *ifconf, const struct sockaddr_in6 *addr, bool delete, uint32_t ttl)
+{
+    batch_add_at(ifconf, addr, delete, ttl, clock_ns(), 0);
+}
+
+// Called by the retry queue once a failed change is due again, it keeps
+// its number
+void batch_requeue(conf_if *ifconf, const struct sockaddr_in6 *addr, bool delete,
+        uint32_t ttl, uint64_t seq)
+{
+    struct metrics_serv *metrics = ifconf->server->metrics;
+
+    if (metrics)
+        metrics_inc(&metrics->retried);
+
+    batch_queue(ifconf, addr, delete, ttl, clock_ns(), 0, seq, true);
+}
+
+// Changes carried by an UPDATE, forgotten by the shadow and handed
+// to the retry queue if it fails, and possibly verified if it succeeds
+struct batch_sent {
+    conf_serv *server;
+    struct batch_op ops[BATCH_MAX_RRS];
+    size_t count;
+    int64_t time;
+};
+
+// Changes held back while an UPDATE for their record was in flight are
+// sent on the next iteration, without waiting for the window again
+static void batch_resume(struct batch *batch)
+{
+    if (!batch || loop_timer_armed(&batch->timer))
+        return;
+
+    for (size_t i = 0; i < batch->used; i++) {
+        if (batch->zones[i].used) {
+            loop_ref(batch->loop);
+            loop_timer_arm(batch->loop, &batch->timer, clock_ms());
+            return;
+        }
+    }
+}
+
+// Whether a change newer than `sent` is queued for the same address, which
+// carries its latest state
+static bool batch_superseded(struct batch *batch, const struct batch_op *sent)
+{
+    for (size_t i = 0; batch && i < batch->used; i++) {
+        struct batch_zone *bzone = &batch->zones[i];
+
+        for (size_t j = 0; j < bzone->used; j++) {
+            struct batch_op *op = &bzone->ops[j];
+
+            if (batch_op_match(op, sent->record, &sent->addr))
+                return op->seq > sent->seq;
+        }
+    }
+
+    return false;
+}
+
+static void batch_sent_done(struct batch_sent *sent, bool ok)
+{
+    conf_serv *servconf = sent->server;
+    bool verify = ok && servconf->verify && verify_sample(servconf->verify);
+    int64_t now = servconf->metrics && ok ? clock_ns() : 0;
+
+    for (size_t i = 0; i < sent->count; i++) {
+        struct batch_op *op = &sent->ops[i];
+
+        if (servconf->shadow)
+            shadow_done(servconf->shadow, op->record, ok);
+
+        if (verify)
+            verify_add(servconf->verify, op->ifconf);
+
+        if (now)
+            metrics_hist_add(&servconf->metrics->ack, now - op->time);
+
+        TRACE(batch_ack, op->event, sent, ok);
+
+        if (!servconf->retry)
+            continue;
+
+        // The retry queue ignores results older than what it holds
+        if (ok)
+            retry_done(servconf->retry, op->record, &op->addr, op->seq);
+        else if (!batch_superseded(servconf->batch, op))
+            retry_add(servconf->retry, op->ifconf, &op->addr, op->delete, op->ttl, op->seq);
+    }
+
+    batch_resume(servconf->batch);
+    free(sent);
+}
+
+static void batch_sent_cb(ldns_pkt *reply, ldns_status status, void *arg)
+{
+    struct batch_sent *sent = arg;
+    struct metrics_serv *metrics = sent->server->metrics;
+    bool ok = dns_reply_ok(reply, status);
+
+    if (metrics) {
+        if (reply && status == LDNS_STATUS_OK) {
+            metrics_inc(&metrics->rcodes[ldns_pkt_get_rcode(reply) & 15]);
+            metrics_hist_add(&metrics->rtt, clock_ns() - sent->time);
+        } else {
+            metrics_inc(&metrics->rcodes[METRICS_RCODE_NONE]);
+        }
+
+        metrics_inc(ok ? &metrics->succeeded : &metrics->failed);
+    }
+
+    batch_sent_done(sent, ok);
+}
+
+// Whether an UPDATE touching the record is in flight, other than `sent`.
+// Another one for the record has to wait for it: the channel sends requests
+// again when they time out, and a late copy of the first one could land
+// after the second.
+static bool batch_inflight(struct shadow *shadow, const struct batch_sent *sent, ldns_rdf *record)
+{
+    struct shadow_rrset *rrset = shadow ? shadow_get(shadow, record) : NULL;
+
+    if (!rrset || !rrset->inflight)
+        return false;
+
+    for (size_t i = 0; i < sent->count; i++)
+        if (sent->ops[i].record == record || ldns_dname_compare(sent->ops[i].record, record) == 0)
+            return false;
+
+    return true;
+}
+
+// RRs are written straight into the zone's template, so no ldns objects
+// are built for them. Changes that have to wait stay in the batch.
+static void batch_flush_zone(struct batch *batch, struct batch_zone *bzone)
+{
+    conf_serv *servconf = batch->server;
+    struct shadow *shadow = servconf->shadow;
+    size_t i = 0, kept = 0;
+
+    while (i < bzone->used) {
+        size_t len = bzone->tmpllen;
+        struct batch_sent *sent = xmalloc(sizeof *sent);
+
+        memcpy(batch->wire, bzone->tmpl, len);
+
+        sent->server = servconf;
+        sent->count = 0;
+
+        for (; i < bzone->used && sent->count < BATCH_MAX_RRS; i++) {
+            struct batch_op *op = &bzone->ops[i];
+
+            // Checked first, the shadow assumes the UPDATE in flight succeeds
+            if (batch_inflight(shadow, sent, op->record)) {
+                bzone->ops[kept++] = *op;
+                continue;
+            }
+
+            // The server already holds this state
+            if (shadow && shadow_redundant(shadow, op->record,
+                        &op->addr.sin6_addr, op->delete, op->ttl)) {
+                if (servconf->retry)
+                    retry_done(servconf->retry, op->record, &op->addr, op->seq);
+
+                continue;
+            }
+
+            size_t next = dns_wire_update_push(batch->wire, len, BATCH_WIRE_SIZE,
+                    op->record, &op->addr.sin6_addr, op->delete, op->ttl);
+
+            // Full, sent with the next UPDATE
+            if (!next)
+                break;
+
+            len = next;
+            sent->ops[sent->count++] = *op;
+
+            TRACE(batch_rr, op->event, sent);
+
+            if (shadow) {
+                shadow_apply(shadow, op->record, &op->addr.sin6_addr, op->delete, op->ttl);
+
+                if (shadow_sent(shadow, op->record))
+                    snap_journal(servconf->name, op->record);
+            }
+        }
+
+        if (sent->count == 0) {
+            free(sent);
+            continue;
+        }
+
+        sent->time = clock_ns();
+
+        ldns_status ret = chan_send_wire(servconf->chan, batch->wire, len, batch_sent_cb, sent);
+
+        if (ret != LDNS_STATUS_OK) {
+            log(LOG_WARNING, "Failed to send UPDATE: %s", ldns_get_errorstr_by_id(ret));
+
+            if (servconf->metrics)
+                metrics_inc(&servconf->metrics->failed);
+
+            batch_sent_done(sent, false);
+        } else if (servconf->metrics) {
+            metrics_inc(&servconf->metrics->sent);
+        }
+    }
+
+    bzone->used = kept;
+}
+
+// Send one UPDATE per zone with pending operations
+static void batch_send(struct batch *batch)
+{
+    for (size_t i = 0; i < batch->used; i++)
+        batch_flush_zone(batch, &batch->zones[i]);
+}
+
+static void batch_timer_cb(struct loop_timer *timer)
+{
+    struct batch *batch = timer->arg;
+
+    loop_unref(batch->loop);
+    batch_send(batch);
+}
+
+// Flush pending operations before the batch window expires
+void batch_flush(struct batch *batch)
+{
+    if (!loop_timer_armed(&batch->timer))
+        return;
+
+    loop_timer_disarm(batch->loop, &batch->timer);
+    loop_unref(batch->loop);
+
+    batch_send(batch);
+}
+
+void batch_free(struct batch *batch)
+{
+    if (!batch)
+        return;
+
+    if (loop_timer_armed(&batch->timer)) {
+        loop_timer_disarm(batch->loop, &batch->timer);
+        loop_unref(batch->loop);
+    }
+
+    for (size_t i = 0; i < batch->used; i++)
+        free(batch->zones[i].ops);
+
+    free(batch->zones);
+    free(batch->wire);
+    free(batch);
+}
@@ -0,0 +1,785 @@
+#include <errno.h>
+#include <unistd.h>
+
+#include <sys/socket.h>
+#include <netinet/tcp.h>
+
+#include "log.h"
+#include "chan.h"
+#include "tsig.h"
+#include "util.h"
+#include "trace.h"
+#include "xalloc.h"
+
+#define CHAN_BUCKETS 64
+#define CHAN_BUFSIZE 65535
+
+// Used if the resolver has no timeout set
+#define CHAN_DEFAULT_TIMEOUT 5000
+
+// Set in the header of truncated replies
+#define CHAN_FLAG_TC 0x02
+
+struct chan_xfer {
+    struct chan *chan;
+    struct chan_xfer *next;
+
+    uint16_t id;
+    uint8_t *wire;
+    size_t wirelen;
+
+    // MAC of the request, needed to verify the TSIG signature of the reply
+    uint8_t mac[TSIG_MAX_MAC];
+    size_t maclen;
+
+    size_t ns;
+    size_t attempts;
+    struct loop_timer timer;
+
+    // Sent over TCP, and the connection it was last written to (0 if none)
+    bool tcp;
+    unsigned gen;
+
+    chan_cb cb;
+    void *arg;
+};
+
+struct chan_ns {
+    struct chan *chan;
+
+    struct sockaddr_storage addr;
+    socklen_t addrlen;
+
+    // Connected UDP socket, created on first use
+    struct loop_io udp;
+
+    // Long-lived TCP connection, shared by every request sent over it.
+    // Requests are pipelined and replies are matched by message ID.
+    struct loop_io tcp;
+    bool connected;
+    unsigned gen;
+    size_t pending;
+    struct loop_timer idle;
+
+    // Length-prefixed messages not yet written, and a partially read one
+    uint8_t *out;
+    size_t outlen, outsize;
+    uint8_t *in;
+    size_t inlen;
+};
+
+struct chan {
+    ldns_resolver *resolv;
+    struct tsig *tsig;
+    struct loop *loop;
+
+    // Allocated separately, so that a removed one can outlive the
+    // iteration of the event loop that removed it
+    struct chan_ns **ns;
+    size_t nns;
+
+    // In-flight requests, keyed by message ID
+    struct chan_xfer *xfers[CHAN_BUCKETS];
+    size_t inflight;
+
+    int64_t timeout;
+    int64_t idle;
+    uint8_t *buf;
+};
+
+static struct chan_xfer **chan_xfer_link(struct chan *chan, uint16_t id)
+{
+    struct chan_xfer **link = &chan->xfers[id % CHAN_BUCKETS];
+
+    while (*link && (*link)->id != id)
+        link = &(*link)->next;
+
+    return link;
+}
+
+// Stops waiting for a reply over the connection the request was written to,
+// which is closed once it has been idle for long enough
+static void chan_xfer_release(struct chan_xfer *xfer)
+{
+    struct chan *chan = xfer->chan;
+    struct chan_ns *ns = chan->ns[xfer->ns];
+
+    if (xfer->gen == 0 || xfer->gen != ns->gen) {
+        xfer->gen = 0;
+        return;
+    }
+
+    xfer->gen = 0;
+
+    if (--ns->pending == 0)
+        loop_timer_arm(chan->loop, &ns->idle, clock_ms() + chan->idle);
+}
+
+static void chan_xfer_free(struct chan_xfer *xfer)
+{
+    struct chan *chan = xfer->chan;
+    struct chan_xfer **link = chan_xfer_link(chan, xfer->id);
+
+    if (*link == xfer)
+        *link = xfer->next;
+
+    chan_xfer_release(xfer);
+
+    loop_timer_disarm(chan->loop, &xfer->timer);
+    loop_unref(chan->loop);
+    chan->inflight--;
+
+    free(xfer->wire);
+    free(xfer);
+}
+
+static void chan_udp_recv(struct loop_io *io, uint32_t events);
+static void chan_tcp_io(struct loop_io *io, uint32_t events);
+
+static int chan_udp_socket(struct chan_ns *ns)
+{
+    struct chan *chan = ns->chan;
+
+    if (ns->udp.fd >= 0)
+        return ns->udp.fd;
+
+    int fd = socket(ns->addr.ss_family, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+
+    if (fd < 0) {
+        log(LOG_WARNING, "Failed to create socket: %s", strerror(errno));
+        return -1;
+    }
+
+    // The kernel drops anything that doesn't come from the nameserver
+    if (connect(fd, (struct sockaddr *)&ns->addr, ns->addrlen) < 0) {
+        log(LOG_WARNING, "Failed to connect socket: %s", strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    loop_io_init(&ns->udp, fd, chan_udp_recv, ns);
+    loop_io_start(chan->loop, &ns->udp, EPOLLIN);
+
+    return fd;
+}
+
+// Requests that were waiting on the connection are retried right away
+static void chan_tcp_close(struct chan_ns *ns)
+{
+    struct chan *chan = ns->chan;
+
+    if (ns->tcp.fd < 0)
+        return;
+
+    loop_io_stop(chan->loop, &ns->tcp);
+    loop_timer_disarm(chan->loop, &ns->idle);
+    close(ns->tcp.fd);
+
+    ns->tcp.fd = -1;
+    ns->connected = false;
+    ns->pending = 0;
+    ns->outlen = 0;
+    ns->inlen = 0;
+
+    unsigned gen = ns->gen++;
+
+    for (size_t i = 0; i < CHAN_BUCKETS; i++) {
+        for (struct chan_xfer *xfer = chan->xfers[i]; xfer; xfer = xfer->next) {
+            if (xfer->gen != gen || chan->ns[xfer->ns] != ns)
+                continue;
+
+            xfer->gen = 0;
+            loop_timer_arm(chan->loop, &xfer->timer, clock_ms());
+        }
+    }
+}
+
+static void chan_tcp_idle(struct loop_timer *timer)
+{
+    struct chan_ns *ns = timer->arg;
+
+    if (ns->pending == 0)
+        chan_tcp_close(ns);
+}
+
+static bool chan_tcp_connect(struct chan_ns *ns)
+{
+    struct chan *chan = ns->chan;
+
+    int fd = socket(ns->addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+
+    if (fd < 0) {
+        log(LOG_WARNING, "Failed to create socket: %s", strerror(errno));
+        return false;
+    }
+
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof one);
+
+    if (connect(fd, (struct sockaddr *)&ns->addr, ns->addrlen) < 0 && errno != EINPROGRESS) {
+        log(LOG_WARNING, "Failed to connect to nameserver: %s", strerror(errno));
+        close(fd);
+        return false;
+    }
+
+    if (!ns->in)
+        ns->in = xmalloc(CHAN_BUFSIZE + 2);
+
+    // Writability signals that the connection has been established
+    loop_io_init(&ns->tcp, fd, chan_tcp_io, ns);
+    loop_io_start(chan->loop, &ns->tcp, EPOLLIN | EPOLLOUT);
+
+    return true;
+}
+
+// Writes as much of the queued data as the socket takes
+static bool chan_tcp_flush(struct chan_ns *ns)
+{
+    struct chan *chan = ns->chan;
+    size_t off = 0;
+
+    while (off < ns->outlen) {
+        ssize_t n = send(ns->tcp.fd, ns->out + off, ns->outlen - off, MSG_NOSIGNAL);
+
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                break;
+
+            log(LOG_WARNING, "Failed to send packet: %s", strerror(errno));
+            return false;
+        }
+
+        off += n;
+    }
+
+    memmove(ns->out, ns->out + off, ns->outlen - off);
+    ns->outlen -= off;
+
+    uint32_t events = ns->outlen ? EPOLLIN | EPOLLOUT : EPOLLIN;
+
+    if (ns->tcp.events != events)
+        loop_io_start(chan->loop, &ns->tcp, events);
+
+    return true;
+}
+
+static void chan_tcp_write(struct chan_ns *ns, struct chan_xfer *xfer)
+{
+    struct chan *chan = ns->chan;
+
+    if (ns->tcp.fd < 0 && !chan_tcp_connect(ns))
+        return;
+
+    size_t need = ns->outlen + 2 + xfer->wirelen;
+
+    if (need > ns->outsize) {
+        ns->outsize = ns->outsize ? ns->outsize : CHAN_BUFSIZE + 2;
+
+        while (ns->outsize < need)
+            ns->outsize *= 2;
+
+        ns->out = xrealloc(ns->out, ns->outsize);
+    }
+
+    ns->out[ns->outlen++] = xfer->wirelen >> 8;
+    ns->out[ns->outlen++] = xfer->wirelen & 0xff;
+
+    memcpy(ns->out + ns->outlen, xfer->wire, xfer->wirelen);
+    ns->outlen += xfer->wirelen;
+
+    xfer->gen = ns->gen;
+    ns->pending++;
+    loop_timer_disarm(chan->loop, &ns->idle);
+
+    if (ns->connected && !chan_tcp_flush(ns))
+        chan_tcp_close(ns);
+}
+
+static void chan_xfer_transmit(struct chan_xfer *xfer)
+{
+    struct chan *chan = xfer->chan;
+    struct chan_ns *ns = chan->ns[xfer->ns];
+
+    // Armed first, a connection lost while writing expires it right away
+    xfer->attempts++;
+    loop_timer_arm(chan->loop, &xfer->timer, clock_ms() + chan->timeout);
+
+    TRACE(chan_send, xfer->arg, xfer->id, xfer->wirelen, xfer->tcp);
+
+    if (xfer->tcp) {
+        chan_tcp_write(ns, xfer);
+        return;
+    }
+
+    int fd = chan_udp_socket(ns);
+
+    // A failed send is handled like a lost packet
+    if (fd >= 0 && send(fd, xfer->wire, xfer->wirelen, 0) < 0)
+        log(LOG_WARNING, "Failed to send packet: %s", strerror(errno));
+}
+
+static void chan_xfer_timeout(struct loop_timer *timer)
+{
+    struct chan_xfer *xfer = timer->arg;
+    struct chan *chan = xfer->chan;
+
+    chan_xfer_release(xfer);
+
+    TRACE(chan_timeout, xfer->arg, xfer->id, xfer->attempts);
+
+    // Mirrors ldns: `retry` rounds over every nameserver
+    uint8_t retry = ldns_resolver_retry(chan->resolv);
+    size_t maxattempts = (retry ? retry : 1) * chan->nns;
+
+    if (xfer->attempts < maxattempts) {
+        xfer->ns = (xfer->ns + 1) % chan->nns;
+        chan_xfer_transmit(xfer);
+        return;
+    }
+
+    xfer->cb(NULL, LDNS_STATUS_NETWORK_ERR, xfer->arg);
+    chan_xfer_free(xfer);
+}
+
+static void chan_reply(struct chan *chan, const uint8_t *buf, size_t len, bool tcp)
+{
+    // Ignore runts
+    if (len < 12)
+        return;
+
+    uint16_t id = (uint16_t)buf[0] << 8 | buf[1];
+    struct chan_xfer *xfer = *chan_xfer_link(chan, id);
+
+    // Late reply to a request that has already completed
+    if (!xfer)
+        return;
+
+    // Truncated, the request is sent again over TCP
+    if (!tcp && !xfer->tcp && buf[2] & CHAN_FLAG_TC) {
+        xfer->tcp = true;
+        chan_xfer_transmit(xfer);
+        return;
+    }
+
+    TRACE(chan_recv, xfer->arg, id, len, tcp);
+
+    ldns_pkt *reply = NULL;
+    ldns_status ret = ldns_wire2pkt(&reply, buf, len);
+
+    if (ret == LDNS_STATUS_OK && xfer->maclen &&
+            !tsig_verify(chan->tsig, buf, len, xfer->mac, xfer->maclen))
+        ret = LDNS_STATUS_CRYPTO_TSIG_BOGUS;
+
+    xfer->cb(ret == LDNS_STATUS_OK ? reply : NULL, ret, xfer->arg);
+    chan_xfer_free(xfer);
+
+    ldns_pkt_free(reply);
+}
+
+static void chan_udp_recv(struct loop_io *io, uint32_t events)
+{
+    (void)events;
+
+    struct chan_ns *ns = io->arg;
+    struct chan *chan = ns->chan;
+
+    while (1) {
+        ssize_t len = recv(io->fd, chan->buf, CHAN_BUFSIZE, 0);
+
+        if (len < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+                log(LOG_WARNING, "Failed to receive packet: %s", strerror(errno));
+
+            if (errno == EINTR)
+                continue;
+
+            return;
+        }
+
+        chan_reply(chan, chan->buf, len, false);
+    }
+}
+
+static void chan_tcp_recv(struct chan_ns *ns)
+{
+    struct chan *chan = ns->chan;
+
+    while (1) {
+        ssize_t n = recv(ns->tcp.fd, ns->in + ns->inlen, CHAN_BUFSIZE + 2 - ns->inlen, 0);
+
+        if (n == 0) {
+            chan_tcp_close(ns);
+            return;
+        }
+
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return;
+
+            log(LOG_WARNING, "Failed to receive packet: %s", strerror(errno));
+            chan_tcp_close(ns);
+            return;
+        }
+
+        ns->inlen += n;
+
+        size_t off = 0;
+
+        while (ns->inlen - off >= 2) {
+            size_t len = (size_t)ns->in[off] << 8 | ns->in[off + 1];
+
+            if (ns->inlen - off < 2 + len)
+                break;
+
+            // Copied out, since the callback may send (or close) over the connection
+            memcpy(chan->buf, ns->in + off + 2, len);
+            off += 2 + len;
+
+            chan_reply(chan, chan->buf, len, true);
+
+            if (ns->tcp.fd < 0)
+                return;
+        }
+
+        memmove(ns->in, ns->in + off, ns->inlen - off);
+        ns->inlen -= off;
+    }
+}
+
+static void chan_tcp_io(struct loop_io *io, uint32_t events)
+{
+    struct chan_ns *ns = io->arg;
+
+    if (!ns->connected) {
+        int err = 0;
+        socklen_t errlen = sizeof err;
+
+        if (getsockopt(io->fd, SOL_SOCKET, SO_ERROR, &err, &errlen) < 0)
+            err = errno;
+
+        if (err) {
+            log(LOG_WARNING, "Failed to connect to nameserver: %s", strerror(err));
+            chan_tcp_close(ns);
+            return;
+        }
+
+        if (!(events & EPOLLOUT))
+            return;
+
+        ns->connected = true;
+    }
+
+    if (events & EPOLLOUT && !chan_tcp_flush(ns)) {
+        chan_tcp_close(ns);
+        return;
+    }
+
+    if (events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+        chan_tcp_recv(ns);
+}
+
+struct chan *chan_new(ldns_resolver *resolv, struct tsig *tsig, struct loop *loop, uint32_t idle)
+{
+    struct chan *chan = xcalloc(1, sizeof *chan);
+
+    chan->resolv = resolv;
+    chan->tsig = tsig;
+    chan->loop = loop;
+    chan->idle = idle;
+    chan->buf = xmalloc(CHAN_BUFSIZE);
+
+    struct timeval tv = ldns_resolver_timeout(resolv);
+    chan->timeout = (int64_t)tv.tv_sec * 1000 + tv.tv_usec / 1000;
+
+    if (chan->timeout <= 0)
+        chan->timeout = CHAN_DEFAULT_TIMEOUT;
+
+    size_t count = ldns_resolver_nameserver_count(resolv);
+    ldns_rdf **nameservers = ldns_resolver_nameservers(resolv);
+
+    struct sockaddr_storage *addrs = xcalloc(count ? count : 1, sizeof *addrs);
+    size_t naddrs = 0;
+
+    for (size_t i = 0; i < count; i++) {
+        size_t addrlen;
+        struct sockaddr_storage *addr = ldns_rdf2native_sockaddr_storage(nameservers[i],
+                ldns_resolver_port(resolv), &addrlen);
+
+        if (!addr)
+            continue;
+
+        addrs[naddrs++] = *addr;
+        free(addr);
+    }
+
+    chan_set_nameservers(chan, addrs, naddrs);
+    free(addrs);
+
+    return chan;
+}
+
+// The event loop may still hold an event for its sockets, so the
+// nameserver itself only goes away once the current iteration is over
+static void chan_ns_free(struct chan_ns *ns)
+{
+    struct chan *chan = ns->chan;
+
+    if (ns->udp.fd >= 0) {
+        loop_io_stop(chan->loop, &ns->udp);
+        close(ns->udp.fd);
+    }
+
+    chan_tcp_close(ns);
+
+    free(ns->out);
+    free(ns->in);
+
+    loop_defer_free(chan->loop, ns);
+}
+
+static bool chan_addr_equal(const struct sockaddr_storage *a, const struct sockaddr_storage *b)
+{
+    if (a->ss_family != b->ss_family)
+        return false;
+
+    if (a->ss_family == AF_INET6) {
+        const struct sockaddr_in6 *a6 = (const struct sockaddr_in6 *)a;
+        const struct sockaddr_in6 *b6 = (const struct sockaddr_in6 *)b;
+
+        return a6->sin6_port == b6->sin6_port &&
+            memcmp(&a6->sin6_addr, &b6->sin6_addr, sizeof a6->sin6_addr) == 0;
+    } else if (a->ss_family == AF_INET) {
+        const struct sockaddr_in *a4 = (const struct sockaddr_in *)a;
+        const struct sockaddr_in *b4 = (const struct sockaddr_in *)b;
+
+        return a4->sin_port == b4->sin_port && a4->sin_addr.s_addr == b4->sin_addr.s_addr;
+    }
+
+    return false;
+}
+
+// Replaces the nameserver addresses. Sockets to addresses that are kept are
+// reused, requests waiting on a removed one are retried on the others right away.
+// Returns whether anything changed, an empty list is ignored.
+bool chan_set_nameservers(struct chan *chan, const struct sockaddr_storage *addrs, size_t naddrs)
+{
+    struct chan_ns **ns = xcalloc(naddrs ? naddrs : 1, sizeof *ns);
+    bool *kept = xcalloc(chan->nns ? chan->nns : 1, sizeof *kept);
+
+    size_t nns = 0;
+    bool changed = false;
+
+    for (size_t i = 0; i < naddrs; i++) {
+        if (addrs[i].ss_family != AF_INET6 && addrs[i].ss_family != AF_INET)
+            continue;
+
+        bool dup = false;
+
+        for (size_t j = 0; j < nns && !dup; j++)
+            dup = chan_addr_equal(&ns[j]->addr, &addrs[i]);
+
+        if (dup)
+            continue;
+
+        size_t j;
+
+        for (j = 0; j < chan->nns; j++)
+            if (!kept[j] && chan_addr_equal(&chan->ns[j]->addr, &addrs[i]))
+                break;
+
+        if (j < chan->nns) {
+            kept[j] = true;
+            ns[nns++] = chan->ns[j];
+            continue;
+        }
+
+        struct chan_ns *new = xcalloc(1, sizeof *new);
+
+        new->chan = chan;
+        new->addr = addrs[i];
+        new->addrlen = addrs[i].ss_family == AF_INET6 ?
+            sizeof(struct sockaddr_in6) : sizeof(struct sockaddr_in);
+        new->gen = 1;
+
+        loop_io_init(&new->udp, -1, chan_udp_recv, new);
+        loop_io_init(&new->tcp, -1, chan_tcp_io, new);
+        loop_timer_init(&new->idle, chan_tcp_idle, new);
+
+        ns[nns++] = new;
+        changed = true;
+    }
+
+    if (nns == 0) {
+        free(kept);
+        free(ns);
+        return false;
+    }
+
+    for (size_t i = 0; i < chan->nns; i++) {
+        if (!kept[i]) {
+            chan_tcp_close(chan->ns[i]);
+            changed = true;
+        }
+    }
+
+    // Requests keep going to the same nameserver if it is still there,
+    // the others are retried right away
+    for (size_t i = 0; i < CHAN_BUCKETS; i++) {
+        for (struct chan_xfer *xfer = chan->xfers[i]; xfer; xfer = xfer->next) {
+            struct chan_ns *old = chan->ns[xfer->ns];
+            size_t j = 0;
+
+            while (j < nns && ns[j] != old)
+                j++;
+
+            if (j < nns) {
+                xfer->ns = j;
+                continue;
+            }
+
+            xfer->ns = 0;
+            xfer->gen = 0;
+            loop_timer_arm(chan->loop, &xfer->timer, clock_ms());
+        }
+    }
+
+    for (size_t i = 0; i < chan->nns; i++)
+        if (!kept[i])
+            chan_ns_free(chan->ns[i]);
+
+    free(kept);
+    free(chan->ns);
+
+    chan->ns = ns;
+    chan->nns = nns;
+
+    return changed;
+}
+
+void chan_free(struct chan *chan)
+{
+    if (!chan)
+        return;
+
+    for (size_t i = 0; i < CHAN_BUCKETS; i++)
+        while (chan->xfers[i])
+            chan_xfer_free(chan->xfers[i]);
+
+    for (size_t i = 0; i < chan->nns; i++)
+        chan_ns_free(chan->ns[i]);
+
+    free(chan->ns);
+    free(chan->buf);
+    free(chan);
+}
+
+struct loop *chan_loop(const struct chan *chan)
+{
+    return chan->loop;
+}
+
+size_t chan_inflight(const struct chan *chan)
+{
+    return chan->inflight;
+}
+
+// Assigns a message ID, signs the message if there is a TSIG key, and sends
+// it to the first nameserver. `wire` is copied.
+ldns_status chan_send_wire(struct chan *chan, const uint8_t *wire, size_t len,
+        chan_cb cb, void *arg)
+{
+    if (chan->nns == 0)
+        return LDNS_STATUS_RES_NO_NS;
+
+    if (len < 12)
+        return LDNS_STATUS_WIRE_INCOMPLETE_HEADER;
+
+    uint16_t id;
+
+    do
+        id = ldns_get_random();
+    while (*chan_xfer_link(chan, id));
+
+    struct chan_xfer *xfer = xcalloc(1, sizeof *xfer);
+    size_t size = len + (chan->tsig ? TSIG_MAX_SIZE : 0);
+
+    xfer->wire = xmalloc(size);
+    xfer->wirelen = len;
+
+    memcpy(xfer->wire, wire, len);
+    xfer->wire[0] = id >> 8;
+    xfer->wire[1] = id & 0xff;
+
+    if (chan->tsig) {
+        TRACE(tsig_sign, arg, len);
+        xfer->wirelen = tsig_sign(chan->tsig, xfer->wire, len, size, xfer->mac, &xfer->maclen);
+        TRACE(tsig_signed, arg, xfer->wirelen);
+
+        if (!xfer->wirelen) {
+            free(xfer->wire);
+            free(xfer);
+            return LDNS_STATUS_CRYPTO_TSIG_ERR;
+        }
+    }
+
+    xfer->chan = chan;
+    xfer->id = id;
+    xfer->tcp = ldns_resolver_usevc(chan->resolv);
+    xfer->cb = cb;
+    xfer->arg = arg;
+
+    loop_timer_init(&xfer->timer, chan_xfer_timeout, xfer);
+
+    xfer->next = chan->xfers[id % CHAN_BUCKETS];
+    chan->xfers[id % CHAN_BUCKETS] = xfer;
+    chan->inflight++;
+
+    loop_ref(chan->loop);
+    chan_xfer_transmit(xfer);
+
+    return LDNS_STATUS_OK;
+}
+
+// Like `chan_send_wire`, for a packet built with ldns. `pkt` is not freed.
+ldns_status chan_send(struct chan *chan, ldns_pkt *pkt, chan_cb cb, void *arg)
+{
+    uint8_t *wire;
+    size_t len;
+
+    ldns_status ret = ldns_pkt2wire(&wire, pkt, &len);
+
+    if (ret != LDNS_STATUS_OK)
+        return ret;
+
+    ret = chan_send_wire(chan, wire, len, cb, arg);
+    free(wire);
+
+    return ret;
+}
+
+// Fails the in-flight requests that were sent with the given callback, or
+// all of them if it is NULL. Each callback is called as if the request had
+// timed out.
+void chan_cancel(struct chan *chan, chan_cb cb)
+{
+    for (size_t i = 0; i < CHAN_BUCKETS; i++) {
+        struct chan_xfer *xfer = chan->xfers[i];
+
+        while (xfer) {
+            struct chan_xfer *next = xfer->next;
+
+            if (!cb || xfer->cb == cb) {
+                xfer->cb(NULL, LDNS_STATUS_NETWORK_ERR, xfer->arg);
+                chan_xfer_free(xfer);
+            }
+
+            xfer = next;
+        }
+    }
+}
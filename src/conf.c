@@ -4,10 +4,18 @@
 #include <strings.h>
 
 #include "log.h"
+#include "chan.h"
+#include "batch.h"
+#include "retry.h"
+#include "shadow.h"
+#include "verify.h"
+#include "metrics.h"
+#include "nscache.h"
 #include "dns.h"
 #include "map.h"
 #include "hash.h"
 #include "conf.h"
+#include "tsig.h"
 #include "xalloc.h"
 
 map_decl(conf_serv, uint64_t, const char *, conf_serv *);
@@ -42,6 +50,9 @@ map_decl(conf_if, uint64_t, const char *, conf_if *);
         return 0;                             \
     }
 
+// Private, used to tell an explicit retry-backlog = 0 from an unset one
+#define CONF_OPT_SERVER_RETRY_BACKLOG (1 << 6)
+
 // Private, used to check if a server is
 // not referenced by any other interface
 #define CONF_OPT_SERVER_USED_BY_IFACE (1 << 7)
@@ -112,8 +123,8 @@ static int handle_servconf(struct conf *conf, const char *server,
         servconf->resolv = ldns_resolver_new();
 
     if (strcmp(name, "fqdn") == 0) {
+        // Resolved once the whole file has been read, see conf_resolve()
         ldns_rdf *fqdn = ldns_dname_new_frm_str(value);
-        dns_resolver_init_frm_dname(servconf->resolv, fqdn);
         ldns_resolver_set_domain(servconf->resolv, fqdn);
 
         ldns_rdf_deep_free(servconf->server);
@@ -188,6 +199,33 @@ static int handle_servconf(struct conf *conf, const char *server,
                 "Invalid value for max-retry: %llu", retry)
 
         ldns_resolver_set_retry(servconf->resolv, retry);
+    } else if (strcmp(name, "batch-window") == 0) {
+        unsigned long long window;
+        TO_NUM_COND_MSG(window, value, window <= 60000,
+                "Invalid value for batch-window: %s", value);
+
+        servconf->batch_window = window;
+    } else if (strcmp(name, "tcp") == 0) {
+        BOOL_FLAG(value, servconf->opts, CONF_OPT_SERVER_TCP);
+    } else if (strcmp(name, "tcp-idle-timeout") == 0) {
+        unsigned long long timeout;
+        TO_NUM_COND_MSG(timeout, value, (timeout != 0 && timeout <= 3600000),
+                "Invalid value for tcp-idle-timeout: %s", value);
+
+        servconf->tcp_idle = timeout;
+    } else if (strcmp(name, "retry-backlog") == 0) {
+        unsigned long long backlog;
+        TO_NUM_COND_MSG(backlog, value, backlog <= 1048576,
+                "Invalid value for retry-backlog: %s", value);
+
+        servconf->retry_backlog = backlog;
+        servconf->opts |= CONF_OPT_SERVER_RETRY_BACKLOG;
+    } else if (strcmp(name, "verify-update") == 0) {
+        unsigned long long ratio;
+        TO_NUM_COND_MSG(ratio, value, ratio <= 100,
+                "Invalid value for verify-update: %s", value);
+
+        servconf->verify_ratio = ratio;
     } else {
         return 0;
     }
@@ -245,6 +283,43 @@ static int handle_ifconf(struct conf *conf, const char *iface,
     return 1;
 }
 
+static int handle_globconf(struct conf *conf, const char *name, const char *value)
+{
+    if (strcmp(name, "threaded") == 0) {
+        BOOL_FLAG(value, conf->opts, CONF_OPT_GLOBAL_THREADED);
+    } else if (strcmp(name, "ring-size") == 0) {
+        unsigned long long size;
+        TO_NUM_COND_MSG(size, value, (size != 0 && size <= 1 << 24),
+                "Invalid value for ring-size: %s", value);
+
+        conf->ringsize = size;
+    } else if (strcmp(name, "netlink-rcvbuf") == 0) {
+        unsigned long long size;
+        TO_NUM_COND_MSG(size, value, size <= INT32_MAX,
+                "Invalid value for netlink-rcvbuf: %s", value);
+
+        conf->nlrcvbuf = size;
+    } else if (strcmp(name, "sync-timeout") == 0) {
+        unsigned long long timeout;
+        TO_NUM_COND_MSG(timeout, value, (timeout != 0 && timeout <= 600000),
+                "Invalid value for sync-timeout: %s", value);
+
+        conf->synctimeout = timeout;
+    } else if (strcmp(name, "state-file") == 0) {
+        free(conf->statefile);
+        conf->statefile = strdup(value);
+    } else if (strcmp(name, "state-trust") == 0) {
+        BOOL_FLAG(value, conf->opts, CONF_OPT_GLOBAL_STATE_TRUST);
+    } else if (strcmp(name, "metrics-socket") == 0) {
+        free(conf->metricssock);
+        conf->metricssock = strdup(value);
+    } else {
+        return 0;
+    }
+
+    return 1;
+}
+
 #undef BOOL_FLAG
 #undef BOOL_IS_FALSE
 #undef BOOL_IS_TRUE
@@ -254,6 +329,9 @@ static int line_cb(void *user, const char *section, const char *name, const char
 {
     struct conf *conf = (struct conf *)user;
 
+    if (strcmp(section, "global") == 0)
+        return handle_globconf(conf, name, value);
+
     const char *sep = strchr(section, '/');
 
     if (!sep) {
@@ -269,31 +347,43 @@ static int line_cb(void *user, const char *section, const char *name, const char
     return 0;
 }
 
+// Logs the error and stops validating, `arg` points to the exit status
+#define INVALID(...)                    \
+    do {                                \
+        log(LOG_ERR, __VA_ARGS__);      \
+        *(int *)arg = EX_DATAERR;       \
+        return false;                   \
+    } while (0)
+
 static bool validate_ifconf(const char *key, conf_if *ifconf, void *arg)
 {
-    (void)arg;
-
     conf_serv *servconf = ifconf->server;
 
     if (!servconf || !servconf->resolv)
-        die(EX_DATAERR, "Invalid server specified for interface %s", key);
+        INVALID("Invalid server specified for interface %s", key);
+
+    ifconf->name = key;
 
+    // Copied, so that the interface can outlive its server across a reload
     if (!ifconf->zone || !ifconf->record) {
         if (!servconf->zone || !servconf->record)
-            die(EX_DATAERR, "No zone/record specified for interface %s or its server", key);
+            INVALID("No zone/record specified for interface %s or its server", key);
 
         ldns_rdf_deep_free(ifconf->zone);
-        ldns_rdf_deep_free(ifconf->zone);
+        ldns_rdf_deep_free(ifconf->record);
 
-        ifconf->zone = servconf->zone;
-        ifconf->record = servconf->record;
+        ifconf->zone = ldns_rdf_clone(servconf->zone);
+        ifconf->record = ldns_rdf_clone(servconf->record);
     }
 
     if (!ldns_dname_is_subdomain(ifconf->record, ifconf->zone))
         ldns_dname_cat(ifconf->record, ifconf->zone);
 
+    ifconf->zonehash = dns_dname_hash(ifconf->zone);
+    ifconf->rechash = dns_dname_hash(ifconf->record);
+
     if (ifconf->opts & CONF_OPT_IFACE_RESPECT_TTL && ifconf->ttl != 0)
-        die(EX_DATAERR, "The options respect-ttl and ttl cannot be specified simultaneously");
+        INVALID("The options respect-ttl and ttl cannot be specified simultaneously");
 
     servconf->opts |= CONF_OPT_SERVER_USED_BY_IFACE;
 
@@ -302,17 +392,26 @@ static bool validate_ifconf(const char *key, conf_if *ifconf, void *arg)
 
 static bool validate_servconf(const char *key, conf_serv *servconf, void *arg)
 {
-    (void)arg;
+    servconf->name = key;
 
     ldns_status ret = dns_tsig_credentials_validate(servconf->cred);
 
     if (ret == LDNS_STATUS_INVALID_B64)
-        die(EX_DATAERR, "Invalid key secret for server %s", key);
+        INVALID("Invalid key secret for server %s", key);
     else if (ret == LDNS_STATUS_CRYPTO_TSIG_BOGUS)
-        die(EX_DATAERR, "Expected all or none of the key name, key secret "
+        INVALID("Expected all or none of the key name, key secret "
                 "and algorithm to be specified for server %s", key);
-    else if (ret == LDNS_STATUS_OK)
-        dns_resolver_set_tsig_credentials(servconf->resolv, servconf->cred);
+    else if (ret == LDNS_STATUS_OK && !(servconf->tsig = tsig_new(servconf->cred)))
+        INVALID("Unsupported key algorithm %s for server %s",
+                servconf->cred.algorithm, key);
+
+    ldns_resolver_set_usevc(servconf->resolv, servconf->opts & CONF_OPT_SERVER_TCP);
+
+    if (servconf->tcp_idle == 0)
+        servconf->tcp_idle = CONF_DEFAULT_TCP_IDLE;
+
+    if (!(servconf->opts & CONF_OPT_SERVER_RETRY_BACKLOG))
+        servconf->retry_backlog = CONF_DEFAULT_RETRY_BACKLOG;
 
     if (!(servconf->opts & CONF_OPT_SERVER_USED_BY_IFACE))
         log(LOG_NOTICE, "Server %s is not referenced by any interfaces", key);
@@ -320,24 +419,59 @@ static bool validate_servconf(const char *key, conf_serv *servconf, void *arg)
     return true;
 }
 
+#undef INVALID
+
+static bool resolve_servconf(const char *key, conf_serv *servconf, void *arg)
+{
+    (void)key;
+    (void)arg;
+
+    conf_resolve(servconf);
+
+    return true;
+}
+
+// Entries of a configuration that was reloaded are left empty
+// once taken over by the new one, see conf_keep_serv()
 static void free_ifconf(conf_if *ifconf)
 {
-    conf_serv *servconf = ifconf->server;
+    if (!ifconf)
+        return;
 
-    if (ifconf->zone != servconf->zone || ifconf->record != servconf->record) {
-        ldns_rdf_deep_free(ifconf->zone);
-        ldns_rdf_deep_free(ifconf->record);
-    }
+    ldns_rdf_deep_free(ifconf->zone);
+    ldns_rdf_deep_free(ifconf->record);
 
     free(ifconf);
 }
 
+// Fails the requests of a server that are still in flight, UPDATEs are
+// handed over for retrying as if they had timed out
+void conf_cancel_serv(conf_serv *servconf)
+{
+    chan_cancel(servconf->chan, NULL);
+    nscache_cancel(servconf->nscache);
+}
+
 static void free_servconf(conf_serv *servconf)
 {
+    if (!servconf)
+        return;
+
+    // Requests still in flight are dropped without calling anything back,
+    // so their answers and failures are neither logged nor counted
+    batch_free(servconf->batch);
+
     ldns_rdf_deep_free(servconf->zone);
     ldns_rdf_deep_free(servconf->record);
 
     ldns_resolver_deep_free(servconf->resolv);
+    nscache_free(servconf->nscache);
+    verify_free(servconf->verify);
+    metrics_serv_free(servconf->metrics);
+    retry_free(servconf->retry);
+    chan_free(servconf->chan);
+    shadow_free(servconf->shadow);
+    tsig_free(servconf->tsig);
 
     free((void *)servconf->cred.algorithm);
     free((void *)servconf->cred.keyname);
@@ -346,13 +480,18 @@ static void free_servconf(conf_serv *servconf)
     free(servconf);
 }
 
-struct conf conf_read(FILE *file, const char *filename)
+// Leaves `conf` empty and returns an exit status on failure, the reason
+// for which is logged
+int conf_load(FILE *file, const char *filename, struct conf *out)
 {
-    struct conf conf;
+    struct conf conf = {
+        .ringsize = CONF_DEFAULT_RING_SIZE,
+        .synctimeout = CONF_DEFAULT_SYNC_TIMEOUT
+    };
 
     map_ops(conf_if) ifops = {
         .compare = strcmp,
-        .hash = murmurhash64a,
+        .hash = hash_str,
         .key_alloc = (const char *(*)(const char *))strdup,
         .key_free = (void (*)(const char *))free,
         .val_free = free_ifconf
@@ -360,7 +499,7 @@ struct conf conf_read(FILE *file, const char *filename)
 
     map_ops(conf_serv) servops = {
         .compare = strcmp,
-        .hash = murmurhash64a,
+        .hash = hash_str,
         .key_alloc = (const char *(*)(const char *))strdup,
         .key_free = (void (*)(const char *))free,
         .val_free = free_servconf
@@ -369,21 +508,151 @@ struct conf conf_read(FILE *file, const char *filename)
     conf.ifaces = map_new_conf_if(4, ifops);
     conf.servers = map_new_conf_serv(4, servops);
 
+    int status = EX_OK;
     int ret = ini_parse_file(file, line_cb, &conf);
 
-    if (ret < 0)
-        die(EX_NOINPUT, "Could not load config file");
-    else if (ret)
-        die(EX_DATAERR, "Error in config file @ %s:%d", filename, ret);
+    if (ret < 0) {
+        log(LOG_ERR, "Could not load config file");
+        status = EX_NOINPUT;
+    } else if (ret) {
+        log(LOG_ERR, "Error in config file @ %s:%d", filename, ret);
+        status = EX_DATAERR;
+    }
+
+    if (status == EX_OK)
+        map_foreach_conf_if(conf.ifaces, validate_ifconf, &status);
+
+    if (status == EX_OK)
+        map_foreach_conf_serv(conf.servers, validate_servconf, &status);
+
+    if (status != EX_OK) {
+        conf_free(conf);
+        *out = (struct conf){ 0 };
+
+        return status;
+    }
 
-    map_foreach_conf_if(conf.ifaces, validate_ifconf, NULL);
-    map_foreach_conf_serv(conf.servers, validate_servconf, NULL);
+    conf.path = strdup(filename);
+    *out = conf;
+
+    return EX_OK;
+}
+
+struct conf conf_read(FILE *file, const char *filename)
+{
+    struct conf conf;
+    int status = conf_load(file, filename, &conf);
+
+    if (status != EX_OK)
+        exit(status);
+
+    map_foreach_conf_serv(conf.servers, resolve_servconf, NULL);
 
     return conf;
 }
 
+// Resolves the addresses of the server, which may block
+void conf_resolve(conf_serv *servconf)
+{
+    if (servconf->server)
+        servconf->ns_ttl = dns_resolver_init_frm_dname(servconf->resolv, servconf->server);
+}
+
+static bool str_equal(const char *a, const char *b)
+{
+    return a == b || (a && b && strcmp(a, b) == 0);
+}
+
+static bool dname_equal(const ldns_rdf *a, const ldns_rdf *b)
+{
+    return a == b || (a && b && ldns_dname_compare(a, b) == 0);
+}
+
+// Whether the server was configured the same way in both files, in
+// which case the one already running can be kept as is
+bool conf_serv_equal(const conf_serv *a, const conf_serv *b)
+{
+    return dname_equal(a->server, b->server)
+        && ldns_resolver_port(a->resolv) == ldns_resolver_port(b->resolv)
+        && ldns_resolver_retry(a->resolv) == ldns_resolver_retry(b->resolv)
+        && ldns_resolver_usevc(a->resolv) == ldns_resolver_usevc(b->resolv)
+        && str_equal(a->cred.algorithm, b->cred.algorithm)
+        && str_equal(a->cred.keyname, b->cred.keyname)
+        && str_equal(a->cred.keydata, b->cred.keydata)
+        && a->batch_window == b->batch_window
+        && a->tcp_idle == b->tcp_idle
+        && a->retry_backlog == b->retry_backlog
+        && a->verify_ratio == b->verify_ratio;
+}
+
+// Servers are compared by identity, so a server must
+// have been kept for its interfaces to be equal
+bool conf_if_equal(const conf_if *a, const conf_if *b)
+{
+    return a->server == b->server
+        && dname_equal(a->zone, b->zone)
+        && dname_equal(a->record, b->record)
+        && a->ttl == b->ttl
+        && a->opts == b->opts;
+}
+
+static bool repoint_ifconf(const char *key, conf_if *ifconf, void *arg)
+{
+    (void)key;
+
+    conf_serv **swap = arg;
+
+    if (ifconf && ifconf->server == swap[0])
+        ifconf->server = swap[1];
+
+    return true;
+}
+
+// Moves the server `key` of `live` into `fresh`, in place of its new
+// copy, along with its connection, queues and counters. The entry
+// left in `live` is emptied, so that freeing it leaves the server be.
+void conf_keep_serv(struct conf *fresh, struct conf *live, const char *key)
+{
+    conf_serv *new, *old;
+
+    if (!map_get_conf_serv(fresh->servers, key, &new) ||
+            !map_get_conf_serv(live->servers, key, &old) || !old)
+        return;
+
+    conf_serv *swap[2] = { new, old };
+    map_foreach_conf_if(fresh->ifaces, repoint_ifconf, swap);
+
+    old->name = new->name;
+
+    map_set_conf_serv(fresh->servers, key, old);
+    map_set_conf_serv(live->servers, key, NULL);
+
+    free_servconf(new);
+}
+
+// Same as conf_keep_serv(), for an interface
+void conf_keep_if(struct conf *fresh, struct conf *live, const char *key)
+{
+    conf_if *new, *old;
+
+    if (!map_get_conf_if(fresh->ifaces, key, &new) ||
+            !map_get_conf_if(live->ifaces, key, &old) || !old)
+        return;
+
+    old->name = new->name;
+
+    map_set_conf_if(fresh->ifaces, key, old);
+    map_set_conf_if(live->ifaces, key, NULL);
+
+    free_ifconf(new);
+}
+
 void conf_free(struct conf conf)
 {
     map_free_conf_if(conf.ifaces);
     map_free_conf_serv(conf.servers);
+
+    free(conf.path);
+    free(conf.statefile);
+    free(conf.metricssock);
 }
@@ -1,8 +1,11 @@
 #include <ctype.h>
+#include <string.h>
 #include <sysexits.h>
 
 #include "log.h"
 #include "dns.h"
+#include "trace.h"
+#include "xalloc.h"
 
 static ldns_resolver *sysresolv = NULL;
 
@@ -26,6 +29,22 @@ void dns_free_sys_resolver(void)
     ldns_resolver_deep_free(sysresolv);
 }
 
+// FNV-1a over the wire format, domain names compare case-insensitively
+uint64_t dns_dname_hash(const ldns_rdf *dname)
+{
+    const uint8_t *data = ldns_rdf_data(dname);
+    size_t size = ldns_rdf_size(dname);
+
+    uint64_t h = 0xcbf29ce484222325LLU;
+
+    for (size_t i = 0; i < size; i++) {
+        h ^= tolower(data[i]);
+        h *= 0x100000001b3LLU;
+    }
+
+    return h;
+}
+
 const char *dns_get_errorstr_by_rcode(ldns_pkt_rcode rcode)
 {
     switch (rcode) {
@@ -54,9 +73,25 @@ const char *dns_get_errorstr_by_rcode(ldns_pkt_rcode rcode)
     }
 }
 
-ldns_resolver *dns_resolver_init_frm_dname(ldns_resolver *resolv, ldns_rdf *server)
+static uint32_t dns_answer_min_ttl(const ldns_pkt *anspkt, uint32_t ttl)
+{
+    ldns_rr_list *answer = ldns_pkt_answer(anspkt);
+
+    for (size_t i = 0; i < ldns_rr_list_rr_count(answer); i++) {
+        ldns_rr *rr = ldns_rr_list_rr(answer, i);
+
+        if (ldns_rr_ttl(rr) < ttl)
+            ttl = ldns_rr_ttl(rr);
+    }
+
+    return ttl;
+}
+
+// Returns the lowest TTL among the addresses found, or 0 if there are none
+uint32_t dns_resolver_init_frm_dname(ldns_resolver *resolv, ldns_rdf *server)
 {
     ldns_pkt *anspkt_aaaa = NULL, *anspkt_a = NULL;
+    uint32_t ttl = 0;
 
     ldns_status ret_aaaa = ldns_resolver_query_status(&anspkt_aaaa, dns_sys_resolver(), server,
             LDNS_RR_TYPE_AAAA, LDNS_RR_CLASS_IN, LDNS_RD);
@@ -82,11 +117,39 @@ ldns_resolver *dns_resolver_init_frm_dname(ldns_resolver *resolv, ldns_rdf *serv
         goto fail;
     }
 
+    ttl = UINT32_MAX;
+
+    if (anspkt_aaaa)
+        ttl = dns_answer_min_ttl(anspkt_aaaa, ttl);
+    if (anspkt_a)
+        ttl = dns_answer_min_ttl(anspkt_a, ttl);
+
 fail:
     ldns_pkt_free(anspkt_aaaa);
     ldns_pkt_free(anspkt_a);
 
-    return resolv;
+    return ttl;
+}
+
+// Replaces the nameservers of the resolver, ports are left to the resolver
+void dns_resolver_set_nameservers(ldns_resolver *resolv,
+        const struct sockaddr_storage *addrs, size_t naddrs)
+{
+    ldns_rdf *ns;
+
+    while ((ns = ldns_resolver_pop_nameserver(resolv)))
+        ldns_rdf_deep_free(ns);
+
+    for (size_t i = 0; i < naddrs; i++) {
+        uint16_t port;
+        ldns_rdf *rdf = ldns_sockaddr_storage2rdf(&addrs[i], &port);
+
+        if (!rdf)
+            continue;
+
+        ldns_resolver_push_nameserver(resolv, rdf);
+        ldns_rdf_deep_free(rdf);
+    }
 }
 
 ldns_status dns_tsig_credentials_validate(ldns_tsig_credentials cred)
@@ -119,14 +182,7 @@ ldns_status dns_tsig_credentials_validate(ldns_tsig_credentials cred)
     }
 }
 
-void dns_resolver_set_tsig_credentials(ldns_resolver *resolv, ldns_tsig_credentials cred)
-{
-    ldns_resolver_set_tsig_algorithm(resolv, cred.algorithm);
-    ldns_resolver_set_tsig_keyname(resolv, cred.keyname);
-    ldns_resolver_set_tsig_keydata(resolv, cred.keydata);
-}
-
-static ldns_rr *dns_prepare_update_rr(ldns_rdf *record,
+ldns_rr *dns_prepare_update_rr(ldns_rdf *record,
         const struct sockaddr *addr, bool delete, uint32_t ttl)
 {
     ldns_rdf *rd = ldns_sockaddr_storage2rdf((struct sockaddr_storage *)addr, NULL);
@@ -149,43 +205,76 @@ static ldns_rr *dns_prepare_update_rr(ldns_rdf *record,
     if (!ldns_rr_push_rdf(updrr, rd))
         die(EX_SOFTWARE, "Failed to allocate memory");
 
+    TRACE(dns_update_rr, ttl, delete);
+
     return updrr;
 }
 
-void dns_send_update(ldns_rdf *zone, ldns_rr_list *updrrlist, ldns_resolver *resolv)
-{
-    ldns_status ret;
+struct dns_update {
+    dns_update_done cb;
+    void *arg;
+};
 
-    ldns_pkt *updanspkt = NULL;
-    ldns_pkt *updpkt = ldns_update_pkt_new(ldns_rdf_clone(zone), LDNS_RR_CLASS_IN, NULL, updrrlist, NULL);
+// Logs why the request failed, if it did
+bool dns_reply_ok(const ldns_pkt *reply, ldns_status status)
+{
+    if (status != LDNS_STATUS_OK) {
+        log(LOG_WARNING, "Failed to query DNS server: %s", ldns_get_errorstr_by_id(status));
+        return false;
+    }
 
-    ret = ldns_update_pkt_tsig_add(updpkt, resolv);
+    ldns_pkt_rcode rcode = ldns_pkt_get_rcode(reply);
 
-    if (ret != LDNS_STATUS_OK) {
-        log(LOG_WARNING, "Failed to sign packet with TSIG key: %s", ldns_get_errorstr_by_id(ret));
-        goto fail;
+    if (rcode != LDNS_RCODE_NOERROR) {
+        log(LOG_WARNING, "Failed to query DNS server: %s", dns_get_errorstr_by_rcode(rcode));
+        return false;
     }
 
-    ret = ldns_resolver_send_pkt(&updanspkt, resolv, updpkt);
+    return true;
+}
 
-    if (ret != LDNS_STATUS_OK) {
-        log(LOG_WARNING, "Failed to query DNS server: %s", ldns_get_errorstr_by_id(ret));
-        goto fail;
+static void dns_update_cb(ldns_pkt *updanspkt, ldns_status ret, void *arg)
+{
+    struct dns_update *update = arg;
+    bool ok = dns_reply_ok(updanspkt, ret);
+
+    if (update) {
+        update->cb(ok, update->arg);
+        free(update);
     }
+}
 
-    ldns_pkt_rcode rcode = ldns_pkt_get_rcode(updanspkt);
+// The reply is handled asynchronously, once it arrives on the channel.
+// `cb` may be NULL, otherwise it is called exactly once.
+void dns_send_update(ldns_rdf *zone, ldns_rr_list *updrrlist, struct chan *chan,
+        dns_update_done cb, void *arg)
+{
+    ldns_pkt *updpkt = ldns_update_pkt_new(ldns_rdf_clone(zone), LDNS_RR_CLASS_IN, NULL, updrrlist, NULL);
+    struct dns_update *update = NULL;
+
+    if (cb) {
+        update = xmalloc(sizeof *update);
+        *update = (struct dns_update) {
+            .cb = cb,
+            .arg = arg
+        };
+    }
 
-    if (rcode != LDNS_RCODE_NOERROR) {
-        log(LOG_WARNING, "Failed to query DNS server: %s", dns_get_errorstr_by_rcode(rcode));
-        goto fail;
+    ldns_status ret = chan_send(chan, updpkt, dns_update_cb, update);
+
+    if (ret != LDNS_STATUS_OK) {
+        log(LOG_WARNING, "Failed to send UPDATE: %s", ldns_get_errorstr_by_id(ret));
+
+        if (update) {
+            cb(false, arg);
+            free(update);
+        }
     }
 
-fail:
-    ldns_pkt_free(updanspkt);
     ldns_pkt_free(updpkt);
 }
 
-void dns_do_update(ldns_resolver *resolv, ldns_rdf *zone, ldns_rdf *record,
+void dns_do_update(struct chan *chan, ldns_rdf *zone, ldns_rdf *record,
         const struct sockaddr *addr, bool delete, uint32_t ttl)
 {
     ldns_rr *updrr = dns_prepare_update_rr(record, addr, delete, ttl);
@@ -194,7 +283,62 @@ void dns_do_update(ldns_resolver *resolv, ldns_rdf *zone, ldns_rdf *record,
     if (!ldns_rr_list_push_rr(updrrlist, updrr))
         die(EX_SOFTWARE, "Failed to allocate memory");
 
-    dns_send_update(zone, updrrlist, resolv);
+    dns_send_update(zone, updrrlist, chan, NULL, NULL);
 
     ldns_rr_list_deep_free(updrrlist);
 }
+
+static void dns_put16(uint8_t *p, uint16_t v)
+{
+    p[0] = v >> 8;
+    p[1] = v & 0xff;
+}
+
+// Writes the header and zone section of an UPDATE, which serve as the
+// template for every UPDATE sent for the zone. Returns the length.
+size_t dns_wire_update_init(uint8_t *wire, const ldns_rdf *zone)
+{
+    size_t zonelen = ldns_rdf_size(zone);
+
+    memset(wire, 0, DNS_WIRE_HDR_SIZE);
+
+    // Opcode UPDATE and a single zone, the message ID is set when sending
+    wire[2] = LDNS_PACKET_UPDATE << 3;
+    dns_put16(wire + 4, 1);
+
+    memcpy(wire + DNS_WIRE_HDR_SIZE, ldns_rdf_data(zone), zonelen);
+    dns_put16(wire + DNS_WIRE_HDR_SIZE + zonelen, LDNS_RR_TYPE_SOA);
+    dns_put16(wire + DNS_WIRE_HDR_SIZE + zonelen + 2, LDNS_RR_CLASS_IN);
+
+    return DNS_WIRE_HDR_SIZE + zonelen + 4;
+}
+
+// Appends an AAAA RR to the update section, with the same semantics as
+// `dns_prepare_update_rr`. Returns the new length, or 0 if it doesn't fit.
+size_t dns_wire_update_push(uint8_t *wire, size_t len, size_t size, const ldns_rdf *record,
+        const struct in6_addr *addr, bool delete, uint32_t ttl)
+{
+    size_t recordlen = ldns_rdf_size(record);
+
+    if (size - len < recordlen + 10 + sizeof *addr)
+        return 0;
+
+    ttl = dns_update_ttl(delete, ttl);
+
+    uint8_t *p = wire + len;
+
+    memcpy(p, ldns_rdf_data(record), recordlen);
+    p += recordlen;
+
+    dns_put16(p, LDNS_RR_TYPE_AAAA);
+    dns_put16(p + 2, delete ? LDNS_RR_CLASS_NONE : LDNS_RR_CLASS_IN);
+    dns_put16(p + 4, ttl >> 16);
+    dns_put16(p + 6, ttl & 0xffff);
+    dns_put16(p + 8, sizeof *addr);
+    memcpy(p + 10, addr, sizeof *addr);
+
+    // Update count
+    dns_put16(wire + 8, ((uint16_t)wire[8] << 8 | wire[9]) + 1);
+
+    return len + recordlen + 10 + sizeof *addr;
+}
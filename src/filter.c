@@ -0,0 +1,96 @@
+#include <errno.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+
+#include <asm/socket.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+
+#include "filter.h"
+#include "xalloc.h"
+
+#define NL_OFF_TYPE   offsetof(struct nlmsghdr, nlmsg_type)
+#define NL_OFF_FLAGS  offsetof(struct nlmsghdr, nlmsg_flags)
+#define IFA_OFF(field) (NLMSG_HDRLEN + offsetof(struct ifaddrmsg, field))
+
+#define ACCEPT 0xffffffff
+#define DROP   0
+
+// Classic BPF loads halfwords and words in network byte order, while
+// Netlink messages are in host byte order, so constants for multi-byte
+// fields have to be swapped.
+//
+// Address messages are only let through if they are IPv6, global scope
+// and for one of the given interfaces. Everything else (link messages,
+// dump replies, errors) is accepted, since it's needed by libnl.
+struct sock_filter *filter_build(const int *ifidx, size_t count, size_t *len)
+{
+    bool checkidx = count <= FILTER_MAX_IFACES;
+
+    struct sock_filter head[] = {
+        BPF_STMT(BPF_LD | BPF_H | BPF_ABS, NL_OFF_TYPE),
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, htons(RTM_NEWADDR), 2, 0),
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, htons(RTM_DELADDR), 1, 0),
+        BPF_STMT(BPF_RET | BPF_K, ACCEPT),
+
+        BPF_STMT(BPF_LD | BPF_H | BPF_ABS, NL_OFF_FLAGS),
+        BPF_JUMP(BPF_JMP | BPF_JSET | BPF_K, htons(NLM_F_MULTI), 0, 1),
+        BPF_STMT(BPF_RET | BPF_K, ACCEPT),
+
+        BPF_STMT(BPF_LD | BPF_B | BPF_ABS, IFA_OFF(ifa_family)),
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, AF_INET6, 1, 0),
+        BPF_STMT(BPF_RET | BPF_K, DROP),
+
+        BPF_STMT(BPF_LD | BPF_B | BPF_ABS, IFA_OFF(ifa_scope)),
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, RT_SCOPE_UNIVERSE, 1, 0),
+        BPF_STMT(BPF_RET | BPF_K, DROP),
+
+        BPF_STMT(BPF_LD | BPF_W | BPF_ABS, IFA_OFF(ifa_index))
+    };
+
+    size_t headlen = sizeof head / sizeof head[0];
+
+    *len = headlen + (checkidx ? 2 * count : 0) + 1;
+
+    struct sock_filter *insns = xreallocarray(NULL, *len, sizeof *insns);
+    struct sock_filter *insn = insns + headlen;
+
+    memcpy(insns, head, sizeof head);
+
+    if (!checkidx) {
+        *insn = (struct sock_filter)BPF_STMT(BPF_RET | BPF_K, ACCEPT);
+        return insns;
+    }
+
+    // Each comparison is followed by its own accept, so
+    // jumps never go past the 8 bits allowed for offsets
+    for (size_t i = 0; i < count; i++) {
+        *insn++ = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, htonl(ifidx[i]), 0, 1);
+        *insn++ = (struct sock_filter)BPF_STMT(BPF_RET | BPF_K, ACCEPT);
+    }
+
+    *insn = (struct sock_filter)BPF_STMT(BPF_RET | BPF_K, DROP);
+
+    return insns;
+}
+
+// Replaces any filter previously attached to the socket
+int filter_attach(int fd, const int *ifidx, size_t count)
+{
+    size_t len;
+    struct sock_filter *insns = filter_build(ifidx, count, &len);
+
+    struct sock_fprog prog = {
+        .len = len,
+        .filter = insns
+    };
+
+    int ret = setsockopt(fd, SOL_SOCKET, SO_ATTACH_FILTER, &prog, sizeof prog);
+
+    free(insns);
+
+    return ret < 0 ? -errno : 0;
+}
@@ -1,60 +1,251 @@
 // To appease glibc
 #define _DEFAULT_SOURCE
 
+#include <poll.h>
+#include <errno.h>
 #include <stdio.h>
+#include <signal.h>
 #include <string.h>
 #include <unistd.h>
 #include <stdarg.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdatomic.h>
 
 #include "log.h"
+#include "ring.h"
 
+// Longer messages are cut short and end with "...". Enough for the
+// metrics summary with long server names, at 2 MiB for the whole ring
+#define LOG_LINE_MAX 1024
+#define LOG_RING_SIZE 2048
+
+// Lines for stdout are gathered into writes of up to this size
+#define LOG_BATCH_SIZE 16384
+
+struct log_msg {
+    uint8_t prio;
+    uint16_t len;
+    char text[LOG_LINE_MAX];
+};
+
+uint8_t log_dropmask;
+
+// Messages are formatted by the thread logging them and handed through a
+// ring to a thread of their own, which does the writing, so that nothing
+// on the event path blocks on stdout or on the syslog socket. Messages
+// logged before that thread is started, or by the ring itself, are written
+// directly.
 static struct log_state {
     enum log_mode mode;
-    uint8_t mask;
-} state;
+
+    struct ring *ring;
+    pthread_t thread;
+    atomic_bool stop;
+
+    // Held by whoever writes, the logging thread, a thread that is exiting
+    // or one writing directly
+    pthread_mutex_t lock;
+    uint64_t dropped;
+
+    char out[LOG_BATCH_SIZE];
+    size_t outlen;
+} state = {
+    .lock = PTHREAD_MUTEX_INITIALIZER
+};
+
+static _Thread_local bool inlog;
+
+static void log_write_out(void)
+{
+    size_t off = 0;
+
+    while (off < state.outlen) {
+        ssize_t n = write(STDOUT_FILENO, state.out + off, state.outlen - off);
+
+        if (n < 0 && errno == EINTR)
+            continue;
+
+        // Nowhere left to report it
+        if (n < 0)
+            break;
+
+        off += n;
+    }
+
+    state.outlen = 0;
+}
+
+static void log_emit(int prio, const char *text, size_t len)
+{
+    if (state.mode == LOG_MODE_SYSLOG) {
+        syslog(prio, "%s", text);
+        return;
+    }
+
+    if (state.outlen + len + 1 > sizeof state.out)
+        log_write_out();
+
+    memcpy(state.out + state.outlen, text, len);
+    state.out[state.outlen + len] = '\n';
+    state.outlen += len + 1;
+}
+
+static void log_drain(void)
+{
+    struct log_msg msg;
+    struct ring_stats stats;
+
+    pthread_mutex_lock(&state.lock);
+
+    while (ring_pop(state.ring, &msg))
+        log_emit(msg.prio, msg.text, msg.len);
+
+    ring_stats(state.ring, &stats);
+
+    if (stats.dropped != state.dropped) {
+        char buf[64];
+        int len = snprintf(buf, sizeof buf, "[" S_LOG_WARNING "] %llu log message(s) dropped",
+                (unsigned long long)(stats.dropped - state.dropped));
+
+        log_emit(LOG_WARNING, buf, len);
+        state.dropped = stats.dropped;
+    }
+
+    log_write_out();
+
+    pthread_mutex_unlock(&state.lock);
+}
+
+static void *log_run(void *arg)
+{
+    (void)arg;
+
+    struct pollfd pfd = {
+        .fd = ring_fd(state.ring),
+        .events = POLLIN
+    };
+
+    while (1) {
+        do
+            log_drain();
+        while (ring_arm(state.ring));
+
+        if (atomic_load(&state.stop))
+            break;
+
+        poll(&pfd, 1, -1);
+    }
+
+    return NULL;
+}
+
+// Whatever is still in the ring when exiting, e.g. after die()
+static void log_flush(void)
+{
+    if (state.ring)
+        log_drain();
+}
 
 void log_init(const char *ident, enum log_mode mode)
 {
-	if (mode == LOG_MODE_DEFAULT)
-		mode = isatty(STDOUT_FILENO)
-			? LOG_MODE_STDOUT
-			: LOG_MODE_SYSLOG;
+    if (mode == LOG_MODE_DEFAULT)
+        mode = isatty(STDOUT_FILENO)
+            ? LOG_MODE_STDOUT
+            : LOG_MODE_SYSLOG;
+
+    if (mode == LOG_MODE_SYSLOG)
+        openlog(ident, LOG_PID, LOG_DAEMON);
+
+    state.mode = mode;
+    log_dropmask = 0;
+
+    struct ring *ring = ring_new(LOG_RING_SIZE, sizeof(struct log_msg));
 
-	if (mode == LOG_MODE_SYSLOG)
-		openlog(ident, LOG_PID, LOG_DAEMON);
+    atomic_store(&state.stop, false);
+    state.ring = ring;
 
-	state.mode = mode;
-	state.mask = 0;
+    // Signals are taken through a signalfd by the threads expecting
+    // them, so none may be delivered to this one
+    sigset_t all, old;
+    sigfillset(&all);
+
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    int ret = pthread_create(&state.thread, NULL, log_run, NULL);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+    if (ret != 0) {
+        state.ring = NULL;
+        ring_free(ring);
+
+        log(LOG_WARNING, "Failed to create logging thread: %s", strerror(ret));
+        return;
+    }
+
+    atexit(log_flush);
 }
 
 void log_close(void)
 {
-	if (state.mode == LOG_MODE_SYSLOG)
-		closelog();
+    if (state.ring) {
+        atomic_store(&state.stop, true);
+        ring_wake(state.ring);
+
+        pthread_join(state.thread, NULL);
+        log_drain();
+
+        ring_free(state.ring);
+        state.ring = NULL;
+    }
+
+    if (state.mode == LOG_MODE_SYSLOG)
+        closelog();
 }
 
-void log_mask(uint8_t prio)
+// Drops messages of the priorities set in `mask`, in either mode
+void log_mask(uint8_t mask)
 {
-	if (state.mode == LOG_MODE_STDOUT)
-		state.mask = prio;
-	else if (state.mask == LOG_MODE_SYSLOG)
-		setlogmask(prio);
+    log_dropmask = mask;
 }
 
 void slog(int prio, const char *fmt, ...)
 {
+    if (state.mode == LOG_MODE_DEFAULT)
+        return;
+
+    struct log_msg msg;
+    msg.prio = prio;
+
     va_list ap;
-	va_start(ap, fmt);
+    va_start(ap, fmt);
+
+    int len = vsnprintf(msg.text, sizeof msg.text, fmt, ap);
+
+    va_end(ap);
+
+    if (len < 0)
+        return;
+
+    if ((size_t)len < sizeof msg.text) {
+        msg.len = len;
+    } else {
+        msg.len = sizeof msg.text - 1;
+        memcpy(msg.text + msg.len - 3, "...", 3);
+    }
+
+    // A full ring drops the message, which is counted and reported later
+    if (state.ring && !inlog) {
+        inlog = true;
+        ring_push(state.ring, &msg);
+        inlog = false;
+
+        return;
+    }
 
-    if (state.mode == LOG_MODE_STDOUT) {
-		if (state.mask & (1 << prio))
-			return;
+    pthread_mutex_lock(&state.lock);
 
-		vprintf(fmt, ap);
-		putchar('\n');
-	} else if (state.mode == LOG_MODE_SYSLOG) {
-		vsyslog(prio, fmt, ap);
-	}
+    log_emit(prio, msg.text, msg.len);
+    log_write_out();
 
-	va_end(ap);
+    pthread_mutex_unlock(&state.lock);
 }
@@ -0,0 +1,405 @@
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include <sys/timerfd.h>
+#include <sys/signalfd.h>
+
+#include "log.h"
+#include "loop.h"
+#include "util.h"
+#include "xalloc.h"
+
+#define LOOP_MAX_EVENTS 32
+
+struct loop_signal {
+    int signo;
+    loop_signal_cb cb;
+    void *arg;
+};
+
+struct loop {
+    int epfd;
+
+    struct loop_io timerio;
+    struct loop_io sigio;
+    sigset_t sigmask;
+
+    // Binary min-heap ordered by deadline
+    struct loop_timer **timers;
+    size_t ntimers, timersize;
+
+    struct loop_signal *signals;
+    size_t nsignals;
+
+    // Freed once the events of the current iteration have been handled,
+    // which may still point at them
+    void **deferred;
+    size_t ndeferred, deferredsize;
+
+    size_t refs;
+    bool stopped;
+};
+
+static void loop_timer_swap(struct loop *loop, size_t a, size_t b)
+{
+    struct loop_timer *tmp = loop->timers[a];
+
+    loop->timers[a] = loop->timers[b];
+    loop->timers[b] = tmp;
+
+    loop->timers[a]->idx = a;
+    loop->timers[b]->idx = b;
+}
+
+static void loop_timer_up(struct loop *loop, size_t i)
+{
+    while (i > 0) {
+        size_t parent = (i - 1) / 2;
+
+        if (loop->timers[parent]->deadline <= loop->timers[i]->deadline)
+            break;
+
+        loop_timer_swap(loop, i, parent);
+        i = parent;
+    }
+}
+
+static void loop_timer_down(struct loop *loop, size_t i)
+{
+    while (1) {
+        size_t min = i;
+        size_t l = 2 * i + 1, r = 2 * i + 2;
+
+        if (l < loop->ntimers && loop->timers[l]->deadline < loop->timers[min]->deadline)
+            min = l;
+        if (r < loop->ntimers && loop->timers[r]->deadline < loop->timers[min]->deadline)
+            min = r;
+
+        if (min == i)
+            break;
+
+        loop_timer_swap(loop, i, min);
+        i = min;
+    }
+}
+
+// Arm the timerfd for the earliest deadline, or disarm it
+static void loop_timer_update(struct loop *loop)
+{
+    struct itimerspec its = {0};
+
+    if (loop->ntimers) {
+        int64_t deadline = loop->timers[0]->deadline;
+
+        its.it_value.tv_sec = deadline / 1000;
+        its.it_value.tv_nsec = (deadline % 1000) * 1000000;
+
+        // An all-zero value would disarm the timer
+        if (its.it_value.tv_sec == 0 && its.it_value.tv_nsec == 0)
+            its.it_value.tv_nsec = 1;
+    }
+
+    timerfd_settime(loop->timerio.fd, TFD_TIMER_ABSTIME, &its, NULL);
+}
+
+static void loop_timer_expire(struct loop_io *io, uint32_t events)
+{
+    (void)events;
+
+    struct loop *loop = io->arg;
+
+    uint64_t expirations;
+    while (read(io->fd, &expirations, sizeof expirations) > 0)
+        ;
+
+    int64_t now = clock_ms();
+
+    while (loop->ntimers && loop->timers[0]->deadline <= now) {
+        struct loop_timer *timer = loop->timers[0];
+
+        loop_timer_disarm(loop, timer);
+        timer->cb(timer);
+    }
+
+    loop_timer_update(loop);
+}
+
+static void loop_signal_recv(struct loop_io *io, uint32_t events)
+{
+    (void)events;
+
+    struct loop *loop = io->arg;
+    struct signalfd_siginfo si;
+
+    while (read(io->fd, &si, sizeof si) == sizeof si) {
+        for (size_t i = 0; i < loop->nsignals; i++) {
+            struct loop_signal *sig = &loop->signals[i];
+
+            if (sig->signo == (int)si.ssi_signo)
+                sig->cb(loop, sig->signo, sig->arg);
+        }
+    }
+}
+
+struct loop *loop_new(void)
+{
+    struct loop *loop = xcalloc(1, sizeof *loop);
+
+    loop->epfd = epoll_create1(EPOLL_CLOEXEC);
+
+    if (loop->epfd < 0)
+        die(EX_OSERR, "Failed to create epoll instance: %s", strerror(errno));
+
+    int timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+
+    if (timerfd < 0)
+        die(EX_OSERR, "Failed to create timer: %s", strerror(errno));
+
+    loop_io_init(&loop->timerio, timerfd, loop_timer_expire, loop);
+    loop_io_start(loop, &loop->timerio, EPOLLIN);
+
+    sigemptyset(&loop->sigmask);
+    loop_io_init(&loop->sigio, -1, loop_signal_recv, loop);
+
+    return loop;
+}
+
+void loop_free(struct loop *loop)
+{
+    if (!loop)
+        return;
+
+    close(loop->timerio.fd);
+
+    if (loop->sigio.fd >= 0)
+        close(loop->sigio.fd);
+
+    close(loop->epfd);
+
+    for (size_t i = 0; i < loop->ndeferred; i++)
+        free(loop->deferred[i]);
+
+    free(loop->deferred);
+    free(loop->timers);
+    free(loop->signals);
+    free(loop);
+}
+
+void loop_io_init(struct loop_io *io, int fd, loop_io_cb cb, void *arg)
+{
+    io->fd = fd;
+    io->events = 0;
+    io->cb = cb;
+    io->arg = arg;
+}
+
+void loop_io_start(struct loop *loop, struct loop_io *io, uint32_t events)
+{
+    struct epoll_event ev = {
+        .events = events,
+        .data.ptr = io
+    };
+
+    int op = io->events ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+
+    if (epoll_ctl(loop->epfd, op, io->fd, &ev) < 0)
+        die(EX_OSERR, "Failed to watch file descriptor: %s", strerror(errno));
+
+    io->events = events;
+}
+
+void loop_io_stop(struct loop *loop, struct loop_io *io)
+{
+    if (!io->events)
+        return;
+
+    epoll_ctl(loop->epfd, EPOLL_CTL_DEL, io->fd, NULL);
+    io->events = 0;
+}
+
+void loop_timer_init(struct loop_timer *timer, loop_timer_cb cb, void *arg)
+{
+    timer->deadline = 0;
+    timer->idx = LOOP_TIMER_INACTIVE;
+    timer->cb = cb;
+    timer->arg = arg;
+}
+
+void loop_timer_arm(struct loop *loop, struct loop_timer *timer, int64_t deadline)
+{
+    if (loop_timer_armed(timer))
+        loop_timer_disarm(loop, timer);
+
+    if (loop->ntimers == loop->timersize) {
+        loop->timersize = loop->timersize ? loop->timersize * 2 : 16;
+        loop->timers = xreallocarray(loop->timers, loop->timersize, sizeof *loop->timers);
+    }
+
+    timer->deadline = deadline;
+    timer->idx = loop->ntimers;
+
+    loop->timers[loop->ntimers++] = timer;
+    loop_timer_up(loop, timer->idx);
+
+    if (loop->timers[0] == timer)
+        loop_timer_update(loop);
+}
+
+void loop_timer_disarm(struct loop *loop, struct loop_timer *timer)
+{
+    if (!loop_timer_armed(timer))
+        return;
+
+    size_t i = timer->idx;
+    size_t last = --loop->ntimers;
+
+    timer->idx = LOOP_TIMER_INACTIVE;
+
+    if (i == last)
+        return;
+
+    loop->timers[i] = loop->timers[last];
+    loop->timers[i]->idx = i;
+
+    loop_timer_up(loop, i);
+    loop_timer_down(loop, loop->timers[i]->idx);
+}
+
+void loop_signal(struct loop *loop, int signo, loop_signal_cb cb, void *arg)
+{
+    loop->signals = xreallocarray(loop->signals, loop->nsignals + 1, sizeof *loop->signals);
+    loop->signals[loop->nsignals++] = (struct loop_signal) {
+        .signo = signo,
+        .cb = cb,
+        .arg = arg
+    };
+
+    // The signal has to be blocked so that it is only delivered through the
+    // signalfd, threads created afterwards inherit the mask
+    sigaddset(&loop->sigmask, signo);
+    pthread_sigmask(SIG_BLOCK, &loop->sigmask, NULL);
+
+    int fd = signalfd(loop->sigio.fd, &loop->sigmask, SFD_NONBLOCK | SFD_CLOEXEC);
+
+    if (fd < 0)
+        die(EX_OSERR, "Failed to create signalfd: %s", strerror(errno));
+
+    if (loop->sigio.fd < 0) {
+        loop->sigio.fd = fd;
+        loop_io_start(loop, &loop->sigio, EPOLLIN);
+    }
+}
+
+// Frees memory holding a watcher that was stopped, once no event of the
+// current iteration can refer to it anymore
+void loop_defer_free(struct loop *loop, void *ptr)
+{
+    if (!ptr)
+        return;
+
+    if (loop->ndeferred == loop->deferredsize) {
+        loop->deferredsize = loop->deferredsize ? loop->deferredsize * 2 : 8;
+        loop->deferred = xreallocarray(loop->deferred, loop->deferredsize, sizeof *loop->deferred);
+    }
+
+    loop->deferred[loop->ndeferred++] = ptr;
+}
+
+void loop_ref(struct loop *loop)
+{
+    loop->refs++;
+}
+
+void loop_unref(struct loop *loop)
+{
+    loop->refs--;
+}
+
+// Whether there is no outstanding work, i.e. `loop_drain` would return
+bool loop_idle(const struct loop *loop)
+{
+    return loop->refs == 0;
+}
+
+static void loop_iterate(struct loop *loop)
+{
+    struct epoll_event events[LOOP_MAX_EVENTS];
+
+    int n = epoll_wait(loop->epfd, events, LOOP_MAX_EVENTS, -1);
+
+    if (n < 0) {
+        if (errno == EINTR)
+            return;
+
+        die(EX_OSERR, "Failed to wait for events: %s", strerror(errno));
+    }
+
+    for (int i = 0; i < n; i++) {
+        struct loop_io *io = events[i].data.ptr;
+
+        // Stopped by an earlier callback of this iteration
+        if (!io->events)
+            continue;
+
+        io->cb(io, events[i].events);
+    }
+
+    for (size_t i = 0; i < loop->ndeferred; i++)
+        free(loop->deferred[i]);
+
+    loop->ndeferred = 0;
+}
+
+// Runs until `loop_stop` is called
+void loop_run(struct loop *loop)
+{
+    while (!loop->stopped)
+        loop_iterate(loop);
+}
+
+// Waits for and handles a single round of events
+void loop_once(struct loop *loop)
+{
+    loop_iterate(loop);
+}
+
+// Runs until there is no outstanding work left
+void loop_drain(struct loop *loop)
+{
+    while (!loop->stopped && loop->refs)
+        loop_iterate(loop);
+}
+
+static void loop_deadline_cb(struct loop_timer *timer)
+{
+    (void)timer;
+}
+
+// Like `loop_drain`, but gives up at `deadline`, returns whether there
+// is no outstanding work left
+bool loop_drain_until(struct loop *loop, int64_t deadline)
+{
+    struct loop_timer timer;
+
+    loop_timer_init(&timer, loop_deadline_cb, NULL);
+    loop_timer_arm(loop, &timer, deadline);
+
+    while (!loop->stopped && loop->refs && loop_timer_armed(&timer))
+        loop_iterate(loop);
+
+    loop_timer_disarm(loop, &timer);
+
+    return loop->refs == 0;
+}
+
+void loop_stop(struct loop *loop)
+{
+    loop->stopped = true;
+}
+
+bool loop_stopped(const struct loop *loop)
+{
+    return loop->stopped;
+}
@@ -6,10 +6,13 @@
 
 #include "nl.h"
 #include "log.h"
+#include "loop.h"
 #include "dns.h"
+#include "snap.h"
 #include "util.h"
 #include "conf.h"
 #include "xalloc.h"
+#include "metrics.h"
 
 int main(int argc, char * const *argv)
 {
@@ -111,13 +114,31 @@ int main(int argc, char * const *argv)
 
     fclose(conf);
 
-    struct nl_cache_mngr *nlmngr = nl_sync(&confmap);
+    if (confmap.statefile)
+        snap_open(confmap.statefile);
+
+    struct loop *loop = loop_new();
+    struct metrics_sock *metrics = NULL;
+
+    if (confmap.metricssock)
+        metrics = metrics_sock_new(confmap.metricssock, &confmap, loop);
+
+    struct nl_cache_mngr *nlmngr = nl_sync(&confmap, loop);
 
     if (!oneshot)
-        nl_run(nlmngr);
+        nl_run(nlmngr, loop, &confmap);
+
+    // Wait for in-flight updates, unless terminated by a signal
+    loop_drain(loop);
+
+    snap_save(&confmap);
+    snap_close();
+
+    metrics_sock_free(metrics);
 
     log_close();
     conf_free(confmap);
     nl_free(nlmngr);
+    loop_free(loop);
     dns_free_sys_resolver();
 }
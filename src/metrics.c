@@ -0,0 +1,461 @@
+#include <errno.h>
+#include <stddef.h>
+#include <string.h>
+#include <unistd.h>
+#include <inttypes.h>
+
+#include <sys/un.h>
+#include <sys/socket.h>
+
+#include "log.h"
+#include "map.h"
+#include "metrics.h"
+#include "xalloc.h"
+
+map_decl(conf_serv, uint64_t, const char *, conf_serv *);
+
+// Clients that connect and never send anything are dropped beyond this
+#define METRICS_MAX_CONNS 16
+
+struct metrics metrics;
+
+static const char * const rcode_names[METRICS_RCODES] = {
+    "NOERROR", "FORMERR", "SERVFAIL", "NXDOMAIN", "NOTIMP", "REFUSED",
+    "YXDOMAIN", "YXRRSET", "NXRRSET", "NOTAUTH", "NOTZONE", "DSOTYPENI",
+    "RCODE12", "RCODE13", "RCODE14", "RCODE15", "none"
+};
+
+struct metrics_conn {
+    struct metrics_sock *sock;
+    struct metrics_conn *next;
+    struct loop_io io;
+};
+
+struct metrics_sock {
+    struct conf *conf;
+    struct loop *loop;
+    struct loop_io io;
+    char *path;
+
+    // Newest first
+    struct metrics_conn *conns;
+    size_t nconns;
+};
+
+static uint64_t metrics_load(const metrics_counter *counter)
+{
+    return atomic_load_explicit(counter, memory_order_relaxed);
+}
+
+uint64_t metrics_hist_upper(size_t idx)
+{
+    size_t exp = idx >> METRICS_HIST_SUB_BITS;
+    size_t sub = idx & (METRICS_HIST_SUB - 1);
+
+    if (exp == 0)
+        return sub + 1;
+
+    return (uint64_t)(METRICS_HIST_SUB + sub + 1) << (exp - 1);
+}
+
+// Upper bound of the bucket holding the value at quantile `q`, 0 if empty
+uint64_t metrics_hist_quantile(const struct metrics_hist *hist, double q)
+{
+    uint64_t counts[METRICS_HIST_BUCKETS];
+    uint64_t total = 0;
+
+    // Read once, so that the rank and the walk agree
+    for (size_t i = 0; i < METRICS_HIST_BUCKETS; i++)
+        total += counts[i] = metrics_load(&hist->counts[i]);
+
+    if (total == 0)
+        return 0;
+
+    uint64_t rank = q * total;
+    uint64_t seen = 0;
+
+    if (rank >= total)
+        rank = total - 1;
+
+    for (size_t i = 0; i < METRICS_HIST_BUCKETS; i++) {
+        seen += counts[i];
+
+        if (seen > rank)
+            return metrics_hist_upper(i);
+    }
+
+    return metrics_hist_upper(METRICS_HIST_BUCKETS - 1);
+}
+
+struct metrics_serv *metrics_serv_new(void)
+{
+    return xcalloc(1, sizeof(struct metrics_serv));
+}
+
+void metrics_serv_free(struct metrics_serv *serv)
+{
+    free(serv);
+}
+
+// Microseconds as seconds, exactly
+static void write_seconds(FILE *file, uint64_t us)
+{
+    fprintf(file, "%" PRIu64 ".%06" PRIu64, us / 1000000, us % 1000000);
+}
+
+static void write_label(FILE *file, const char *name)
+{
+    fputs("server=\"", file);
+
+    for (; *name; name++) {
+        if (*name == '"' || *name == '\\')
+            fputc('\\', file);
+
+        if (*name == '\n')
+            fputs("\\n", file);
+        else
+            fputc(*name, file);
+    }
+
+    fputc('"', file);
+}
+
+struct metrics_family {
+    FILE *file;
+    const char *name;
+    size_t offset;
+    // Counters with the rcode label, or histograms
+    bool rcodes, hist;
+};
+
+static bool write_servconf(const char *key, conf_serv *servconf, void *arg)
+{
+    struct metrics_family *family = arg;
+    struct metrics_serv *serv = servconf->metrics;
+    FILE *file = family->file;
+
+    if (!serv)
+        return true;
+
+    if (family->rcodes) {
+        for (size_t i = 0; i < METRICS_RCODES; i++) {
+            uint64_t count = metrics_load(&serv->rcodes[i]);
+
+            // Only the common ones are always present
+            if (!count && i != 0 && i != 2 && i != 5 && i != METRICS_RCODE_NONE)
+                continue;
+
+            fprintf(file, "%s_total{", family->name);
+            write_label(file, key);
+            fprintf(file, ",rcode=\"%s\"} %" PRIu64 "\n", rcode_names[i], count);
+        }
+
+        return true;
+    }
+
+    if (!family->hist) {
+        fprintf(file, "%s_total{", family->name);
+        write_label(file, key);
+        fprintf(file, "} %" PRIu64 "\n",
+                metrics_load((metrics_counter *)((char *)serv + family->offset)));
+
+        return true;
+    }
+
+    const struct metrics_hist *hist = (struct metrics_hist *)((char *)serv + family->offset);
+    uint64_t total = 0;
+
+    // Only the power of two boundaries, the last group is left to +Inf
+    for (size_t i = 0; i < METRICS_HIST_BUCKETS; i++) {
+        total += metrics_load(&hist->counts[i]);
+
+        if ((i & (METRICS_HIST_SUB - 1)) != METRICS_HIST_SUB - 1 ||
+                i >= METRICS_HIST_BUCKETS - METRICS_HIST_SUB)
+            continue;
+
+        fprintf(file, "%s_bucket{", family->name);
+        write_label(file, key);
+        fputs(",le=\"", file);
+        write_seconds(file, metrics_hist_upper(i));
+        fprintf(file, "\"} %" PRIu64 "\n", total);
+    }
+
+    fprintf(file, "%s_bucket{", family->name);
+    write_label(file, key);
+    fprintf(file, ",le=\"+Inf\"} %" PRIu64 "\n", total);
+
+    fprintf(file, "%s_count{", family->name);
+    write_label(file, key);
+    fprintf(file, "} %" PRIu64 "\n", total);
+
+    fprintf(file, "%s_sum{", family->name);
+    write_label(file, key);
+    fputs("} ", file);
+    write_seconds(file, metrics_load(&hist->sum));
+    fputc('\n', file);
+
+    return true;
+}
+
+// OpenMetrics text format
+void metrics_write(FILE *file, struct conf *conf)
+{
+    fprintf(file, "# TYPE ipup_netlink_messages counter\n"
+            "# HELP ipup_netlink_messages Messages read from the Netlink socket.\n"
+            "ipup_netlink_messages_total %" PRIu64 "\n",
+            metrics_load(&metrics.nl_received));
+
+    fprintf(file, "# TYPE ipup_address_events counter\n"
+            "# HELP ipup_address_events Address events, by whether they were passed on.\n"
+            "ipup_address_events_total{result=\"ignored\"} %" PRIu64 "\n"
+            "ipup_address_events_total{result=\"queued\"} %" PRIu64 "\n"
+            "ipup_address_events_total{result=\"deferred\"} %" PRIu64 "\n",
+            metrics_load(&metrics.nl_ignored), metrics_load(&metrics.nl_queued),
+            metrics_load(&metrics.nl_deferred));
+
+    fputs("# TYPE ipup_sync_duration_seconds gauge\n"
+            "# HELP ipup_sync_duration_seconds Time taken by the startup synchronization.\n"
+            "ipup_sync_duration_seconds ", file);
+    write_seconds(file, metrics_load(&metrics.sync_ns) / 1000);
+    fputc('\n', file);
+
+    static const struct {
+        const char *name, *type, *help;
+        size_t offset;
+        bool rcodes, hist;
+    } families[] = {
+        { "ipup_updates_sent", "counter", "UPDATEs sent.",
+            offsetof(struct metrics_serv, sent), false, false },
+        { "ipup_updates_succeeded", "counter", "UPDATEs answered with NOERROR.",
+            offsetof(struct metrics_serv, succeeded), false, false },
+        { "ipup_updates_failed", "counter", "UPDATEs that failed, for any reason.",
+            offsetof(struct metrics_serv, failed), false, false },
+        { "ipup_update_replies", "counter", "Answers to UPDATEs by rcode, none if there was no valid one.",
+            0, true, false },
+        { "ipup_retries", "counter", "Failed changes queued again.",
+            offsetof(struct metrics_serv, retried), false, false },
+        { "ipup_update_rtt_seconds", "histogram", "Time from sending an UPDATE to its answer.",
+            offsetof(struct metrics_serv, rtt), false, true },
+        { "ipup_event_ack_seconds", "histogram",
+            "Time from an address change to the answer to the UPDATE carrying it.",
+            offsetof(struct metrics_serv, ack), false, true }
+    };
+
+    for (size_t i = 0; i < sizeof families / sizeof *families; i++) {
+        fprintf(file, "# TYPE %s %s\n# HELP %s %s\n", families[i].name, families[i].type,
+                families[i].name, families[i].help);
+
+        struct metrics_family family = {
+            .file = file,
+            .name = families[i].name,
+            .offset = families[i].offset,
+            .rcodes = families[i].rcodes,
+            .hist = families[i].hist
+        };
+
+        map_foreach_conf_serv(conf->servers, write_servconf, &family);
+    }
+
+    fputs("# EOF\n", file);
+}
+
+static bool log_servconf(const char *key, conf_serv *servconf, void *arg)
+{
+    (void)arg;
+
+    struct metrics_serv *serv = servconf->metrics;
+
+    if (!serv)
+        return true;
+
+    log(LOG_INFO, "Server %s: %" PRIu64 " UPDATE(s) sent, %" PRIu64 " succeeded, %" PRIu64
+            " failed, %" PRIu64 " retries; RTT p50 %" PRIu64 "us, p99 %" PRIu64 "us; "
+            "event to ack p50 %" PRIu64 "us, p99 %" PRIu64 "us", key,
+            metrics_load(&serv->sent), metrics_load(&serv->succeeded),
+            metrics_load(&serv->failed), metrics_load(&serv->retried),
+            metrics_hist_quantile(&serv->rtt, 0.5), metrics_hist_quantile(&serv->rtt, 0.99),
+            metrics_hist_quantile(&serv->ack, 0.5), metrics_hist_quantile(&serv->ack, 0.99));
+
+    char buf[512];
+    size_t len = 0;
+
+    for (size_t i = 0; i < METRICS_RCODES && len < sizeof buf; i++) {
+        uint64_t count = metrics_load(&serv->rcodes[i]);
+
+        if (count)
+            len += snprintf(buf + len, sizeof buf - len, "%s%s %" PRIu64,
+                    len ? ", " : "", rcode_names[i], count);
+    }
+
+    if (len)
+        log(LOG_INFO, "Server %s replies: %s", key, buf);
+
+    return true;
+}
+
+void metrics_log(struct conf *conf)
+{
+    log(LOG_INFO, "Netlink: %" PRIu64 " message(s), %" PRIu64 " address event(s) ignored, %"
+            PRIu64 " queued, %" PRIu64 " deferred; startup synchronization took %" PRIu64 "ms",
+            metrics_load(&metrics.nl_received), metrics_load(&metrics.nl_ignored),
+            metrics_load(&metrics.nl_queued), metrics_load(&metrics.nl_deferred),
+            metrics_load(&metrics.sync_ns) / 1000000);
+
+    map_foreach_conf_serv(conf->servers, log_servconf, NULL);
+}
+
+static void metrics_conn_close(struct metrics_conn *conn)
+{
+    struct metrics_sock *sock = conn->sock;
+
+    for (struct metrics_conn **link = &sock->conns; *link; link = &(*link)->next) {
+        if (*link == conn) {
+            *link = conn->next;
+            break;
+        }
+    }
+
+    loop_io_stop(sock->loop, &conn->io);
+    close(conn->io.fd);
+
+    // It may have an event pending in the batch being handled, e.g. when
+    // dropped to make room for a new one
+    sock->nconns--;
+    loop_defer_free(sock->loop, conn);
+}
+
+static void metrics_send(int fd, const char *buf, size_t len)
+{
+    // Never waits for a slow client, the whole answer fits in the socket buffer
+    while (len) {
+        ssize_t n = send(fd, buf, len, MSG_DONTWAIT | MSG_NOSIGNAL);
+
+        if (n < 0 && errno == EINTR)
+            continue;
+
+        if (n <= 0)
+            return;
+
+        buf += n;
+        len -= n;
+    }
+}
+
+static void metrics_conn_recv(struct loop_io *io, uint32_t events)
+{
+    (void)events;
+
+    struct metrics_conn *conn = io->arg;
+    char req[512];
+
+    ssize_t n = recv(io->fd, req, sizeof req, MSG_DONTWAIT);
+
+    if (n < 0 && (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK))
+        return;
+
+    char *text = NULL;
+    size_t len = 0;
+    FILE *file = open_memstream(&text, &len);
+
+    if (n >= 0 && file) {
+        metrics_write(file, conn->sock->conf);
+        fclose(file);
+
+        if (n >= 4 && memcmp(req, "GET ", 4) == 0) {
+            char header[256];
+            int hlen = snprintf(header, sizeof header, "HTTP/1.0 200 OK\r\n"
+                    "Content-Type: application/openmetrics-text; version=1.0.0; charset=utf-8\r\n"
+                    "Content-Length: %zu\r\nConnection: close\r\n\r\n", len);
+
+            metrics_send(io->fd, header, hlen);
+        }
+
+        metrics_send(io->fd, text, len);
+    } else if (file) {
+        fclose(file);
+    }
+
+    free(text);
+    metrics_conn_close(conn);
+}
+
+static void metrics_accept(struct loop_io *io, uint32_t events)
+{
+    (void)events;
+
+    struct metrics_sock *sock = io->arg;
+    int fd = accept(io->fd, NULL, NULL);
+
+    if (fd < 0)
+        return;
+
+    // Drop the oldest, which is at the end
+    if (sock->nconns == METRICS_MAX_CONNS) {
+        struct metrics_conn *oldest = sock->conns;
+
+        while (oldest->next)
+            oldest = oldest->next;
+
+        metrics_conn_close(oldest);
+    }
+
+    struct metrics_conn *conn = xcalloc(1, sizeof *conn);
+
+    conn->sock = sock;
+    conn->next = sock->conns;
+    sock->conns = conn;
+    sock->nconns++;
+
+    loop_io_init(&conn->io, fd, metrics_conn_recv, conn);
+    loop_io_start(sock->loop, &conn->io, EPOLLIN);
+}
+
+struct metrics_sock *metrics_sock_new(const char *path, struct conf *conf, struct loop *loop)
+{
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+
+    if (strlen(path) >= sizeof addr.sun_path)
+        die(EX_DATAERR, "Metrics socket path is too long: %s", path);
+
+    strcpy(addr.sun_path, path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+
+    if (fd < 0)
+        die(EX_OSERR, "Failed to create metrics socket: %s", strerror(errno));
+
+    // Left behind by a previous run that did not exit cleanly
+    if (unlink(path) < 0 && errno != ENOENT)
+        log(LOG_WARNING, "Failed to remove %s: %s", path, strerror(errno));
+
+    if (bind(fd, (struct sockaddr *)&addr, sizeof addr) < 0 || listen(fd, METRICS_MAX_CONNS) < 0)
+        die(EX_OSERR, "Failed to listen on metrics socket %s: %s", path, strerror(errno));
+
+    struct metrics_sock *sock = xcalloc(1, sizeof *sock);
+
+    sock->conf = conf;
+    sock->loop = loop;
+    sock->path = strdup(path);
+
+    loop_io_init(&sock->io, fd, metrics_accept, sock);
+    loop_io_start(loop, &sock->io, EPOLLIN);
+
+    return sock;
+}
+
+void metrics_sock_free(struct metrics_sock *sock)
+{
+    if (!sock)
+        return;
+
+    while (sock->conns)
+        metrics_conn_close(sock->conns);
+
+    loop_io_stop(sock->loop, &sock->io);
+    close(sock->io.fd);
+
+    unlink(sock->path);
+
+    free(sock->path);
+    free(sock);
+}
@@ -1,18 +1,54 @@
+#include <errno.h>
 #include <signal.h>
-#include <net/if.h>
 #include <arpa/inet.h>
 
+#include <asm/socket.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+
+#include <netlink/msg.h>
 #include <netlink/cache.h>
 #include <netlink/netlink.h>
 #include <netlink/route/addr.h>
+#include <netlink/route/link.h>
 
 #include "log.h"
 #include "dns.h"
 #include "map.h"
+#include "hash.h"
+#include "chan.h"
 #include "conf.h"
-
+#include "loop.h"
+#include "util.h"
+#include "snap.h"
+#include "batch.h"
+#include "retry.h"
+#include "trace.h"
+#include "filter.h"
+#include "shadow.h"
+#include "verify.h"
+#include "worker.h"
+#include "addrset.h"
+#include "metrics.h"
+#include "nscache.h"
+
+map_decl(conf_serv, uint64_t, const char *, conf_serv *);
 map_decl(conf_if, uint64_t, const char *, conf_if *);
-map_decl(serv_rr, uintptr_t, conf_if *, ldns_rr_list *);
+
+struct sync_rec;
+map_decl(sync_rec, uint64_t, conf_if *, struct sync_rec *);
+
+struct sync_zone;
+map_decl(sync_zone, uint64_t, conf_if *, struct sync_zone *);
+
+#ifndef SOL_NETLINK
+#define SOL_NETLINK 270
+#endif
+
+// Makes the kernel honor the interface index in dump requests (Linux 4.20+)
+#ifndef NETLINK_GET_STRICT_CHK
+#define NETLINK_GET_STRICT_CHK 12
+#endif
 
 struct rtnl_addr_prop {
     struct nl_addr *nladdr;
@@ -34,105 +70,334 @@ static void rtnl_addr_get_prop(struct nl_object *obj, struct rtnl_addr_prop *pro
     prop->validlft = rtnl_addr_get_valid_lifetime(rtaddr);
 }
 
-static void nl_dns_do_update(struct rtnl_addr_prop *prop, struct conf *conf, bool delete)
+static struct nl_state {
+    struct loop_io io;
+    struct conf *conf;
+    struct nl_cache_mngr *mngr;
+
+    // Event socket used by the cache manager, and a socket for dumps
+    struct nl_sock *sock;
+    struct nl_sock *dumpsock;
+
+    // Monitored interfaces by index, kept up to date from link messages
+    // so that address messages never need a name lookup
+    struct nl_cache *linkcache;
+    conf_if **iftable;
+    size_t iftablesize;
+
+    // Interfaces let through by the socket filter, sorted
+    int *ifidx;
+    size_t nifidx;
+
+    // Address changes seen so far, numbered for tracing
+    uint64_t events;
+
+    // Interfaces with changes that did not fit in their worker's ring, by
+    // index. They are resynchronized once the worker had time to catch up.
+    struct loop *loop;
+    struct loop_timer resync;
+    int *dirty;
+    size_t ndirty, dirtysize;
+
+    // Set on SIGHUP, the configuration is read again between two iterations
+    bool reload;
+} state;
+
+static conf_if *iftable_get(int ifidx)
 {
-    // Get the interface name to index the config map
-    char ifbuf[IF_NAMESIZE] = {0};
-    if_indextoname(prop->ifidx, ifbuf);
+    if (ifidx <= 0 || (size_t)ifidx >= state.iftablesize)
+        return NULL;
 
-    conf_if *ifconf;
+    return state.iftable[ifidx];
+}
+
+// Point the index at the interface configured under the given name, or at
+// nothing if there is none. Returns true if the table changed.
+static bool iftable_set(int ifidx, const char *name)
+{
+    conf_if *ifconf = NULL;
+
+    if (ifidx <= 0)
+        return false;
+
+    if (name)
+        map_get_conf_if(state.conf->ifaces, name, &ifconf);
+
+    conf_if *old = iftable_get(ifidx);
+
+    if (old == ifconf)
+        return false;
+
+    // Renamed or deleted
+    if (old) {
+        state.iftable[ifidx] = NULL;
+        old->ifidx = 0;
+    }
+
+    if (!ifconf)
+        return true;
+
+    // Re-created under a new index
+    if (ifconf->ifidx)
+        state.iftable[ifconf->ifidx] = NULL;
+
+    if ((size_t)ifidx >= state.iftablesize) {
+        size_t size = state.iftablesize ? state.iftablesize : 16;
+
+        while (size <= (size_t)ifidx)
+            size *= 2;
+
+        state.iftable = xreallocarray(state.iftable, size, sizeof *state.iftable);
+        memset(state.iftable + state.iftablesize, 0,
+                (size - state.iftablesize) * sizeof *state.iftable);
+
+        state.iftablesize = size;
+    }
+
+    state.iftable[ifidx] = ifconf;
+    ifconf->ifidx = ifidx;
+
+    return true;
+}
+
+static void iftable_add_link(struct nl_object *obj, void *arg)
+{
+    (void)arg;
+
+    struct rtnl_link *link = (struct rtnl_link *)obj;
+    iftable_set(rtnl_link_get_ifindex(link), rtnl_link_get_name(link));
+}
+
+// Point the table at the interfaces of a new configuration
+static void iftable_rebuild(void)
+{
+    if (state.iftable)
+        memset(state.iftable, 0, state.iftablesize * sizeof *state.iftable);
+
+    nl_cache_foreach(state.linkcache, iftable_add_link, NULL);
+}
+
+// Delay before resynchronizing an interface whose changes were dropped, in milliseconds
+#define NL_RESYNC_DELAY 100
+
+enum nl_update {
+    // The address belongs to an interface that isn't monitored
+    NL_UPDATE_IGNORED,
+    NL_UPDATE_QUEUED,
+    // The worker's ring was full, the interface will be resynchronized
+    NL_UPDATE_DEFERRED
+};
+
+static void resync_later(int ifidx)
+{
+    for (size_t i = 0; i < state.ndirty; i++)
+        if (state.dirty[i] == ifidx)
+            return;
+
+    if (state.ndirty == state.dirtysize) {
+        state.dirtysize = state.dirtysize ? state.dirtysize * 2 : 4;
+        state.dirty = xreallocarray(state.dirty, state.dirtysize, sizeof *state.dirty);
+    }
+
+    state.dirty[state.ndirty++] = ifidx;
+
+    if (!loop_timer_armed(&state.resync))
+        loop_timer_arm(state.loop, &state.resync, clock_ms() + NL_RESYNC_DELAY);
+}
+
+static enum nl_update nl_dns_do_update(struct rtnl_addr_prop *prop, bool delete, uint64_t event)
+{
+    conf_if *ifconf = iftable_get(prop->ifidx);
 
     // Interface not listed
-    if (!map_get_conf_if(conf->ifaces, ifbuf, &ifconf))
-        return;
+    if (!ifconf)
+        return NL_UPDATE_IGNORED;
 
-    const conf_serv *servconf = ifconf->server;
-    struct sockaddr *addr = (struct sockaddr *)&prop->addr;
+    struct sockaddr_in6 *addr = (struct sockaddr_in6 *)&prop->addr;
 
     uint32_t ttl = ifconf->opts & CONF_OPT_IFACE_RESPECT_TTL
             ? prop->validlft : ifconf->ttl;
 
-    char addrbuf[INET6_ADDRSTRLEN] = {0};
-    nl_addr2str(prop->nladdr, addrbuf, sizeof addrbuf);
+    if (log_enabled(LOG_INFO)) {
+        char addrbuf[INET6_ADDRSTRLEN] = {0};
+        nl_addr2str(prop->nladdr, addrbuf, sizeof addrbuf);
+
+        log(LOG_INFO, "%s address %s from %s", delete ? "Deleting" : "Updating", addrbuf, ifconf->name);
+    }
+
+    TRACE(nl_queued, event, prop->ifidx, delete, ttl);
+
+    if (!ifconf->server->worker) {
+        batch_add_at(ifconf, addr, delete, ttl, clock_ns(), event);
+        return NL_UPDATE_QUEUED;
+    }
+
+    if (worker_push(ifconf, addr, delete, ttl, event))
+        return NL_UPDATE_QUEUED;
 
-    log(LOG_INFO, "%s address %s from %s", delete ? "Deleting" : "Updating", addrbuf, ifbuf);
+    resync_later(prop->ifidx);
 
-    dns_do_update(servconf->resolv, ifconf->zone, ifconf->record, addr, delete, ttl);
+    return NL_UPDATE_DEFERRED;
 }
 
 static void cache_change_cb(struct nl_cache *cache,
         struct nl_object *obj, int action, void *arg)
 {
+    uint64_t event = ++state.events;
+
+    TRACE(nl_change, event, action, rtnl_addr_get_ifindex((struct rtnl_addr *)obj));
+
     // Duplicate address, ignore
-    if (action == NL_ACT_CHANGE)
+    if (action == NL_ACT_CHANGE) {
+        metrics_inc(&metrics.nl_ignored);
+        TRACE(nl_ignored, event);
         return;
+    }
 
     struct rtnl_addr_prop prop;
     rtnl_addr_get_prop(obj, &prop);
 
-    struct conf *conf = arg;
     struct sockaddr *addr = (struct sockaddr *)&prop.addr;
 
     // We are only interested in global scope
     // addresses and we do not support IPv4
-    if (prop.scope != 0 || addr->sa_family == AF_INET)
+    if (prop.scope != 0 || addr->sa_family == AF_INET) {
+        metrics_inc(&metrics.nl_ignored);
+        TRACE(nl_ignored, event);
         return;
+    }
 
-    nl_dns_do_update(&prop, conf, action == NL_ACT_DEL);
+    switch (nl_dns_do_update(&prop, action == NL_ACT_DEL, event)) {
+    case NL_UPDATE_QUEUED:
+        metrics_inc(&metrics.nl_queued);
+        break;
+    case NL_UPDATE_IGNORED:
+        metrics_inc(&metrics.nl_ignored);
+        TRACE(nl_ignored, event);
+        break;
+    case NL_UPDATE_DEFERRED:
+        // Undone in the cache, so that resynchronizing finds it again
+        if (action == NL_ACT_DEL)
+            nl_cache_add(cache, obj);
+        else
+            nl_cache_remove(obj);
+
+        metrics_inc(&metrics.nl_deferred);
+        break;
+    }
 }
 
-static ldns_rr_list *diff_addr_get_rr_list(map(serv_rr) *servrrlist, conf_if *ifconf)
+struct sync;
+
+// Startup state of a DNS record, shared by all interfaces pointing to it
+struct sync_rec {
+    struct sync *sync;
+    conf_if *ifconf;
+
+    // Global host addresses of those interfaces
+    struct nl_object **hosts;
+    size_t nhosts, hostsize;
+
+    // Saved by a previous run, and the zone serial when it was queried
+    const struct snap_rec *snap;
+    int64_t serial;
+
+    bool delete;
+};
+
+// Records sharing a zone, checked against the snapshot with a single SOA
+// query, and a single UPDATE with only prerequisites if the serial moved
+struct sync_zone {
+    struct sync *sync;
+    conf_if *ifconf;
+
+    struct sync_rec **recs;
+    size_t nrecs, size;
+
+    int64_t serial;
+};
+
+struct sync {
+    map(sync_rec) *recs;
+    map(sync_zone) *zones;
+
+    struct loop *loop;
+    struct loop_timer deadline;
+    size_t pending;
+
+    bool snapshot, trust, expired;
+};
+
+static uint64_t sync_rec_hash(conf_if *ifconf)
 {
-    ldns_rr_list *ansrrlist = NULL;
+    return ifconf->rechash ^ hash_int((uintptr_t)ifconf->server);
+}
 
-    if (!map_get_serv_rr(servrrlist, ifconf, &ansrrlist)) {
-        ldns_pkt *anspkt;
-        ldns_status ret = ldns_resolver_query_status(&anspkt, ifconf->server->resolv,
-                ifconf->record, LDNS_RR_TYPE_AAAA, LDNS_RR_CLASS_IN, 0);
+static int sync_rec_compare(conf_if *a, conf_if *b)
+{
+    if (a->server != b->server)
+        return 1;
 
-        if (ret != LDNS_STATUS_OK) {
-            log(LOG_WARNING, "Failed to query DNS server: %s", ldns_get_errorstr_by_id(ret));
-            goto fail;
-        }
+    return ldns_dname_compare(a->record, b->record);
+}
 
-        ldns_pkt_rcode rcode = ldns_pkt_get_rcode(anspkt);
+static void sync_rec_free(struct sync_rec *rec)
+{
+    for (size_t i = 0; i < rec->nhosts; i++)
+        nl_object_put(rec->hosts[i]);
 
-        if (rcode != LDNS_RCODE_NOERROR) {
-            log(LOG_WARNING, "Failed to query DNS server: %s", dns_get_errorstr_by_rcode(rcode));
-            goto fail;
-        }
+    free(rec->hosts);
+    free(rec);
+}
 
-        if (ldns_pkt_ancount(anspkt) == 0)
-            goto fail;
+static uint64_t sync_zone_hash(conf_if *ifconf)
+{
+    return ifconf->zonehash ^ hash_int((uintptr_t)ifconf->server);
+}
 
-        ansrrlist = ldns_rr_list_clone(ldns_pkt_answer(anspkt));
-        map_set_serv_rr(servrrlist, ifconf, ansrrlist);
+static int sync_zone_compare(conf_if *a, conf_if *b)
+{
+    if (a->server != b->server)
+        return 1;
 
-fail:
-        ldns_pkt_free(anspkt);
-    }
+    return ldns_dname_compare(a->zone, b->zone);
+}
 
-    return ansrrlist;
+static void sync_zone_free(struct sync_zone *zone)
+{
+    free(zone->recs);
+    free(zone);
 }
 
-// Diff the host address table against the DNS records,
-// mark the host addreses that are present in a DNS record
-static bool diff_addr_ifconf(const char *key, conf_if *ifconf, void *arg)
+static bool sync_collect_ifconf(const char *key, conf_if *ifconf, void *arg)
 {
-    struct nl_cache *addrcache = nl_cache_mngt_require("route/addr");
+    (void)key;
 
-    map(serv_rr) *servrrlist = arg;
+    struct sync *sync = arg;
+    struct sync_rec *rec;
 
-    struct nl_object *obj = nl_cache_get_first(addrcache);
-    struct nl_object *next;
+    if (!map_get_sync_rec(sync->recs, ifconf, &rec)) {
+        rec = xcalloc(1, sizeof *rec);
+        rec->sync = sync;
+        rec->ifconf = ifconf;
 
-    if (!obj)
-        return false;
+        map_set_sync_rec(sync->recs, ifconf, rec);
+    }
+
+    if (ifconf->opts & CONF_OPT_IFACE_DELETE_EXISTING)
+        rec->delete = true;
 
-    int ifidx = if_nametoindex(key);
+    return true;
+}
+
+// Single pass over the host address table: bucket the addresses by the
+// record of their interface, and drop the ones we are not interested in
+static void sync_bucket(struct sync *sync)
+{
+    struct nl_cache *addrcache = nl_cache_mngt_require("route/addr");
+    struct nl_object *obj, *next;
 
-    // XXX: Inefficient?
-    do {
+    for (obj = nl_cache_get_first(addrcache); obj; obj = next) {
         next = nl_cache_get_next(obj);
 
         struct rtnl_addr_prop prop;
@@ -140,165 +405,1110 @@ static bool diff_addr_ifconf(const char *key, conf_if *ifconf, void *arg)
 
         struct sockaddr *addr = (struct sockaddr *)&prop.addr;
 
-        // Remove useless entries
         if (prop.scope != 0 || addr->sa_family == AF_INET) {
             nl_cache_remove(obj);
             continue;
         }
 
-        if (ifidx != prop.ifidx)
+        conf_if *ifconf = iftable_get(prop.ifidx);
+        struct sync_rec *rec;
+
+        if (!ifconf || !map_get_sync_rec(sync->recs, ifconf, &rec))
             continue;
 
-        // Memoize DNS query result in hashmap
-        ldns_rr_list *ansrrlist = diff_addr_get_rr_list(servrrlist, ifconf);
-        ldns_rdf *hostrdf = ldns_sockaddr_storage2rdf((struct sockaddr_storage *)addr, NULL);
-        size_t ansrrcount = ldns_rr_list_rr_count(ansrrlist);
+        if (rec->nhosts == rec->hostsize) {
+            rec->hostsize = rec->hostsize ? rec->hostsize * 2 : 4;
+            rec->hosts = xreallocarray(rec->hosts, rec->hostsize, sizeof *rec->hosts);
+        }
+
+        // Left over from an earlier synchronization
+        nl_object_unmark(obj);
 
-        // Remove from list if address is present in the host address table, and
-        // mark it in the host address table
-        for (size_t i = 0; i < ansrrcount; i++) {
-            ldns_rr *rr = ldns_rr_list_rr(ansrrlist, i);
-            ldns_rdf *tmp = ldns_rr_a_address(rr);
+        nl_object_get(obj);
+        rec->hosts[rec->nhosts++] = obj;
+    }
+}
 
-            if (ldns_rdf_compare(hostrdf, tmp) == 0) {
-                ldns_rr_free(rr);
+// Mark the host addresses that are present in the record, and delete
+// the addresses in the record that no interface has
+static void sync_diff_rec(struct sync_rec *rec)
+{
+    struct shadow_rrset *rrset = shadow_get(rec->ifconf->server->shadow, rec->ifconf->record);
+    struct addrset *addrs = addrset_new(rrset->used);
 
-                nl_object_mark(obj);
+    for (size_t i = 0; i < rrset->used; i++)
+        if (rrset->addrs[i].present)
+            addrset_add(addrs, &rrset->addrs[i].addr);
 
-                for (size_t j = i; j < ansrrcount - 1; j++) {
-                    ldns_rr *tmprr = ldns_rr_list_rr(ansrrlist, j + 1);
-                    ldns_rr_list_set_rr(ansrrlist, tmprr, j);
-                }
+    for (size_t i = 0; i < rec->nhosts; i++) {
+        struct rtnl_addr_prop prop;
+        rtnl_addr_get_prop(rec->hosts[i], &prop);
 
-                ansrrcount--;
-                ldns_rr_list_set_rr_count(ansrrlist, ansrrcount);
+        struct sockaddr_in6 *addr = (struct sockaddr_in6 *)&prop.addr;
 
-                break;
-            }
-        }
+        if (addrset_mark(addrs, &addr->sin6_addr))
+            nl_object_mark(rec->hosts[i]);
+    }
 
-        ldns_rdf_deep_free(hostrdf);
-    } while ((obj = next));
+    for (size_t i = 0; rec->delete && i < rrset->used; i++) {
+        struct sockaddr_in6 addr = {
+            .sin6_family = AF_INET6,
+            .sin6_addr = rrset->addrs[i].addr
+        };
 
-    return true;
+        if (rrset->addrs[i].present && !addrset_marked(addrs, &addr.sin6_addr))
+            batch_add(rec->ifconf, &addr, true, 0);
+    }
+
+    addrset_free(addrs);
 }
 
-static bool sync_addr_del(conf_if *key, ldns_rr_list *delrrs, void *arg)
+static int64_t sync_snap_serial(const struct snap_rec *snaprec)
 {
-    if (!(key->opts & CONF_OPT_IFACE_DELETE_EXISTING))
-        return true;
+    return snaprec->flags & SNAP_HAS_SERIAL ? (int64_t)snaprec->serial : SHADOW_NO_SERIAL;
+}
 
-    size_t delrrcount = ldns_rr_list_rr_count(delrrs);
+// Take the record from the snapshot instead of querying it, `serial`
+// being the one of the zone when the snapshot was last found current
+static void sync_restore_rec(struct sync_rec *rec, int64_t serial)
+{
+    const struct snap_rec *snaprec = rec->snap;
+    const struct snap_addr *addrs = snap_rec_addrs(snaprec);
 
-    if (delrrcount == 0)
-        return true;
+    struct shadow_rrset *rrset = shadow_reset(rec->ifconf->server->shadow, rec->ifconf->record, serial);
 
-    for (size_t i = 0; i < delrrcount; i++) {
-        ldns_rr *rr = ldns_rr_list_rr(delrrs, i);
+    for (size_t i = 0; i < snaprec->naddrs; i++) {
+        struct in6_addr addr;
+        memcpy(&addr, addrs[i].addr, sizeof addr);
 
-        ldns_rr_set_class(rr, LDNS_RR_CLASS_NONE);
-        ldns_rr_set_ttl(rr, 0);
+        shadow_rrset_set(rrset, &addr, true, addrs[i].ttl);
     }
 
-    dns_send_update(key->zone, delrrs, key->server->resolv);
+    sync_diff_rec(rec);
+}
 
-    return true;
+static void sync_query_done(struct sync *sync)
+{
+    sync->pending--;
+
+    TRACE(sync_answered, sync->pending);
+
+    if (sync->pending == 0 && loop_timer_armed(&sync->deadline)) {
+        loop_timer_disarm(sync->loop, &sync->deadline);
+        loop_unref(sync->loop);
+    }
 }
 
-static void sync_addr_upd(struct nl_object *obj, void *arg)
+static void sync_query_cb(ldns_pkt *reply, ldns_status status, void *arg)
 {
-    if (nl_object_is_marked(obj))
-        return;
+    struct sync_rec *rec = arg;
 
-    struct rtnl_addr_prop prop;
-    rtnl_addr_get_prop(obj, &prop);
+    if (dns_reply_ok(reply, status)) {
+        shadow_learn(rec->ifconf->server->shadow, rec->ifconf->record,
+                ldns_pkt_answer(reply), rec->serial);
+        sync_diff_rec(rec);
+    }
+
+    sync_query_done(rec->sync);
+}
+
+static void sync_query(struct sync *sync, conf_if *ifconf, ldns_rdf *name,
+        ldns_rr_type type, chan_cb cb, void *arg)
+{
+    ldns_pkt *querypkt = ldns_pkt_query_new(ldns_rdf_clone(name), type, LDNS_RR_CLASS_IN, LDNS_RD);
+
+    if (!querypkt)
+        die(EX_SOFTWARE, "Failed to allocate memory");
 
-    struct conf *conf = arg;
+    ldns_status ret = chan_send(ifconf->server->chan, querypkt, cb, arg);
 
-    nl_dns_do_update(&prop, conf, false);
+    if (ret == LDNS_STATUS_OK)
+        sync->pending++;
+    else
+        log(LOG_WARNING, "Failed to query DNS server: %s", ldns_get_errorstr_by_id(ret));
+
+    ldns_pkt_free(querypkt);
 }
 
-static volatile bool signaled = false;
+static void sync_query_rec(struct sync_rec *rec, int64_t serial)
+{
+    rec->serial = serial;
+    sync_query(rec->sync, rec->ifconf, rec->ifconf->record, LDNS_RR_TYPE_AAAA, sync_query_cb, rec);
+}
 
-static void sig_handle(int signo)
+static int64_t sync_soa_serial(ldns_pkt *reply)
 {
-    (void)signo;
-    signaled = true;
+    ldns_rr_list *answer = ldns_pkt_answer(reply);
+
+    for (size_t i = 0; i < ldns_rr_list_rr_count(answer); i++) {
+        ldns_rr *rr = ldns_rr_list_rr(answer, i);
+
+        if (ldns_rr_get_type(rr) == LDNS_RR_TYPE_SOA && ldns_rr_rd_count(rr) >= 3)
+            return ldns_rdf2native_int32(ldns_rr_rdf(rr, 2));
+    }
+
+    return SHADOW_NO_SERIAL;
 }
 
-static struct nl_cache_mngr *nl_setup(struct conf *conf)
+static bool sync_snap_current(const struct sync_rec *rec, int64_t serial)
 {
-    struct sigaction sa = {
-        .sa_handler = sig_handle,
-        .sa_flags = SA_RESETHAND
-    };
+    return serial != SHADOW_NO_SERIAL && sync_snap_serial(rec->snap) == serial;
+}
 
-    sigaction(SIGINT, &sa, NULL);
-    sigaction(SIGTERM, &sa, NULL);
+// Snapshot records checked by the prerequisites
+static bool sync_snap_stale(const struct sync_rec *rec, int64_t serial)
+{
+    return rec->snap && !sync_snap_current(rec, serial);
+}
 
-    int ret;
+// `addr` NULL requires the RRset not to exist
+static void sync_push_prereq(ldns_rr_list *prereqs, ldns_rdf *record, const struct snap_addr *addr)
+{
+    ldns_rr *rr = ldns_rr_new();
 
-    struct nl_cache_mngr *nlmngr;
-    ret = nl_cache_mngr_alloc(NULL, NETLINK_ROUTE, NL_AUTO_PROVIDE, &nlmngr);
+    if (!rr)
+        die(EX_SOFTWARE, "Failed to allocate memory");
 
-    if (ret < 0)
-        die(EX_SOFTWARE, "Failed to set up Netlink cache manager: %s", nl_geterror(ret));
+    ldns_rr_set_owner(rr, ldns_rdf_clone(record));
+    ldns_rr_set_type(rr, LDNS_RR_TYPE_AAAA);
+    ldns_rr_set_class(rr, addr ? LDNS_RR_CLASS_IN : LDNS_RR_CLASS_NONE);
+    ldns_rr_set_ttl(rr, 0);
 
-    struct nl_cache *cache;
-    ret = rtnl_addr_alloc_cache(NULL, &cache);
+    if (addr && !ldns_rr_push_rdf(rr, ldns_rdf_new_frm_data(LDNS_RDF_TYPE_AAAA, sizeof addr->addr, addr->addr)))
+        die(EX_SOFTWARE, "Failed to allocate memory");
 
-    if (ret < 0)
-        die(EX_SOFTWARE, "Failed to allocate Netlink address cache: %s", nl_geterror(ret));
+    if (!ldns_rr_list_push_rr(prereqs, rr))
+        die(EX_SOFTWARE, "Failed to allocate memory");
+}
 
-    ret = nl_cache_mngr_add_cache(nlmngr, cache, cache_change_cb, conf);
+// A failed prerequisite only means some record changed since the snapshot
+static bool sync_check_ok(const ldns_pkt *reply, ldns_status status)
+{
+    if (status == LDNS_STATUS_OK) {
+        ldns_pkt_rcode rcode = ldns_pkt_get_rcode(reply);
 
-    if (ret < 0)
-        die(EX_SOFTWARE, "Failed to add cache to Netlink cache manager: %s", nl_geterror(ret));
+        if (rcode == LDNS_RCODE_NXRRSET || rcode == LDNS_RCODE_YXRRSET)
+            return false;
+    }
 
-    return nlmngr;
+    return dns_reply_ok(reply, status);
 }
 
-struct nl_cache_mngr *nl_sync(struct conf *conf)
+// The stale records are all restored if the zone still holds exactly the
+// saved addresses for each of them, otherwise they are all queried
+static void sync_check_cb(ldns_pkt *reply, ldns_status status, void *arg)
 {
-    struct nl_cache_mngr *nlmngr = nl_setup(conf);
+    struct sync_zone *zone = arg;
+    bool ok = sync_check_ok(reply, status);
 
-    map_ops(serv_rr) ops = {
-        .val_free = ldns_rr_list_deep_free
-    };
+    for (size_t i = 0; !zone->sync->expired && i < zone->nrecs; i++) {
+        struct sync_rec *rec = zone->recs[i];
 
-    map(serv_rr) *servrrlist = map_new_serv_rr(4, ops);
+        if (!sync_snap_stale(rec, zone->serial))
+            continue;
+
+        if (ok)
+            sync_restore_rec(rec, zone->serial);
+        else
+            sync_query_rec(rec, zone->serial);
+    }
+
+    sync_query_done(zone->sync);
+}
 
-    // Store the addresses returned for each DNS record, then remove each record that is
-    // present on the host address table from the list, for each interface. Additionally, mark
-    // the host addresses that have corresponding DNS records. At the end, issue UPDATE queries to
-    // delete all addresses that are still in the list (that is, that do not match any interfaces),
-    // but only if the user has enabled `delete-existing`.
-    map_foreach_conf_if(conf->ifaces, diff_addr_ifconf, servrrlist);
-    map_foreach_serv_rr(servrrlist, sync_addr_del, NULL);
+// Nothing is updated, the prerequisites are all there is to the UPDATE
+static void sync_check_zone(struct sync_zone *zone)
+{
+    ldns_rr_list *prereqs = ldns_rr_list_new();
 
-    // Send UPDATE queries for all entries in the address table that haven't been marked
-    nl_cache_foreach(nl_cache_mngt_require("route/addr"), sync_addr_upd, conf);
+    if (!prereqs)
+        die(EX_SOFTWARE, "Failed to allocate memory");
 
-    map_free_serv_rr(servrrlist);
+    for (size_t i = 0; i < zone->nrecs; i++) {
+        struct sync_rec *rec = zone->recs[i];
 
-    return nlmngr;
+        if (!sync_snap_stale(rec, zone->serial))
+            continue;
+
+        const struct snap_addr *addrs = snap_rec_addrs(rec->snap);
+
+        if (rec->snap->naddrs == 0)
+            sync_push_prereq(prereqs, rec->ifconf->record, NULL);
+
+        for (size_t j = 0; j < rec->snap->naddrs; j++)
+            sync_push_prereq(prereqs, rec->ifconf->record, &addrs[j]);
+    }
+
+    ldns_pkt *updpkt = ldns_update_pkt_new(ldns_rdf_clone(zone->ifconf->zone), LDNS_RR_CLASS_IN,
+            prereqs, NULL, NULL);
+
+    if (!updpkt)
+        die(EX_SOFTWARE, "Failed to allocate memory");
+
+    ldns_status ret = chan_send(zone->ifconf->server->chan, updpkt, sync_check_cb, zone);
+
+    ldns_pkt_free(updpkt);
+    ldns_rr_list_deep_free(prereqs);
+
+    if (ret == LDNS_STATUS_OK) {
+        zone->sync->pending++;
+        return;
+    }
+
+    log(LOG_WARNING, "Failed to send UPDATE: %s", ldns_get_errorstr_by_id(ret));
+
+    for (size_t i = 0; i < zone->nrecs; i++)
+        if (sync_snap_stale(zone->recs[i], zone->serial))
+            sync_query_rec(zone->recs[i], zone->serial);
+}
+
+// Records whose zone has not changed since the snapshot was taken are
+// restored from it. The others in the snapshot are checked against the
+// zone with prerequisites, and the rest are queried.
+static void sync_soa_cb(ldns_pkt *reply, ldns_status status, void *arg)
+{
+    struct sync_zone *zone = arg;
+    bool stale = false;
+
+    zone->serial = SHADOW_NO_SERIAL;
+
+    if (dns_reply_ok(reply, status))
+        zone->serial = sync_soa_serial(reply);
+
+    for (size_t i = 0; !zone->sync->expired && i < zone->nrecs; i++) {
+        struct sync_rec *rec = zone->recs[i];
+
+        if (!rec->snap)
+            sync_query_rec(rec, zone->serial);
+        else if (sync_snap_current(rec, zone->serial))
+            sync_restore_rec(rec, zone->serial);
+        else
+            stale = true;
+    }
+
+    if (stale && !zone->sync->expired)
+        sync_check_zone(zone);
+
+    sync_query_done(zone->sync);
 }
 
-void nl_run(struct nl_cache_mngr *nlmngr)
+static bool sync_start_rec(conf_if *key, struct sync_rec *rec, void *arg)
 {
-    // Runs until an error occurs or the user requests termination
-    while (1) {
-        int ret = nl_cache_mngr_poll(nlmngr, -1);
+    struct sync *sync = arg;
+
+    if (sync->snapshot)
+        rec->snap = snap_lookup(key->server->name, key->record);
+
+    if (rec->snap && sync->trust) {
+        sync_restore_rec(rec, sync_snap_serial(rec->snap));
+        return true;
+    }
+
+    if (!sync->snapshot || sync->trust) {
+        sync_query_rec(rec, SHADOW_NO_SERIAL);
+        return true;
+    }
+
+    struct sync_zone *zone;
+
+    if (!map_get_sync_zone(sync->zones, key, &zone)) {
+        zone = xcalloc(1, sizeof *zone);
+        zone->sync = sync;
+        zone->ifconf = key;
 
-        if (signaled)
-            break;
+        map_set_sync_zone(sync->zones, key, zone);
+    }
 
-        if (ret < 0)
-            die(EX_OSERR, "Failed to poll on Netlink channel: %s", nl_geterror(ret));
+    if (zone->nrecs == zone->size) {
+        zone->size = zone->size ? zone->size * 2 : 4;
+        zone->recs = xreallocarray(zone->recs, zone->size, sizeof *zone->recs);
     }
+
+    zone->recs[zone->nrecs++] = rec;
+
+    return true;
 }
 
-void nl_free(struct nl_cache_mngr *nlmngr)
+static bool sync_start_zone(conf_if *key, struct sync_zone *zone, void *arg)
 {
-    nl_cache_mngr_free(nlmngr);
+    (void)arg;
+
+    sync_query(zone->sync, key, key->zone, LDNS_RR_TYPE_SOA, sync_soa_cb, zone);
+
+    return true;
+}
+
+static bool sync_cancel_servconf(const char *key, conf_serv *servconf, void *arg)
+{
+    (void)key;
+    (void)arg;
+
+    chan_cancel(servconf->chan, sync_soa_cb);
+    chan_cancel(servconf->chan, sync_query_cb);
+    chan_cancel(servconf->chan, sync_check_cb);
+
+    return true;
+}
+
+static void sync_deadline_cb(struct loop_timer *timer)
+{
+    struct sync *sync = timer->arg;
+
+    log(LOG_WARNING, "Timed out waiting for %zu DNS quer%s", sync->pending,
+            sync->pending == 1 ? "y" : "ies");
+
+    sync->expired = true;
+
+    loop_unref(sync->loop);
+    map_foreach_conf_serv(state.conf->servers, sync_cancel_servconf, NULL);
+}
+
+// Send the host addresses that were not found in the record
+static bool sync_upd_rec(conf_if *key, struct sync_rec *rec, void *arg)
+{
+    (void)key;
+    (void)arg;
+
+    for (size_t i = 0; i < rec->nhosts; i++) {
+        if (nl_object_is_marked(rec->hosts[i]))
+            continue;
+
+        struct rtnl_addr_prop prop;
+        rtnl_addr_get_prop(rec->hosts[i], &prop);
+
+        nl_dns_do_update(&prop, false, ++state.events);
+    }
+
+    return true;
+}
+
+struct resync_arg {
+    struct nl_cache *cache;
+    int ifidx;
+};
+
+static void resync_parse_obj(struct nl_object *obj, void *arg)
+{
+    struct resync_arg *rarg = arg;
+
+    struct rtnl_addr_prop prop;
+    rtnl_addr_get_prop(obj, &prop);
+
+    // Older kernels ignore the interface index in the request
+    if (prop.ifidx != rarg->ifidx || prop.scope != 0 || prop.addr.ss_family != AF_INET6)
+        return;
+
+    nl_cache_add(rarg->cache, obj);
+}
+
+static int resync_parse_msg(struct nl_msg *msg, void *arg)
+{
+    nl_msg_parse(msg, resync_parse_obj, arg);
+
+    return NL_OK;
+}
+
+static struct nl_sock *resync_sock(void)
+{
+    if (state.dumpsock)
+        return state.dumpsock;
+
+    struct nl_sock *sk = nl_socket_alloc();
+
+    if (!sk)
+        die(EX_SOFTWARE, "Failed to allocate memory");
+
+    int ret = nl_connect(sk, NETLINK_ROUTE);
+
+    if (ret < 0)
+        die(EX_OSERR, "Failed to connect Netlink socket: %s", nl_geterror(ret));
+
+    int one = 1;
+    setsockopt(nl_socket_get_fd(sk), SOL_NETLINK, NETLINK_GET_STRICT_CHK, &one, sizeof one);
+
+    return state.dumpsock = sk;
+}
+
+// Dump the addresses of a single interface and diff them against the
+// cache, which holds the last state known to ipup. Only the differences
+// are turned into updates, and the cache is brought back in sync.
+static bool resync_ifconf(const char *key, conf_if *ifconf, void *arg)
+{
+    (void)arg;
+
+    int ifidx = ifconf->ifidx;
+
+    if (ifidx == 0)
+        return true;
+
+    struct nl_sock *sk = resync_sock();
+    struct nl_cache *fresh;
+
+    int ret = nl_cache_alloc_name("route/addr", &fresh);
+
+    if (ret < 0)
+        die(EX_SOFTWARE, "Failed to allocate Netlink address cache: %s", nl_geterror(ret));
+
+    struct resync_arg rarg = {
+        .cache = fresh,
+        .ifidx = ifidx
+    };
+
+    struct ifaddrmsg ifa = {
+        .ifa_family = AF_INET6,
+        .ifa_index = ifidx
+    };
+
+    nl_socket_modify_cb(sk, NL_CB_VALID, NL_CB_CUSTOM, resync_parse_msg, &rarg);
+
+    ret = nl_send_simple(sk, RTM_GETADDR, NLM_F_DUMP, &ifa, sizeof ifa);
+
+    if (ret >= 0)
+        ret = nl_recvmsgs_default(sk);
+
+    if (ret < 0) {
+        log(LOG_WARNING, "Failed to dump addresses of %s: %s", key, nl_geterror(ret));
+        nl_cache_free(fresh);
+        return true;
+    }
+
+    struct nl_cache *cache = nl_cache_mngt_require("route/addr");
+    struct nl_object *obj, *next;
+
+    for (obj = nl_cache_get_first(cache); obj; obj = next) {
+        next = nl_cache_get_next(obj);
+
+        struct rtnl_addr_prop prop;
+        rtnl_addr_get_prop(obj, &prop);
+
+        if (prop.ifidx != ifidx || prop.scope != 0 || prop.addr.ss_family != AF_INET6)
+            continue;
+
+        struct nl_object *match = nl_cache_search(fresh, obj);
+
+        if (match) {
+            nl_object_put(match);
+            continue;
+        }
+
+        // The deletion got lost
+        if (nl_dns_do_update(&prop, true, ++state.events) != NL_UPDATE_DEFERRED)
+            nl_cache_remove(obj);
+    }
+
+    for (obj = nl_cache_get_first(fresh); obj; obj = nl_cache_get_next(obj)) {
+        struct nl_object *match = nl_cache_search(cache, obj);
+
+        if (match) {
+            nl_object_put(match);
+            continue;
+        }
+
+        struct rtnl_addr_prop prop;
+        rtnl_addr_get_prop(obj, &prop);
+
+        // The addition got lost
+        if (nl_dns_do_update(&prop, false, ++state.events) != NL_UPDATE_DEFERRED)
+            nl_cache_add(cache, obj);
+    }
+
+    nl_cache_free(fresh);
+
+    return true;
+}
+
+static void resync_timer_cb(struct loop_timer *timer)
+{
+    (void)timer;
+
+    int *dirty = state.dirty;
+    size_t ndirty = state.ndirty;
+
+    // Interfaces that are dropped from again are marked anew
+    state.dirty = NULL;
+    state.ndirty = state.dirtysize = 0;
+
+    for (size_t i = 0; i < ndirty; i++) {
+        conf_if *ifconf = iftable_get(dirty[i]);
+
+        if (ifconf)
+            resync_ifconf(ifconf->name, ifconf, NULL);
+    }
+
+    free(dirty);
+}
+
+static int cmp_int(const void *a, const void *b)
+{
+    int x = *(const int *)a, y = *(const int *)b;
+    return (x > y) - (x < y);
+}
+
+// Regenerate the socket filter if the set of monitored interfaces changed, so
+// that messages about other interfaces are dropped by the kernel before
+// libnl gets to allocate and parse them
+static void filter_update(bool resync)
+{
+    int *ifidx = xcalloc(state.conf->ifaces->used + 1, sizeof *ifidx);
+    size_t count = 0;
+
+    // Walking the table yields the indices in order
+    for (size_t i = 0; i < state.iftablesize; i++)
+        if (state.iftable[i])
+            ifidx[count++] = i;
+
+    if (state.ifidx && count == state.nifidx &&
+            memcmp(ifidx, state.ifidx, count * sizeof *ifidx) == 0) {
+        free(ifidx);
+        return;
+    }
+
+    int ret = filter_attach(nl_socket_get_fd(state.sock), ifidx, count);
+
+    if (ret < 0)
+        log(LOG_WARNING, "Failed to attach Netlink socket filter: %s", strerror(-ret));
+
+    // Messages about an interface that just appeared may have
+    // been dropped before the filter was updated
+    for (size_t i = 0; resync && i < count; i++) {
+        if (state.nifidx && bsearch(&ifidx[i], state.ifidx,
+                    state.nifidx, sizeof *state.ifidx, cmp_int))
+            continue;
+
+        conf_if *ifconf = state.iftable[ifidx[i]];
+        resync_ifconf(ifconf->name, ifconf, NULL);
+    }
+
+    free(state.ifidx);
+
+    state.ifidx = ifidx;
+    state.nifidx = count;
+}
+
+static void link_change_cb(struct nl_cache *cache,
+        struct nl_object *obj, int action, void *arg)
+{
+    (void)cache;
+    (void)arg;
+
+    struct rtnl_link *link = (struct rtnl_link *)obj;
+    const char *name = action == NL_ACT_DEL ? NULL : rtnl_link_get_name(link);
+
+    // Also covers renames, which arrive as a change of the same index
+    if (iftable_set(rtnl_link_get_ifindex(link), name))
+        filter_update(true);
+}
+
+static void sig_handle(struct loop *loop, int signo, void *arg)
+{
+    (void)signo;
+    (void)arg;
+
+    loop_stop(loop);
+}
+
+static void sig_reload(struct loop *loop, int signo, void *arg)
+{
+    (void)loop;
+    (void)signo;
+    (void)arg;
+
+    state.reload = true;
+}
+
+static void sig_stats(struct loop *loop, int signo, void *arg)
+{
+    (void)loop;
+    (void)signo;
+
+    worker_log_stats(arg);
+    metrics_log(arg);
+}
+
+static void mngr_recv(struct loop_io *io, uint32_t events)
+{
+    (void)io;
+    (void)events;
+
+    int ret = nl_cache_mngr_data_ready(state.mngr);
+
+    if (ret > 0)
+        metrics_add(&metrics.nl_received, ret);
+
+    if (ret == -NLE_NOMEM) {
+        // ENOBUFS, the kernel dropped messages because the receive buffer was full
+        log(LOG_WARNING, "Netlink receive buffer overrun, resynchronizing interfaces");
+        map_foreach_conf_if(state.conf->ifaces, resync_ifconf, NULL);
+    } else if (ret < 0) {
+        die(EX_OSERR, "Failed to receive from Netlink channel: %s", nl_geterror(ret));
+    }
+}
+
+// Also called on reload, for servers that are new or were handed back by
+// their worker. What they learned about their records, their metrics and
+// the changes they were retrying are kept.
+static bool setup_servconf(const char *key, conf_serv *servconf, void *arg)
+{
+    struct loop *loop = arg;
+
+    if (servconf->chan)
+        return true;
+
+    servconf->chan = chan_new(servconf->resolv, servconf->tsig, loop, servconf->tcp_idle);
+    servconf->batch = batch_new(servconf, loop);
+    servconf->nscache = nscache_new(servconf, loop);
+
+    if (!servconf->shadow)
+        servconf->shadow = shadow_new();
+
+    if (!servconf->metrics)
+        servconf->metrics = metrics_serv_new();
+
+    if (servconf->retry)
+        retry_set_loop(servconf->retry, loop);
+    else if (servconf->retry_backlog)
+        servconf->retry = retry_new(loop, servconf->retry_backlog, batch_requeue);
+
+    if (servconf->verify_ratio)
+        servconf->verify = verify_new(servconf, loop);
+
+    if (ldns_resolver_nameserver_count(servconf->resolv) == 0)
+        log(LOG_WARNING, "No nameserver address known for server %s", key);
+
+    return true;
+}
+
+static bool flush_servconf(const char *key, conf_serv *servconf, void *arg)
+{
+    (void)key;
+    (void)arg;
+
+    batch_flush(servconf->batch);
+
+    return true;
+}
+
+static struct nl_cache_mngr *nl_setup(struct conf *conf, struct loop *loop)
+{
+    loop_signal(loop, SIGINT, sig_handle, NULL);
+    loop_signal(loop, SIGTERM, sig_handle, NULL);
+
+    // Has to be blocked before the workers, if any, inherit the signal mask
+    loop_signal(loop, SIGUSR1, sig_stats, conf);
+    loop_signal(loop, SIGHUP, sig_reload, NULL);
+
+    state.loop = loop;
+    loop_timer_init(&state.resync, resync_timer_cb, NULL);
+
+    map_foreach_conf_serv(conf->servers, setup_servconf, loop);
+
+    int ret;
+
+    state.conf = conf;
+    state.sock = nl_socket_alloc();
+
+    if (!state.sock)
+        die(EX_SOFTWARE, "Failed to allocate memory");
+
+    struct nl_cache_mngr *nlmngr;
+    ret = nl_cache_mngr_alloc(state.sock, NETLINK_ROUTE, NL_AUTO_PROVIDE, &nlmngr);
+
+    if (ret < 0)
+        die(EX_SOFTWARE, "Failed to set up Netlink cache manager: %s", nl_geterror(ret));
+
+    state.mngr = nlmngr;
+
+    if (conf->nlrcvbuf) {
+        int fd = nl_socket_get_fd(state.sock);
+        int size = conf->nlrcvbuf;
+
+        // Bypasses net.core.rmem_max if ipup has CAP_NET_ADMIN
+        if (setsockopt(fd, SOL_SOCKET, SO_RCVBUFFORCE, &size, sizeof size) < 0 &&
+                (ret = nl_socket_set_buffer_size(state.sock, size, 0)) < 0)
+            log(LOG_WARNING, "Failed to set Netlink receive buffer size: %s", nl_geterror(ret));
+    }
+
+    // Links are needed to map the configured interfaces to indices
+    ret = rtnl_link_alloc_cache(NULL, AF_UNSPEC, &state.linkcache);
+
+    if (ret < 0)
+        die(EX_SOFTWARE, "Failed to allocate Netlink link cache: %s", nl_geterror(ret));
+
+    nl_cache_foreach(state.linkcache, iftable_add_link, NULL);
+
+    ret = nl_cache_mngr_add_cache(nlmngr, state.linkcache, link_change_cb, NULL);
+
+    if (ret < 0)
+        die(EX_SOFTWARE, "Failed to add cache to Netlink cache manager: %s", nl_geterror(ret));
+
+    filter_update(false);
+
+    struct nl_cache *cache;
+    ret = rtnl_addr_alloc_cache(NULL, &cache);
+
+    if (ret < 0)
+        die(EX_SOFTWARE, "Failed to allocate Netlink address cache: %s", nl_geterror(ret));
+
+    ret = nl_cache_mngr_add_cache(nlmngr, cache, cache_change_cb, NULL);
+
+    if (ret < 0)
+        die(EX_SOFTWARE, "Failed to add cache to Netlink cache manager: %s", nl_geterror(ret));
+
+    return nlmngr;
+}
+
+// Bring the records of the given interfaces in line with their host
+// addresses. Updates are queued, but left to their batch window.
+static void sync_ifaces(struct conf *conf, struct loop *loop, map(conf_if) *ifaces, bool snapshot)
+{
+    map_ops(sync_rec) recops = {
+        .hash = sync_rec_hash,
+        .compare = sync_rec_compare,
+        .val_free = sync_rec_free
+    };
+
+    map_ops(sync_zone) zoneops = {
+        .hash = sync_zone_hash,
+        .compare = sync_zone_compare,
+        .val_free = sync_zone_free
+    };
+
+    struct sync sync = {
+        .recs = map_new_sync_rec(4, recops),
+        .zones = map_new_sync_zone(4, zoneops),
+        .loop = loop,
+        .snapshot = snapshot,
+        .trust = conf->opts & CONF_OPT_GLOBAL_STATE_TRUST
+    };
+
+    // At most one record per interface
+    map_reserve_sync_rec(sync.recs, ifaces->used);
+
+    loop_timer_init(&sync.deadline, sync_deadline_cb, &sync);
+
+    // Query each DNS record once, however many interfaces point to it. The
+    // queries for all records go out at once, and as each answer arrives,
+    // the host addresses that are already present in the record are marked,
+    // and the addresses in the record that no interface has are deleted (only
+    // if `delete-existing` was enabled for one of the interfaces). Records
+    // saved by a previous run are taken from the snapshot instead, if their
+    // zone's serial has not changed since, or if the snapshot is trusted.
+    map_foreach_conf_if(ifaces, sync_collect_ifconf, &sync);
+    sync_bucket(&sync);
+
+    TRACE(sync_start, sync.recs->used);
+
+    map_foreach_sync_rec(sync.recs, sync_start_rec, &sync);
+    map_foreach_sync_zone(sync.zones, sync_start_zone, &sync);
+
+    TRACE(sync_queried, sync.pending);
+
+    if (sync.pending) {
+        loop_ref(loop);
+        loop_timer_arm(loop, &sync.deadline, clock_ms() + conf->synctimeout);
+    }
+
+    // Updates queued in the meantime are left to their batch window
+    while (sync.pending && !loop_stopped(loop))
+        loop_once(loop);
+
+    // Terminated by a signal
+    if (sync.pending) {
+        sync.expired = true;
+
+        loop_timer_disarm(loop, &sync.deadline);
+        loop_unref(loop);
+
+        map_foreach_conf_serv(conf->servers, sync_cancel_servconf, NULL);
+    }
+
+    // Send UPDATE queries for all host addresses that haven't been marked
+    map_foreach_sync_rec(sync.recs, sync_upd_rec, NULL);
+
+    map_free_sync_zone(sync.zones);
+    map_free_sync_rec(sync.recs);
+}
+
+struct nl_cache_mngr *nl_sync(struct conf *conf, struct loop *loop)
+{
+    int64_t start = clock_ns();
+    struct nl_cache_mngr *nlmngr = nl_setup(conf, loop);
+
+    // The snapshot is saved once the updates sent here have been answered,
+    // records with an UPDATE in flight are left out of it
+    sync_ifaces(conf, loop, conf->ifaces, conf->statefile);
+    map_foreach_conf_serv(conf->servers, flush_servconf, NULL);
+
+    int64_t took = clock_ns() - start;
+    metrics_add(&metrics.sync_ns, took);
+
+    TRACE(sync_done, took);
+
+    log(LOG_INFO, "Startup synchronization took %lld ms", (long long)(took / 1000000));
+
+    return nlmngr;
+}
+
+struct reload {
+    struct conf *live;
+    struct conf *fresh;
+
+    // Interfaces that are new or changed, keyed by the new configuration
+    map(conf_if) *changed;
+    size_t servers;
+};
+
+// Options that are only read on startup keep their running value
+static void reload_keep_globals(struct conf *fresh, struct conf *live)
+{
+    if ((fresh->opts ^ live->opts) & CONF_OPT_GLOBAL_THREADED)
+        log(LOG_NOTICE, "Changing threaded requires a restart");
+
+    if (fresh->ringsize != live->ringsize)
+        log(LOG_NOTICE, "Changing ring-size requires a restart");
+
+    if (fresh->nlrcvbuf != live->nlrcvbuf)
+        log(LOG_NOTICE, "Changing netlink-rcvbuf requires a restart");
+
+    if (!fresh->statefile != !live->statefile ||
+            (fresh->statefile && strcmp(fresh->statefile, live->statefile) != 0))
+        log(LOG_NOTICE, "Changing state-file requires a restart");
+
+    if (!fresh->metricssock != !live->metricssock ||
+            (fresh->metricssock && strcmp(fresh->metricssock, live->metricssock) != 0))
+        log(LOG_NOTICE, "Changing metrics-socket requires a restart");
+
+    fresh->opts = (fresh->opts & ~CONF_OPT_GLOBAL_THREADED) | (live->opts & CONF_OPT_GLOBAL_THREADED);
+    fresh->ringsize = live->ringsize;
+    fresh->nlrcvbuf = live->nlrcvbuf;
+
+    // Swapped, so that each is freed along with the other configuration
+    char *statefile = fresh->statefile;
+    char *metricssock = fresh->metricssock;
+
+    fresh->statefile = live->statefile;
+    fresh->metricssock = live->metricssock;
+
+    live->statefile = statefile;
+    live->metricssock = metricssock;
+}
+
+static bool reload_servconf(const char *key, conf_serv *servconf, void *arg)
+{
+    struct reload *reload = arg;
+    conf_serv *old;
+
+    if (map_get_conf_serv(reload->live->servers, key, &old) && conf_serv_equal(old, servconf)) {
+        conf_keep_serv(reload->fresh, reload->live, key);
+        return true;
+    }
+
+    conf_resolve(servconf);
+    reload->servers++;
+
+    return true;
+}
+
+static bool reload_ifconf(const char *key, conf_if *ifconf, void *arg)
+{
+    struct reload *reload = arg;
+    conf_if *old;
+
+    if (map_get_conf_if(reload->live->ifaces, key, &old) && conf_if_equal(old, ifconf))
+        conf_keep_if(reload->fresh, reload->live, key);
+    else
+        map_set_conf_if(reload->changed, key, ifconf);
+
+    return true;
+}
+
+// Changes queued for a retired interface would outlive it
+static bool reload_retire_ifconf(const char *key, conf_if *ifconf, void *arg)
+{
+    (void)key;
+    (void)arg;
+
+    if (ifconf && ifconf->server->retry)
+        retry_forget(ifconf->server->retry, ifconf);
+
+    return true;
+}
+
+static bool cancel_servconf(const char *key, conf_serv *servconf, void *arg)
+{
+    (void)key;
+    (void)arg;
+
+    conf_cancel_serv(servconf);
+
+    return true;
+}
+
+// Waits for the answers to what was sent. Netlink is not read meanwhile,
+// so a dead server may only hold it up for the sync timeout, what is not
+// answered by then is failed and left to be retried. Changes held back
+// until then are sent once the others fail, and failed in turn.
+static void reload_drain(struct loop *loop, struct conf *conf)
+{
+    int64_t deadline = clock_ms() + conf->synctimeout;
+
+    if (loop_drain_until(loop, deadline) || loop_stopped(loop))
+        return;
+
+    log(LOG_WARNING, "Timed out waiting for answers from DNS servers, "
+            "failing what is still in flight");
+
+    do
+        map_foreach_conf_serv(conf->servers, cancel_servconf, NULL);
+    while (!loop_drain_until(loop, deadline) && !loop_stopped(loop));
+}
+
+// Reads the configuration file again and applies it. Servers and interfaces
+// that are configured the same way are carried over as they are, along with
+// their connections and what is known about their records. The others are
+// set up from scratch, and only the records of new or changed interfaces
+// are synchronized again.
+static void nl_reload(struct loop *loop, struct conf *conf)
+{
+    bool threaded = conf->opts & CONF_OPT_GLOBAL_THREADED;
+
+    log(LOG_NOTICE, "Reloading configuration from %s", conf->path);
+
+    FILE *file = fopen(conf->path, "r");
+    struct conf fresh;
+
+    if (!file) {
+        log(LOG_ERR, "Could not open config file %s: %s", conf->path, strerror(errno));
+        log(LOG_WARNING, "Keeping the current configuration");
+        return;
+    }
+
+    int status = conf_load(file, conf->path, &fresh);
+    fclose(file);
+
+    if (status != EX_OK) {
+        log(LOG_WARNING, "Keeping the current configuration");
+        return;
+    }
+
+    reload_keep_globals(&fresh, conf);
+
+    // Nothing may refer to the current configuration once it is swapped
+    // out: stop reading from Netlink, and wait for the changes that were
+    // already read to be acknowledged
+    loop_io_stop(loop, &state.io);
+
+    if (threaded) {
+        worker_stop(conf, true);
+    } else {
+        map_foreach_conf_serv(conf->servers, flush_servconf, NULL);
+        reload_drain(loop, conf);
+    }
+
+    // Terminated by a signal, the workers are not needed anymore
+    if (loop_stopped(loop)) {
+        conf_free(fresh);
+        return;
+    }
+
+    map_ops(conf_if) changedops = {
+        .compare = strcmp,
+        .hash = hash_str
+    };
+
+    struct reload reload = {
+        .live = conf,
+        .fresh = &fresh,
+        .changed = map_new_conf_if(4, changedops)
+    };
+
+    // Servers first, their interfaces compare equal only if they were kept
+    map_foreach_conf_serv(fresh.servers, reload_servconf, &reload);
+    map_foreach_conf_if(fresh.ifaces, reload_ifconf, &reload);
+    map_foreach_conf_if(conf->ifaces, reload_retire_ifconf, NULL);
+
+    struct conf old = *conf;
+    *conf = fresh;
+    conf_free(old);
+
+    map_foreach_conf_serv(conf->servers, setup_servconf, loop);
+
+    iftable_rebuild();
+    filter_update(true);
+
+    sync_ifaces(conf, loop, reload.changed, false);
+    map_foreach_conf_serv(conf->servers, flush_servconf, NULL);
+
+    if (threaded) {
+        reload_drain(loop, conf);
+        worker_start(conf);
+    }
+
+    loop_io_start(loop, &state.io, EPOLLIN);
+
+    log(LOG_NOTICE, "Configuration reloaded, %zu server(s) and %zu interface(s) new or changed",
+            reload.servers, reload.changed->used);
+
+    map_free_conf_if(reload.changed);
+}
+
+void nl_run(struct nl_cache_mngr *nlmngr, struct loop *loop, struct conf *conf)
+{
+    bool threaded = conf->opts & CONF_OPT_GLOBAL_THREADED;
+    bool save = true;
+
+    // In threaded mode, this thread only reads from the Netlink socket, and
+    // each server is handed over to a worker once the startup updates are done
+    if (threaded) {
+        loop_drain(loop);
+        snap_save(conf);
+        worker_start(conf);
+
+        save = false;
+    }
+
+    loop_io_init(&state.io, nl_cache_mngr_get_fd(nlmngr), mngr_recv, NULL);
+    loop_io_start(loop, &state.io, EPOLLIN);
+
+    // Runs until an error occurs or the user requests termination. Netlink
+    // events and DNS replies are handled as they arrive, so a slow or dead
+    // server does not hold up the others.
+    while (!loop_stopped(loop)) {
+        loop_once(loop);
+
+        // Once the answers to the startup updates are in
+        if (save && loop_idle(loop)) {
+            snap_save(conf);
+            save = false;
+        }
+
+        if (state.reload) {
+            state.reload = false;
+            nl_reload(loop, conf);
+        }
+    }
+
+    loop_io_stop(loop, &state.io);
+    loop_timer_disarm(loop, &state.resync);
+
+    if (threaded) {
+        worker_log_stats(conf);
+        worker_stop(conf, false);
+    } else {
+        // Send whatever is still being coalesced
+        map_foreach_conf_serv(conf->servers, flush_servconf, NULL);
+    }
+}
+
+void nl_free(struct nl_cache_mngr *nlmngr)
+{
+    nl_cache_mngr_free(nlmngr);
+
+    // Sockets passed to the cache manager are not freed along with it
+    nl_socket_free(state.sock);
+    nl_socket_free(state.dumpsock);
+
+    free(state.iftable);
+    free(state.ifidx);
+    free(state.dirty);
 }
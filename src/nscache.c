@@ -0,0 +1,177 @@
+#include <string.h>
+
+#include "log.h"
+#include "dns.h"
+#include "chan.h"
+#include "util.h"
+#include "xalloc.h"
+#include "nscache.h"
+
+// Bounds for the refresh interval, in milliseconds, regardless of the TTL
+#define NSCACHE_MIN_REFRESH 30000
+#define NSCACHE_MAX_REFRESH 3600000
+
+// The addresses of a server's nameserver are resolved again in the background
+// before their TTL runs out, and swapped into its channel once both lookups
+// have completed. The channel and the cache are owned by the same loop, so
+// requests never see a partial update. They are also written back into the
+// server's resolver, which channels created later on are built from; the
+// thread that owns the loop is the only one touching it in the meantime.
+struct nscache {
+    conf_serv *server;
+    struct loop *loop;
+    struct chan *lookup;
+    struct loop_timer timer;
+
+    // Collected from the replies of the refresh in progress
+    struct sockaddr_storage *addrs;
+    size_t naddrs, size;
+    uint32_t ttl;
+    size_t pending;
+};
+
+static void nscache_refresh(struct loop_timer *timer);
+
+static void nscache_schedule(struct nscache *nscache, uint32_t ttl)
+{
+    // Refreshed once three quarters of the TTL have passed
+    int64_t delay = (int64_t)ttl * 750;
+
+    if (delay < NSCACHE_MIN_REFRESH)
+        delay = NSCACHE_MIN_REFRESH;
+    if (delay > NSCACHE_MAX_REFRESH)
+        delay = NSCACHE_MAX_REFRESH;
+
+    loop_timer_arm(nscache->loop, &nscache->timer, clock_ms() + delay);
+}
+
+static void nscache_collect(struct nscache *nscache, ldns_rr_list *answer)
+{
+    uint16_t port = ldns_resolver_port(nscache->server->resolv);
+
+    for (size_t i = 0; i < ldns_rr_list_rr_count(answer); i++) {
+        ldns_rr *rr = ldns_rr_list_rr(answer, i);
+        ldns_rr_type type = ldns_rr_get_type(rr);
+
+        // Anything else would be part of a CNAME chain
+        if (type != LDNS_RR_TYPE_A && type != LDNS_RR_TYPE_AAAA)
+            continue;
+
+        size_t addrlen;
+        struct sockaddr_storage *addr = ldns_rdf2native_sockaddr_storage(ldns_rr_a_address(rr),
+                port, &addrlen);
+
+        if (!addr)
+            continue;
+
+        if (nscache->naddrs == nscache->size) {
+            nscache->size = nscache->size ? nscache->size * 2 : 4;
+            nscache->addrs = xreallocarray(nscache->addrs, nscache->size, sizeof *nscache->addrs);
+        }
+
+        nscache->addrs[nscache->naddrs++] = *addr;
+        free(addr);
+
+        if (ldns_rr_ttl(rr) < nscache->ttl)
+            nscache->ttl = ldns_rr_ttl(rr);
+    }
+}
+
+static void nscache_lookup_cb(ldns_pkt *reply, ldns_status status, void *arg)
+{
+    (void)status;
+
+    struct nscache *nscache = arg;
+
+    if (reply && ldns_pkt_get_rcode(reply) == LDNS_RCODE_NOERROR)
+        nscache_collect(nscache, ldns_pkt_answer(reply));
+
+    if (--nscache->pending)
+        return;
+
+    const char *name = nscache->server->name;
+
+    // The current addresses are kept until a lookup succeeds
+    if (nscache->naddrs == 0) {
+        log(LOG_WARNING, "Failed to refresh nameserver addresses for server %s", name);
+        nscache_schedule(nscache, 0);
+        return;
+    }
+
+    if (chan_set_nameservers(nscache->server->chan, nscache->addrs, nscache->naddrs))
+        log(LOG_NOTICE, "Nameserver addresses for server %s changed", name);
+
+    dns_resolver_set_nameservers(nscache->server->resolv, nscache->addrs, nscache->naddrs);
+    nscache->server->ns_ttl = nscache->ttl;
+
+    nscache_schedule(nscache, nscache->ttl);
+}
+
+static void nscache_query(struct nscache *nscache, ldns_rr_type type)
+{
+    ldns_pkt *querypkt = ldns_pkt_query_new(ldns_rdf_clone(nscache->server->server),
+            type, LDNS_RR_CLASS_IN, LDNS_RD);
+
+    if (!querypkt)
+        die(EX_SOFTWARE, "Failed to allocate memory");
+
+    ldns_status ret = chan_send(nscache->lookup, querypkt, nscache_lookup_cb, nscache);
+
+    if (ret == LDNS_STATUS_OK)
+        nscache->pending++;
+    else
+        log(LOG_WARNING, "Failed to query DNS server: %s", ldns_get_errorstr_by_id(ret));
+
+    ldns_pkt_free(querypkt);
+}
+
+static void nscache_refresh(struct loop_timer *timer)
+{
+    struct nscache *nscache = timer->arg;
+
+    nscache->naddrs = 0;
+    nscache->ttl = UINT32_MAX;
+
+    nscache_query(nscache, LDNS_RR_TYPE_AAAA);
+    nscache_query(nscache, LDNS_RR_TYPE_A);
+
+    if (nscache->pending == 0)
+        nscache_schedule(nscache, 0);
+}
+
+// Uses the TTL of the addresses resolved while the configuration was read
+struct nscache *nscache_new(conf_serv *servconf, struct loop *loop)
+{
+    if (!servconf->server)
+        return NULL;
+
+    struct nscache *nscache = xcalloc(1, sizeof *nscache);
+
+    nscache->server = servconf;
+    nscache->loop = loop;
+    nscache->lookup = chan_new(dns_sys_resolver(), NULL, loop, 0);
+
+    loop_timer_init(&nscache->timer, nscache_refresh, nscache);
+    nscache_schedule(nscache, servconf->ns_ttl);
+
+    return nscache;
+}
+
+// The current addresses are kept, and the lookup is tried again later
+void nscache_cancel(struct nscache *nscache)
+{
+    if (nscache)
+        chan_cancel(nscache->lookup, nscache_lookup_cb);
+}
+
+void nscache_free(struct nscache *nscache)
+{
+    if (!nscache)
+        return;
+
+    loop_timer_disarm(nscache->loop, &nscache->timer);
+    chan_free(nscache->lookup);
+
+    free(nscache->addrs);
+    free(nscache);
+}
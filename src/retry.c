@@ -0,0 +1,416 @@
+#include <string.h>
+
+#include "log.h"
+#include "dns.h"
+#include "util.h"
+#include "retry.h"
+#include "xalloc.h"
+
+// Delay before the first retry and upper bound for later ones, in milliseconds
+#define RETRY_BASE_DELAY 1000
+#define RETRY_MAX_DELAY 300000
+
+// Two levels of 64 slots each, with a resolution of 100 ms. The wheel spans
+// a little under 7 minutes, which has to be longer than the maximum delay.
+#define RETRY_TICK 100
+#define RETRY_WHEEL_BITS 6
+#define RETRY_WHEEL_SLOTS (1 << RETRY_WHEEL_BITS)
+#define RETRY_WHEEL_MASK (RETRY_WHEEL_SLOTS - 1)
+#define RETRY_WHEEL_LEVELS 2
+
+#define RETRY_BUCKETS 256
+
+// A change that failed to reach the server. Entries stay around while they
+// are being sent again, so that another failure backs off further.
+struct retry_entry {
+    // Either in the wheel or waiting for the outcome of the resend
+    struct retry_entry *next, **pprev;
+    struct retry_entry *hnext;
+
+    conf_if *ifconf;
+    struct sockaddr_in6 addr;
+    uint32_t ttl;
+    bool delete;
+    uint64_t seq;
+
+    unsigned attempts;
+    uint64_t expires;
+    bool scheduled;
+};
+
+struct retry {
+    struct loop *loop;
+    struct loop_timer timer;
+    retry_cb cb;
+
+    // Ticks are counted from `epoch`, on the monotonic clock
+    int64_t epoch;
+    uint64_t now;
+    struct retry_entry *wheel[RETRY_WHEEL_LEVELS][RETRY_WHEEL_SLOTS];
+    struct retry_entry *resent;
+    size_t pending;
+
+    // Keyed by record and address, so that changes to the same address collapse
+    struct retry_entry *buckets[RETRY_BUCKETS];
+    size_t count, max;
+    size_t dropped;
+
+    uint64_t rng;
+};
+
+static size_t retry_bucket(ldns_rdf *record, const struct sockaddr_in6 *addr)
+{
+    uint64_t h = dns_dname_hash(record);
+    const uint8_t *bytes = addr->sin6_addr.s6_addr;
+
+    for (size_t i = 0; i < sizeof addr->sin6_addr; i++) {
+        h ^= bytes[i];
+        h *= 0x100000001b3LLU;
+    }
+
+    return h % RETRY_BUCKETS;
+}
+
+static struct retry_entry **retry_find(struct retry *retry, ldns_rdf *record,
+        const struct sockaddr_in6 *addr)
+{
+    struct retry_entry **link = &retry->buckets[retry_bucket(record, addr)];
+
+    for (; *link; link = &(*link)->hnext) {
+        struct retry_entry *entry = *link;
+
+        if (memcmp(&entry->addr.sin6_addr, &addr->sin6_addr, sizeof addr->sin6_addr) == 0 &&
+                (entry->ifconf->record == record ||
+                 ldns_dname_compare(entry->ifconf->record, record) == 0))
+            return link;
+    }
+
+    return link;
+}
+
+static void retry_unlink(struct retry_entry *entry)
+{
+    if (!entry->pprev)
+        return;
+
+    *entry->pprev = entry->next;
+
+    if (entry->next)
+        entry->next->pprev = entry->pprev;
+
+    entry->next = NULL;
+    entry->pprev = NULL;
+}
+
+static void retry_link(struct retry_entry **head, struct retry_entry *entry)
+{
+    entry->next = *head;
+    entry->pprev = head;
+
+    if (*head)
+        (*head)->pprev = &entry->next;
+
+    *head = entry;
+}
+
+static uint64_t retry_clock(struct retry *retry)
+{
+    return (clock_ms() - retry->epoch) / RETRY_TICK;
+}
+
+// The first tick after `now` at which an entry is due, or at which entries
+// on the upper level move down, UINT64_MAX if the wheel is empty
+static uint64_t retry_next_tick(const struct retry *retry)
+{
+    uint64_t next = UINT64_MAX;
+
+    for (uint64_t tick = retry->now + 1; tick <= retry->now + RETRY_WHEEL_MASK; tick++) {
+        if (retry->wheel[0][tick & RETRY_WHEEL_MASK]) {
+            next = tick;
+            break;
+        }
+    }
+
+    uint64_t block = retry->now >> RETRY_WHEEL_BITS;
+
+    for (uint64_t i = block + 1; i <= block + RETRY_WHEEL_SLOTS; i++) {
+        uint64_t tick = i << RETRY_WHEEL_BITS;
+
+        if (tick >= next)
+            break;
+
+        if (retry->wheel[1][i & RETRY_WHEEL_MASK])
+            return tick;
+    }
+
+    return next;
+}
+
+// The timer only goes off when something has to happen, so the wheel lags
+// behind the clock in between. Nothing happens before the next tick, which
+// makes it safe to skip ahead to just short of it.
+static void retry_catch_up(struct retry *retry)
+{
+    uint64_t tick = retry_clock(retry);
+    uint64_t next = retry_next_tick(retry);
+
+    if (tick >= next)
+        tick = next - 1;
+
+    if (tick > retry->now)
+        retry->now = tick;
+}
+
+static void retry_schedule_timer(struct retry *retry)
+{
+    if (!retry->loop)
+        return;
+
+    if (retry->pending == 0) {
+        loop_timer_disarm(retry->loop, &retry->timer);
+        return;
+    }
+
+    int64_t deadline = retry->epoch + (int64_t)retry_next_tick(retry) * RETRY_TICK;
+
+    if (!loop_timer_armed(&retry->timer) || retry->timer.deadline != deadline)
+        loop_timer_arm(retry->loop, &retry->timer, deadline);
+}
+
+// Entries due before `floor` go into its slot instead
+static void retry_wheel_insert(struct retry *retry, struct retry_entry *entry, uint64_t floor)
+{
+    uint64_t expires = entry->expires > floor ? entry->expires : floor;
+    struct retry_entry **head;
+
+    if (expires - retry->now < RETRY_WHEEL_SLOTS)
+        head = &retry->wheel[0][expires & RETRY_WHEEL_MASK];
+    else
+        head = &retry->wheel[1][(expires >> RETRY_WHEEL_BITS) & RETRY_WHEEL_MASK];
+
+    if (!entry->scheduled)
+        retry->pending++;
+
+    retry_unlink(entry);
+    retry_link(head, entry);
+    entry->scheduled = true;
+}
+
+// xorshift64*, only used to spread retries out
+static uint64_t retry_random(struct retry *retry)
+{
+    retry->rng ^= retry->rng >> 12;
+    retry->rng ^= retry->rng << 25;
+    retry->rng ^= retry->rng >> 27;
+
+    return retry->rng * 0x2545f4914f6cdd1dLLU;
+}
+
+// Exponential backoff, with the delay picked at random from its upper half
+// so that servers coming back up don't see every client at once
+static uint64_t retry_backoff(struct retry *retry, unsigned attempts)
+{
+    int64_t delay = RETRY_MAX_DELAY;
+
+    if (attempts < 16 && (RETRY_BASE_DELAY << attempts) < RETRY_MAX_DELAY)
+        delay = (int64_t)RETRY_BASE_DELAY << attempts;
+
+    delay = delay / 2 + retry_random(retry) % (delay / 2 + 1);
+
+    return (delay + RETRY_TICK - 1) / RETRY_TICK;
+}
+
+static void retry_fire(struct retry *retry, struct retry_entry *entry)
+{
+    retry_unlink(entry);
+    retry_link(&retry->resent, entry);
+
+    entry->scheduled = false;
+    retry->pending--;
+
+    retry->cb(entry->ifconf, &entry->addr, entry->delete, entry->ttl, entry->seq);
+}
+
+// Advances the wheel up to `tick`, firing every entry due by then
+static void retry_advance(struct retry *retry, uint64_t tick)
+{
+    while (retry->now < tick && retry->pending) {
+        retry->now++;
+
+        // Entries on the upper level move down whenever the lower one wraps around
+        if ((retry->now & RETRY_WHEEL_MASK) == 0) {
+            struct retry_entry **head =
+                &retry->wheel[1][(retry->now >> RETRY_WHEEL_BITS) & RETRY_WHEEL_MASK];
+
+            while (*head)
+                retry_wheel_insert(retry, *head, retry->now);
+        }
+
+        struct retry_entry **head = &retry->wheel[0][retry->now & RETRY_WHEEL_MASK];
+
+        // The callback only queues the change, it never adds entries here
+        while (*head)
+            retry_fire(retry, *head);
+    }
+
+    // Nothing left to fire, skip over the remaining ticks
+    if (retry->now < tick)
+        retry->now = tick;
+}
+
+static void retry_timer_cb(struct loop_timer *timer)
+{
+    struct retry *retry = timer->arg;
+
+    retry_advance(retry, retry_clock(retry));
+    retry_schedule_timer(retry);
+}
+
+struct retry *retry_new(struct loop *loop, size_t max, retry_cb cb)
+{
+    struct retry *retry = xcalloc(1, sizeof *retry);
+
+    retry->loop = loop;
+    retry->max = max;
+    retry->cb = cb;
+    retry->epoch = clock_ms();
+    retry->rng = (uint64_t)retry->epoch << 16 | ldns_get_random() | 1;
+
+    loop_timer_init(&retry->timer, retry_timer_cb, retry);
+
+    return retry;
+}
+
+void retry_free(struct retry *retry)
+{
+    if (!retry)
+        return;
+
+    if (retry->loop)
+        loop_timer_disarm(retry->loop, &retry->timer);
+
+    for (size_t i = 0; i < RETRY_BUCKETS; i++) {
+        while (retry->buckets[i]) {
+            struct retry_entry *entry = retry->buckets[i];
+
+            retry->buckets[i] = entry->hnext;
+            free(entry);
+        }
+    }
+
+    free(retry);
+}
+
+// Moves the timer over to another loop, which has to run on the calling thread
+void retry_set_loop(struct retry *retry, struct loop *loop)
+{
+    if (retry->loop)
+        loop_timer_disarm(retry->loop, &retry->timer);
+
+    retry->loop = loop;
+    retry_schedule_timer(retry);
+}
+
+// Queues a change that failed to reach the server, replacing whatever was queued
+// for the same address unless that is newer. Returns false if the backlog is full.
+bool retry_add(struct retry *retry, conf_if *ifconf, const struct sockaddr_in6 *addr,
+        bool delete, uint32_t ttl, uint64_t seq)
+{
+    struct retry_entry **link = retry_find(retry, ifconf->record, addr);
+    struct retry_entry *entry = *link;
+
+    // A late failure of a change that has been superseded since
+    if (entry && entry->seq > seq)
+        return true;
+
+    if (!entry) {
+        if (retry->count >= retry->max) {
+            // Don't flood the log while the server is unreachable
+            if ((retry->dropped & (retry->dropped + 1)) == 0)
+                log(LOG_WARNING, "Retry backlog full, dropped %zu changes so far",
+                        retry->dropped + 1);
+
+            retry->dropped++;
+            return false;
+        }
+
+        entry = xcalloc(1, sizeof *entry);
+        *link = entry;
+
+        retry->count++;
+    } else if (!entry->scheduled) {
+        entry->attempts++;
+    }
+
+    entry->ifconf = ifconf;
+    entry->addr = *addr;
+    entry->delete = delete;
+    entry->ttl = ttl;
+    entry->seq = seq;
+
+    if (!entry->scheduled) {
+        retry_catch_up(retry);
+
+        entry->expires = retry->now + retry_backoff(retry, entry->attempts);
+        retry_wheel_insert(retry, entry, retry->now + 1);
+    }
+
+    retry_schedule_timer(retry);
+
+    return true;
+}
+
+// Forgets about an address, either because change `seq` reached the server
+// or because it superseded what was queued. Newer changes are kept.
+void retry_done(struct retry *retry, ldns_rdf *record, const struct sockaddr_in6 *addr,
+        uint64_t seq)
+{
+    struct retry_entry **link = retry_find(retry, record, addr);
+    struct retry_entry *entry = *link;
+
+    if (!entry || entry->seq > seq)
+        return;
+
+    *link = entry->hnext;
+    retry_unlink(entry);
+
+    if (entry->scheduled)
+        retry->pending--;
+
+    free(entry);
+    retry->count--;
+    retry_schedule_timer(retry);
+}
+
+// Drops every change queued for an interface that is going away
+void retry_forget(struct retry *retry, const conf_if *ifconf)
+{
+    for (size_t i = 0; i < RETRY_BUCKETS; i++) {
+        struct retry_entry **link = &retry->buckets[i];
+
+        while (*link) {
+            struct retry_entry *entry = *link;
+
+            if (entry->ifconf != ifconf) {
+                link = &entry->hnext;
+                continue;
+            }
+
+            *link = entry->hnext;
+            retry_unlink(entry);
+
+            if (entry->scheduled)
+                retry->pending--;
+
+            free(entry);
+            retry->count--;
+        }
+    }
+
+    retry_schedule_timer(retry);
+}
+
+size_t retry_count(const struct retry *retry)
+{
+    return retry->count;
+}
@@ -0,0 +1,197 @@
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdalign.h>
+#include <stdatomic.h>
+
+#include <sys/eventfd.h>
+
+#include "log.h"
+#include "ring.h"
+#include "xalloc.h"
+
+#define RING_CACHELINE 64
+
+// Bounded multi-producer queue (Vyukov), each cell carries a sequence
+// number telling whether it is free for the producer of a given lap or
+// holds data for the consumer. Producers and the consumer never share
+// a lock, and the only syscall is the eventfd write that wakes up a
+// consumer that went to sleep on an empty ring.
+struct ring_cell {
+    atomic_size_t seq;
+    alignas(max_align_t) unsigned char data[];
+};
+
+struct ring {
+    alignas(RING_CACHELINE) atomic_size_t head;
+    alignas(RING_CACHELINE) atomic_size_t tail;
+
+    alignas(RING_CACHELINE) atomic_size_t highwater;
+    atomic_uint_fast64_t pushed;
+    atomic_uint_fast64_t dropped;
+    atomic_bool waiting;
+
+    size_t mask;
+    size_t stride;
+    size_t elemsize;
+    int fd;
+
+    unsigned char *cells;
+};
+
+static struct ring_cell *ring_cell(const struct ring *ring, size_t pos)
+{
+    return (struct ring_cell *)(ring->cells + (pos & ring->mask) * ring->stride);
+}
+
+struct ring *ring_new(size_t size, size_t elemsize)
+{
+    struct ring *ring = aligned_alloc(RING_CACHELINE, sizeof *ring);
+
+    if (!ring)
+        die(EX_SOFTWARE, "Failed to allocate memory");
+
+    memset(ring, 0, sizeof *ring);
+
+    // Round up to a power of two
+    size_t cap = 2;
+    while (cap < size)
+        cap <<= 1;
+
+    ring->mask = cap - 1;
+    ring->elemsize = elemsize;
+    ring->stride = sizeof(struct ring_cell) + elemsize;
+    ring->stride = (ring->stride + alignof(max_align_t) - 1) & ~(alignof(max_align_t) - 1);
+    ring->cells = xcalloc(cap, ring->stride);
+
+    for (size_t i = 0; i < cap; i++)
+        atomic_init(&ring_cell(ring, i)->seq, i);
+
+    ring->fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+    if (ring->fd < 0)
+        die(EX_OSERR, "Failed to create eventfd: %s", strerror(errno));
+
+    return ring;
+}
+
+void ring_free(struct ring *ring)
+{
+    if (!ring)
+        return;
+
+    close(ring->fd);
+    free(ring->cells);
+    free(ring);
+}
+
+// Returns false, and counts a drop, if the ring is full
+bool ring_push(struct ring *ring, const void *elem)
+{
+    size_t pos = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    struct ring_cell *cell;
+
+    while (1) {
+        cell = ring_cell(ring, pos);
+
+        size_t seq = atomic_load_explicit(&cell->seq, memory_order_acquire);
+        intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&ring->head, &pos, pos + 1,
+                    memory_order_relaxed, memory_order_relaxed))
+                break;
+        } else if (diff < 0) {
+            atomic_fetch_add_explicit(&ring->dropped, 1, memory_order_relaxed);
+            return false;
+        } else {
+            pos = atomic_load_explicit(&ring->head, memory_order_relaxed);
+        }
+    }
+
+    memcpy(cell->data, elem, ring->elemsize);
+    atomic_store_explicit(&cell->seq, pos + 1, memory_order_release);
+
+    atomic_fetch_add_explicit(&ring->pushed, 1, memory_order_relaxed);
+
+    size_t depth = pos + 1 - atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    size_t highwater = atomic_load_explicit(&ring->highwater, memory_order_relaxed);
+
+    while (depth > highwater && !atomic_compare_exchange_weak_explicit(&ring->highwater,
+                &highwater, depth, memory_order_relaxed, memory_order_relaxed))
+        ;
+
+    if (atomic_exchange(&ring->waiting, false)) {
+        uint64_t one = 1;
+
+        if (write(ring->fd, &one, sizeof one) < 0 && errno != EAGAIN)
+            log(LOG_WARNING, "Failed to wake up ring consumer: %s", strerror(errno));
+    }
+
+    return true;
+}
+
+// Must only be called by the (single) consumer
+bool ring_pop(struct ring *ring, void *elem)
+{
+    size_t pos = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    struct ring_cell *cell = ring_cell(ring, pos);
+
+    size_t seq = atomic_load_explicit(&cell->seq, memory_order_acquire);
+
+    if ((intptr_t)seq - (intptr_t)(pos + 1) < 0)
+        return false;
+
+    memcpy(elem, cell->data, ring->elemsize);
+
+    atomic_store_explicit(&cell->seq, pos + ring->mask + 1, memory_order_release);
+    atomic_store_explicit(&ring->tail, pos + 1, memory_order_relaxed);
+
+    return true;
+}
+
+int ring_fd(const struct ring *ring)
+{
+    return ring->fd;
+}
+
+// Called by the consumer before going to sleep on `ring_fd`, after draining
+// the ring. Clears the eventfd and returns true if elements were pushed in
+// the meantime, in which case the ring has to be drained again.
+bool ring_arm(struct ring *ring)
+{
+    uint64_t count;
+
+    if (read(ring->fd, &count, sizeof count) < 0 && errno != EAGAIN)
+        log(LOG_WARNING, "Failed to read from eventfd: %s", strerror(errno));
+
+    atomic_store(&ring->waiting, true);
+
+    size_t pos = atomic_load(&ring->tail);
+    size_t seq = atomic_load(&ring_cell(ring, pos)->seq);
+
+    return (intptr_t)seq - (intptr_t)(pos + 1) >= 0;
+}
+
+// Wakes up the consumer even if the ring is empty
+void ring_wake(struct ring *ring)
+{
+    uint64_t one = 1;
+
+    atomic_store(&ring->waiting, false);
+
+    if (write(ring->fd, &one, sizeof one) < 0 && errno != EAGAIN)
+        log(LOG_WARNING, "Failed to wake up ring consumer: %s", strerror(errno));
+}
+
+void ring_stats(const struct ring *ring, struct ring_stats *stats)
+{
+    size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+
+    stats->size = ring->mask + 1;
+    stats->depth = head - tail;
+    stats->highwater = atomic_load_explicit(&ring->highwater, memory_order_relaxed);
+    stats->pushed = atomic_load_explicit(&ring->pushed, memory_order_relaxed);
+    stats->dropped = atomic_load_explicit(&ring->dropped, memory_order_relaxed);
+}
@@ -0,0 +1,210 @@
+#include <string.h>
+
+#include "dns.h"
+#include "map.h"
+#include "shadow.h"
+#include "xalloc.h"
+
+map_decl(shadow, uint64_t, ldns_rdf *, struct shadow_rrset *);
+
+// What ipup believes each managed record on a server holds, used to
+// skip updates that would not change anything
+struct shadow {
+    map(shadow) *rrsets;
+};
+
+static void shadow_rrset_free(struct shadow_rrset *rrset)
+{
+    free(rrset->addrs);
+    free(rrset);
+}
+
+static struct shadow_rrset *shadow_rrset(struct shadow *shadow, ldns_rdf *record, bool create)
+{
+    struct shadow_rrset *rrset;
+
+    if (map_get_shadow(shadow->rrsets, record, &rrset))
+        return rrset;
+
+    if (!create)
+        return NULL;
+
+    rrset = xcalloc(1, sizeof *rrset);
+    rrset->serial = SHADOW_NO_SERIAL;
+
+    map_set_shadow(shadow->rrsets, record, rrset);
+
+    return rrset;
+}
+
+static struct shadow_addr *shadow_rrset_find(struct shadow_rrset *rrset, const struct in6_addr *addr)
+{
+    for (size_t i = 0; i < rrset->used; i++)
+        if (memcmp(&rrset->addrs[i].addr, addr, sizeof *addr) == 0)
+            return &rrset->addrs[i];
+
+    return NULL;
+}
+
+void shadow_rrset_set(struct shadow_rrset *rrset, const struct in6_addr *addr,
+        bool present, uint32_t ttl)
+{
+    struct shadow_addr *entry = shadow_rrset_find(rrset, addr);
+
+    if (!entry) {
+        if (rrset->used == rrset->size) {
+            rrset->size = rrset->size ? rrset->size * 2 : 4;
+            rrset->addrs = xreallocarray(rrset->addrs, rrset->size, sizeof *rrset->addrs);
+        }
+
+        entry = &rrset->addrs[rrset->used++];
+        entry->addr = *addr;
+    }
+
+    entry->present = present;
+    entry->ttl = present ? ttl : 0;
+}
+
+struct shadow *shadow_new(void)
+{
+    struct shadow *shadow = xcalloc(1, sizeof *shadow);
+
+    map_ops(shadow) ops = {
+        .hash = (uint64_t (*)(ldns_rdf *))dns_dname_hash,
+        .compare = (int (*)(ldns_rdf *, ldns_rdf *))ldns_dname_compare,
+        .key_alloc = (ldns_rdf *(*)(ldns_rdf *))ldns_rdf_clone,
+        .key_free = ldns_rdf_deep_free,
+        .val_free = shadow_rrset_free
+    };
+
+    shadow->rrsets = map_new_shadow(4, ops);
+
+    return shadow;
+}
+
+void shadow_free(struct shadow *shadow)
+{
+    if (!shadow)
+        return;
+
+    map_free_shadow(shadow->rrsets);
+    free(shadow);
+}
+
+// Start over from an RRset known to be empty, at the given zone serial
+struct shadow_rrset *shadow_reset(struct shadow *shadow, ldns_rdf *record, int64_t serial)
+{
+    struct shadow_rrset *rrset = shadow_rrset(shadow, record, true);
+
+    rrset->used = 0;
+    rrset->complete = true;
+    rrset->serial = serial;
+
+    return rrset;
+}
+
+// Replace what is known about the record with the answer to an AAAA query
+void shadow_learn(struct shadow *shadow, ldns_rdf *record, const ldns_rr_list *answer, int64_t serial)
+{
+    struct shadow_rrset *rrset = shadow_reset(shadow, record, serial);
+
+    for (size_t i = 0; i < ldns_rr_list_rr_count(answer); i++) {
+        ldns_rr *rr = ldns_rr_list_rr(answer, i);
+        ldns_rdf *rdf = ldns_rr_a_address(rr);
+
+        // Skip anything along a CNAME chain
+        if (ldns_rr_get_type(rr) != LDNS_RR_TYPE_AAAA ||
+                ldns_dname_compare(ldns_rr_owner(rr), record) != 0 ||
+                ldns_rdf_size(rdf) != sizeof(struct in6_addr))
+            continue;
+
+        struct in6_addr addr;
+        memcpy(&addr, ldns_rdf_data(rdf), sizeof addr);
+
+        shadow_rrset_set(rrset, &addr, true, ldns_rr_ttl(rr));
+    }
+}
+
+// Called when the server state can no longer be trusted, e.g. after a failed UPDATE
+void shadow_forget(struct shadow *shadow, ldns_rdf *record)
+{
+    struct shadow_rrset *rrset = shadow_rrset(shadow, record, false);
+
+    if (!rrset)
+        return;
+
+    rrset->used = 0;
+    rrset->complete = false;
+    rrset->serial = SHADOW_NO_SERIAL;
+}
+
+struct shadow_rrset *shadow_get(struct shadow *shadow, ldns_rdf *record)
+{
+    return shadow_rrset(shadow, record, false);
+}
+
+bool shadow_redundant(struct shadow *shadow, ldns_rdf *record,
+        const struct in6_addr *addr, bool delete, uint32_t ttl)
+{
+    struct shadow_rrset *rrset = shadow_rrset(shadow, record, false);
+
+    if (!rrset)
+        return false;
+
+    struct shadow_addr *entry = shadow_rrset_find(rrset, addr);
+
+    if (!entry)
+        return delete && rrset->complete;
+
+    if (delete)
+        return !entry->present;
+
+    return entry->present && entry->ttl == ttl;
+}
+
+// Record the effect of an UPDATE that is about to be sent
+void shadow_apply(struct shadow *shadow, ldns_rdf *record,
+        const struct in6_addr *addr, bool delete, uint32_t ttl)
+{
+    struct shadow_rrset *rrset = shadow_rrset(shadow, record, true);
+
+    // All RRs in an RRset share the TTL of the last one added (RFC 2136, 3.4.2.2)
+    for (size_t i = 0; !delete && i < rrset->used; i++)
+        if (rrset->addrs[i].present)
+            rrset->addrs[i].ttl = ttl;
+
+    shadow_rrset_set(rrset, addr, !delete, ttl);
+}
+
+// An UPDATE touching the record is about to be sent. Returns true if the
+// record has not changed since the last snapshot until now.
+bool shadow_sent(struct shadow *shadow, ldns_rdf *record)
+{
+    struct shadow_rrset *rrset = shadow_rrset(shadow, record, true);
+    bool dirty = rrset->dirty;
+
+    rrset->inflight++;
+    rrset->dirty = true;
+
+    return !dirty;
+}
+
+// The server answered an UPDATE touching the record
+void shadow_done(struct shadow *shadow, ldns_rdf *record, bool ok)
+{
+    struct shadow_rrset *rrset = shadow_rrset(shadow, record, false);
+
+    if (!rrset)
+        return;
+
+    rrset->inflight--;
+
+    if (!ok)
+        shadow_forget(shadow, record);
+}
+
+bool shadow_foreach(struct shadow *shadow,
+        bool (*func)(ldns_rdf *record, struct shadow_rrset *rrset, void *arg), void *arg)
+{
+    return map_foreach_shadow(shadow->rrsets, func, arg);
+}
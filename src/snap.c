@@ -0,0 +1,535 @@
+#include <errno.h>
+#include <ctype.h>
+#include <fcntl.h>
+#include <string.h>
+#include <libgen.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "log.h"
+#include "map.h"
+#include "snap.h"
+#include "util.h"
+#include "shadow.h"
+#include "xalloc.h"
+
+#define SNAP_ALIGN(x, n) (((x) + (n) - 1) & ~(size_t)((n) - 1))
+
+// A snapshot record without addresses, used as a lookup key
+struct snap_key {
+    struct snap_rec rec;
+    uint8_t data[2 * UINT8_MAX];
+};
+
+struct snap_ent {
+    const struct snap_rec *rec;
+
+    // Changed after the snapshot was taken
+    bool journaled;
+};
+
+map_decl(conf_serv, uint64_t, const char *, conf_serv *);
+map_decl(snap, uint64_t, const struct snap_rec *, struct snap_ent *);
+
+// The snapshot holds the RRsets known when it was written, it is replaced
+// atomically and read through a read-only mapping. Every record touched by
+// an UPDATE afterwards is first appended to the journal, which is truncated
+// when the next snapshot has been written, so a record that is in the
+// snapshot and not in the journal is known not to have changed since.
+static struct snap_state {
+    char *path;
+    int journalfd;
+
+    void *base;
+    size_t size;
+    map(snap) *index;
+} state = { .journalfd = -1 };
+
+static const char *snap_rec_server(const struct snap_rec *rec)
+{
+    return (const char *)(rec + 1);
+}
+
+static const uint8_t *snap_rec_name(const struct snap_rec *rec)
+{
+    return (const uint8_t *)(rec + 1) + rec->servlen;
+}
+
+const struct snap_addr *snap_rec_addrs(const struct snap_rec *rec)
+{
+    return (const struct snap_addr *)((const uint8_t *)(rec + 1) +
+            SNAP_ALIGN(rec->servlen + rec->namelen, 4));
+}
+
+static size_t snap_rec_size(size_t servlen, size_t namelen, size_t naddrs)
+{
+    return SNAP_ALIGN(sizeof(struct snap_rec) + SNAP_ALIGN(servlen + namelen, 4) +
+            naddrs * sizeof(struct snap_addr), 8);
+}
+
+// The server name is compared as is, the record name case-insensitively
+static uint64_t snap_key_hash(const struct snap_rec *key)
+{
+    const uint8_t *data = (const uint8_t *)(key + 1);
+    uint64_t h = 0xcbf29ce484222325LLU;
+
+    for (size_t i = 0; i < (size_t)key->servlen + key->namelen; i++) {
+        h ^= i < key->servlen ? data[i] : tolower(data[i]);
+        h *= 0x100000001b3LLU;
+    }
+
+    return h;
+}
+
+static int snap_key_compare(const struct snap_rec *a, const struct snap_rec *b)
+{
+    if (a->servlen != b->servlen || a->namelen != b->namelen)
+        return 1;
+
+    if (memcmp(snap_rec_server(a), snap_rec_server(b), a->servlen) != 0)
+        return 1;
+
+    const uint8_t *x = snap_rec_name(a), *y = snap_rec_name(b);
+
+    for (size_t i = 0; i < a->namelen; i++)
+        if (tolower(x[i]) != tolower(y[i]))
+            return 1;
+
+    return 0;
+}
+
+static bool snap_key(struct snap_key *key, const char *server, const uint8_t *name, size_t namelen)
+{
+    size_t servlen = strlen(server);
+
+    if (servlen > UINT8_MAX || namelen > UINT8_MAX)
+        return false;
+
+    key->rec = (struct snap_rec) {
+        .servlen = servlen,
+        .namelen = namelen
+    };
+
+    memcpy(key->data, server, servlen);
+    memcpy(key->data + servlen, name, namelen);
+
+    return true;
+}
+
+static uint64_t snap_checksum(const uint8_t *data, size_t size)
+{
+    uint64_t h = 0xcbf29ce484222325LLU;
+
+    for (size_t i = 0; i < size; i++) {
+        h ^= data[i];
+        h *= 0x100000001b3LLU;
+    }
+
+    return h;
+}
+
+static bool snap_map(void)
+{
+    int fd = open(state.path, O_RDONLY | O_CLOEXEC);
+
+    if (fd < 0) {
+        if (errno != ENOENT)
+            log(LOG_WARNING, "Failed to open state file %s: %s", state.path, strerror(errno));
+
+        return false;
+    }
+
+    struct stat sb;
+
+    if (fstat(fd, &sb) < 0 || (size_t)sb.st_size < sizeof(struct snap_hdr)) {
+        close(fd);
+        return false;
+    }
+
+    void *base = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+
+    if (base == MAP_FAILED) {
+        log(LOG_WARNING, "Failed to map state file %s: %s", state.path, strerror(errno));
+        return false;
+    }
+
+    state.base = base;
+    state.size = sb.st_size;
+
+    const struct snap_hdr *hdr = base;
+
+    if (hdr->magic != SNAP_MAGIC || hdr->version != SNAP_VERSION || hdr->size != state.size ||
+            hdr->checksum != snap_checksum((const uint8_t *)(hdr + 1), state.size - sizeof *hdr)) {
+        log(LOG_WARNING, "Ignoring invalid or outdated state file %s", state.path);
+        return false;
+    }
+
+    map_ops(snap) ops = {
+        .hash = snap_key_hash,
+        .compare = snap_key_compare,
+        .val_free = (void (*)(struct snap_ent *))free
+    };
+
+    state.index = map_new_snap(4, ops);
+    map_reserve_snap(state.index, hdr->count);
+
+    size_t off = sizeof *hdr;
+
+    for (uint32_t i = 0; i < hdr->count; i++) {
+        const struct snap_rec *rec = (const struct snap_rec *)((const uint8_t *)base + off);
+
+        if (state.size - off < sizeof *rec)
+            return false;
+
+        size_t size = snap_rec_size(rec->servlen, rec->namelen, rec->naddrs);
+
+        if (state.size - off < size)
+            return false;
+
+        struct snap_ent *ent;
+
+        if (!map_get_snap(state.index, rec, &ent)) {
+            ent = xcalloc(1, sizeof *ent);
+            ent->rec = rec;
+
+            map_set_snap(state.index, rec, ent);
+        }
+
+        off += size;
+    }
+
+    return true;
+}
+
+static void snap_unmap(void)
+{
+    if (state.index)
+        map_free_snap(state.index);
+
+    if (state.base)
+        munmap(state.base, state.size);
+
+    state.index = NULL;
+    state.base = NULL;
+}
+
+// Each entry is the length of the server name and of the record name,
+// followed by both. A torn entry at the end is ignored.
+static void snap_read_journal(void)
+{
+    struct stat sb;
+
+    if (fstat(state.journalfd, &sb) < 0 || sb.st_size == 0)
+        return;
+
+    uint8_t *buf = xmalloc(sb.st_size);
+    ssize_t len = pread(state.journalfd, buf, sb.st_size, 0);
+
+    for (ssize_t off = 0; len > 0 && off + 2 <= len; ) {
+        size_t servlen = buf[off], namelen = buf[off + 1];
+
+        if (off + 2 + (ssize_t)(servlen + namelen) > len)
+            break;
+
+        struct snap_key key = {
+            .rec = {
+                .servlen = servlen,
+                .namelen = namelen
+            }
+        };
+
+        memcpy(key.data, buf + off + 2, servlen + namelen);
+
+        struct snap_ent *ent;
+
+        if (map_get_snap(state.index, &key.rec, &ent))
+            ent->journaled = true;
+
+        off += 2 + servlen + namelen;
+    }
+
+    free(buf);
+}
+
+void snap_open(const char *path)
+{
+    state.path = strdup(path);
+
+    if (!state.path)
+        die(EX_SOFTWARE, "Failed to allocate memory");
+
+    size_t pathlen = strlen(path);
+    char *journal = xmalloc(pathlen + sizeof ".journal");
+
+    concat(journal, path, pathlen, ".journal", sizeof ".journal" - 1);
+
+    state.journalfd = open(journal, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+    free(journal);
+
+    // Without a journal, a crash would leave a snapshot that can't be trusted
+    if (state.journalfd < 0) {
+        log(LOG_WARNING, "Failed to open state journal for %s: %s", path, strerror(errno));
+        snap_close();
+        return;
+    }
+
+    if (!snap_map()) {
+        snap_unmap();
+        return;
+    }
+
+    snap_read_journal();
+}
+
+void snap_close(void)
+{
+    snap_unmap();
+
+    if (state.journalfd >= 0)
+        close(state.journalfd);
+
+    free(state.path);
+
+    state.path = NULL;
+    state.journalfd = -1;
+}
+
+// Returns NULL if the record is not in the snapshot, or has changed since
+const struct snap_rec *snap_lookup(const char *server, const ldns_rdf *record)
+{
+    struct snap_key key;
+    struct snap_ent *ent;
+
+    if (!state.index || !snap_key(&key, server, ldns_rdf_data(record), ldns_rdf_size(record)))
+        return NULL;
+
+    if (!map_get_snap(state.index, &key.rec, &ent) || ent->journaled)
+        return NULL;
+
+    return ent->rec;
+}
+
+// Called before the first UPDATE touching a record after a snapshot is sent,
+// may be called from any thread
+void snap_journal(const char *server, const ldns_rdf *record)
+{
+    if (state.journalfd < 0)
+        return;
+
+    struct snap_key key;
+
+    if (!snap_key(&key, server, ldns_rdf_data(record), ldns_rdf_size(record)))
+        return;
+
+    uint8_t buf[2 + sizeof key.data];
+    size_t len = 2 + key.rec.servlen + key.rec.namelen;
+
+    buf[0] = key.rec.servlen;
+    buf[1] = key.rec.namelen;
+    memcpy(buf + 2, key.data, len - 2);
+
+    // A single write to a file opened with O_APPEND is not interleaved with others
+    if (write(state.journalfd, buf, len) != (ssize_t)len)
+        log(LOG_WARNING, "Failed to write to state journal: %s", strerror(errno));
+}
+
+struct snap_buf {
+    uint8_t *data;
+    size_t used, size;
+
+    const char *server;
+    uint32_t count;
+};
+
+static void *snap_buf_reserve(struct snap_buf *buf, size_t size)
+{
+    if (buf->size - buf->used < size) {
+        while (buf->size - buf->used < size)
+            buf->size = buf->size ? buf->size * 2 : 4096;
+
+        buf->data = xrealloc(buf->data, buf->size);
+    }
+
+    void *ret = buf->data + buf->used;
+
+    memset(ret, 0, size);
+    buf->used += size;
+
+    return ret;
+}
+
+// Only RRsets that are fully known and have no UPDATE pending are saved
+static bool snap_saveable(const struct shadow_rrset *rrset)
+{
+    return rrset->complete && rrset->inflight == 0;
+}
+
+static bool snap_save_rrset(ldns_rdf *record, struct shadow_rrset *rrset, void *arg)
+{
+    struct snap_buf *buf = arg;
+
+    size_t servlen = strlen(buf->server);
+    size_t namelen = ldns_rdf_size(record);
+    size_t naddrs = 0;
+
+    if (!snap_saveable(rrset) || servlen > UINT8_MAX || namelen > UINT8_MAX)
+        return true;
+
+    for (size_t i = 0; i < rrset->used; i++)
+        naddrs += rrset->addrs[i].present;
+
+    if (naddrs > UINT16_MAX)
+        return true;
+
+    // The buffer may move, so the record is only filled in afterwards
+    size_t off = buf->used;
+    snap_buf_reserve(buf, snap_rec_size(servlen, namelen, naddrs));
+
+    struct snap_rec *rec = (struct snap_rec *)(buf->data + off);
+
+    rec->serial = rrset->serial >= 0 ? rrset->serial : 0;
+    rec->flags = rrset->serial >= 0 ? SNAP_HAS_SERIAL : 0;
+    rec->naddrs = naddrs;
+    rec->servlen = servlen;
+    rec->namelen = namelen;
+
+    memcpy((uint8_t *)(rec + 1), buf->server, servlen);
+    memcpy((uint8_t *)(rec + 1) + servlen, ldns_rdf_data(record), namelen);
+
+    struct snap_addr *addrs = (struct snap_addr *)snap_rec_addrs(rec);
+
+    for (size_t i = 0, j = 0; i < rrset->used; i++) {
+        if (!rrset->addrs[i].present)
+            continue;
+
+        memcpy(addrs[j].addr, &rrset->addrs[i].addr, sizeof addrs[j].addr);
+        addrs[j].ttl = rrset->addrs[i].ttl;
+        j++;
+    }
+
+    buf->count++;
+
+    return true;
+}
+
+static bool snap_save_servconf(const char *key, conf_serv *servconf, void *arg)
+{
+    struct snap_buf *buf = arg;
+
+    if (!servconf->shadow)
+        return true;
+
+    buf->server = key;
+    shadow_foreach(servconf->shadow, snap_save_rrset, buf);
+
+    return true;
+}
+
+static bool snap_clean_rrset(ldns_rdf *record, struct shadow_rrset *rrset, void *arg)
+{
+    (void)record;
+    (void)arg;
+
+    if (snap_saveable(rrset))
+        rrset->dirty = false;
+
+    return true;
+}
+
+static bool snap_clean_servconf(const char *key, conf_serv *servconf, void *arg)
+{
+    (void)key;
+    (void)arg;
+
+    if (servconf->shadow)
+        shadow_foreach(servconf->shadow, snap_clean_rrset, NULL);
+
+    return true;
+}
+
+static bool snap_write(const char *path, const uint8_t *data, size_t size)
+{
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+
+    if (fd < 0)
+        return false;
+
+    while (size > 0) {
+        ssize_t ret = write(fd, data, size);
+
+        if (ret < 0) {
+            if (errno == EINTR)
+                continue;
+
+            close(fd);
+            return false;
+        }
+
+        data += ret;
+        size -= ret;
+    }
+
+    if (fsync(fd) < 0) {
+        close(fd);
+        return false;
+    }
+
+    return close(fd) == 0;
+}
+
+// Must not be called while other threads are sending updates
+void snap_save(struct conf *conf)
+{
+    if (!state.path)
+        return;
+
+    struct snap_buf buf = {0};
+    snap_buf_reserve(&buf, sizeof(struct snap_hdr));
+
+    map_foreach_conf_serv(conf->servers, snap_save_servconf, &buf);
+
+    struct snap_hdr *hdr = (struct snap_hdr *)buf.data;
+
+    hdr->magic = SNAP_MAGIC;
+    hdr->version = SNAP_VERSION;
+    hdr->size = buf.used;
+    hdr->count = buf.count;
+    hdr->checksum = snap_checksum(buf.data + sizeof *hdr, buf.used - sizeof *hdr);
+
+    size_t pathlen = strlen(state.path);
+    char *tmp = xmalloc(pathlen + sizeof ".tmp");
+
+    concat(tmp, state.path, pathlen, ".tmp", sizeof ".tmp" - 1);
+
+    if (!snap_write(tmp, buf.data, buf.used) || rename(tmp, state.path) < 0) {
+        log(LOG_WARNING, "Failed to write state file %s: %s", state.path, strerror(errno));
+        unlink(tmp);
+        goto out;
+    }
+
+    // Make the rename itself durable before the journal goes away
+    char *dir = strdup(state.path);
+
+    if (dir) {
+        int dirfd = open(dirname(dir), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+        if (dirfd >= 0) {
+            fsync(dirfd);
+            close(dirfd);
+        }
+
+        free(dir);
+    }
+
+    if (ftruncate(state.journalfd, 0) < 0)
+        log(LOG_WARNING, "Failed to truncate state journal: %s", strerror(errno));
+
+    map_foreach_conf_serv(conf->servers, snap_clean_servconf, NULL);
+
+out:
+    free(tmp);
+    free(buf.data);
+}
@@ -0,0 +1,310 @@
+#include <time.h>
+#include <ctype.h>
+#include <string.h>
+#include <strings.h>
+
+#include <openssl/evp.h>
+#include <openssl/core_names.h>
+#include <openssl/crypto.h>
+
+#include "log.h"
+#include "tsig.h"
+#include "xalloc.h"
+
+// Allowed clock skew between us and the server, in seconds
+#define TSIG_FUDGE 300
+
+#define TSIG_HDR_SIZE 12
+
+// RFC 8945 algorithm names, as used in `key-algo` with a trailing dot
+static const struct {
+    const char *name;
+    const char *digest;
+} tsig_algorithms[] = {
+    { "hmac-md5.sig-alg.reg.int.", "MD5" },
+    { "hmac-sha1.", "SHA1" },
+    { "hmac-sha224.", "SHA224" },
+    { "hmac-sha256.", "SHA256" },
+    { "hmac-sha384.", "SHA384" },
+    { "hmac-sha512.", "SHA512" },
+};
+
+// The key is decoded and set up once, each message only reinitializes the context
+struct tsig {
+    EVP_MAC *hmac;
+    EVP_MAC_CTX *ctx;
+
+    // Canonical (lowercase) wire format
+    uint8_t keyname[255];
+    size_t keynamelen;
+    uint8_t algorithm[255];
+    size_t algorithmlen;
+};
+
+static size_t tsig_dname_canonical(uint8_t *out, const char *str)
+{
+    ldns_rdf *dname = ldns_dname_new_frm_str(str);
+
+    if (!dname)
+        return 0;
+
+    size_t len = ldns_rdf_size(dname);
+    const uint8_t *data = ldns_rdf_data(dname);
+
+    // Label lengths are at most 63, so they are never changed
+    for (size_t i = 0; i < len; i++)
+        out[i] = tolower(data[i]);
+
+    ldns_rdf_deep_free(dname);
+
+    return len;
+}
+
+// Returns NULL if the algorithm is not supported
+struct tsig *tsig_new(ldns_tsig_credentials cred)
+{
+    const char *digest = NULL;
+
+    for (size_t i = 0; i < sizeof tsig_algorithms / sizeof tsig_algorithms[0]; i++)
+        if (strcasecmp(cred.algorithm, tsig_algorithms[i].name) == 0)
+            digest = tsig_algorithms[i].digest;
+
+    if (!digest)
+        return NULL;
+
+    struct tsig *tsig = xcalloc(1, sizeof *tsig);
+
+    tsig->keynamelen = tsig_dname_canonical(tsig->keyname, cred.keyname);
+    tsig->algorithmlen = tsig_dname_canonical(tsig->algorithm, cred.algorithm);
+
+    size_t secretsize = ldns_b64_pton_calculate_size(strlen(cred.keydata));
+    uint8_t *secret = xmalloc(secretsize ? secretsize : 1);
+    int secretlen = ldns_b64_pton(cred.keydata, secret, secretsize);
+
+    OSSL_PARAM params[] = {
+        OSSL_PARAM_construct_utf8_string(OSSL_MAC_PARAM_DIGEST, (char *)digest, 0),
+        OSSL_PARAM_construct_end()
+    };
+
+    tsig->hmac = EVP_MAC_fetch(NULL, "HMAC", NULL);
+    tsig->ctx = tsig->hmac ? EVP_MAC_CTX_new(tsig->hmac) : NULL;
+
+    if (!tsig->keynamelen || !tsig->algorithmlen || secretlen <= 0 || !tsig->ctx ||
+            !EVP_MAC_init(tsig->ctx, secret, secretlen, params)) {
+        OPENSSL_cleanse(secret, secretsize);
+        free(secret);
+        tsig_free(tsig);
+
+        return NULL;
+    }
+
+    OPENSSL_cleanse(secret, secretsize);
+    free(secret);
+
+    return tsig;
+}
+
+void tsig_free(struct tsig *tsig)
+{
+    if (!tsig)
+        return;
+
+    EVP_MAC_CTX_free(tsig->ctx);
+    EVP_MAC_free(tsig->hmac);
+    free(tsig);
+}
+
+static void put16(uint8_t *p, uint16_t v)
+{
+    p[0] = v >> 8;
+    p[1] = v & 0xff;
+}
+
+static uint16_t get16(const uint8_t *p)
+{
+    return (uint16_t)p[0] << 8 | p[1];
+}
+
+static void put48(uint8_t *p, uint64_t v)
+{
+    for (int i = 5; i >= 0; i--, v >>= 8)
+        p[i] = v & 0xff;
+}
+
+// Digests the TSIG variables that follow the message, RFC 8945 section 4.3.3
+static void tsig_digest_vars(struct tsig *tsig, const uint8_t *timefudge,
+        const uint8_t *errother, size_t errotherlen)
+{
+    static const uint8_t classttl[6] = { 0, LDNS_RR_CLASS_ANY, 0, 0, 0, 0 };
+
+    EVP_MAC_update(tsig->ctx, tsig->keyname, tsig->keynamelen);
+    EVP_MAC_update(tsig->ctx, classttl, sizeof classttl);
+    EVP_MAC_update(tsig->ctx, tsig->algorithm, tsig->algorithmlen);
+    EVP_MAC_update(tsig->ctx, timefudge, 8);
+    EVP_MAC_update(tsig->ctx, errother, errotherlen);
+}
+
+// Signs the message in `wire`, which has room for `size` bytes, by appending
+// a TSIG RR. Returns the new length, or 0 if it doesn't fit. The MAC is
+// copied to `mac`, for the reply to be verified against.
+size_t tsig_sign(struct tsig *tsig, uint8_t *wire, size_t len, size_t size,
+        uint8_t *mac, size_t *maclen)
+{
+    if (len < TSIG_HDR_SIZE || size - len < TSIG_MAX_SIZE)
+        return 0;
+
+    uint8_t timefudge[8];
+    put48(timefudge, time(NULL));
+    put16(timefudge + 6, TSIG_FUDGE);
+
+    // Error and other length, both zero in requests
+    static const uint8_t errother[4] = {0};
+
+    EVP_MAC_init(tsig->ctx, NULL, 0, NULL);
+    EVP_MAC_update(tsig->ctx, wire, len);
+    tsig_digest_vars(tsig, timefudge, errother, sizeof errother);
+
+    if (!EVP_MAC_final(tsig->ctx, mac, maclen, TSIG_MAX_MAC))
+        return 0;
+
+    uint8_t *p = wire + len;
+
+    memcpy(p, tsig->keyname, tsig->keynamelen);
+    p += tsig->keynamelen;
+
+    put16(p, LDNS_RR_TYPE_TSIG);
+    put16(p + 2, LDNS_RR_CLASS_ANY);
+    memset(p + 4, 0, 4);
+    put16(p + 8, tsig->algorithmlen + 16 + *maclen);
+    p += 10;
+
+    memcpy(p, tsig->algorithm, tsig->algorithmlen);
+    p += tsig->algorithmlen;
+
+    memcpy(p, timefudge, sizeof timefudge);
+    put16(p + 8, *maclen);
+    p += 10;
+
+    memcpy(p, mac, *maclen);
+    p += *maclen;
+
+    // Original ID, then the error and other length
+    memcpy(p, wire, 2);
+    memcpy(p + 2, errother, sizeof errother);
+    p += 6;
+
+    put16(wire + 10, get16(wire + 10) + 1);
+
+    return p - wire;
+}
+
+// Returns the offset right after the name at `off`, or 0 if it is malformed
+static size_t tsig_skip_name(const uint8_t *wire, size_t len, size_t off)
+{
+    while (off < len) {
+        uint8_t label = wire[off];
+
+        if ((label & 0xc0) == 0xc0)
+            return off + 2 <= len ? off + 2 : 0;
+
+        if (label & 0xc0)
+            return 0;
+
+        off += label + 1;
+
+        if (label == 0)
+            return off;
+    }
+
+    return 0;
+}
+
+// Checks the TSIG RR at the end of a reply against the MAC of the request
+bool tsig_verify(struct tsig *tsig, const uint8_t *wire, size_t len,
+        const uint8_t *reqmac, size_t reqmaclen)
+{
+    if (len < TSIG_HDR_SIZE || get16(wire + 10) == 0)
+        return false;
+
+    size_t qdcount = get16(wire + 4);
+    size_t rrcount = (size_t)get16(wire + 6) + get16(wire + 8) + get16(wire + 10);
+    size_t off = TSIG_HDR_SIZE, rr = 0;
+
+    for (size_t i = 0; i < qdcount; i++) {
+        off = tsig_skip_name(wire, len, off);
+
+        if (!off || (off += 4) > len)
+            return false;
+    }
+
+    // The TSIG RR has to be the last one
+    for (size_t i = 0; i < rrcount; i++) {
+        rr = off;
+        off = tsig_skip_name(wire, len, off);
+
+        if (!off || off + 10 > len || off + 10 + get16(wire + off + 8) > len)
+            return false;
+
+        off += 10 + get16(wire + off + 8);
+    }
+
+    if (off != len)
+        return false;
+
+    size_t rdata = tsig_skip_name(wire, len, rr);
+
+    if (get16(wire + rdata) != LDNS_RR_TYPE_TSIG)
+        return false;
+
+    size_t rdend = rdata + 10 + get16(wire + rdata + 8);
+    size_t alg = rdata + 10;
+    size_t algend = tsig_skip_name(wire, rdend, alg);
+
+    if (!algend || algend - alg != tsig->algorithmlen)
+        return false;
+
+    for (size_t i = 0; i < tsig->algorithmlen; i++)
+        if (tolower(wire[alg + i]) != tsig->algorithm[i])
+            return false;
+
+    if (algend + 10 > rdend)
+        return false;
+
+    const uint8_t *timefudge = wire + algend;
+    size_t maclen = get16(wire + algend + 8);
+    size_t macoff = algend + 10;
+
+    if (macoff + maclen + 6 > rdend || maclen == 0 || maclen > TSIG_MAX_MAC)
+        return false;
+
+    const uint8_t *origid = wire + macoff + maclen;
+    const uint8_t *errother = origid + 2;
+
+    // A non-zero error means the server didn't accept our signature
+    if (get16(errother) != 0)
+        return false;
+
+    uint8_t prefix[2 + TSIG_MAX_MAC];
+    put16(prefix, reqmaclen);
+    memcpy(prefix + 2, reqmac, reqmaclen);
+
+    // The reply is digested as it was before the TSIG RR was added
+    uint8_t hdr[TSIG_HDR_SIZE];
+    memcpy(hdr, wire, sizeof hdr);
+    memcpy(hdr, origid, 2);
+    put16(hdr + 10, get16(wire + 10) - 1);
+
+    uint8_t calc[EVP_MAX_MD_SIZE];
+    size_t calclen;
+
+    EVP_MAC_init(tsig->ctx, NULL, 0, NULL);
+    EVP_MAC_update(tsig->ctx, prefix, 2 + reqmaclen);
+    EVP_MAC_update(tsig->ctx, hdr, sizeof hdr);
+    EVP_MAC_update(tsig->ctx, wire + sizeof hdr, rr - sizeof hdr);
+    tsig_digest_vars(tsig, timefudge, errother, rdend - (errother - wire));
+
+    if (!EVP_MAC_final(tsig->ctx, calc, &calclen, sizeof calc))
+        return false;
+
+    return calclen == maclen && CRYPTO_memcmp(calc, wire + macoff, maclen) == 0;
+}
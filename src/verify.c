@@ -0,0 +1,185 @@
+#include <string.h>
+
+#include "log.h"
+#include "dns.h"
+#include "chan.h"
+#include "util.h"
+#include "batch.h"
+#include "shadow.h"
+#include "verify.h"
+#include "xalloc.h"
+
+// Records touched by successful UPDATEs are queried again, and the answer is
+// compared with what the shadow expects. Records collected within the same
+// loop iteration are queried together, and the queries share the server's
+// channel with the UPDATEs, so nothing waits on them.
+struct verify {
+    conf_serv *server;
+    struct loop *loop;
+    struct loop_timer timer;
+
+    conf_if **pending;
+    size_t used, size;
+};
+
+static void verify_timer_cb(struct loop_timer *timer);
+
+struct verify *verify_new(conf_serv *servconf, struct loop *loop)
+{
+    struct verify *verify = xcalloc(1, sizeof *verify);
+
+    verify->server = servconf;
+    verify->loop = loop;
+
+    loop_timer_init(&verify->timer, verify_timer_cb, verify);
+
+    return verify;
+}
+
+static void verify_query_cb(ldns_pkt *reply, ldns_status status, void *arg);
+
+void verify_free(struct verify *verify)
+{
+    if (!verify)
+        return;
+
+    if (loop_timer_armed(&verify->timer)) {
+        loop_timer_disarm(verify->loop, &verify->timer);
+        loop_unref(verify->loop);
+    }
+
+    chan_cancel(verify->server->chan, verify_query_cb);
+
+    free(verify->pending);
+    free(verify);
+}
+
+// Whether the next successful UPDATE should be verified, so that only
+// the configured percentage of them costs an extra query per record
+bool verify_sample(const struct verify *verify)
+{
+    return ldns_get_random() % 100 < verify->server->verify_ratio;
+}
+
+void verify_add(struct verify *verify, conf_if *ifconf)
+{
+    for (size_t i = 0; i < verify->used; i++) {
+        ldns_rdf *record = verify->pending[i]->record;
+
+        if (record == ifconf->record || ldns_dname_compare(record, ifconf->record) == 0)
+            return;
+    }
+
+    if (verify->used == verify->size) {
+        verify->size = verify->size ? verify->size * 2 : 4;
+        verify->pending = xreallocarray(verify->pending, verify->size, sizeof *verify->pending);
+    }
+
+    verify->pending[verify->used++] = ifconf;
+
+    // Sent on the next loop iteration, along with anything else answered by then
+    if (!loop_timer_armed(&verify->timer)) {
+        loop_ref(verify->loop);
+        loop_timer_arm(verify->loop, &verify->timer, clock_ms());
+    }
+}
+
+static bool verify_answer_has(ldns_rr_list *answer, ldns_rdf *record, const struct in6_addr *addr)
+{
+    for (size_t i = 0; i < ldns_rr_list_rr_count(answer); i++) {
+        ldns_rr *rr = ldns_rr_list_rr(answer, i);
+        ldns_rdf *rdf = ldns_rr_a_address(rr);
+
+        if (ldns_rr_get_type(rr) != LDNS_RR_TYPE_AAAA ||
+                ldns_dname_compare(ldns_rr_owner(rr), record) != 0 ||
+                ldns_rdf_size(rdf) != sizeof *addr)
+            continue;
+
+        if (memcmp(ldns_rdf_data(rdf), addr, sizeof *addr) == 0)
+            return true;
+    }
+
+    return false;
+}
+
+// Learn what the server actually holds, and send only the changes it is missing again
+static void verify_correct(conf_if *ifconf, struct shadow_rrset *rrset, ldns_rr_list *answer)
+{
+    struct shadow *shadow = ifconf->server->shadow;
+    size_t count = rrset->used;
+
+    struct shadow_addr *expected = xmalloc(count * sizeof *expected);
+    memcpy(expected, rrset->addrs, count * sizeof *expected);
+
+    shadow_learn(shadow, ifconf->record, answer, SHADOW_NO_SERIAL);
+
+    for (size_t i = 0; i < count; i++) {
+        struct sockaddr_in6 addr = {
+            .sin6_family = AF_INET6,
+            .sin6_addr = expected[i].addr
+        };
+
+        if (!shadow_redundant(shadow, ifconf->record, &addr.sin6_addr,
+                    !expected[i].present, expected[i].ttl))
+            batch_add(ifconf, &addr, !expected[i].present, expected[i].ttl);
+    }
+
+    free(expected);
+}
+
+static void verify_query_cb(ldns_pkt *reply, ldns_status status, void *arg)
+{
+    conf_if *ifconf = arg;
+    struct shadow *shadow = ifconf->server->shadow;
+
+    // Nothing can be told from a failed query
+    if (!dns_reply_ok(reply, status))
+        return;
+
+    struct shadow_rrset *rrset = shadow_get(shadow, ifconf->record);
+
+    // A newer UPDATE is on its way, and the answer may predate it
+    if (!rrset || rrset->inflight)
+        return;
+
+    ldns_rr_list *answer = ldns_pkt_answer(reply);
+
+    for (size_t i = 0; i < rrset->used; i++) {
+        struct shadow_addr *entry = &rrset->addrs[i];
+
+        if (entry->present == verify_answer_has(answer, ifconf->record, &entry->addr))
+            continue;
+
+        log(LOG_WARNING, "Record for %s on server %s does not match what was sent, "
+                "updating it again", ifconf->name, ifconf->server->name);
+
+        verify_correct(ifconf, rrset, answer);
+        return;
+    }
+}
+
+static void verify_timer_cb(struct loop_timer *timer)
+{
+    struct verify *verify = timer->arg;
+    struct chan *chan = verify->server->chan;
+
+    loop_unref(verify->loop);
+
+    for (size_t i = 0; i < verify->used; i++) {
+        conf_if *ifconf = verify->pending[i];
+        ldns_pkt *querypkt = ldns_pkt_query_new(ldns_rdf_clone(ifconf->record),
+                LDNS_RR_TYPE_AAAA, LDNS_RR_CLASS_IN, LDNS_RD);
+
+        if (!querypkt)
+            die(EX_SOFTWARE, "Failed to allocate memory");
+
+        ldns_status ret = chan_send(chan, querypkt, verify_query_cb, ifconf);
+
+        if (ret != LDNS_STATUS_OK)
+            log(LOG_WARNING, "Failed to query DNS server: %s", ldns_get_errorstr_by_id(ret));
+
+        ldns_pkt_free(querypkt);
+    }
+
+    verify->used = 0;
+}
@@ -0,0 +1,249 @@
+#include <errno.h>
+#include <string.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "log.h"
+#include "map.h"
+#include "chan.h"
+#include "loop.h"
+#include "ring.h"
+#include "util.h"
+#include "batch.h"
+#include "retry.h"
+#include "nscache.h"
+#include "verify.h"
+#include "worker.h"
+#include "xalloc.h"
+
+map_decl(conf_serv, uint64_t, const char *, conf_serv *);
+
+// Each server is owned by a worker thread running its own event loop,
+// fed through a ring by the thread that reads from the Netlink socket
+struct worker {
+    const char *name;
+    conf_serv *server;
+
+    pthread_t thread;
+    struct loop *loop;
+    struct ring *ring;
+    struct loop_io io;
+
+    atomic_bool stop;
+    // Whether to wait for the answers to in-flight UPDATEs when stopping,
+    // for at most `timeout` milliseconds
+    atomic_bool drain;
+    uint32_t timeout;
+};
+
+static void worker_recv(struct loop_io *io, uint32_t events)
+{
+    (void)events;
+
+    struct worker *worker = io->arg;
+    struct addr_event ev;
+
+    do {
+        while (ring_pop(worker->ring, &ev))
+            batch_add_at(ev.ifconf, &ev.addr, ev.delete, ev.ttl, ev.time, ev.event);
+    } while (ring_arm(worker->ring));
+}
+
+static void *worker_run(void *arg)
+{
+    struct worker *worker = arg;
+
+    // The ring is woken up when `stop` is set
+    while (!atomic_load(&worker->stop))
+        loop_once(worker->loop);
+
+    // Changes pushed right before `stop` was set
+    worker_recv(&worker->io, 0);
+
+    // Send whatever is still being coalesced
+    batch_flush(worker->server->batch);
+
+    if (!atomic_load(&worker->drain))
+        return NULL;
+
+    // A dead server would otherwise hold up a reload for as long as its
+    // requests are retried. Changes held back until then are sent once the
+    // others fail, and failed in turn.
+    int64_t deadline = clock_ms() + worker->timeout;
+
+    if (!loop_drain_until(worker->loop, deadline)) {
+        log(LOG_WARNING, "Timed out waiting for answers from server %s, "
+                "failing what is still in flight", worker->name);
+
+        do
+            conf_cancel_serv(worker->server);
+        while (!loop_drain_until(worker->loop, deadline));
+    }
+
+    return NULL;
+}
+
+static bool worker_start_servconf(const char *key, conf_serv *servconf, void *arg)
+{
+    struct conf *conf = arg;
+    struct worker *worker = xcalloc(1, sizeof *worker);
+
+    worker->name = key;
+    worker->server = servconf;
+    worker->loop = loop_new();
+    worker->ring = ring_new(conf->ringsize, sizeof(struct addr_event));
+    worker->timeout = conf->synctimeout;
+
+    atomic_init(&worker->stop, false);
+    atomic_init(&worker->drain, false);
+
+    loop_io_init(&worker->io, ring_fd(worker->ring), worker_recv, worker);
+    loop_io_start(worker->loop, &worker->io, EPOLLIN);
+    ring_arm(worker->ring);
+
+    // The channel and batch move from the main loop to the worker's loop,
+    // this happens before the thread starts and after the startup
+    // synchronization has completed, so nothing can be pending. Changes
+    // that failed during the synchronization are kept for retrying.
+    nscache_free(servconf->nscache);
+    verify_free(servconf->verify);
+    batch_free(servconf->batch);
+    chan_free(servconf->chan);
+
+    servconf->chan = chan_new(servconf->resolv, servconf->tsig, worker->loop, servconf->tcp_idle);
+    servconf->batch = batch_new(servconf, worker->loop);
+    servconf->nscache = nscache_new(servconf, worker->loop);
+    servconf->verify = servconf->verify_ratio ? verify_new(servconf, worker->loop) : NULL;
+    servconf->worker = worker;
+
+    if (servconf->retry)
+        retry_set_loop(servconf->retry, worker->loop);
+
+    int ret = pthread_create(&worker->thread, NULL, worker_run, worker);
+
+    if (ret != 0)
+        die(EX_OSERR, "Failed to create worker thread for server %s: %s", key, strerror(ret));
+
+    return true;
+}
+
+// All workers are told to stop before waiting for any, so that they drain
+// at the same time
+static bool worker_signal_servconf(const char *key, conf_serv *servconf, void *arg)
+{
+    (void)key;
+
+    bool *drain = arg;
+    struct worker *worker = servconf->worker;
+
+    if (!worker)
+        return true;
+
+    atomic_store(&worker->drain, *drain);
+    atomic_store(&worker->stop, true);
+    ring_wake(worker->ring);
+
+    return true;
+}
+
+static bool worker_stop_servconf(const char *key, conf_serv *servconf, void *arg)
+{
+    (void)key;
+    (void)arg;
+
+    struct worker *worker = servconf->worker;
+
+    if (!worker)
+        return true;
+
+    pthread_join(worker->thread, NULL);
+
+    // Everything owned by the worker's loop has to go before it, changes
+    // waiting to be retried are kept for whichever loop comes next
+    nscache_free(servconf->nscache);
+    verify_free(servconf->verify);
+    batch_free(servconf->batch);
+    chan_free(servconf->chan);
+
+    if (servconf->retry)
+        retry_set_loop(servconf->retry, NULL);
+
+    servconf->nscache = NULL;
+    servconf->verify = NULL;
+    servconf->batch = NULL;
+    servconf->chan = NULL;
+    servconf->worker = NULL;
+
+    loop_free(worker->loop);
+    ring_free(worker->ring);
+    free(worker);
+
+    return true;
+}
+
+static bool worker_log_servconf(const char *key, conf_serv *servconf, void *arg)
+{
+    (void)arg;
+
+    if (!servconf->worker)
+        return true;
+
+    struct ring_stats stats;
+    ring_stats(servconf->worker->ring, &stats);
+
+    log(LOG_INFO, "Ring for server %s: depth %zu/%zu, high-water %zu, "
+            "pushed %llu, dropped %llu", key, stats.depth, stats.size, stats.highwater,
+            (unsigned long long)stats.pushed, (unsigned long long)stats.dropped);
+
+    return true;
+}
+
+void worker_start(struct conf *conf)
+{
+    map_foreach_conf_serv(conf->servers, worker_start_servconf, conf);
+}
+
+// With `drain`, workers wait for the answers to the UPDATEs they have
+// sent before stopping, for at most the sync timeout, after which those
+// are failed and kept for retrying. Otherwise those are dropped without calling
+// anything back, which leaves them counted as in flight by the batch and
+// the shadow records, so that is only meant for exiting.
+void worker_stop(struct conf *conf, bool drain)
+{
+    map_foreach_conf_serv(conf->servers, worker_signal_servconf, &drain);
+    map_foreach_conf_serv(conf->servers, worker_stop_servconf, NULL);
+}
+
+// Called from the Netlink thread, never blocks
+bool worker_push(conf_if *ifconf, const struct sockaddr_in6 *addr, bool delete,
+        uint32_t ttl, uint64_t event)
+{
+    struct worker *worker = ifconf->server->worker;
+
+    struct addr_event ev = {
+        .ifconf = ifconf,
+        .addr = *addr,
+        .ttl = ttl,
+        .delete = delete,
+        .time = clock_ns(),
+        .event = event
+    };
+
+    if (ring_push(worker->ring, &ev))
+        return true;
+
+    struct ring_stats stats;
+    ring_stats(worker->ring, &stats);
+
+    // Warn on the first drop and then every time the count doubles
+    if ((stats.dropped & (stats.dropped - 1)) == 0)
+        log(LOG_WARNING, "Ring for server %s is full, %llu event(s) deferred so far",
+                worker->name, (unsigned long long)stats.dropped);
+
+    return false;
+}
+
+void worker_log_stats(struct conf *conf)
+{
+    map_foreach_conf_serv(conf->servers, worker_log_servconf, NULL);
+}
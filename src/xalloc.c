@@ -7,3 +7,11 @@
 XALLOC(malloc, PARAM(size_t size), PARAM(size));
 XALLOC(calloc, PARAM(size_t nmemb, size_t size), PARAM(nmemb, size));
 XALLOC(realloc, PARAM(void *ptr, size_t size), PARAM(ptr, size));
+
+void *xreallocarray(void *ptr, size_t nmemb, size_t size)
+{
+    if (size && nmemb > SIZE_MAX / size)
+        die(EX_SOFTWARE, "Failed to allocate memory");
+
+    return xrealloc(ptr, nmemb * size);
+}
@@ -0,0 +1,359 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include "map.h"
+#include "pcg.h"
+#include "hash.h"
+#include "util.h"
+
+// Prints one JSON object per line, for example:
+//
+//   {"bench":"hit","keys":"str","n":1024,"ops":1048576,"ns_per_op":12.34}
+//
+// Throughput results are averaged over at least BENCH_MIN_OPS operations,
+// latency results give percentiles of single operations. For the hash
+// functions, `n` is the length of the input in bytes.
+
+map_decl(str, uint64_t, const char *, uint64_t);
+map_decl(ptr, uint64_t, const void *, uint64_t);
+
+#define BENCH_MIN_OPS (1 << 20)
+#define BENCH_MAX_SIZE (1 << 20)
+#define BENCH_LATENCY_SAMPLES 4096
+
+// Keys are 8 to 40 characters long, like interface and server names
+#define BENCH_KEY_MIN 8
+#define BENCH_KEY_MAX 40
+
+// Pointer keys point into an array of these, like the configuration structs
+struct bench_obj {
+    uint8_t pad[48];
+};
+
+static pcg32_random_t rng;
+static volatile uint64_t sink;
+
+static size_t bench_reps(size_t n)
+{
+    return n >= BENCH_MIN_OPS ? 1 : (BENCH_MIN_OPS + n - 1) / n;
+}
+
+static void report(const char *bench, const char *keys, size_t n, size_t ops, int64_t ns)
+{
+    printf("{\"bench\":\"%s\",\"keys\":\"%s\",\"n\":%zu,\"ops\":%zu,\"ns_per_op\":%.2f}\n",
+            bench, keys, n, ops, (double)ns / ops);
+}
+
+static int compare_i64(const void *a, const void *b)
+{
+    int64_t x = *(const int64_t *)a, y = *(const int64_t *)b;
+
+    return (x > y) - (x < y);
+}
+
+// Cost of reading the clock, subtracted from single-operation timings
+static int64_t clock_overhead(void)
+{
+    int64_t samples[BENCH_LATENCY_SAMPLES];
+
+    for (size_t i = 0; i < BENCH_LATENCY_SAMPLES; i++) {
+        int64_t start = clock_ns();
+        samples[i] = clock_ns() - start;
+    }
+
+    qsort(samples, BENCH_LATENCY_SAMPLES, sizeof *samples, compare_i64);
+
+    return samples[BENCH_LATENCY_SAMPLES / 2];
+}
+
+static void report_latency(const char *bench, const char *keys, size_t n,
+        int64_t *samples, int64_t overhead)
+{
+    qsort(samples, BENCH_LATENCY_SAMPLES, sizeof *samples, compare_i64);
+
+    int64_t p50 = samples[BENCH_LATENCY_SAMPLES / 2] - overhead;
+    int64_t p99 = samples[BENCH_LATENCY_SAMPLES * 99 / 100] - overhead;
+
+    printf("{\"bench\":\"%s\",\"keys\":\"%s\",\"n\":%zu,\"samples\":%d,"
+            "\"p50_ns\":%" PRId64 ",\"p99_ns\":%" PRId64 "}\n",
+            bench, keys, n, BENCH_LATENCY_SAMPLES, p50 > 0 ? p50 : 0, p99 > 0 ? p99 : 0);
+}
+
+static void shuffle(size_t *order, size_t n)
+{
+    for (size_t i = 0; i < n; i++)
+        order[i] = i;
+
+    for (size_t i = n - 1; i > 0; i--) {
+        size_t j = pcg32_random_r(&rng) % (i + 1);
+        size_t tmp = order[i];
+
+        order[i] = order[j];
+        order[j] = tmp;
+    }
+}
+
+static bool sum_cb(const void *key, uint64_t val, void *arg)
+{
+    (void)key;
+
+    *(uint64_t *)arg += val;
+    return true;
+}
+
+static bool sum_str_cb(const char *key, uint64_t val, void *arg)
+{
+    return sum_cb(key, val, arg);
+}
+
+// The same set of benchmarks for both kinds of keys. `keys` holds the `n`
+// keys that are inserted, followed by `n` keys that are not.
+#define BENCH_MAP(name, Tk) \
+static void bench_##name(const char *kind, struct map_ops_##name ops, Tk *keys, size_t n, \
+        size_t *order, int64_t overhead) \
+{ \
+    size_t reps = bench_reps(n); \
+    int64_t ns = 0; \
+    \
+    for (size_t r = 0; r < reps; r++) { \
+        int64_t start = clock_ns(); \
+        struct map_##name *map = map_new_##name(4, ops); \
+        \
+        for (size_t i = 0; i < n; i++) \
+            map_set_##name(map, keys[i], i); \
+        \
+        ns += clock_ns() - start; \
+        map_free_##name(map); \
+    } \
+    \
+    report("insert", kind, n, n * reps, ns); \
+    ns = 0; \
+    \
+    for (size_t r = 0; r < reps; r++) { \
+        int64_t start = clock_ns(); \
+        struct map_##name *map = map_new_##name(4, ops); \
+        \
+        map_reserve_##name(map, n); \
+        \
+        for (size_t i = 0; i < n; i++) \
+            map_set_##name(map, keys[i], i); \
+        \
+        ns += clock_ns() - start; \
+        map_free_##name(map); \
+    } \
+    \
+    report("insert_reserved", kind, n, n * reps, ns); \
+    ns = 0; \
+    \
+    /* Per entry moved, doubling a map that is as full as it gets */ \
+    for (size_t r = 0; r < reps; r++) { \
+        struct map_##name *map = map_new_##name(4, ops); \
+        \
+        for (size_t i = 0; i < n; i++) \
+            map_set_##name(map, keys[i], i); \
+        \
+        int64_t start = clock_ns(); \
+        map_resize_##name(map, map->size * 2); \
+        ns += clock_ns() - start; \
+        \
+        map_free_##name(map); \
+    } \
+    \
+    report("resize", kind, n, n * reps, ns); \
+    \
+    struct map_##name *map = map_new_##name(4, ops); \
+    \
+    for (size_t i = 0; i < n; i++) \
+        map_set_##name(map, keys[i], i); \
+    \
+    shuffle(order, n); \
+    \
+    uint64_t res, sum = 0; \
+    int64_t start = clock_ns(); \
+    \
+    for (size_t r = 0; r < reps; r++) \
+        for (size_t i = 0; i < n; i++) \
+            sum += map_get_##name(map, keys[order[i]], &res); \
+    \
+    report("hit", kind, n, n * reps, clock_ns() - start); \
+    start = clock_ns(); \
+    \
+    for (size_t r = 0; r < reps; r++) \
+        for (size_t i = 0; i < n; i++) \
+            sum += map_get_##name(map, keys[n + order[i]], &res); \
+    \
+    report("miss", kind, n, n * reps, clock_ns() - start); \
+    start = clock_ns(); \
+    \
+    for (size_t r = 0; r < reps; r++) \
+        map_foreach_##name(map, name##_sum, &sum); \
+    \
+    report("iterate", kind, n, n * reps, clock_ns() - start); \
+    \
+    int64_t samples[BENCH_LATENCY_SAMPLES]; \
+    \
+    for (size_t i = 0; i < BENCH_LATENCY_SAMPLES; i++) { \
+        Tk key = keys[order[i % n]]; \
+        \
+        start = clock_ns(); \
+        sum += map_get_##name(map, key, &res); \
+        samples[i] = clock_ns() - start; \
+    } \
+    \
+    report_latency("hit_latency", kind, n, samples, overhead); \
+    \
+    for (size_t i = 0; i < BENCH_LATENCY_SAMPLES; i++) { \
+        Tk key = keys[n + order[i % n]]; \
+        \
+        start = clock_ns(); \
+        sum += map_get_##name(map, key, &res); \
+        samples[i] = clock_ns() - start; \
+    } \
+    \
+    report_latency("miss_latency", kind, n, samples, overhead); \
+    map_free_##name(map); \
+    ns = 0; \
+    \
+    for (size_t r = 0; r < reps; r++) { \
+        map = map_new_##name(4, ops); \
+        \
+        for (size_t i = 0; i < n; i++) \
+            map_set_##name(map, keys[i], i); \
+        \
+        start = clock_ns(); \
+        \
+        for (size_t i = 0; i < n; i++) \
+            map_del_##name(map, keys[order[i]]); \
+        \
+        ns += clock_ns() - start; \
+        map_free_##name(map); \
+    } \
+    \
+    report("delete", kind, n, n * reps, ns); \
+    sink += sum; \
+}
+
+#define str_sum sum_str_cb
+#define ptr_sum sum_cb
+
+BENCH_MAP(str, const char *)
+BENCH_MAP(ptr, const void *)
+
+static char *random_key(void)
+{
+    static const char chars[] = "abcdefghijklmnopqrstuvwxyz0123456789-.";
+
+    size_t len = BENCH_KEY_MIN + pcg32_random_r(&rng) % (BENCH_KEY_MAX - BENCH_KEY_MIN + 1);
+    char *key = xmalloc(len + 1);
+
+    for (size_t i = 0; i < len; i++)
+        key[i] = chars[pcg32_random_r(&rng) % (sizeof chars - 1)];
+
+    key[len] = 0;
+
+    return key;
+}
+
+static void bench_hashes(void)
+{
+    static const size_t lens[] = { 4, 8, 16, 32, 64, 128, 256, 1024, 4096 };
+    uint8_t *buf = xmalloc(4096 + 64);
+
+    for (size_t i = 0; i < 4096 + 64; i++)
+        buf[i] = pcg32_random_r(&rng);
+
+    for (size_t l = 0; l < sizeof lens / sizeof *lens; l++) {
+        size_t len = lens[l];
+        size_t ops = BENCH_MIN_OPS * 16 / len;
+        uint64_t sum = 0;
+
+        // The offset changes so that the hash can't be hoisted out of the loop
+        int64_t start = clock_ns();
+
+        for (size_t i = 0; i < ops; i++)
+            sum += murmurhash64a_len(buf + (i & 63), len);
+
+        report("hash_murmur", "bytes", len, ops, clock_ns() - start);
+        start = clock_ns();
+
+        for (size_t i = 0; i < ops; i++)
+            sum += wyhash(buf + (i & 63), len, 0);
+
+        report("hash_wyhash", "bytes", len, ops, clock_ns() - start);
+        sink += sum;
+    }
+
+    uint64_t sum = 0;
+    int64_t start = clock_ns();
+
+    for (size_t i = 0; i < BENCH_MIN_OPS * 16; i++)
+        sum += hash_int(i);
+
+    report("hash_int", "u64", 8, BENCH_MIN_OPS * 16, clock_ns() - start);
+    sink += sum;
+
+    free(buf);
+}
+
+// Takes the largest number of entries to benchmark with, a power of 4 up to 1M
+int main(int argc, char **argv)
+{
+    size_t max = argc > 1 ? strtoull(argv[1], NULL, 10) : BENCH_MAX_SIZE;
+
+    if (max < 4 || max > BENCH_MAX_SIZE) {
+        fprintf(stderr, "Usage: %s [max entries, 4 to %d]\n", argv[0], BENCH_MAX_SIZE);
+        return 1;
+    }
+
+    rng = pcgstate;
+
+    int64_t overhead = clock_overhead();
+
+    char **strs = xmalloc(2 * max * sizeof *strs);
+    const char **strkeys = xmalloc(2 * max * sizeof *strkeys);
+    const void **ptrkeys = xmalloc(2 * max * sizeof *ptrkeys);
+    struct bench_obj *objs = xmalloc(2 * max * sizeof *objs);
+    size_t *order = xmalloc(max * sizeof *order);
+
+    // Random keys are distinct in practice, duplicates would only
+    // turn a few misses into hits
+    for (size_t i = 0; i < 2 * max; i++)
+        strs[i] = random_key();
+
+    map_ops(str) strops = {
+        .compare = strcmp,
+        .hash = hash_str
+    };
+
+    map_ops(ptr) ptrops = {0};
+
+    for (size_t n = 4; n <= max; n *= 4) {
+        // Misses come right after the hits, taken from the second half
+        for (size_t i = 0; i < n; i++) {
+            strkeys[i] = strs[i];
+            strkeys[n + i] = strs[max + i];
+            ptrkeys[i] = &objs[i];
+            ptrkeys[n + i] = &objs[max + i];
+        }
+
+        bench_str("str", strops, strkeys, n, order, overhead);
+        bench_ptr("ptr", ptrops, ptrkeys, n, order, overhead);
+
+        fflush(stdout);
+    }
+
+    bench_hashes();
+
+    for (size_t i = 0; i < 2 * max; i++)
+        free(strs[i]);
+
+    free(strs);
+    free(strkeys);
+    free(ptrkeys);
+    free(objs);
+    free(order);
+
+    return 0;
+}
@@ -0,0 +1,697 @@
+// For syscall(2)
+#define _DEFAULT_SOURCE
+
+#include <stdio.h>
+#include <unistd.h>
+#include <inttypes.h>
+
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#include "nl.c"
+#include "standin.h"
+
+// Feeds address messages through everything past the Netlink socket read:
+// parsing, the address cache (which turns them into NL_ACT_NEW/NL_ACT_DEL
+// or swallows duplicates) and `cache_change_cb`, with the server's batch
+// and channel running against a stand-in DNS server on the loopback
+// interface. The messages are either generated, following one of the
+// profiles below, or read from a capture of an nlmon interface:
+//
+//   # ip link add nlmon0 type nlmon && ip link set nlmon0 up
+//   # tcpdump -i nlmon0 -w addr.pcap
+//
+// Interface indices are mapped to interfaces named bench<index>. Results
+// are printed as a single JSON object; an event counts as acknowledged
+// once the stand-in server has answered an UPDATE for its address.
+//
+// Logging is left disabled unless -s is given, as for ipup itself.
+
+#define BENCH_DEFAULT_EVENTS 100000
+#define BENCH_DEFAULT_IFACES 16
+#define BENCH_DEFAULT_BURST 64
+
+// Addresses per interface in the flap and renumber profiles
+#define BENCH_FLAP_ADDRS 4
+#define BENCH_RENUMBER_ADDRS 8
+
+#define PCAP_MAGIC 0xa1b2c3d4
+#define PCAP_MAGIC_NS 0xa1b23c4d
+#define PCAP_LINKTYPE_NETLINK 253
+// Pseudo-header in front of every captured Netlink message
+#define PCAP_NETLINK_HDR 16
+
+enum bench_profile {
+    // A new address on every event
+    BENCH_FLOOD,
+    // The same few addresses come and go
+    BENCH_FLAP,
+    // Every interface moves to a new prefix, over and over
+    BENCH_RENUMBER
+};
+
+static const char * const profile_names[] = {
+    [BENCH_FLOOD] = "flood",
+    [BENCH_FLAP] = "flap",
+    [BENCH_RENUMBER] = "renumber"
+};
+
+struct bench_event {
+    struct nl_msg *msg;
+    struct in6_addr addr;
+    // When the message was handed over, on the monotonic clock in nanoseconds
+    int64_t time;
+};
+
+struct bench {
+    struct loop *loop;
+    struct loop_timer timer;
+    struct nl_cache *cache;
+
+    struct bench_event *events;
+    size_t nevents, size, next;
+    int maxifidx;
+
+    // Events per timer expiration, and per second if not 0
+    size_t burst;
+    uint64_t rate;
+
+    int64_t start, injected;
+};
+
+static void bench_push(struct bench *bench, struct nl_msg *msg)
+{
+    if (bench->nevents == bench->size) {
+        bench->size = bench->size ? bench->size * 2 : 1024;
+        bench->events = xreallocarray(bench->events, bench->size, sizeof *bench->events);
+    }
+
+    nlmsg_set_proto(msg, NETLINK_ROUTE);
+
+    bench->events[bench->nevents++] = (struct bench_event) {
+        .msg = msg
+    };
+}
+
+static struct in6_addr bench_addr(uint16_t prefix, int ifidx, uint32_t host)
+{
+    struct in6_addr addr = {0};
+
+    // 2001:db8:<prefix>:<ifidx>::<host>
+    addr.s6_addr[0] = 0x20;
+    addr.s6_addr[1] = 0x01;
+    addr.s6_addr[2] = 0x0d;
+    addr.s6_addr[3] = 0xb8;
+    addr.s6_addr[4] = prefix >> 8;
+    addr.s6_addr[5] = prefix;
+    addr.s6_addr[6] = ifidx >> 8;
+    addr.s6_addr[7] = ifidx;
+    addr.s6_addr[12] = host >> 24;
+    addr.s6_addr[13] = host >> 16;
+    addr.s6_addr[14] = host >> 8;
+    addr.s6_addr[15] = host;
+
+    return addr;
+}
+
+static bool bench_gen(struct bench *bench, size_t count, int ifidx,
+        const struct in6_addr *in6, bool delete)
+{
+    if (bench->nevents == count)
+        return false;
+
+    struct rtnl_addr *rtaddr = rtnl_addr_alloc();
+    struct nl_addr *local = nl_addr_build(AF_INET6, in6, sizeof *in6);
+
+    if (!rtaddr || !local)
+        die(EX_SOFTWARE, "Failed to allocate memory");
+
+    nl_addr_set_prefixlen(local, 64);
+
+    rtnl_addr_set_ifindex(rtaddr, ifidx);
+    rtnl_addr_set_family(rtaddr, AF_INET6);
+    rtnl_addr_set_local(rtaddr, local);
+    rtnl_addr_set_scope(rtaddr, RT_SCOPE_UNIVERSE);
+    rtnl_addr_set_valid_lifetime(rtaddr, 3600);
+    rtnl_addr_set_preferred_lifetime(rtaddr, 1800);
+
+    struct nl_msg *msg;
+    int ret = delete
+        ? rtnl_addr_build_delete_request(rtaddr, 0, &msg)
+        : rtnl_addr_build_add_request(rtaddr, 0, &msg);
+
+    if (ret < 0)
+        die(EX_SOFTWARE, "Failed to build Netlink message: %s", nl_geterror(ret));
+
+    nl_addr_put(local);
+    rtnl_addr_put(rtaddr);
+
+    bench_push(bench, msg);
+
+    return true;
+}
+
+static void bench_generate(struct bench *bench, enum bench_profile profile, size_t count, int ifaces)
+{
+    bench->maxifidx = ifaces;
+
+    switch (profile) {
+        case BENCH_FLOOD:
+            for (uint32_t host = 0; ; host++) {
+                int ifidx = host % ifaces + 1;
+                struct in6_addr addr = bench_addr(0, ifidx, host);
+
+                if (!bench_gen(bench, count, ifidx, &addr, false))
+                    return;
+            }
+        case BENCH_FLAP:
+            for (size_t round = 0; ; round++) {
+                for (uint32_t host = 0; host < BENCH_FLAP_ADDRS; host++) {
+                    for (int ifidx = 1; ifidx <= ifaces; ifidx++) {
+                        struct in6_addr addr = bench_addr(0, ifidx, host);
+
+                        if (!bench_gen(bench, count, ifidx, &addr, round & 1))
+                            return;
+                    }
+                }
+            }
+        case BENCH_RENUMBER:
+            // New addresses appear before the old ones go away
+            for (uint16_t prefix = 0; ; prefix++) {
+                for (int ifidx = 1; ifidx <= ifaces; ifidx++) {
+                    for (uint32_t host = 0; host < BENCH_RENUMBER_ADDRS; host++) {
+                        struct in6_addr addr = bench_addr(prefix, ifidx, host);
+
+                        if (!bench_gen(bench, count, ifidx, &addr, false))
+                            return;
+                    }
+                }
+
+                for (int ifidx = 1; prefix && ifidx <= ifaces; ifidx++) {
+                    for (uint32_t host = 0; host < BENCH_RENUMBER_ADDRS; host++) {
+                        struct in6_addr addr = bench_addr(prefix - 1, ifidx, host);
+
+                        if (!bench_gen(bench, count, ifidx, &addr, true))
+                            return;
+                    }
+                }
+            }
+    }
+}
+
+static uint32_t pcap_u32(const uint8_t *p, bool swap)
+{
+    uint32_t v;
+    memcpy(&v, p, sizeof v);
+
+    return swap ? __builtin_bswap32(v) : v;
+}
+
+// Takes the address messages from a capture, up to `count` of them
+static void bench_load(struct bench *bench, const char *path, size_t count)
+{
+    FILE *file = fopen(path, "rb");
+
+    if (!file)
+        die(EX_NOINPUT, "Could not open capture file %s", path);
+
+    uint8_t hdr[24];
+
+    if (fread(hdr, sizeof hdr, 1, file) != 1)
+        die(EX_DATAERR, "Capture file %s is too short", path);
+
+    uint32_t magic = pcap_u32(hdr, false);
+    bool swap = magic != PCAP_MAGIC && magic != PCAP_MAGIC_NS;
+
+    if (swap && pcap_u32(hdr, true) != PCAP_MAGIC && pcap_u32(hdr, true) != PCAP_MAGIC_NS)
+        die(EX_DATAERR, "%s is not a pcap file", path);
+
+    if (pcap_u32(hdr + 20, swap) != PCAP_LINKTYPE_NETLINK)
+        die(EX_DATAERR, "%s was not captured on an nlmon interface", path);
+
+    uint8_t rec[16];
+    uint8_t *data = NULL;
+    size_t size = 0;
+
+    while (bench->nevents < count && fread(rec, sizeof rec, 1, file) == 1) {
+        size_t len = pcap_u32(rec + 8, swap);
+
+        if (len > size) {
+            size = len;
+            data = xrealloc(data, size);
+        }
+
+        if (fread(data, len, 1, file) != 1)
+            break;
+
+        if (len < PCAP_NETLINK_HDR)
+            continue;
+
+        // Protocol family of the Netlink socket, big-endian
+        if ((data[14] << 8 | data[15]) != NETLINK_ROUTE)
+            continue;
+
+        struct nlmsghdr *nlh = (struct nlmsghdr *)(data + PCAP_NETLINK_HDR);
+        int remaining = len - PCAP_NETLINK_HDR;
+
+        for (; nlmsg_ok(nlh, remaining) && bench->nevents < count; nlh = nlmsg_next(nlh, &remaining)) {
+            if (nlh->nlmsg_type != RTM_NEWADDR && nlh->nlmsg_type != RTM_DELADDR)
+                continue;
+
+            struct nl_msg *msg = nlmsg_convert(nlh);
+
+            if (!msg)
+                die(EX_SOFTWARE, "Failed to allocate memory");
+
+            bench_push(bench, msg);
+        }
+    }
+
+    free(data);
+    fclose(file);
+
+    if (bench->nevents == 0)
+        die(EX_DATAERR, "No address messages in %s", path);
+}
+
+static void bench_addr_prop(struct nl_object *obj, void *arg)
+{
+    struct bench_event *ev = arg;
+
+    struct rtnl_addr_prop prop;
+    rtnl_addr_get_prop(obj, &prop);
+
+    if (prop.addr.ss_family == AF_INET6)
+        ev->addr = ((struct sockaddr_in6 *)&prop.addr)->sin6_addr;
+}
+
+static void bench_ifidx(struct nl_object *obj, void *arg)
+{
+    struct bench *bench = arg;
+    int ifidx = rtnl_addr_get_ifindex((struct rtnl_addr *)obj);
+
+    if (ifidx > bench->maxifidx)
+        bench->maxifidx = ifidx;
+}
+
+// Parsed once beforehand, to know which address each event is about
+static void bench_prepare(struct bench *bench)
+{
+    for (size_t i = 0; i < bench->nevents; i++) {
+        nl_msg_parse(bench->events[i].msg, bench_addr_prop, &bench->events[i]);
+        nl_msg_parse(bench->events[i].msg, bench_ifidx, bench);
+    }
+}
+
+static void bench_include(struct nl_object *obj, void *arg)
+{
+    nl_cache_include(arg, obj, cache_change_cb, NULL);
+}
+
+static void bench_inject(struct loop_timer *timer)
+{
+    struct bench *bench = timer->arg;
+    size_t end = bench->next + bench->burst;
+
+    if (bench->rate) {
+        size_t due = (clock_ns() - bench->start) * bench->rate / 1000000000 + 1;
+
+        if (due < end)
+            end = due;
+    }
+
+    if (end > bench->nevents)
+        end = bench->nevents;
+
+    for (; bench->next < end; bench->next++) {
+        struct bench_event *ev = &bench->events[bench->next];
+
+        ev->time = clock_ns();
+        nl_msg_parse(ev->msg, bench_include, bench->cache);
+    }
+
+    if (bench->next == bench->nevents) {
+        bench->injected = clock_ns();
+        loop_unref(bench->loop);
+        return;
+    }
+
+    // Other events are handled in between
+    int64_t deadline = clock_ms();
+
+    if (bench->rate)
+        deadline = bench->start / 1000000 + bench->next * 1000 / bench->rate;
+
+    loop_timer_arm(bench->loop, timer, deadline);
+}
+
+static struct conf bench_conf(uint16_t port, int ifaces, long window)
+{
+    char *text;
+    size_t len;
+
+    FILE *file = open_memstream(&text, &len);
+
+    if (!file)
+        die(EX_OSERR, "Failed to allocate memory");
+
+    fprintf(file, "[server/standin]\nport = %u\n", port);
+
+    if (window >= 0)
+        fprintf(file, "batch-window = %ld\n", window);
+
+    for (int ifidx = 1; ifidx <= ifaces; ifidx++)
+        fprintf(file, "[iface/bench%d]\nserver = standin\nzone = bench.test.\nrecord = bench%d\n",
+                ifidx, ifidx);
+
+    fclose(file);
+
+    file = fmemopen(text, len, "r");
+
+    if (!file)
+        die(EX_OSERR, "Failed to allocate memory");
+
+    struct conf conf = conf_read(file, "bench");
+
+    fclose(file);
+    free(text);
+
+    conf_serv *servconf;
+    map_get_conf_serv(conf.servers, "standin", &servconf);
+
+    ldns_rdf *ns = ldns_rdf_new_frm_str(LDNS_RDF_TYPE_A, "127.0.0.1");
+
+    if (!ns || ldns_resolver_push_nameserver(servconf->resolv, ns) != LDNS_STATUS_OK)
+        die(EX_SOFTWARE, "Failed to set up nameserver");
+
+    ldns_rdf_deep_free(ns);
+
+    return conf;
+}
+
+struct perf {
+    int cycles, instructions;
+    bool kernel;
+};
+
+static int perf_open(uint64_t config, bool kernel, int group)
+{
+    struct perf_event_attr attr = {
+        .type = PERF_TYPE_HARDWARE,
+        .size = sizeof attr,
+        .config = config,
+        .disabled = group < 0,
+        .exclude_kernel = !kernel,
+        .exclude_hv = 1
+    };
+
+    // This thread only, the stand-in server is not counted
+    return syscall(SYS_perf_event_open, &attr, 0, -1, group, 0);
+}
+
+// Counting kernel time needs perf_event_paranoid <= 1, user time is tried
+// next, and nothing is counted if there is no PMU (e.g. in a VM)
+static void perf_start(struct perf *perf)
+{
+    perf->kernel = true;
+    perf->cycles = perf_open(PERF_COUNT_HW_CPU_CYCLES, true, -1);
+
+    if (perf->cycles < 0) {
+        perf->kernel = false;
+        perf->cycles = perf_open(PERF_COUNT_HW_CPU_CYCLES, false, -1);
+    }
+
+    perf->instructions = perf->cycles < 0 ? -1
+        : perf_open(PERF_COUNT_HW_INSTRUCTIONS, perf->kernel, perf->cycles);
+
+    if (perf->cycles >= 0)
+        ioctl(perf->cycles, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+}
+
+static void perf_stop(struct perf *perf, uint64_t *cycles, uint64_t *instructions)
+{
+    *cycles = *instructions = 0;
+
+    if (perf->cycles < 0)
+        return;
+
+    ioctl(perf->cycles, PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+
+    if (read(perf->cycles, cycles, sizeof *cycles) != sizeof *cycles)
+        *cycles = 0;
+
+    if (perf->instructions >= 0 &&
+            read(perf->instructions, instructions, sizeof *instructions) != sizeof *instructions)
+        *instructions = 0;
+
+    close(perf->cycles);
+
+    if (perf->instructions >= 0)
+        close(perf->instructions);
+}
+
+static int compare_change(const void *a, const void *b)
+{
+    const struct standin_change *x = a, *y = b;
+    int ret = memcmp(&x->addr, &y->addr, sizeof x->addr);
+
+    if (ret)
+        return ret;
+
+    return (x->time > y->time) - (x->time < y->time);
+}
+
+static int compare_i64(const void *a, const void *b)
+{
+    int64_t x = *(const int64_t *)a, y = *(const int64_t *)b;
+
+    return (x > y) - (x < y);
+}
+
+// First change to the address at or after `time`
+static const struct standin_change *bench_ack(const struct standin_change *changes, size_t count,
+        const struct in6_addr *addr, int64_t time)
+{
+    size_t lo = 0, hi = count;
+    struct standin_change key = { .addr = *addr, .time = time };
+
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+
+        if (compare_change(&changes[mid], &key) < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    if (lo == count || memcmp(&changes[lo].addr, addr, sizeof *addr) != 0)
+        return NULL;
+
+    return &changes[lo];
+}
+
+static void print_perf(const char *name, uint64_t count, size_t events)
+{
+    if (count)
+        printf(",\"%s_per_event\":%.1f", name, (double)count / events);
+    else
+        printf(",\"%s_per_event\":null", name);
+}
+
+static void usage(const char *progname)
+{
+    fprintf(stderr,
+            "Usage: %s [ -p <profile> | -f <capture> ] [ -n <events> ] [ -i <ifaces> ]\n"
+            "          [ -b <burst> ] [ -r <rate> ] [ -w <window> ] [ -d <latency> ] [ -s ]\n"
+            "  -p    Generate events: flood (default), flap or renumber\n"
+            "  -f    Replay the address messages from an nlmon capture\n"
+            "  -n    Number of events (default %d)\n"
+            "  -i    Number of interfaces for generated events (default %d)\n"
+            "  -b    Events handed over at once (default %d)\n"
+            "  -r    Events per second, unlimited by default\n"
+            "  -w    Batch window in milliseconds\n"
+            "  -d    Latency of the stand-in server in milliseconds\n"
+            "  -s    Log to stdout\n", progname,
+            BENCH_DEFAULT_EVENTS, BENCH_DEFAULT_IFACES, BENCH_DEFAULT_BURST);
+}
+
+int main(int argc, char **argv)
+{
+    int opt;
+
+    enum bench_profile profile = BENCH_FLOOD;
+    const char *capture = NULL;
+    size_t count = BENCH_DEFAULT_EVENTS;
+    int ifaces = BENCH_DEFAULT_IFACES;
+    long window = -1;
+
+    struct standin_opts opts = {0};
+
+    struct bench bench = {
+        .burst = BENCH_DEFAULT_BURST
+    };
+
+    while ((opt = getopt(argc, argv, "p:f:n:i:b:r:w:d:sh")) != -1) {
+        switch (opt) {
+            case 'p': {
+                size_t i = 0, n = sizeof profile_names / sizeof *profile_names;
+
+                while (i < n && strcmp(optarg, profile_names[i]) != 0)
+                    i++;
+
+                if (i == n) {
+                    usage(argv[0]);
+                    return EX_USAGE;
+                }
+
+                profile = i;
+                break;
+            }
+            case 'f':
+                capture = optarg;
+                break;
+            case 'n':
+                count = strtoull(optarg, NULL, 10);
+                break;
+            case 'i':
+                ifaces = atoi(optarg);
+                break;
+            case 'b':
+                bench.burst = strtoull(optarg, NULL, 10);
+                break;
+            case 'r':
+                bench.rate = strtoull(optarg, NULL, 10);
+                break;
+            case 'w':
+                window = atol(optarg);
+                break;
+            case 'd':
+                opts.latency = strtoul(optarg, NULL, 10);
+                break;
+            case 's':
+                log_init(argv[0], LOG_MODE_STDOUT);
+                break;
+            case 'h': default:
+                usage(argv[0]);
+                return opt == 'h' ? EX_OK : EX_USAGE;
+        }
+    }
+
+    if (count == 0 || ifaces <= 0 || ifaces > UINT16_MAX || bench.burst == 0) {
+        usage(argv[0]);
+        return EX_USAGE;
+    }
+
+    if (capture)
+        bench_load(&bench, capture, count);
+    else
+        bench_generate(&bench, profile, count, ifaces);
+
+    bench_prepare(&bench);
+
+    struct standin *standin = standin_new(&opts);
+    struct conf conf = bench_conf(standin_port(standin), bench.maxifidx, window);
+
+    bench.loop = loop_new();
+
+    int ret = nl_cache_alloc_name("route/addr", &bench.cache);
+
+    if (ret < 0)
+        die(EX_SOFTWARE, "Failed to allocate Netlink address cache: %s", nl_geterror(ret));
+
+    map_foreach_conf_serv(conf.servers, setup_servconf, bench.loop);
+
+    state.conf = &conf;
+
+    for (int ifidx = 1; ifidx <= bench.maxifidx; ifidx++) {
+        char name[32];
+        snprintf(name, sizeof name, "bench%d", ifidx);
+
+        iftable_set(ifidx, name);
+    }
+
+    standin_start(standin);
+
+    struct perf perf;
+    perf_start(&perf);
+
+    loop_timer_init(&bench.timer, bench_inject, &bench);
+    loop_ref(bench.loop);
+
+    bench.start = clock_ns();
+    loop_timer_arm(bench.loop, &bench.timer, clock_ms());
+
+    // Until every batch has been sent and answered
+    loop_drain(bench.loop);
+
+    int64_t end = clock_ns();
+
+    uint64_t cycles, instructions;
+    perf_stop(&perf, &cycles, &instructions);
+
+    standin_stop(standin);
+
+    size_t nchanges;
+    const struct standin_change *changes = standin_changes(standin, &nchanges);
+
+    struct standin_change *sorted = xreallocarray(NULL, nchanges + 1, sizeof *sorted);
+    memcpy(sorted, changes, nchanges * sizeof *sorted);
+    qsort(sorted, nchanges, sizeof *sorted, compare_change);
+
+    // Events that were swallowed (duplicates, addresses removed before
+    // the batch went out) have no acknowledgement of their own
+    int64_t *latencies = xreallocarray(NULL, bench.nevents, sizeof *latencies);
+    size_t acked = 0;
+
+    for (size_t i = 0; i < bench.nevents; i++) {
+        struct bench_event *ev = &bench.events[i];
+        const struct standin_change *change = bench_ack(sorted, nchanges, &ev->addr, ev->time);
+
+        if (change)
+            latencies[acked++] = change->time - ev->time;
+    }
+
+    qsort(latencies, acked, sizeof *latencies, compare_i64);
+
+    struct standin_stats stats;
+    standin_stats(standin, &stats);
+
+    double injects = (bench.injected - bench.start) / 1e9;
+    double total = (end - bench.start) / 1e9;
+
+    printf("{\"bench\":\"nl\",\"source\":\"%s\",\"events\":%zu,\"ifaces\":%d,"
+            "\"updates\":%" PRIu64 ",\"rrs\":%" PRIu64 ",\"acked\":%zu,"
+            "\"inject_s\":%.6f,\"total_s\":%.6f,\"events_per_s\":%.0f,\"updates_per_s\":%.0f",
+            capture ? "capture" : profile_names[profile], bench.nevents, bench.maxifidx,
+            stats.updates, stats.rrs, acked, injects, total,
+            bench.nevents / injects, stats.updates / total);
+
+    if (acked)
+        printf(",\"p50_us\":%.1f,\"p99_us\":%.1f,\"p999_us\":%.1f",
+                latencies[acked / 2] / 1e3, latencies[acked * 99 / 100] / 1e3,
+                latencies[acked * 999 / 1000] / 1e3);
+
+    print_perf("cycles", cycles, bench.nevents);
+    print_perf("instructions", instructions, bench.nevents);
+
+    printf(",\"perf_kernel\":%s}\n", perf.cycles >= 0 && perf.kernel ? "true" : "false");
+
+    free(latencies);
+    free(sorted);
+
+    for (size_t i = 0; i < bench.nevents; i++)
+        nlmsg_free(bench.events[i].msg);
+
+    free(bench.events);
+
+    state.conf = NULL;
+    free(state.iftable);
+
+    conf_free(conf);
+    nl_cache_free(bench.cache);
+    standin_free(standin);
+    loop_free(bench.loop);
+
+    return EX_OK;
+}
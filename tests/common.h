@@ -1,6 +1,9 @@
 #ifndef COMMON_H
 #define COMMON_H
 
+#include <arpa/inet.h>
+#include <netinet/in.h>
+
 #include <criterion/criterion.h>
 #include <criterion/new/assert.h>
 
@@ -10,41 +13,14 @@
 #define assert(...) \
     cr_assert(__VA_ARGS__, #__VA_ARGS__)
 
-/*
- * PCG Random Number Generation for C.
- *
- * Copyright 2014 Melissa O'Neill <oneill@pcg-random.org>
- *
- * Licensed under the Apache License, Version 2.0 (the "License");
- * you may not use this file except in compliance with the License.
- * You may obtain a copy of the License at
- *
- *     http://www.apache.org/licenses/LICENSE-2.0
- *
- * Unless required by applicable law or agreed to in writing, software
- * distributed under the License is distributed on an "AS IS" BASIS,
- * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
- * See the License for the specific language governing permissions and
- * limitations under the License.
- *
- * For additional information about the PCG random number generation scheme,
- * including its license and other licensing options, visit
- *
- *       http://www.pcg-random.org
- */
-typedef struct { uint64_t state;  uint64_t inc; } pcg32_random_t;
-
-pcg32_random_t pcgstate = { 0x853c49e6748fea9bULL, 0xda3e39cb94b95bdbULL };
-
-uint32_t pcg32_random_r(pcg32_random_t *rng)
+#include "pcg.h"
+
+static inline struct sockaddr_in6 mkaddr(const char *str)
 {
-    uint64_t oldstate = rng->state;
-    // Advance internal state
-    rng->state = oldstate * 6364136223846793005ULL + (rng->inc|1);
-    // Calculate output function (XSH RR), uses old state for max ILP
-    uint32_t xorshifted = ((oldstate >> 18u) ^ oldstate) >> 27u;
-    uint32_t rot = oldstate >> 59u;
-    return (xorshifted >> rot) | (xorshifted << ((-rot) & 31));
+    struct sockaddr_in6 addr = { .sin6_family = AF_INET6 };
+    inet_pton(AF_INET6, str, &addr.sin6_addr);
+
+    return addr;
 }
 
 #endif /* COMMON_H */
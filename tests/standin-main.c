@@ -0,0 +1,137 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <libgen.h>
+#include <signal.h>
+#include <unistd.h>
+#include <inttypes.h>
+
+#include "log.h"
+#include "standin.h"
+
+// Runs the stand-in server on its own, for load runs against a real ipup.
+// Prints the port once it is listening, and its counters when interrupted.
+
+static void usage(const char *progname)
+{
+    fprintf(stderr,
+            "Usage: %s [ -p <port> ] [ -z <zone> ] [ -k <name>:<secret> [ -a <algorithm> ] ]\n"
+            "          [ -d <latency> ] [ -l <loss> ] [ -f <servfail> ] [ -r <refused> ]\n"
+            "          [ -t <truncate> ] [ -s ]\n"
+            "  -p    Port to listen on, on 127.0.0.1 (default any)\n"
+            "  -z    Only accept UPDATEs for this zone\n"
+            "  -k    Require requests to be signed with this key, in base64\n"
+            "  -a    Key algorithm (default hmac-sha256.)\n"
+            "  -d    Latency in milliseconds\n"
+            "  -l    Percentage of requests dropped\n"
+            "  -f    Percentage of requests answered with SERVFAIL\n"
+            "  -r    Percentage of requests answered with REFUSED\n"
+            "  -t    Percentage of UDP requests answered with the TC bit set\n"
+            "  -s    Log to stdout\n", progname);
+}
+
+static uint8_t percent(const char *str)
+{
+    unsigned long val = strtoul(str, NULL, 10);
+
+    return val > 100 ? 100 : val;
+}
+
+int main(int argc, char **argv)
+{
+    int opt;
+
+    const char *progname = basename(argv[0]);
+    char *key = NULL;
+
+    struct standin_opts opts = {
+        .cred.algorithm = "hmac-sha256."
+    };
+
+    while ((opt = getopt(argc, argv, "p:z:k:a:d:l:f:r:t:sh")) != -1) {
+        switch (opt) {
+            case 'p':
+                opts.port = strtoul(optarg, NULL, 10);
+                break;
+            case 'z':
+                opts.zone = optarg;
+                break;
+            case 'k':
+                key = optarg;
+                break;
+            case 'a':
+                opts.cred.algorithm = optarg;
+                break;
+            case 'd':
+                opts.latency = strtoul(optarg, NULL, 10);
+                break;
+            case 'l':
+                opts.loss = percent(optarg);
+                break;
+            case 'f':
+                opts.servfail = percent(optarg);
+                break;
+            case 'r':
+                opts.refused = percent(optarg);
+                break;
+            case 't':
+                opts.truncate = percent(optarg);
+                break;
+            case 's':
+                log_init(progname, LOG_MODE_STDOUT);
+                break;
+            case 'h': default:
+                usage(progname);
+                return opt == 'h' ? EX_OK : EX_USAGE;
+        }
+    }
+
+    if (key) {
+        char *sep = strchr(key, ':');
+
+        if (!sep) {
+            usage(progname);
+            return EX_USAGE;
+        }
+
+        *sep = 0;
+        opts.cred.keyname = key;
+        opts.cred.keydata = sep + 1;
+    } else {
+        opts.cred.algorithm = NULL;
+    }
+
+    // Blocked before the server thread starts, so that it inherits the mask
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGINT);
+    sigaddset(&set, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+    struct standin *standin = standin_new(&opts);
+    standin_start(standin);
+
+    printf("%u\n", standin_port(standin));
+    fflush(stdout);
+
+    int signo;
+    sigwait(&set, &signo);
+
+    standin_stop(standin);
+
+    struct standin_stats stats;
+    standin_stats(standin, &stats);
+
+    printf("{\"packets\":%" PRIu64 ",\"tcp\":%" PRIu64 ",\"updates\":%" PRIu64
+            ",\"queries\":%" PRIu64 ",\"rrs\":%" PRIu64 ",\"dropped\":%" PRIu64
+            ",\"servfail\":%" PRIu64 ",\"refused\":%" PRIu64 ",\"truncated\":%" PRIu64
+            ",\"badsig\":%" PRIu64 ",\"serial\":%" PRIu32 "}\n",
+            stats.packets, stats.tcp, stats.updates, stats.queries, stats.rrs,
+            stats.dropped, stats.servfail, stats.refused, stats.truncated,
+            stats.badsig, standin_serial(standin));
+
+    standin_free(standin);
+
+    return EX_OK;
+}
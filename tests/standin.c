@@ -0,0 +1,929 @@
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include <sys/uio.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/eventfd.h>
+
+#include <ldns/ldns.h>
+
+#include "log.h"
+#include "map.h"
+#include "pcg.h"
+#include "hash.h"
+#include "loop.h"
+#include "util.h"
+#include "xalloc.h"
+#include "standin.h"
+
+#define STANDIN_BUFSIZE 65535
+#define STANDIN_TSIG_FUDGE 300
+
+struct standin_rr {
+    struct in6_addr addr;
+    uint32_t ttl;
+};
+
+struct standin_rrset {
+    struct standin_rr *rrs;
+    size_t used, size;
+};
+
+map_decl(standin_rrset, uint64_t, const char *, struct standin_rrset *);
+
+struct standin_conn {
+    struct standin *standin;
+    struct standin_conn *next;
+    struct loop_io io;
+
+    // Length-prefixed messages, possibly split across reads
+    uint8_t in[STANDIN_BUFSIZE + 2];
+    size_t inlen;
+};
+
+// Answer held back until the injected latency has passed
+struct standin_reply {
+    struct standin_reply *next;
+    int64_t deadline;
+
+    // Cleared if the connection goes away in the meantime
+    struct standin_conn *conn;
+    bool tcp;
+
+    struct sockaddr_storage to;
+    socklen_t tolen;
+
+    uint8_t *wire;
+    size_t len;
+};
+
+struct standin {
+    struct standin_opts opts;
+    ldns_rdf *zone;
+
+    struct loop *loop;
+    struct loop_io udp, tcp, wake;
+    struct loop_timer timer;
+    pthread_t thread;
+    uint16_t port;
+
+    // Protects everything below, which is also read by other threads
+    pthread_mutex_t lock;
+
+    map(standin_rrset) *rrsets;
+    uint32_t serial;
+    pcg32_random_t rng;
+
+    struct standin_conn *conns;
+    struct standin_reply *head, **tail;
+
+    struct standin_change *changes;
+    size_t nchanges, size;
+
+    struct standin_stats stats;
+    uint8_t buf[STANDIN_BUFSIZE];
+};
+
+static void standin_rrset_free(struct standin_rrset *rrset)
+{
+    free(rrset->rrs);
+    free(rrset);
+}
+
+// Map key for a name, in canonical (lowercase) presentation format
+static char *standin_name(const ldns_rdf *dname)
+{
+    ldns_rdf *canon = ldns_rdf_clone(dname);
+    ldns_dname2canonical(canon);
+
+    char *name = ldns_rdf2str(canon);
+    ldns_rdf_deep_free(canon);
+
+    if (!name)
+        die(EX_SOFTWARE, "Failed to allocate memory");
+
+    return name;
+}
+
+static struct standin_rrset *standin_rrset(struct standin *standin, const char *name)
+{
+    struct standin_rrset *rrset;
+
+    if (!map_get_standin_rrset(standin->rrsets, name, &rrset)) {
+        rrset = xcalloc(1, sizeof *rrset);
+        map_set_standin_rrset(standin->rrsets, name, rrset);
+    }
+
+    return rrset;
+}
+
+static bool standin_rrset_add(struct standin_rrset *rrset, const struct in6_addr *addr, uint32_t ttl)
+{
+    for (size_t i = 0; i < rrset->used; i++) {
+        if (memcmp(&rrset->rrs[i].addr, addr, sizeof *addr) == 0) {
+            bool changed = rrset->rrs[i].ttl != ttl;
+            rrset->rrs[i].ttl = ttl;
+
+            return changed;
+        }
+    }
+
+    if (rrset->used == rrset->size) {
+        rrset->size = rrset->size ? rrset->size * 2 : 4;
+        rrset->rrs = xreallocarray(rrset->rrs, rrset->size, sizeof *rrset->rrs);
+    }
+
+    rrset->rrs[rrset->used++] = (struct standin_rr) {
+        .addr = *addr,
+        .ttl = ttl
+    };
+
+    return true;
+}
+
+static bool standin_rrset_del(struct standin_rrset *rrset, const struct in6_addr *addr)
+{
+    for (size_t i = 0; i < rrset->used; i++) {
+        if (memcmp(&rrset->rrs[i].addr, addr, sizeof *addr) == 0) {
+            rrset->rrs[i] = rrset->rrs[--rrset->used];
+            return true;
+        }
+    }
+
+    return false;
+}
+
+static bool standin_rrset_has(const struct standin_rrset *rrset, const struct in6_addr *addr)
+{
+    for (size_t i = 0; i < rrset->used; i++)
+        if (memcmp(&rrset->rrs[i].addr, addr, sizeof *addr) == 0)
+            return true;
+
+    return false;
+}
+
+static bool standin_rr_addr(const ldns_rr *rr, struct in6_addr *addr)
+{
+    ldns_rdf *rdf = ldns_rr_rd_count(rr) ? ldns_rr_rdf(rr, 0) : NULL;
+
+    if (ldns_rr_get_type(rr) != LDNS_RR_TYPE_AAAA || !rdf || ldns_rdf_size(rdf) != sizeof *addr)
+        return false;
+
+    memcpy(addr, ldns_rdf_data(rdf), sizeof *addr);
+    return true;
+}
+
+static void standin_record(struct standin *standin, const struct in6_addr *addr, bool delete, int64_t time)
+{
+    if (standin->nchanges == standin->size) {
+        standin->size = standin->size ? standin->size * 2 : 1024;
+        standin->changes = xreallocarray(standin->changes, standin->size, sizeof *standin->changes);
+    }
+
+    standin->changes[standin->nchanges++] = (struct standin_change) {
+        .addr = *addr,
+        .time = time,
+        .delete = delete
+    };
+}
+
+static bool standin_roll(struct standin *standin, uint8_t percent)
+{
+    return percent && pcg32_random_r(&standin->rng) % 100 < percent;
+}
+
+static bool standin_in_zone(const ldns_rr_list *rrs, const ldns_rdf *zone)
+{
+    for (size_t i = 0; i < ldns_rr_list_rr_count(rrs); i++) {
+        ldns_rdf *owner = ldns_rr_owner(ldns_rr_list_rr(rrs, i));
+
+        if (ldns_dname_compare(owner, zone) != 0 && !ldns_dname_is_subdomain(owner, zone))
+            return false;
+    }
+
+    return true;
+}
+
+// Only AAAA prerequisites are checked: the RRset exists (with or without
+// the listed values) or does not exist. The rest are accepted and ignored.
+static ldns_pkt_rcode standin_prereqs(struct standin *standin, const ldns_rr_list *prereqs)
+{
+    size_t count = ldns_rr_list_rr_count(prereqs);
+
+    for (size_t i = 0; i < count; i++) {
+        ldns_rr *rr = ldns_rr_list_rr(prereqs, i);
+        ldns_rr_class class = ldns_rr_get_class(rr);
+
+        if (ldns_rr_get_type(rr) != LDNS_RR_TYPE_AAAA)
+            continue;
+
+        char *name = standin_name(ldns_rr_owner(rr));
+        struct standin_rrset *rrset = standin_rrset(standin, name);
+
+        free(name);
+
+        if (class == LDNS_RR_CLASS_ANY && rrset->used == 0)
+            return LDNS_RCODE_NXRRSET;
+
+        if (class == LDNS_RR_CLASS_NONE && rrset->used != 0)
+            return LDNS_RCODE_YXRRSET;
+
+        if (class != LDNS_RR_CLASS_IN)
+            continue;
+
+        // The values listed for the name have to match the RRset exactly
+        struct standin_rrset want = { 0 };
+        struct in6_addr addr;
+
+        for (size_t j = 0; j < count; j++) {
+            ldns_rr *other = ldns_rr_list_rr(prereqs, j);
+
+            if (ldns_rr_get_class(other) == LDNS_RR_CLASS_IN && standin_rr_addr(other, &addr) &&
+                    ldns_dname_compare(ldns_rr_owner(other), ldns_rr_owner(rr)) == 0)
+                standin_rrset_add(&want, &addr, 0);
+        }
+
+        bool match = want.used == rrset->used;
+
+        for (size_t j = 0; match && j < want.used; j++)
+            match = standin_rrset_has(rrset, &want.rrs[j].addr);
+
+        free(want.rrs);
+
+        if (!match)
+            return LDNS_RCODE_NXRRSET;
+    }
+
+    return LDNS_RCODE_NOERROR;
+}
+
+// Only AAAA records are kept, anything else in the update section is
+// accepted and ignored.
+static ldns_pkt_rcode standin_update(struct standin *standin, const ldns_pkt *req, int64_t time)
+{
+    ldns_rr_list *zones = ldns_pkt_question(req);
+
+    if (ldns_rr_list_rr_count(zones) != 1 || ldns_rr_get_type(ldns_rr_list_rr(zones, 0)) != LDNS_RR_TYPE_SOA)
+        return LDNS_RCODE_FORMERR;
+
+    ldns_rdf *zone = ldns_rr_owner(ldns_rr_list_rr(zones, 0));
+
+    if (standin->zone && ldns_dname_compare(zone, standin->zone) != 0)
+        return LDNS_RCODE_NOTAUTH;
+
+    ldns_rr_list *prereqs = ldns_pkt_answer(req);
+    ldns_rr_list *updates = ldns_pkt_authority(req);
+
+    // Nothing is applied if any of the records is out of the zone
+    if (!standin_in_zone(prereqs, zone) || !standin_in_zone(updates, zone))
+        return LDNS_RCODE_NOTZONE;
+
+    ldns_pkt_rcode rcode = standin_prereqs(standin, prereqs);
+
+    if (rcode != LDNS_RCODE_NOERROR)
+        return rcode;
+
+    bool changed = false;
+
+    for (size_t i = 0; i < ldns_rr_list_rr_count(updates); i++) {
+        ldns_rr *rr = ldns_rr_list_rr(updates, i);
+        ldns_rr_type type = ldns_rr_get_type(rr);
+        ldns_rr_class class = ldns_rr_get_class(rr);
+
+        if (type != LDNS_RR_TYPE_AAAA && type != LDNS_RR_TYPE_ANY)
+            continue;
+
+        char *name = standin_name(ldns_rr_owner(rr));
+        struct standin_rrset *rrset = standin_rrset(standin, name);
+
+        free(name);
+
+        // Deletes the whole RRset, or every RRset of the name
+        if (class == LDNS_RR_CLASS_ANY) {
+            for (size_t j = 0; j < rrset->used; j++)
+                standin_record(standin, &rrset->rrs[j].addr, true, time);
+
+            changed |= rrset->used != 0;
+            rrset->used = 0;
+
+            continue;
+        }
+
+        struct in6_addr addr;
+
+        if (!standin_rr_addr(rr, &addr))
+            continue;
+
+        if (class == LDNS_RR_CLASS_NONE)
+            changed |= standin_rrset_del(rrset, &addr);
+        else
+            changed |= standin_rrset_add(rrset, &addr, ldns_rr_ttl(rr));
+
+        standin_record(standin, &addr, class == LDNS_RR_CLASS_NONE, time);
+    }
+
+    if (changed)
+        standin->serial++;
+
+    return LDNS_RCODE_NOERROR;
+}
+
+static void standin_push_soa(struct standin *standin, ldns_pkt *reply, const ldns_rdf *owner)
+{
+    char *name = ldns_rdf2str(owner);
+    char *str = NULL;
+
+    if (!name)
+        die(EX_SOFTWARE, "Failed to allocate memory");
+
+    size_t len = strlen(name) * 3 + 64;
+    str = xmalloc(len);
+
+    snprintf(str, len, "%s 3600 IN SOA ns.%s hostmaster.%s %u 3600 600 86400 60",
+            name, name, name, standin->serial);
+
+    ldns_rr *rr;
+
+    if (ldns_rr_new_frm_str(&rr, str, 0, NULL, NULL) == LDNS_STATUS_OK)
+        ldns_pkt_push_rr(reply, LDNS_SECTION_ANSWER, rr);
+
+    free(str);
+    free(name);
+}
+
+// Answers AAAA queries from the zone, and SOA queries for the zone itself
+static ldns_pkt_rcode standin_query(struct standin *standin, const ldns_pkt *req, ldns_pkt *reply)
+{
+    ldns_rr_list *question = ldns_pkt_question(req);
+
+    if (ldns_rr_list_rr_count(question) != 1)
+        return LDNS_RCODE_FORMERR;
+
+    ldns_rr *q = ldns_rr_list_rr(question, 0);
+    ldns_rdf *owner = ldns_rr_owner(q);
+
+    if (ldns_rr_get_type(q) == LDNS_RR_TYPE_SOA) {
+        if (!standin->zone || ldns_dname_compare(owner, standin->zone) == 0)
+            standin_push_soa(standin, reply, owner);
+
+        return LDNS_RCODE_NOERROR;
+    }
+
+    if (ldns_rr_get_type(q) != LDNS_RR_TYPE_AAAA)
+        return LDNS_RCODE_NOERROR;
+
+    char *name = standin_name(owner);
+    struct standin_rrset *rrset;
+
+    if (map_get_standin_rrset(standin->rrsets, name, &rrset)) {
+        for (size_t i = 0; i < rrset->used; i++) {
+            ldns_rr *rr = ldns_rr_new();
+
+            ldns_rr_set_owner(rr, ldns_rdf_clone(owner));
+            ldns_rr_set_ttl(rr, rrset->rrs[i].ttl);
+            ldns_rr_set_class(rr, LDNS_RR_CLASS_IN);
+            ldns_rr_set_type(rr, LDNS_RR_TYPE_AAAA);
+            ldns_rr_push_rdf(rr, ldns_rdf_new_frm_data(LDNS_RDF_TYPE_AAAA,
+                        sizeof rrset->rrs[i].addr, &rrset->rrs[i].addr));
+
+            ldns_pkt_push_rr(reply, LDNS_SECTION_ANSWER, rr);
+        }
+    }
+
+    free(name);
+
+    return LDNS_RCODE_NOERROR;
+}
+
+static ldns_pkt *standin_reply_new(const ldns_pkt *req)
+{
+    ldns_pkt *reply = ldns_pkt_new();
+
+    if (!reply)
+        die(EX_SOFTWARE, "Failed to allocate memory");
+
+    ldns_pkt_set_id(reply, ldns_pkt_id(req));
+    ldns_pkt_set_qr(reply, true);
+    ldns_pkt_set_aa(reply, true);
+    ldns_pkt_set_opcode(reply, ldns_pkt_get_opcode(req));
+
+    const ldns_rr_list *question = ldns_pkt_question(req);
+
+    for (size_t i = 0; i < ldns_rr_list_rr_count(question); i++)
+        ldns_pkt_push_rr(reply, LDNS_SECTION_QUESTION, ldns_rr_clone(ldns_rr_list_rr(question, i)));
+
+    return reply;
+}
+
+// Returns the answer in wire format, or NULL if there is none
+static uint8_t *standin_handle(struct standin *standin, const uint8_t *wire, size_t len,
+        bool tcp, size_t *outlen)
+{
+    const struct standin_opts *opts = &standin->opts;
+    ldns_pkt *req = NULL;
+
+    standin->stats.packets++;
+    standin->stats.tcp += tcp;
+
+    if (ldns_wire2pkt(&req, wire, len) != LDNS_STATUS_OK || ldns_pkt_qr(req)) {
+        ldns_pkt_free(req);
+        return NULL;
+    }
+
+    bool update = ldns_pkt_get_opcode(req) == LDNS_PACKET_UPDATE;
+
+    if (update) {
+        standin->stats.updates++;
+        standin->stats.rrs += ldns_rr_list_rr_count(ldns_pkt_authority(req));
+    } else {
+        standin->stats.queries++;
+    }
+
+    if (standin_roll(standin, opts->loss)) {
+        standin->stats.dropped++;
+        ldns_pkt_free(req);
+
+        return NULL;
+    }
+
+    ldns_pkt *reply = standin_reply_new(req);
+    ldns_pkt_rcode rcode = LDNS_RCODE_NOERROR;
+    const ldns_rdf *reqmac = NULL;
+
+    if (opts->cred.keyname) {
+        ldns_rr *tsig = ldns_pkt_tsig(req);
+
+        if (tsig && ldns_rr_rd_count(tsig) > 3 && ldns_pkt_tsig_verify(req, wire, len,
+                    opts->cred.keyname, opts->cred.keydata, NULL))
+            reqmac = ldns_rr_rdf(tsig, 3);
+    }
+
+    if (opts->cred.keyname && !reqmac) {
+        standin->stats.badsig++;
+        rcode = LDNS_RCODE_NOTAUTH;
+    } else if (!tcp && standin_roll(standin, opts->truncate)) {
+        standin->stats.truncated++;
+        ldns_pkt_set_tc(reply, true);
+    } else if (standin_roll(standin, opts->servfail)) {
+        standin->stats.servfail++;
+        rcode = LDNS_RCODE_SERVFAIL;
+    } else if (standin_roll(standin, opts->refused)) {
+        standin->stats.refused++;
+        rcode = LDNS_RCODE_REFUSED;
+    } else if (update) {
+        rcode = standin_update(standin, req, clock_ns() + (int64_t)opts->latency * 1000000);
+    } else {
+        rcode = standin_query(standin, req, reply);
+    }
+
+    ldns_pkt_set_rcode(reply, rcode);
+
+    if (reqmac && ldns_pkt_tsig_sign(reply, opts->cred.keyname, opts->cred.keydata,
+                STANDIN_TSIG_FUDGE, opts->cred.algorithm, reqmac) != LDNS_STATUS_OK)
+        log(LOG_WARNING, "Stand-in server failed to sign reply");
+
+    uint8_t *out = NULL;
+
+    if (ldns_pkt2wire(&out, reply, outlen) != LDNS_STATUS_OK)
+        out = NULL;
+
+    ldns_pkt_free(reply);
+    ldns_pkt_free(req);
+
+    return out;
+}
+
+static void standin_send(struct standin *standin, struct standin_reply *reply)
+{
+    if (reply->tcp) {
+        uint8_t prefix[2] = { reply->len >> 8, reply->len & 0xff };
+
+        struct iovec iov[2] = {
+            { .iov_base = prefix, .iov_len = sizeof prefix },
+            { .iov_base = reply->wire, .iov_len = reply->len }
+        };
+
+        // Dropped along with the connection
+        if (reply->conn && writev(reply->conn->io.fd, iov, 2) < 0)
+            log(LOG_WARNING, "Stand-in server failed to send reply: %s", strerror(errno));
+    } else if (sendto(standin->udp.fd, reply->wire, reply->len, 0,
+                (struct sockaddr *)&reply->to, reply->tolen) < 0) {
+        log(LOG_WARNING, "Stand-in server failed to send reply: %s", strerror(errno));
+    }
+}
+
+static void standin_flush(struct loop_timer *timer)
+{
+    struct standin *standin = timer->arg;
+    int64_t now = clock_ms();
+
+    while (standin->head && standin->head->deadline <= now) {
+        struct standin_reply *reply = standin->head;
+
+        standin->head = reply->next;
+
+        if (!standin->head)
+            standin->tail = &standin->head;
+
+        standin_send(standin, reply);
+
+        free(reply->wire);
+        free(reply);
+    }
+
+    if (standin->head)
+        loop_timer_arm(standin->loop, &standin->timer, standin->head->deadline);
+}
+
+static void standin_request(struct standin *standin, const uint8_t *wire, size_t len,
+        struct standin_conn *conn, const struct sockaddr_storage *from, socklen_t fromlen)
+{
+    pthread_mutex_lock(&standin->lock);
+
+    struct standin_reply reply = {
+        .conn = conn,
+        .tcp = conn
+    };
+
+    reply.wire = standin_handle(standin, wire, len, conn, &reply.len);
+
+    pthread_mutex_unlock(&standin->lock);
+
+    if (!reply.wire)
+        return;
+
+    if (from) {
+        reply.to = *from;
+        reply.tolen = fromlen;
+    }
+
+    if (!standin->opts.latency) {
+        standin_send(standin, &reply);
+        free(reply.wire);
+
+        return;
+    }
+
+    // The latency is the same for every answer, so the queue stays in order
+    struct standin_reply *queued = xmalloc(sizeof *queued);
+
+    *queued = reply;
+    queued->deadline = clock_ms() + standin->opts.latency;
+
+    *standin->tail = queued;
+    standin->tail = &queued->next;
+
+    if (!loop_timer_armed(&standin->timer))
+        loop_timer_arm(standin->loop, &standin->timer, queued->deadline);
+}
+
+static void standin_udp_recv(struct loop_io *io, uint32_t events)
+{
+    (void)events;
+
+    struct standin *standin = io->arg;
+
+    while (1) {
+        struct sockaddr_storage from;
+        socklen_t fromlen = sizeof from;
+
+        ssize_t len = recvfrom(io->fd, standin->buf, sizeof standin->buf, 0,
+                (struct sockaddr *)&from, &fromlen);
+
+        if (len < 0) {
+            if (errno == EINTR)
+                continue;
+
+            return;
+        }
+
+        standin_request(standin, standin->buf, len, NULL, &from, fromlen);
+    }
+}
+
+static void standin_conn_close(struct standin_conn *conn)
+{
+    struct standin *standin = conn->standin;
+
+    for (struct standin_reply *reply = standin->head; reply; reply = reply->next)
+        if (reply->conn == conn)
+            reply->conn = NULL;
+
+    for (struct standin_conn **link = &standin->conns; *link; link = &(*link)->next) {
+        if (*link == conn) {
+            *link = conn->next;
+            break;
+        }
+    }
+
+    loop_io_stop(standin->loop, &conn->io);
+    close(conn->io.fd);
+
+    free(conn);
+}
+
+static void standin_tcp_recv(struct loop_io *io, uint32_t events)
+{
+    (void)events;
+
+    struct standin_conn *conn = io->arg;
+
+    // The socket is blocking, but only read from once it is readable
+    ssize_t n = recv(io->fd, conn->in + conn->inlen, sizeof conn->in - conn->inlen, 0);
+
+    if (n < 0 && errno == EINTR)
+        return;
+
+    if (n <= 0) {
+        standin_conn_close(conn);
+        return;
+    }
+
+    conn->inlen += n;
+
+    while (conn->inlen >= 2) {
+        size_t len = (size_t)conn->in[0] << 8 | conn->in[1];
+
+        if (conn->inlen < len + 2)
+            break;
+
+        standin_request(conn->standin, conn->in + 2, len, conn, NULL, 0);
+
+        conn->inlen -= len + 2;
+        memmove(conn->in, conn->in + len + 2, conn->inlen);
+    }
+}
+
+static void standin_accept(struct loop_io *io, uint32_t events)
+{
+    (void)events;
+
+    struct standin *standin = io->arg;
+    int fd = accept(io->fd, NULL, NULL);
+
+    if (fd < 0)
+        return;
+
+    struct standin_conn *conn = xcalloc(1, sizeof *conn);
+
+    conn->standin = standin;
+    conn->next = standin->conns;
+    standin->conns = conn;
+
+    loop_io_init(&conn->io, fd, standin_tcp_recv, conn);
+    loop_io_start(standin->loop, &conn->io, EPOLLIN);
+}
+
+static void standin_wake(struct loop_io *io, uint32_t events)
+{
+    (void)events;
+
+    struct standin *standin = io->arg;
+    uint64_t count;
+
+    if (read(io->fd, &count, sizeof count) < 0 && errno != EAGAIN)
+        log(LOG_WARNING, "Failed to read from eventfd: %s", strerror(errno));
+
+    loop_stop(standin->loop);
+}
+
+static void *standin_run(void *arg)
+{
+    struct standin *standin = arg;
+
+    loop_run(standin->loop);
+
+    return NULL;
+}
+
+static int standin_socket(int type, uint16_t port)
+{
+    int fd = socket(AF_INET, type | SOCK_CLOEXEC, 0);
+
+    if (fd < 0)
+        die(EX_OSERR, "Failed to create socket: %s", strerror(errno));
+
+    int one = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof one);
+
+    struct sockaddr_in addr = {
+        .sin_family = AF_INET,
+        .sin_port = htons(port),
+        .sin_addr.s_addr = htonl(INADDR_LOOPBACK)
+    };
+
+    if (bind(fd, (struct sockaddr *)&addr, sizeof addr) < 0)
+        die(EX_OSERR, "Failed to bind stand-in server to port %u: %s", port, strerror(errno));
+
+    return fd;
+}
+
+static char *standin_strdup(const char *str)
+{
+    return str ? strdup(str) : NULL;
+}
+
+struct standin *standin_new(const struct standin_opts *opts)
+{
+    struct standin *standin = xcalloc(1, sizeof *standin);
+
+    if (opts)
+        standin->opts = *opts;
+
+    standin->opts.zone = standin_strdup(standin->opts.zone);
+    standin->opts.cred.algorithm = standin_strdup(standin->opts.cred.algorithm);
+    standin->opts.cred.keyname = standin_strdup(standin->opts.cred.keyname);
+    standin->opts.cred.keydata = standin_strdup(standin->opts.cred.keydata);
+
+    if (standin->opts.zone && !(standin->zone = ldns_dname_new_frm_str(standin->opts.zone)))
+        die(EX_DATAERR, "Invalid zone %s", standin->opts.zone);
+
+    // UDP picks the port, if any will do, and TCP takes the same
+    int udp = standin_socket(SOCK_DGRAM | SOCK_NONBLOCK, standin->opts.port);
+
+    struct sockaddr_in addr;
+    socklen_t addrlen = sizeof addr;
+
+    if (getsockname(udp, (struct sockaddr *)&addr, &addrlen) < 0)
+        die(EX_OSERR, "Failed to get stand-in server address: %s", strerror(errno));
+
+    standin->port = ntohs(addr.sin_port);
+
+    int tcp = standin_socket(SOCK_STREAM | SOCK_NONBLOCK, standin->port);
+
+    if (listen(tcp, 16) < 0)
+        die(EX_OSERR, "Failed to listen on port %u: %s", standin->port, strerror(errno));
+
+    int wake = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+    if (wake < 0)
+        die(EX_OSERR, "Failed to create eventfd: %s", strerror(errno));
+
+    map_ops(standin_rrset) ops = {
+        .compare = strcmp,
+        .hash = hash_str,
+        .key_alloc = (const char *(*)(const char *))strdup,
+        .key_free = (void (*)(const char *))free,
+        .val_free = standin_rrset_free
+    };
+
+    standin->rrsets = map_new_standin_rrset(16, ops);
+    standin->serial = 1;
+    standin->rng = pcgstate;
+    standin->tail = &standin->head;
+
+    pthread_mutex_init(&standin->lock, NULL);
+
+    standin->loop = loop_new();
+    loop_timer_init(&standin->timer, standin_flush, standin);
+
+    loop_io_init(&standin->udp, udp, standin_udp_recv, standin);
+    loop_io_start(standin->loop, &standin->udp, EPOLLIN);
+
+    loop_io_init(&standin->tcp, tcp, standin_accept, standin);
+    loop_io_start(standin->loop, &standin->tcp, EPOLLIN);
+
+    loop_io_init(&standin->wake, wake, standin_wake, standin);
+    loop_io_start(standin->loop, &standin->wake, EPOLLIN);
+
+    return standin;
+}
+
+void standin_free(struct standin *standin)
+{
+    if (!standin)
+        return;
+
+    while (standin->conns)
+        standin_conn_close(standin->conns);
+
+    while (standin->head) {
+        struct standin_reply *reply = standin->head;
+        standin->head = reply->next;
+
+        free(reply->wire);
+        free(reply);
+    }
+
+    loop_io_stop(standin->loop, &standin->udp);
+    loop_io_stop(standin->loop, &standin->tcp);
+    loop_io_stop(standin->loop, &standin->wake);
+    loop_timer_disarm(standin->loop, &standin->timer);
+    loop_free(standin->loop);
+
+    close(standin->udp.fd);
+    close(standin->tcp.fd);
+    close(standin->wake.fd);
+
+    map_free_standin_rrset(standin->rrsets);
+    ldns_rdf_deep_free(standin->zone);
+    pthread_mutex_destroy(&standin->lock);
+
+    free((void *)standin->opts.zone);
+    free((void *)standin->opts.cred.algorithm);
+    free((void *)standin->opts.cred.keyname);
+    free((void *)standin->opts.cred.keydata);
+
+    free(standin->changes);
+    free(standin);
+}
+
+uint16_t standin_port(const struct standin *standin)
+{
+    return standin->port;
+}
+
+void standin_start(struct standin *standin)
+{
+    int ret = pthread_create(&standin->thread, NULL, standin_run, standin);
+
+    if (ret != 0)
+        die(EX_OSERR, "Failed to create stand-in server thread: %s", strerror(ret));
+}
+
+void standin_stop(struct standin *standin)
+{
+    uint64_t one = 1;
+
+    if (write(standin->wake.fd, &one, sizeof one) < 0)
+        die(EX_OSERR, "Failed to write to eventfd: %s", strerror(errno));
+
+    pthread_join(standin->thread, NULL);
+}
+
+// Records present before ipup starts, to be picked up by the startup synchronization
+void standin_zone_add(struct standin *standin, const char *name,
+        const struct in6_addr *addr, uint32_t ttl)
+{
+    ldns_rdf *dname = ldns_dname_new_frm_str(name);
+
+    if (!dname)
+        die(EX_DATAERR, "Invalid name %s", name);
+
+    char *key = standin_name(dname);
+
+    pthread_mutex_lock(&standin->lock);
+
+    if (standin_rrset_add(standin_rrset(standin, key), addr, ttl))
+        standin->serial++;
+
+    pthread_mutex_unlock(&standin->lock);
+
+    free(key);
+    ldns_rdf_deep_free(dname);
+}
+
+// Copies up to `max` addresses of the name, returns how many it has
+size_t standin_zone_get(struct standin *standin, const char *name,
+        struct in6_addr *addrs, size_t max)
+{
+    ldns_rdf *dname = ldns_dname_new_frm_str(name);
+
+    if (!dname)
+        die(EX_DATAERR, "Invalid name %s", name);
+
+    char *key = standin_name(dname);
+    struct standin_rrset *rrset;
+    size_t count = 0;
+
+    pthread_mutex_lock(&standin->lock);
+
+    if (map_get_standin_rrset(standin->rrsets, key, &rrset)) {
+        count = rrset->used;
+
+        for (size_t i = 0; i < count && i < max; i++)
+            addrs[i] = rrset->rrs[i].addr;
+    }
+
+    pthread_mutex_unlock(&standin->lock);
+
+    free(key);
+    ldns_rdf_deep_free(dname);
+
+    return count;
+}
+
+uint32_t standin_serial(struct standin *standin)
+{
+    pthread_mutex_lock(&standin->lock);
+    uint32_t serial = standin->serial;
+    pthread_mutex_unlock(&standin->lock);
+
+    return serial;
+}
+
+void standin_stats(struct standin *standin, struct standin_stats *stats)
+{
+    pthread_mutex_lock(&standin->lock);
+    *stats = standin->stats;
+    pthread_mutex_unlock(&standin->lock);
+}
+
+const struct standin_change *standin_changes(const struct standin *standin, size_t *count)
+{
+    *count = standin->nchanges;
+    return standin->changes;
+}
@@ -0,0 +1,71 @@
+#ifndef STANDIN_H
+#define STANDIN_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include <netinet/in.h>
+#include <ldns/ldns.h>
+
+// Stand-in for the authoritative DNS server, answering UPDATEs and queries
+// over UDP and TCP on the loopback interface, from a thread of its own.
+// AAAA records are kept in memory, and faults can be injected at random.
+
+struct standin;
+
+struct standin_opts {
+    // Bound to any free port if 0
+    uint16_t port;
+    // UPDATEs for other zones get NOTAUTH, any zone is accepted if NULL
+    const char *zone;
+    // Requests have to be signed with this key, if one is set
+    ldns_tsig_credentials cred;
+    // Added to every answer, in milliseconds
+    uint32_t latency;
+    // Percentage of requests that are dropped, answered with SERVFAIL or
+    // REFUSED, or answered over UDP with the TC bit set
+    uint8_t loss, servfail, refused, truncate;
+};
+
+// Each address added or deleted by an UPDATE, with the time of the answer
+struct standin_change {
+    struct in6_addr addr;
+    // Monotonic clock, in nanoseconds
+    int64_t time;
+    bool delete;
+};
+
+struct standin_stats {
+    uint64_t packets;
+    // Received over TCP, included in `packets`
+    uint64_t tcp;
+    uint64_t updates;
+    uint64_t queries;
+    // Resource records in the update sections
+    uint64_t rrs;
+    // Injected faults
+    uint64_t dropped, servfail, refused, truncated;
+    // Missing or invalid signatures
+    uint64_t badsig;
+};
+
+struct standin *standin_new(const struct standin_opts *opts);
+void standin_free(struct standin *standin);
+
+uint16_t standin_port(const struct standin *standin);
+
+void standin_start(struct standin *standin);
+void standin_stop(struct standin *standin);
+
+void standin_zone_add(struct standin *standin, const char *name,
+        const struct in6_addr *addr, uint32_t ttl);
+size_t standin_zone_get(struct standin *standin, const char *name,
+        struct in6_addr *addrs, size_t max);
+uint32_t standin_serial(struct standin *standin);
+
+void standin_stats(struct standin *standin, struct standin_stats *stats);
+
+// Only valid while the server is stopped
+const struct standin_change *standin_changes(const struct standin *standin, size_t *count);
+
+#endif /* STANDIN_H */
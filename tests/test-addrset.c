@@ -0,0 +1,60 @@
+#include "common.h"
+
+#include "addrset.h"
+
+static struct in6_addr addr_from_u32(uint32_t a, uint32_t b)
+{
+    struct in6_addr addr = {{{ 0x20, 0x01, 0x0d, 0xb8 }}};
+
+    memcpy(&addr.s6_addr[8], &a, sizeof a);
+    memcpy(&addr.s6_addr[12], &b, sizeof b);
+
+    return addr;
+}
+
+Test(addrset, duplicates_are_rejected) {
+    struct addrset *set = addrset_new(0);
+    struct in6_addr addr = addr_from_u32(1, 2);
+
+    expect(addrset_add(set, &addr));
+    expect(not(addrset_add(set, &addr)));
+    expect(eq(sz, addrset_count(set), 1));
+
+    addrset_free(set);
+}
+
+Test(addrset, only_present_addresses_are_marked) {
+    struct addrset *set = addrset_new(2);
+    struct in6_addr a = addr_from_u32(1, 2), b = addr_from_u32(2, 1);
+
+    addrset_add(set, &a);
+
+    expect(not(addrset_marked(set, &a)));
+    expect(addrset_mark(set, &a));
+    expect(addrset_marked(set, &a));
+
+    expect(not(addrset_mark(set, &b)));
+    expect(not(addrset_marked(set, &b)));
+
+    addrset_free(set);
+}
+
+Test(addrset, marks_survive_growth) {
+    struct addrset *set = addrset_new(0);
+    struct in6_addr addrs[512];
+
+    for (size_t i = 0; i < 512; i++) {
+        addrs[i] = addr_from_u32(pcg32_random_r(&pcgstate), i);
+        assert(addrset_add(set, &addrs[i]));
+
+        if (i % 3 == 0)
+            addrset_mark(set, &addrs[i]);
+    }
+
+    expect(eq(sz, addrset_count(set), 512));
+
+    for (size_t i = 0; i < 512; i++)
+        expect(addrset_marked(set, &addrs[i]) == (i % 3 == 0));
+
+    addrset_free(set);
+}
@@ -0,0 +1,125 @@
+#include "common.h"
+
+#include "batch.c"
+
+static struct loop *loop;
+static conf_serv servconf;
+static conf_if ifconf = { .server = &servconf };
+
+static void setup(void)
+{
+    loop = loop_new();
+    servconf.batch = batch_new(&servconf, loop);
+
+    ifconf.zone = ldns_dname_new_frm_str("example.com.");
+    ifconf.record = ldns_dname_new_frm_str("foo.example.com.");
+}
+
+static void teardown(void)
+{
+    batch_free(servconf.batch);
+    servconf.batch = NULL;
+
+    loop_free(loop);
+
+    ldns_rdf_deep_free(ifconf.zone);
+    ldns_rdf_deep_free(ifconf.record);
+}
+
+TestSuite(batch, .init = setup, .fini = teardown);
+
+Test(batch, add_and_delete_cancel_out) {
+    struct sockaddr_in6 a = mkaddr("2001:db8::1");
+    struct sockaddr_in6 b = mkaddr("2001:db8::2");
+
+    batch_add(&ifconf, &a, false, 3600);
+    batch_add(&ifconf, &b, false, 3600);
+    batch_add(&ifconf, &a, true, 0);
+
+    struct batch *batch = servconf.batch;
+
+    assert(eq(sz, batch->used, 1));
+    expect(eq(sz, batch->zones[0].used, 1));
+    expect(eq(i32, memcmp(&batch->zones[0].ops[0].addr, &b, sizeof b), 0));
+}
+
+Test(batch, repeated_changes_are_coalesced) {
+    struct sockaddr_in6 a = mkaddr("2001:db8::1");
+
+    batch_add(&ifconf, &a, false, 3600);
+    batch_add(&ifconf, &a, false, 60);
+
+    struct batch *batch = servconf.batch;
+
+    assert(eq(sz, batch->zones[0].used, 1));
+    expect(eq(u32, batch->zones[0].ops[0].ttl, 60));
+    expect(loop_timer_armed(&batch->timer));
+}
+
+Test(batch, default_ttl_is_the_one_sent) {
+    struct sockaddr_in6 a = mkaddr("2001:db8::1");
+    struct sockaddr_in6 b = mkaddr("2001:db8::2");
+
+    batch_add(&ifconf, &a, false, 0);
+    batch_add(&ifconf, &b, true, 60);
+
+    struct batch *batch = servconf.batch;
+
+    assert(eq(sz, batch->zones[0].used, 2));
+    expect(eq(u32, batch->zones[0].ops[0].ttl, DNS_DEFAULT_TTL));
+    expect(eq(u32, batch->zones[0].ops[1].ttl, 0));
+}
+
+Test(batch, late_failures_of_superseded_changes_are_not_retried) {
+    struct sockaddr_in6 a = mkaddr("2001:db8::1");
+    struct batch *batch = servconf.batch;
+
+    servconf.retry = retry_new(loop, 16, batch_requeue);
+
+    // As if it had been sent
+    batch_add(&ifconf, &a, false, 3600);
+
+    struct batch_sent *sent = xcalloc(1, sizeof *sent);
+
+    sent->server = &servconf;
+    sent->ops[sent->count++] = batch->zones[0].ops[0];
+    batch->zones[0].used = 0;
+
+    batch_add(&ifconf, &a, true, 0);
+    batch_sent_done(sent, false);
+
+    expect(eq(sz, retry_count(servconf.retry), 0));
+
+    retry_free(servconf.retry);
+    servconf.retry = NULL;
+}
+
+Test(batch, changes_wait_for_the_update_in_flight_for_their_record) {
+    struct sockaddr_in6 a = mkaddr("2001:db8::1");
+    struct sockaddr_in6 b = mkaddr("2001:db8::2");
+    struct batch *batch = servconf.batch;
+
+    servconf.shadow = shadow_new();
+
+    // An earlier UPDATE, adding b
+    struct batch_sent *sent = xcalloc(1, sizeof *sent);
+
+    sent->server = &servconf;
+    sent->ops[sent->count++] = (struct batch_op) { .ifconf = &ifconf, .record = ifconf.record, .addr = b };
+    shadow_sent(servconf.shadow, ifconf.record);
+
+    batch_add(&ifconf, &a, false, 3600);
+    batch_flush(batch);
+
+    // Nothing was sent, the channel would have been needed for that
+    assert(eq(sz, batch->zones[0].used, 1));
+    expect(not(loop_timer_armed(&batch->timer)));
+
+    batch_sent_done(sent, true);
+
+    expect(eq(sz, shadow_get(servconf.shadow, ifconf.record)->inflight, 0));
+    expect(loop_timer_armed(&batch->timer));
+
+    shadow_free(servconf.shadow);
+    servconf.shadow = NULL;
+}
@@ -23,3 +23,100 @@ Test(conf, str_to_time_duration_bails_on_invalid_inputs) {
     expect(not(str_to_time_duration(&out, "1sss")));
     expect(not(str_to_time_duration(&out, "3g,")));
 }
+
+static int load(const char *text, struct conf *conf)
+{
+    FILE *file = fmemopen((void *)text, strlen(text), "r");
+    assert(not(eq(ptr, file, NULL)));
+
+    int status = conf_load(file, "test", conf);
+    fclose(file);
+
+    return status;
+}
+
+Test(conf, load_reports_errors_instead_of_exiting) {
+    struct conf conf;
+
+    expect(eq(i32, load("[server/a]\nport = 0\n", &conf), EX_DATAERR));
+    expect(eq(ptr, conf.servers, NULL));
+
+    // No server
+    expect(eq(i32, load("[iface/x]\nzone = example.com.\nrecord = x\n", &conf), EX_DATAERR));
+    expect(eq(ptr, conf.ifaces, NULL));
+
+    expect(eq(i32, load("[server/a]\nzone = example.com.\nrecord = a\n"
+                    "[iface/x]\nserver = a\nttl = 1h\nrespect-ttl = yes\n", &conf), EX_DATAERR));
+
+    assert(eq(i32, load("[server/a]\nzone = example.com.\nrecord = a\n"
+                    "[iface/x]\nserver = a\n", &conf), EX_OK));
+    expect(eq(str, conf.path, "test"));
+
+    conf_free(conf);
+}
+
+#define RELOAD_LIVE                                                     \
+    "[server/a]\nport = 5353\nbatch-window = 100\n"                     \
+    "[server/b]\nport = 53\n"                                           \
+    "[iface/x]\nserver = a\nzone = example.com.\nrecord = x\n"          \
+    "[iface/y]\nserver = a\nzone = example.com.\nrecord = y\n"          \
+    "[iface/z]\nserver = b\nzone = example.org.\nrecord = z\n"
+
+#define RELOAD_FRESH                                                    \
+    "[server/a]\nport = 5353\nbatch-window = 100\n"                     \
+    "[server/b]\nport = 54\n"                                           \
+    "[iface/x]\nserver = a\nzone = example.com.\nrecord = x\n"          \
+    "[iface/y]\nserver = a\nzone = example.com.\nrecord = w\n"          \
+    "[iface/z]\nserver = b\nzone = example.org.\nrecord = z\n"
+
+Test(conf, reload_keeps_what_did_not_change) {
+    struct conf live, fresh;
+
+    assert(eq(i32, load(RELOAD_LIVE, &live), EX_OK));
+    assert(eq(i32, load(RELOAD_FRESH, &fresh), EX_OK));
+
+    conf_serv *olda, *oldb, *newa, *newb;
+    conf_if *oldx, *oldy, *oldz, *newx, *newy, *newz;
+
+    assert(map_get_conf_serv(live.servers, "a", &olda));
+    assert(map_get_conf_serv(live.servers, "b", &oldb));
+    assert(map_get_conf_serv(fresh.servers, "a", &newa));
+    assert(map_get_conf_serv(fresh.servers, "b", &newb));
+
+    expect(conf_serv_equal(olda, newa));
+    expect(not(conf_serv_equal(oldb, newb)));
+
+    conf_keep_serv(&fresh, &live, "a");
+
+    assert(map_get_conf_serv(fresh.servers, "a", &newa));
+    expect(eq(ptr, newa, olda));
+
+    assert(map_get_conf_if(live.ifaces, "x", &oldx));
+    assert(map_get_conf_if(live.ifaces, "y", &oldy));
+    assert(map_get_conf_if(live.ifaces, "z", &oldz));
+    assert(map_get_conf_if(fresh.ifaces, "x", &newx));
+    assert(map_get_conf_if(fresh.ifaces, "y", &newy));
+    assert(map_get_conf_if(fresh.ifaces, "z", &newz));
+
+    // Moved over to the kept server
+    expect(eq(ptr, newx->server, olda));
+    expect(eq(ptr, newy->server, olda));
+
+    expect(conf_if_equal(oldx, newx));
+    expect(not(conf_if_equal(oldy, newy)));
+    expect(not(conf_if_equal(oldz, newz)));
+
+    conf_keep_if(&fresh, &live, "x");
+
+    assert(map_get_conf_if(fresh.ifaces, "x", &newx));
+    expect(eq(ptr, newx, oldx));
+
+    conf_free(live);
+
+    // Names point into the map of the configuration that is left
+    expect(eq(str, newa->name, "a"));
+    expect(eq(str, newx->name, "x"));
+    expect(eq(ptr, newx->server, newa));
+
+    conf_free(fresh);
+}
@@ -30,3 +30,37 @@ Test(dns, invalid_tsig_key_is_invalid) {
     cr_expect(eq(dns_tsig_credentials_validate(cred), (ldns_status)LDNS_STATUS_INVALID_B64),
             "Key with no padding considered valid");
 }
+
+Test(dns, update_wire_has_expected_rrs) {
+    ldns_rdf *zone = ldns_dname_new_frm_str("example.com.");
+    ldns_rdf *record = ldns_dname_new_frm_str("foo.example.com.");
+
+    uint8_t wire[512];
+    struct in6_addr addr = IN6ADDR_LOOPBACK_INIT;
+
+    size_t len = dns_wire_update_init(wire, zone);
+    size_t rr = len + ldns_rdf_size(record);
+
+    len = dns_wire_update_push(wire, len, sizeof wire, record, &addr, false, 0);
+    len = dns_wire_update_push(wire, len, sizeof wire, record, &addr, true, 60);
+
+    ldns_pkt *pkt = NULL;
+
+    assert(eq(ldns_wire2pkt(&pkt, wire, len), (ldns_status)LDNS_STATUS_OK));
+    expect(eq(i32, ldns_pkt_get_opcode(pkt), LDNS_PACKET_UPDATE));
+
+    // The update section is returned as the authority section
+    ldns_rr_list *updates = ldns_pkt_authority(pkt);
+
+    assert(eq(sz, ldns_rr_list_rr_count(updates), 2));
+    expect(eq(u32, ldns_rr_ttl(ldns_rr_list_rr(updates, 0)), DNS_DEFAULT_TTL));
+    expect(eq(i32, ldns_rr_get_class(ldns_rr_list_rr(updates, 1)), LDNS_RR_CLASS_NONE));
+    expect(eq(u32, ldns_rr_ttl(ldns_rr_list_rr(updates, 1)), 0));
+
+    // Additions are in the IN class
+    expect(eq(i32, wire[rr + 3], LDNS_RR_CLASS_IN));
+
+    ldns_pkt_free(pkt);
+    ldns_rdf_deep_free(zone);
+    ldns_rdf_deep_free(record);
+}
@@ -0,0 +1,100 @@
+#include "common.h"
+
+#include "filter.c"
+
+// Minimal interpreter for the subset of classic BPF used by the filter
+static uint32_t run_filter(const struct sock_filter *insns, size_t len,
+        const uint8_t *pkt, size_t pktlen)
+{
+    uint32_t acc = 0;
+
+    for (size_t pc = 0; pc < len; pc++) {
+        const struct sock_filter *insn = &insns[pc];
+
+        switch (insn->code) {
+            case BPF_LD | BPF_B | BPF_ABS:
+                cr_assert(insn->k + 1 <= pktlen);
+                acc = pkt[insn->k];
+                break;
+            case BPF_LD | BPF_H | BPF_ABS:
+                cr_assert(insn->k + 2 <= pktlen);
+                acc = (uint32_t)pkt[insn->k] << 8 | pkt[insn->k + 1];
+                break;
+            case BPF_LD | BPF_W | BPF_ABS:
+                cr_assert(insn->k + 4 <= pktlen);
+                acc = (uint32_t)pkt[insn->k] << 24 | (uint32_t)pkt[insn->k + 1] << 16 |
+                    (uint32_t)pkt[insn->k + 2] << 8 | pkt[insn->k + 3];
+                break;
+            case BPF_JMP | BPF_JEQ | BPF_K:
+                pc += acc == insn->k ? insn->jt : insn->jf;
+                break;
+            case BPF_JMP | BPF_JSET | BPF_K:
+                pc += acc & insn->k ? insn->jt : insn->jf;
+                break;
+            case BPF_RET | BPF_K:
+                return insn->k;
+            default:
+                cr_assert_fail("Unexpected instruction");
+        }
+    }
+
+    cr_assert_fail("Filter fell through");
+    return 0;
+}
+
+struct addrmsg {
+    struct nlmsghdr hdr;
+    struct ifaddrmsg ifa;
+};
+
+static bool accepts(const int *ifidx, size_t count, struct addrmsg msg)
+{
+    size_t len;
+    struct sock_filter *insns = filter_build(ifidx, count, &len);
+
+    uint32_t ret = run_filter(insns, len, (const uint8_t *)&msg, sizeof msg);
+    free(insns);
+
+    return ret != 0;
+}
+
+static struct addrmsg addrmsg(uint16_t type, uint8_t family, uint8_t scope, int ifidx)
+{
+    return (struct addrmsg) {
+        .hdr = { .nlmsg_len = sizeof(struct addrmsg), .nlmsg_type = type },
+        .ifa = { .ifa_family = family, .ifa_scope = scope, .ifa_index = ifidx }
+    };
+}
+
+Test(filter, only_monitored_global_ipv6_addresses_pass) {
+    int ifidx[] = { 2, 7, 300 };
+    size_t count = sizeof ifidx / sizeof ifidx[0];
+
+    expect(accepts(ifidx, count, addrmsg(RTM_NEWADDR, AF_INET6, RT_SCOPE_UNIVERSE, 7)));
+    expect(accepts(ifidx, count, addrmsg(RTM_DELADDR, AF_INET6, RT_SCOPE_UNIVERSE, 300)));
+
+    expect(not(accepts(ifidx, count, addrmsg(RTM_NEWADDR, AF_INET6, RT_SCOPE_UNIVERSE, 3))));
+    expect(not(accepts(ifidx, count, addrmsg(RTM_NEWADDR, AF_INET, RT_SCOPE_UNIVERSE, 2))));
+    expect(not(accepts(ifidx, count, addrmsg(RTM_NEWADDR, AF_INET6, RT_SCOPE_LINK, 2))));
+}
+
+Test(filter, other_messages_pass) {
+    int ifidx[] = { 2 };
+
+    expect(accepts(ifidx, 1, addrmsg(RTM_NEWLINK, AF_UNSPEC, 0, 5)));
+
+    struct addrmsg dump = addrmsg(RTM_NEWADDR, AF_INET, RT_SCOPE_HOST, 5);
+    dump.hdr.nlmsg_flags = NLM_F_MULTI;
+
+    expect(accepts(ifidx, 1, dump));
+}
+
+Test(filter, interface_check_is_skipped_past_limit) {
+    static int ifidx[FILTER_MAX_IFACES + 1];
+
+    for (size_t i = 0; i < FILTER_MAX_IFACES + 1; i++)
+        ifidx[i] = i + 1;
+
+    expect(accepts(ifidx, FILTER_MAX_IFACES + 1,
+                addrmsg(RTM_NEWADDR, AF_INET6, RT_SCOPE_UNIVERSE, 5000)));
+}
@@ -0,0 +1,59 @@
+#include "common.h"
+
+#include "hash.h"
+
+static const char *inputs[] = {
+    "",
+    "a",
+    "abc",
+    "message digest",
+    "abcdefghijklmnopqrstuvwxyz",
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789",
+    "12345678901234567890123456789012345678901234567890123456789012345678901234567890"
+};
+
+Test(hash, wyhash_matches_reference) {
+    // From the test vectors of the reference implementation, seeded with the index
+    uint64_t expected[] = {
+        0x93228a4de0eec5a2LLU, 0xc5bac3db178713c4LLU, 0xa97f2f7b1d9b3314LLU,
+        0x786d1f1df3801df4LLU, 0xdca5a8138ad37c87LLU, 0xb9e734f117cfaf70LLU,
+        0x6cc5eab49a92d617LLU
+    };
+
+    for (size_t i = 0; i < sizeof inputs / sizeof *inputs; i++)
+        expect(eq(u64, wyhash(inputs[i], strlen(inputs[i]), i), expected[i]));
+}
+
+Test(hash, string_hash_ignores_what_follows) {
+    char buf[] = "eth0\0garbage";
+
+    expect(eq(u64, hash_str(buf), hash_bytes("eth0", 4)));
+    expect(eq(u64, murmurhash64a(buf), murmurhash64a_len("eth0garbage", 4)));
+}
+
+Test(hash, every_byte_counts) {
+    char buf[32];
+
+    for (size_t len = 1; len < sizeof buf; len++) {
+        memset(buf, 'x', sizeof buf);
+        uint64_t h = hash_bytes(buf, len);
+
+        for (size_t i = 0; i < len; i++) {
+            buf[i] = 'y';
+            expect(neq(u64, hash_bytes(buf, len), h), "Byte %zu of %zu ignored", i, len);
+            buf[i] = 'x';
+        }
+
+        expect(neq(u64, hash_bytes(buf, len - 1), h));
+    }
+}
+
+Test(hash, int_hash_mixes_low_bits) {
+    // Keys that differ only in high bits end up in different low bits
+    size_t same = 0;
+
+    for (uint64_t i = 1; i < 256; i++)
+        same += (hash_int(i << 32) & 0xff) == (hash_int(0) & 0xff);
+
+    expect(lt(sz, same, 8));
+}
@@ -0,0 +1,132 @@
+#include "common.h"
+
+#include "log.c"
+#include "xalloc.h"
+
+// Lines go to stdout, which is pointed at a temporary file
+
+static FILE *out;
+
+static void capture(void)
+{
+    out = tmpfile();
+    assert(not(eq(ptr, out, NULL)));
+    assert(eq(i32, dup2(fileno(out), STDOUT_FILENO), STDOUT_FILENO));
+
+    log_init("test", LOG_MODE_STDOUT);
+}
+
+// Everything written until the logger is closed, NUL-terminated
+static char *captured(void)
+{
+    log_close();
+
+    off_t size = lseek(fileno(out), 0, SEEK_END);
+    assert(ge(i64, size, 0));
+
+    char *text = xmalloc(size + 1);
+    assert(eq(i64, pread(fileno(out), text, size, 0), size));
+    text[size] = '\0';
+
+    fclose(out);
+
+    return text;
+}
+
+static size_t count_lines(const char *text)
+{
+    size_t count = 0;
+
+    for (; *text; text++)
+        count += *text == '\n';
+
+    return count;
+}
+
+Test(log, masked_levels_are_not_evaluated) {
+    capture();
+
+    int evaluated = 0;
+
+    log_mask(1 << LOG_INFO);
+    log(LOG_INFO, "info %d", ++evaluated);
+    log(LOG_NOTICE, "notice %d", evaluated);
+
+    // Compiled out at the default `LOG_LEVEL`
+    expect(not(log_enabled(LOG_DEBUG)));
+
+    char *text = captured();
+
+    expect(eq(i32, evaluated, 0));
+    expect(eq(ptr, strstr(text, "info"), NULL));
+    expect(not(eq(ptr, strstr(text, "[" S_LOG_NOTICE "] notice 0\n"), NULL)));
+
+    free(text);
+}
+
+Test(log, long_lines_are_truncated) {
+    capture();
+
+    char arg[2 * LOG_LINE_MAX];
+    memset(arg, 'x', sizeof arg - 1);
+    arg[sizeof arg - 1] = '\0';
+
+    log(LOG_INFO, "%s", arg);
+    log(LOG_INFO, "next");
+
+    char *text = captured();
+    char *end = strchr(text, '\n');
+
+    assert(not(eq(ptr, end, NULL)));
+    expect(eq(sz, end - text, LOG_LINE_MAX - 1));
+    expect(eq(i32, memcmp(end - 3, "...", 3), 0));
+    expect(eq(i32, strcmp(end + 1, "[" S_LOG_INFO "] next\n"), 0));
+
+    free(text);
+}
+
+Test(log, full_ring_reports_dropped_lines) {
+    capture();
+
+    // Keeps the logging thread from taking anything out of the ring
+    pthread_mutex_lock(&state.lock);
+
+    for (int i = 0; i < LOG_RING_SIZE + 10; i++)
+        log(LOG_INFO, "line %d", i);
+
+    pthread_mutex_unlock(&state.lock);
+
+    char *text = captured();
+
+    // The ring holds exactly `LOG_RING_SIZE` lines, the newest are dropped
+    expect(eq(sz, count_lines(text), LOG_RING_SIZE + 1));
+    expect(not(eq(ptr, strstr(text, "[" S_LOG_INFO "] line 2047\n"), NULL)));
+    expect(eq(ptr, strstr(text, "[" S_LOG_INFO "] line 2048\n"), NULL));
+    expect(not(eq(ptr, strstr(text, "[" S_LOG_WARNING "] 10 log message(s) dropped\n"), NULL)));
+
+    free(text);
+}
+
+Test(log, close_flushes_pending_lines) {
+    capture();
+
+    pthread_mutex_lock(&state.lock);
+
+    for (int i = 0; i < 100; i++)
+        log(LOG_INFO, "line %d", i);
+
+    // Nothing can have been written yet
+    expect(eq(i64, lseek(fileno(out), 0, SEEK_END), 0));
+
+    pthread_mutex_unlock(&state.lock);
+
+    char *text = captured();
+
+    const char *first = "[" S_LOG_INFO "] line 0\n";
+
+    expect(eq(sz, count_lines(text), 100));
+    expect(eq(i32, strncmp(text, first, strlen(first)), 0));
+    expect(not(eq(ptr, strstr(text, "[" S_LOG_INFO "] line 99\n"), NULL)));
+
+    free(text);
+}
@@ -10,9 +10,15 @@ map_ops(str) owning = {
     .key_alloc = (const char *(*)(const char *))strdup,
     .key_free = (void (*)(const char *))free,
     .compare = strcmp,
-    .hash = murmurhash64a
+    .hash = hash_str
 };
 
+// Keeps collisions predictable
+static uint64_t identity(uint64_t key)
+{
+    return key;
+}
+
 uint64_t map_get_self_wrap(map(self) *map, uint64_t key)
 {
     uint64_t res;
@@ -24,37 +30,150 @@ uint64_t map_get_self_wrap(map(self) *map, uint64_t key)
 }
 
 Test(map, new_entries_of_same_hash_override_previous) {
-    map_ops(self) ops = {0};
+    map_ops(self) ops = { .hash = identity };
 
     map(self) *map = map_new_self(16, ops);
 
-    for (uint64_t i = 0; i < floor(16 * MAP_LOAD_FACTOR); i++)
+    // Multiples of the size share the first slot,
+    // and push the entries that belong to the following slots further away
+    for (uint64_t i = 0; i < 4; i++) {
+        map_set_self(map, i * map->size, i);
+        map_set_self(map, i * map->size + 1, i);
+    }
+
+    map_set_self(map, 16, 62);
+    map_set_self(map, 33, 31);
+    map_set_self(map, 16, 63);
+
+    cr_assert(eq(sz, map->used, 8));
+    cr_assert(eq(u64, map_get_self_wrap(map, 16), 63));
+    cr_assert(eq(u64, map_get_self_wrap(map, 33), 31));
+    cr_assert(eq(u64, map_get_self_wrap(map, 48), 3));
+    cr_assert(eq(u64, map_get_self_wrap(map, 1), 0));
+
+    uint64_t res;
+    cr_assert(not(map_get_self(map, 64, &res)), "Missing key found in map");
+
+    // Entries are still found after the map grows
+    for (uint64_t i = 100; map->size == 16; i++)
         map_set_self(map, i, i);
 
-    uint64_t used = 0;
+    cr_assert(eq(u64, map_get_self_wrap(map, 16), 63));
+    cr_assert(eq(u64, map_get_self_wrap(map, 49), 3));
+    cr_assert(eq(u64, map_get_self_wrap(map, 100), 100));
+    cr_assert(not(map_get_self(map, 64, &res)), "Missing key found in map");
+
+    map_free_self(map);
+}
+
+Test(map, deleted_entries_are_gone) {
+    map_ops(self) ops = { .hash = identity };
+
+    map(self) *map = map_new_self(16, ops);
+
+    // Clustered keys, so that deletions have to shift other entries back
+    for (uint64_t i = 0; i < 12; i++)
+        map_set_self(map, i % 3 * map->size + i / 3, i);
+
+    for (uint64_t i = 0; i < 12; i += 2)
+        cr_assert(map_del_self(map, i % 3 * map->size + i / 3));
+
+    cr_assert(not(map_del_self(map, 0)), "Deleted key deleted twice");
+    cr_assert(eq(sz, map->used, 6));
 
-    for (uint64_t i = 0; i < 2; i++) {
-        for (uint64_t j = map->size * (i + 1); j < map->size * (i + 2); j++) {
-            map_set_self(map, j, j % map->size);
-            used++;
-            map->used--;
-        }
+    for (uint64_t i = 0; i < 12; i++) {
+        uint64_t res;
+        bool found = map_get_self(map, i % 3 * map->size + i / 3, &res);
+
+        cr_assert(eq(i32, found, i % 2), "Wrong entries deleted");
+
+        if (found)
+            cr_assert(eq(u64, res, i));
     }
 
-    map_set_self(map, 63, 62);
-    map_set_self(map, 31, 31);
-    map_set_self(map, 24, 24);
-    map_set_self(map, 63, 63);
-    map_set_self(map, 0, 1);
+    map_set_self(map, 0, 42);
+    cr_assert(eq(u64, map_get_self_wrap(map, 0), 42));
+
+    map_free_self(map);
+}
+
+static bool collect(uint64_t key, uint64_t val, void *arg)
+{
+    (void)key;
+
+    uint64_t **out = arg;
+    *(*out)++ = val;
+
+    return true;
+}
+
+Test(map, ordered_map_keeps_insertion_order) {
+    map_ops(self) ops = { .ordered = true };
+
+    map(self) *map = map_new_self(4, ops);
+
+    for (uint64_t i = 0; i < 10; i++)
+        map_set_self(map, i * 7, i);
+
+    map_del_self(map, 0);
+    map_del_self(map, 35);
+    map_del_self(map, 63);
+
+    uint64_t vals[10], *out = vals;
+    map_foreach_self(map, collect, &out);
+
+    uint64_t expected[] = { 1, 2, 3, 4, 6, 7, 8 };
+
+    cr_assert(eq(sz, out - vals, 7));
+
+    for (size_t i = 0; i < 7; i++)
+        cr_assert(eq(u64, vals[i], expected[i]));
+    cr_assert(eq(u64, map_get_self_wrap(map, 56), 8));
+
+    map_free_self(map);
+}
+
+Test(map, reserve_avoids_resizing) {
+    map_ops(self) ops = {0};
+
+    map(self) *map = map_new_self(4, ops);
+    map_reserve_self(map, 100);
+
+    size_t size = map->size;
+
+    for (uint64_t i = 0; i < 100; i++)
+        map_set_self(map, i, i);
+
+    cr_assert(eq(sz, map->size, size));
+    cr_assert(eq(u64, map_get_self_wrap(map, 99), 99));
+
+    map_free_self(map);
+}
+
+Test(map, aligned_keys_are_spread) {
+    map_ops(self) ops = {0};
+
+    map(self) *map = map_new_self(64, ops);
+
+    // Like pointers to 16-byte aligned allocations, which would only
+    // have 4 home slots out of 64 if they were not mixed
+    for (uint64_t i = 0; i < 48; i++)
+        map_set_self(map, 0x10000 + i * 16, i);
+
+    bool seen[64] = {0};
+    size_t homes = 0;
+
+    for (size_t i = 0; i < map->used; i++) {
+        size_t home = map->entries[i].hash & (map->size - 1);
+
+        homes += !seen[home];
+        seen[home] = true;
+    }
 
-    cr_assert(eq(u64, map_get_self_wrap(map, 63), 63));
-    cr_assert(eq(u64, map_get_self_wrap(map, 31), 31));
-    cr_assert(eq(u64, map_get_self_wrap(map, 24), 24));
-    cr_assert(eq(u64, map_get_self_wrap(map, 0), 1));
-    cr_assert(eq(u64, map_get_self_wrap(map, 54), 54 % map->size));
-    cr_assert(eq(u64, map_get_self_wrap(map, 19), 19 % map->size));
+    cr_assert(eq(sz, map->size, 64));
+    cr_assert(gt(sz, homes, 16), "Keys not spread over the map");
+    cr_assert(eq(u64, map_get_self_wrap(map, 0x10000 + 47 * 16), 47));
 
-    map->used += used;
     map_free_self(map);
 }
 
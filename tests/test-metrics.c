@@ -0,0 +1,115 @@
+#include "common.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#include "metrics.c"
+
+static map(conf_serv) *servers;
+static conf_serv servconf;
+static struct conf conf;
+
+static void setup(void)
+{
+    map_ops(conf_serv) ops = {
+        .compare = strcmp,
+        .hash = hash_str
+    };
+
+    servers = map_new_conf_serv(4, ops);
+    servconf.metrics = metrics_serv_new();
+
+    map_set_conf_serv(servers, "ns\"1", &servconf);
+
+    conf.servers = servers;
+}
+
+static void teardown(void)
+{
+    metrics_serv_free(servconf.metrics);
+    map_free_conf_serv(servers);
+}
+
+TestSuite(metrics, .init = setup, .fini = teardown);
+
+Test(metrics, buckets_bound_their_values) {
+    pcg32_random_t rng = pcgstate;
+
+    for (uint64_t us = 0; us < 4096; us++) {
+        size_t idx = metrics_hist_index(us);
+
+        assert(le(u64, us, metrics_hist_upper(idx)));
+
+        if (idx > 0)
+            assert(gt(u64, us, metrics_hist_upper(idx - 1)));
+    }
+
+    for (size_t i = 0; i < 100000; i++) {
+        uint64_t us = ((uint64_t)pcg32_random_r(&rng) << 32 | pcg32_random_r(&rng)) >> 30;
+        size_t idx = metrics_hist_index(us);
+
+        if (idx == METRICS_HIST_BUCKETS - 1)
+            continue;
+
+        uint64_t upper = metrics_hist_upper(idx);
+
+        // Within an eighth of the value
+        assert(le(u64, us, upper));
+        assert(le(u64, upper - us, us / METRICS_HIST_SUB + 1));
+    }
+
+    expect(eq(sz, metrics_hist_index(UINT64_MAX / 2), METRICS_HIST_BUCKETS - 1));
+}
+
+Test(metrics, quantiles) {
+    struct metrics_hist *hist = &servconf.metrics->rtt;
+
+    expect(eq(u64, metrics_hist_quantile(hist, 0.5), 0));
+
+    // 1ms to 100ms
+    for (int64_t ms = 1; ms <= 100; ms++)
+        metrics_hist_add(hist, ms * 1000000);
+
+    uint64_t p50 = metrics_hist_quantile(hist, 0.5);
+    uint64_t p99 = metrics_hist_quantile(hist, 0.99);
+
+    expect(ge(u64, p50, 50000));
+    expect(le(u64, p50, 50000 + 50000 / METRICS_HIST_SUB));
+    expect(ge(u64, p99, 99000));
+    expect(le(u64, p99, 99000 + 99000 / METRICS_HIST_SUB));
+    expect(eq(u64, metrics_load(&hist->sum), 5050000));
+}
+
+Test(metrics, openmetrics_text) {
+    struct metrics_serv *serv = servconf.metrics;
+
+    metrics_inc(&serv->sent);
+    metrics_inc(&serv->sent);
+    metrics_inc(&serv->rcodes[9]);
+    metrics_hist_add(&serv->ack, 3000000);
+
+    char *text = NULL;
+    size_t len = 0;
+
+    FILE *file = open_memstream(&text, &len);
+    assert(not(eq(ptr, file, NULL)));
+
+    metrics_write(file, &conf);
+    fclose(file);
+
+    expect(not(eq(ptr, strstr(text, "ipup_updates_sent_total{server=\"ns\\\"1\"} 2\n"), NULL)));
+    expect(not(eq(ptr, strstr(text, "ipup_update_replies_total{server=\"ns\\\"1\",rcode=\"NOTAUTH\"} 1\n"), NULL)));
+    expect(not(eq(ptr, strstr(text, "ipup_update_replies_total{server=\"ns\\\"1\",rcode=\"NOERROR\"} 0\n"), NULL)));
+    expect(eq(ptr, strstr(text, "rcode=\"NXDOMAIN\""), NULL));
+
+    // 3ms is in the bucket up to 2^12us
+    expect(not(eq(ptr, strstr(text, "ipup_event_ack_seconds_bucket{server=\"ns\\\"1\",le=\"0.002048\"} 0\n"), NULL)));
+    expect(not(eq(ptr, strstr(text, "ipup_event_ack_seconds_bucket{server=\"ns\\\"1\",le=\"0.004096\"} 1\n"), NULL)));
+    expect(not(eq(ptr, strstr(text, "ipup_event_ack_seconds_count{server=\"ns\\\"1\"} 1\n"), NULL)));
+    expect(not(eq(ptr, strstr(text, "ipup_event_ack_seconds_sum{server=\"ns\\\"1\"} 0.003000\n"), NULL)));
+
+    assert(ge(sz, len, sizeof "# EOF\n" - 1));
+    expect(eq(str, text + len - (sizeof "# EOF\n" - 1), "# EOF\n"));
+
+    free(text);
+}
@@ -0,0 +1,95 @@
+#include "common.h"
+
+#include "nscache.c"
+#include "standin.c"
+
+// Resolves the server's name against the stand-in server instead of the
+// system resolver, which holds two addresses for it
+
+static struct loop *loop;
+static struct standin *standin;
+static struct nscache *nscache;
+static conf_serv servconf = { .name = "standin" };
+
+static struct in6_addr ns1, ns2;
+
+static void setup(void)
+{
+    standin = standin_new(NULL);
+
+    ns1 = mkaddr("2001:db8::53").sin6_addr;
+    ns2 = mkaddr("2001:db8::54").sin6_addr;
+
+    standin_zone_add(standin, "ns.example.com.", &ns1, 600);
+    standin_zone_add(standin, "ns.example.com.", &ns2, 900);
+    standin_start(standin);
+
+    loop = loop_new();
+
+    // As resolved when the configuration was read
+    servconf.server = ldns_dname_new_frm_str("ns.example.com.");
+    servconf.resolv = ldns_resolver_new();
+    servconf.ns_ttl = 3600;
+
+    ldns_resolver_set_port(servconf.resolv, standin_port(standin));
+
+    ldns_rdf *ns = ldns_rdf_new_frm_str(LDNS_RDF_TYPE_A, "127.0.0.1");
+    assert(eq(i32, ldns_resolver_push_nameserver(servconf.resolv, ns), LDNS_STATUS_OK));
+    ldns_rdf_deep_free(ns);
+
+    servconf.chan = chan_new(servconf.resolv, NULL, loop, 0);
+
+    nscache = nscache_new(&servconf, loop);
+    assert(not(eq(ptr, nscache, NULL)));
+
+    chan_free(nscache->lookup);
+    nscache->lookup = chan_new(servconf.resolv, NULL, loop, 0);
+}
+
+static void teardown(void)
+{
+    standin_stop(standin);
+
+    nscache_free(nscache);
+    chan_free(servconf.chan);
+    ldns_resolver_deep_free(servconf.resolv);
+    ldns_rdf_deep_free(servconf.server);
+
+    loop_free(loop);
+    standin_free(standin);
+}
+
+TestSuite(nscache, .init = setup, .fini = teardown);
+
+Test(nscache, refreshed_addresses_are_kept_for_later_channels) {
+    nscache_refresh(&nscache->timer);
+    loop_drain(loop);
+
+    // Channels set up afterwards, e.g. by a worker, start from these
+    assert(eq(sz, ldns_resolver_nameserver_count(servconf.resolv), 2));
+
+    ldns_rdf **nameservers = ldns_resolver_nameservers(servconf.resolv);
+    const struct in6_addr *expected[] = { &ns1, &ns2 };
+
+    for (size_t i = 0; i < 2; i++) {
+        assert(eq(sz, ldns_rdf_size(nameservers[i]), sizeof(struct in6_addr)));
+        expect(eq(i32, memcmp(ldns_rdf_data(nameservers[i]), expected[i], sizeof(struct in6_addr)), 0));
+    }
+
+    expect(eq(u16, ldns_resolver_port(servconf.resolv), standin_port(standin)));
+    expect(eq(u32, servconf.ns_ttl, 600));
+    expect(loop_timer_armed(&nscache->timer));
+}
+
+Test(nscache, failed_refresh_keeps_the_current_addresses) {
+    // Not in the stand-in's zone
+    ldns_rdf_deep_free(servconf.server);
+    servconf.server = ldns_dname_new_frm_str("gone.example.com.");
+
+    nscache_refresh(&nscache->timer);
+    loop_drain(loop);
+
+    expect(eq(sz, ldns_resolver_nameserver_count(servconf.resolv), 1));
+    expect(eq(u32, servconf.ns_ttl, 3600));
+    expect(loop_timer_armed(&nscache->timer));
+}
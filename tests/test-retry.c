@@ -0,0 +1,179 @@
+#include "common.h"
+
+#include "retry.c"
+
+static struct loop *loop;
+static struct retry *retry;
+static conf_if ifconf;
+
+static size_t fired;
+static struct sockaddr_in6 fired_addr;
+static bool fired_delete;
+static uint64_t fired_seq;
+
+static void record_cb(conf_if *ifconf, const struct sockaddr_in6 *addr, bool delete,
+        uint32_t ttl, uint64_t seq)
+{
+    (void)ifconf;
+    (void)ttl;
+
+    fired++;
+    fired_addr = *addr;
+    fired_delete = delete;
+    fired_seq = seq;
+}
+
+static void setup(void)
+{
+    loop = loop_new();
+    retry = retry_new(loop, 2, record_cb);
+
+    ifconf.record = ldns_dname_new_frm_str("foo.example.com.");
+    fired = 0;
+}
+
+static void teardown(void)
+{
+    retry_free(retry);
+    loop_free(loop);
+
+    ldns_rdf_deep_free(ifconf.record);
+}
+
+TestSuite(retry, .init = setup, .fini = teardown);
+
+Test(retry, changes_to_same_address_collapse) {
+    struct sockaddr_in6 a = mkaddr("2001:db8::1");
+
+    expect(retry_add(retry, &ifconf, &a, false, 3600, 1));
+    expect(retry_add(retry, &ifconf, &a, true, 0, 2));
+
+    assert(eq(sz, retry_count(retry), 1));
+
+    retry_advance(retry, retry->now + RETRY_WHEEL_SLOTS);
+
+    assert(eq(sz, fired, 1));
+    expect(fired_delete);
+}
+
+Test(retry, backlog_is_capped) {
+    struct sockaddr_in6 a = mkaddr("2001:db8::1");
+    struct sockaddr_in6 b = mkaddr("2001:db8::2");
+    struct sockaddr_in6 c = mkaddr("2001:db8::3");
+
+    expect(retry_add(retry, &ifconf, &a, false, 3600, 1));
+    expect(retry_add(retry, &ifconf, &b, false, 3600, 1));
+    expect(not(retry_add(retry, &ifconf, &c, false, 3600, 1)));
+
+    // Entries already queued can still be updated
+    expect(retry_add(retry, &ifconf, &a, true, 0, 2));
+    expect(eq(sz, retry_count(retry), 2));
+}
+
+Test(retry, done_entries_never_fire) {
+    struct sockaddr_in6 a = mkaddr("2001:db8::1");
+
+    retry_add(retry, &ifconf, &a, false, 3600, 1);
+    expect(loop_timer_armed(&retry->timer));
+
+    retry_done(retry, ifconf.record, &a, 1);
+
+    expect(eq(sz, retry_count(retry), 0));
+    expect(not(loop_timer_armed(&retry->timer)));
+
+    retry_advance(retry, retry->now + RETRY_WHEEL_SLOTS);
+    expect(eq(sz, fired, 0));
+}
+
+Test(retry, late_failures_do_not_replace_newer_changes) {
+    struct sockaddr_in6 a = mkaddr("2001:db8::1");
+
+    expect(retry_add(retry, &ifconf, &a, false, 3600, 2));
+    expect(retry_add(retry, &ifconf, &a, true, 0, 1));
+
+    retry_advance(retry, retry->now + RETRY_WHEEL_SLOTS);
+
+    assert(eq(sz, fired, 1));
+    expect(not(fired_delete));
+    expect(eq(u64, fired_seq, 2));
+}
+
+Test(retry, late_successes_keep_newer_changes) {
+    struct sockaddr_in6 a = mkaddr("2001:db8::1");
+
+    retry_add(retry, &ifconf, &a, true, 0, 2);
+    retry_done(retry, ifconf.record, &a, 1);
+
+    expect(eq(sz, retry_count(retry), 1));
+
+    retry_done(retry, ifconf.record, &a, 2);
+    expect(eq(sz, retry_count(retry), 0));
+}
+
+Test(retry, delay_grows_with_each_failure) {
+    struct sockaddr_in6 a = mkaddr("2001:db8::1");
+
+    retry_add(retry, &ifconf, &a, false, 3600, 1);
+
+    // The first retry comes after half a second to a second
+    retry_advance(retry, retry->now + RETRY_BASE_DELAY / RETRY_TICK / 2 - 1);
+    expect(eq(sz, fired, 0));
+
+    retry_advance(retry, retry->now + RETRY_BASE_DELAY / RETRY_TICK);
+    assert(eq(sz, fired, 1));
+    expect(eq(i32, memcmp(&fired_addr, &a, sizeof a), 0));
+
+    // Still known while being sent again, so the next failure backs off further
+    assert(eq(sz, retry_count(retry), 1));
+
+    retry_add(retry, &ifconf, &a, false, 3600, 1);
+
+    retry_advance(retry, retry->now + RETRY_BASE_DELAY / RETRY_TICK - 1);
+    expect(eq(sz, fired, 1));
+
+    retry_advance(retry, retry->now + 2 * RETRY_BASE_DELAY / RETRY_TICK);
+    expect(eq(sz, fired, 2));
+}
+
+Test(retry, long_delays_cascade_down) {
+    struct sockaddr_in6 a = mkaddr("2001:db8::1");
+
+    // Enough failures to reach the maximum delay, past the first level
+    for (size_t i = 0; i < 12; i++) {
+        retry_add(retry, &ifconf, &a, false, 3600, 1);
+        retry_advance(retry, retry->now + RETRY_MAX_DELAY / RETRY_TICK);
+
+        assert(eq(sz, fired, i + 1));
+    }
+
+    retry_add(retry, &ifconf, &a, false, 3600, 1);
+
+    retry_advance(retry, retry->now + RETRY_MAX_DELAY / RETRY_TICK / 2 - 1);
+    expect(eq(sz, fired, 12));
+}
+
+Test(retry, timer_waits_for_the_next_due_entry) {
+    struct sockaddr_in6 a = mkaddr("2001:db8::1");
+    struct sockaddr_in6 b = mkaddr("2001:db8::2");
+
+    retry_add(retry, &ifconf, &a, false, 3600, 1);
+
+    struct retry_entry *entry = *retry_find(retry, ifconf.record, &a);
+
+    // Not on every tick until then
+    assert(loop_timer_armed(&retry->timer));
+    expect(eq(i64, retry->timer.deadline, retry->epoch + (int64_t)entry->expires * RETRY_TICK));
+
+    // Far enough to be on the upper level, it only wakes the timer once it moves down
+    for (size_t i = 0; i < 12; i++) {
+        retry_add(retry, &ifconf, &b, false, 3600, 1);
+        retry_advance(retry, retry->now + RETRY_MAX_DELAY / RETRY_TICK);
+    }
+
+    retry_add(retry, &ifconf, &b, false, 3600, 1);
+    entry = *retry_find(retry, ifconf.record, &b);
+
+    assert(gt(u64, entry->expires - retry->now, RETRY_WHEEL_SLOTS));
+    expect(eq(i64, retry->timer.deadline,
+            retry->epoch + (int64_t)(entry->expires & ~(uint64_t)RETRY_WHEEL_MASK) * RETRY_TICK));
+}
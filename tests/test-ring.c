@@ -0,0 +1,68 @@
+#include "common.h"
+
+#include "ring.h"
+
+Test(ring, size_is_rounded_to_power_of_two) {
+    struct ring *ring = ring_new(5, sizeof(uint64_t));
+    struct ring_stats stats;
+
+    ring_stats(ring, &stats);
+    expect(eq(sz, stats.size, 8));
+
+    ring_free(ring);
+}
+
+Test(ring, elements_are_popped_in_order_across_laps) {
+    struct ring *ring = ring_new(4, sizeof(uint64_t));
+
+    for (uint64_t lap = 0; lap < 3; lap++) {
+        for (uint64_t i = 0; i < 4; i++)
+            assert(ring_push(ring, &(uint64_t) { lap * 4 + i }));
+
+        for (uint64_t i = 0; i < 4; i++) {
+            uint64_t val;
+
+            assert(ring_pop(ring, &val));
+            expect(eq(u64, val, lap * 4 + i));
+        }
+    }
+
+    uint64_t val;
+    expect(not(ring_pop(ring, &val)));
+
+    ring_free(ring);
+}
+
+Test(ring, full_ring_drops_and_keeps_stats) {
+    struct ring *ring = ring_new(4, sizeof(uint64_t));
+    struct ring_stats stats;
+
+    for (uint64_t i = 0; i < 6; i++)
+        ring_push(ring, &i);
+
+    ring_stats(ring, &stats);
+
+    expect(eq(sz, stats.depth, 4));
+    expect(eq(sz, stats.highwater, 4));
+    expect(eq(u64, stats.pushed, 4));
+    expect(eq(u64, stats.dropped, 2));
+
+    uint64_t val;
+    ring_pop(ring, &val);
+
+    ring_stats(ring, &stats);
+    expect(eq(sz, stats.depth, 3));
+
+    ring_free(ring);
+}
+
+Test(ring, arm_reports_pending_elements) {
+    struct ring *ring = ring_new(4, sizeof(uint64_t));
+
+    expect(not(ring_arm(ring)));
+
+    ring_push(ring, &(uint64_t) { 1 });
+    expect(ring_arm(ring));
+
+    ring_free(ring);
+}
@@ -0,0 +1,72 @@
+#include "common.h"
+
+#include "shadow.h"
+
+static struct shadow *shadow;
+static ldns_rdf *record;
+
+static void setup(void)
+{
+    shadow = shadow_new();
+    record = ldns_dname_new_frm_str("foo.example.com.");
+}
+
+static void teardown(void)
+{
+    shadow_free(shadow);
+    ldns_rdf_deep_free(record);
+}
+
+TestSuite(shadow, .init = setup, .fini = teardown);
+
+Test(shadow, unknown_records_are_never_redundant) {
+    struct in6_addr a = mkaddr("2001:db8::1").sin6_addr;
+
+    expect(not(shadow_redundant(shadow, record, &a, false, 3600)));
+    expect(not(shadow_redundant(shadow, record, &a, true, 0)));
+}
+
+Test(shadow, learned_records_are_complete) {
+    struct in6_addr a = mkaddr("2001:db8::1").sin6_addr;
+    struct in6_addr b = mkaddr("2001:db8::2").sin6_addr;
+
+    ldns_rr_list *answer = ldns_rr_list_new();
+    ldns_rr *rr;
+
+    assert(ldns_rr_new_frm_str(&rr, "foo.example.com. 3600 IN AAAA 2001:db8::1",
+                0, NULL, NULL) == LDNS_STATUS_OK);
+    ldns_rr_list_push_rr(answer, rr);
+
+    // Differs only in case
+    ldns_rdf *upper = ldns_dname_new_frm_str("FOO.example.com.");
+    shadow_learn(shadow, upper, answer, SHADOW_NO_SERIAL);
+    ldns_rdf_deep_free(upper);
+
+    expect(shadow_redundant(shadow, record, &a, false, 3600));
+    expect(not(shadow_redundant(shadow, record, &a, false, 60)));
+    expect(not(shadow_redundant(shadow, record, &a, true, 0)));
+
+    expect(shadow_redundant(shadow, record, &b, true, 0));
+    expect(not(shadow_redundant(shadow, record, &b, false, 3600)));
+
+    ldns_rr_list_deep_free(answer);
+}
+
+Test(shadow, applied_updates_are_tracked_until_forgotten) {
+    struct in6_addr a = mkaddr("2001:db8::1").sin6_addr;
+    struct in6_addr b = mkaddr("2001:db8::2").sin6_addr;
+
+    shadow_apply(shadow, record, &a, false, 3600);
+    expect(shadow_redundant(shadow, record, &a, false, 3600));
+
+    // Adding to the RRset changes the TTL of every RR in it
+    shadow_apply(shadow, record, &b, false, 60);
+    expect(shadow_redundant(shadow, record, &a, false, 60));
+
+    shadow_apply(shadow, record, &a, true, 0);
+    expect(shadow_redundant(shadow, record, &a, true, 0));
+
+    shadow_forget(shadow, record);
+    expect(not(shadow_redundant(shadow, record, &a, true, 0)));
+    expect(not(shadow_redundant(shadow, record, &b, false, 60)));
+}
@@ -0,0 +1,132 @@
+#include "common.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "map.h"
+#include "snap.h"
+#include "shadow.h"
+
+map_decl(conf_serv, uint64_t, const char *, conf_serv *);
+
+static char dir[sizeof "/tmp/ipup-test-XXXXXX"];
+static char path[sizeof dir + sizeof "/state"];
+
+static struct conf conf;
+static conf_serv servconf;
+static ldns_rdf *record;
+
+static void setup(void)
+{
+    strcpy(dir, "/tmp/ipup-test-XXXXXX");
+    assert(mkdtemp(dir));
+    snprintf(path, sizeof path, "%s/state", dir);
+
+    servconf.shadow = shadow_new();
+
+    conf.servers = map_new_conf_serv(4, (map_ops(conf_serv)) {0});
+    map_set_conf_serv(conf.servers, "example", &servconf);
+
+    record = ldns_dname_new_frm_str("foo.example.com.");
+}
+
+static void teardown(void)
+{
+    snap_close();
+
+    map_free_conf_serv(conf.servers);
+    shadow_free(servconf.shadow);
+    ldns_rdf_deep_free(record);
+
+    char buf[sizeof path + sizeof ".journal"];
+
+    snprintf(buf, sizeof buf, "%s.journal", path);
+    unlink(buf);
+    unlink(path);
+    rmdir(dir);
+}
+
+TestSuite(snap, .init = setup, .fini = teardown);
+
+Test(snap, saved_records_are_restored) {
+    struct in6_addr a = mkaddr("2001:db8::1").sin6_addr;
+    struct in6_addr b = mkaddr("2001:db8::2").sin6_addr;
+
+    struct shadow_rrset *rrset = shadow_reset(servconf.shadow, record, 42);
+    shadow_rrset_set(rrset, &a, true, 3600);
+    shadow_rrset_set(rrset, &b, false, 0);
+
+    snap_open(path);
+    snap_save(&conf);
+    snap_close();
+
+    snap_open(path);
+
+    const struct snap_rec *rec = snap_lookup("example", record);
+
+    assert(rec);
+    expect(eq(u32, rec->serial, 42));
+    expect(rec->flags & SNAP_HAS_SERIAL);
+    assert(eq(u32, rec->naddrs, 1));
+    expect(eq(i32, memcmp(snap_rec_addrs(rec)[0].addr, &a, sizeof a), 0));
+    expect(eq(u32, snap_rec_addrs(rec)[0].ttl, 3600));
+
+    expect(not(snap_lookup("other", record)));
+}
+
+Test(snap, journaled_and_pending_records_are_not_trusted) {
+    struct in6_addr a = mkaddr("2001:db8::1").sin6_addr;
+
+    struct shadow_rrset *rrset = shadow_reset(servconf.shadow, record, SHADOW_NO_SERIAL);
+    shadow_rrset_set(rrset, &a, true, 3600);
+
+    snap_open(path);
+    snap_save(&conf);
+    snap_journal("example", record);
+    snap_close();
+
+    snap_open(path);
+    expect(not(snap_lookup("example", record)));
+
+    // Saving again truncates the journal, but an UPDATE is still in flight
+    shadow_sent(servconf.shadow, record);
+    snap_save(&conf);
+    snap_close();
+
+    snap_open(path);
+    expect(not(snap_lookup("example", record)));
+    snap_close();
+
+    shadow_done(servconf.shadow, record, true);
+
+    snap_open(path);
+    snap_save(&conf);
+    snap_close();
+
+    snap_open(path);
+
+    const struct snap_rec *rec = snap_lookup("example", record);
+
+    assert(rec);
+    expect(not(rec->flags & SNAP_HAS_SERIAL));
+}
+
+Test(snap, corrupt_snapshots_are_ignored) {
+    struct shadow_rrset *rrset = shadow_reset(servconf.shadow, record, 1);
+    shadow_rrset_set(rrset, &(struct in6_addr) {0}, true, 60);
+
+    snap_open(path);
+    snap_save(&conf);
+    snap_close();
+
+    FILE *file = fopen(path, "r+b");
+
+    assert(file);
+    fseek(file, -1, SEEK_END);
+    fputc(0xff, file);
+    fclose(file);
+
+    snap_open(path);
+    expect(not(snap_lookup("example", record)));
+}
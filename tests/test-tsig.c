@@ -0,0 +1,90 @@
+#include "common.h"
+
+#include "tsig.h"
+
+static struct tsig *tsig;
+
+static const ldns_tsig_credentials cred = {
+    .algorithm = "hmac-sha256.",
+    .keyname = "key.example.",
+    .keydata = "c2VjcmV0c2VjcmV0c2VjcmV0c2VjcmV0"
+};
+
+// MAC of an UPDATE for example.com, and the server's signed reply to it
+static const uint8_t reqmac[] = {
+    0xa4, 0xa8, 0x8f, 0x00, 0x17, 0xb0, 0x69, 0x2c, 0xde, 0x48, 0xd4, 0x10,
+    0xd9, 0xc1, 0xf2, 0xa6, 0x1d, 0xd6, 0x26, 0x12, 0xb1, 0x6e, 0x8f, 0x6c,
+    0xb8, 0xa4, 0x7e, 0x58, 0xd9, 0x5d, 0x5d, 0x26,
+};
+
+static const uint8_t reply[] = {
+    0x12, 0x34, 0xa8, 0x00, 0x00, 0x01, 0x00, 0x00, 0x00, 0x00, 0x00, 0x01,
+    0x07, 0x65, 0x78, 0x61, 0x6d, 0x70, 0x6c, 0x65, 0x03, 0x63, 0x6f, 0x6d,
+    0x00, 0x00, 0x06, 0x00, 0x01, 0x03, 0x6b, 0x65, 0x79, 0x07, 0x65, 0x78,
+    0x61, 0x6d, 0x70, 0x6c, 0x65, 0x00, 0x00, 0xfa, 0x00, 0xff, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x3d, 0x0b, 0x68, 0x6d, 0x61, 0x63, 0x2d, 0x73, 0x68,
+    0x61, 0x32, 0x35, 0x36, 0x00, 0x00, 0x00, 0x6a, 0xd2, 0xd2, 0xc4, 0x01,
+    0x2c, 0x00, 0x20, 0x66, 0xb5, 0x4a, 0x01, 0xea, 0x12, 0x6b, 0x36, 0xb2,
+    0x1b, 0xe8, 0xb1, 0x91, 0x55, 0x33, 0xce, 0xb1, 0x46, 0xf5, 0x6f, 0x76,
+    0xdc, 0x10, 0x60, 0xe4, 0x3e, 0x53, 0x1c, 0x7a, 0xa7, 0x34, 0x44, 0x12,
+    0x34, 0x00, 0x00, 0x00, 0x00,
+};
+
+static void setup(void)
+{
+    tsig = tsig_new(cred);
+}
+
+static void teardown(void)
+{
+    tsig_free(tsig);
+}
+
+TestSuite(tsig, .init = setup, .fini = teardown);
+
+Test(tsig, unsupported_algorithm_is_rejected) {
+    ldns_tsig_credentials other = cred;
+    other.algorithm = "rsasha1.";
+
+    expect(tsig_new(other) == NULL);
+}
+
+Test(tsig, signed_reply_is_verified) {
+    assert(tsig);
+
+    expect(tsig_verify(tsig, reply, sizeof reply, reqmac, sizeof reqmac));
+}
+
+Test(tsig, tampered_reply_is_rejected) {
+    uint8_t wire[sizeof reply];
+    memcpy(wire, reply, sizeof reply);
+
+    // Turns the rcode into REFUSED
+    wire[3] |= LDNS_RCODE_REFUSED;
+
+    expect(!tsig_verify(tsig, wire, sizeof wire, reqmac, sizeof reqmac));
+}
+
+Test(tsig, reply_to_other_request_is_rejected) {
+    uint8_t other[sizeof reqmac];
+    memcpy(other, reqmac, sizeof reqmac);
+    other[0] ^= 1;
+
+    expect(!tsig_verify(tsig, reply, sizeof reply, other, sizeof other));
+}
+
+Test(tsig, signing_appends_tsig_rr) {
+    uint8_t wire[1024] = { 0x12, 0x34, LDNS_PACKET_UPDATE << 3 };
+    uint8_t mac[TSIG_MAX_MAC];
+    size_t maclen;
+
+    size_t len = tsig_sign(tsig, wire, 12, sizeof wire, mac, &maclen);
+
+    assert(len > 12);
+    expect(maclen == 32);
+    // One additional RR, owned by the key
+    expect(wire[10] == 0 && wire[11] == 1);
+    expect(memcmp(wire + 12, "\3key\7example", 13) == 0);
+    // The original ID is kept in the RR
+    expect(wire[len - 6] == 0x12 && wire[len - 5] == 0x34);
+}
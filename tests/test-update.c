@@ -0,0 +1,366 @@
+#include <stdarg.h>
+
+#include "common.h"
+
+#include "batch.c"
+#include "standin.c"
+
+map_decl(conf_serv, uint64_t, const char *, conf_serv *);
+map_decl(conf_if, uint64_t, const char *, conf_if *);
+
+// Sends UPDATEs through the batch and the channel to the stand-in server,
+// running the loop until every request has been answered
+
+#define TEST_KEY "aXB1cCB0ZXN0IGtleSwgbm90IGEgc2VjcmV0"
+
+static struct loop *loop;
+static struct standin *standin;
+static struct conf conf;
+static conf_serv *servconf;
+static conf_if *ifconf;
+
+// `key` is the secret ipup signs with, which may differ from the server's
+static void start(const struct standin_opts *opts, const char *key)
+{
+    standin = standin_new(opts);
+
+    char *text;
+    size_t len;
+
+    FILE *file = open_memstream(&text, &len);
+    assert(not(eq(ptr, file, NULL)));
+
+    fprintf(file, "[server/standin]\nport = %u\nbatch-window = 0\n", standin_port(standin));
+
+    if (key)
+        fprintf(file, "key-name = ipup.\nkey-secret = %s\nkey-algo = hmac-sha256\n", key);
+
+    fprintf(file, "[iface/test]\nserver = standin\nzone = example.com.\nrecord = foo\n");
+    fclose(file);
+
+    file = fmemopen(text, len, "r");
+    conf = conf_read(file, "test");
+
+    fclose(file);
+    free(text);
+
+    assert(map_get_conf_serv(conf.servers, "standin", &servconf));
+    assert(map_get_conf_if(conf.ifaces, "test", &ifconf));
+
+    ldns_rdf *ns = ldns_rdf_new_frm_str(LDNS_RDF_TYPE_A, "127.0.0.1");
+    assert(eq(i32, ldns_resolver_push_nameserver(servconf->resolv, ns), LDNS_STATUS_OK));
+    ldns_rdf_deep_free(ns);
+
+    loop = loop_new();
+
+    servconf->chan = chan_new(servconf->resolv, servconf->tsig, loop, servconf->tcp_idle);
+    servconf->batch = batch_new(servconf, loop);
+    servconf->shadow = shadow_new();
+    servconf->retry = retry_new(loop, 16, batch_requeue);
+
+    standin_start(standin);
+}
+
+static void teardown(void)
+{
+    if (!standin)
+        return;
+
+    standin_stop(standin);
+
+    conf_free(conf);
+    loop_free(loop);
+    standin_free(standin);
+
+    standin = NULL;
+}
+
+static size_t zone_get(struct in6_addr *addrs, size_t max)
+{
+    return standin_zone_get(standin, "foo.example.com.", addrs, max);
+}
+
+TestSuite(update, .fini = teardown);
+
+Test(update, batched_changes_are_sent_together) {
+    start(NULL, NULL);
+
+    struct sockaddr_in6 a = mkaddr("2001:db8::1");
+    struct sockaddr_in6 b = mkaddr("2001:db8::2");
+    struct sockaddr_in6 c = mkaddr("2001:db8::3");
+
+    batch_add(ifconf, &a, false, 3600);
+    batch_add(ifconf, &b, false, 3600);
+    batch_add(ifconf, &c, false, 3600);
+    batch_add(ifconf, &b, true, 0);
+
+    loop_drain(loop);
+
+    struct standin_stats stats;
+    standin_stats(standin, &stats);
+
+    expect(eq(u64, stats.updates, 1));
+    expect(eq(u64, stats.rrs, 2));
+
+    struct in6_addr addrs[4];
+    assert(eq(sz, zone_get(addrs, 4), 2));
+    expect(eq(sz, retry_count(servconf->retry), 0));
+    expect(eq(u32, standin_serial(standin), 2));
+}
+
+Test(update, existing_records_are_deleted) {
+    start(NULL, NULL);
+
+    struct sockaddr_in6 a = mkaddr("2001:db8::1");
+    standin_zone_add(standin, "FOO.example.com.", &a.sin6_addr, 3600);
+
+    batch_add(ifconf, &a, true, 0);
+    loop_drain(loop);
+
+    struct in6_addr addrs[1];
+    expect(eq(sz, zone_get(addrs, 1), 0));
+}
+
+Test(update, signed_updates_are_accepted) {
+    struct standin_opts opts = {
+        .zone = "example.com.",
+        .cred = {
+            .algorithm = "hmac-sha256.",
+            .keyname = "ipup.",
+            .keydata = TEST_KEY
+        }
+    };
+
+    start(&opts, TEST_KEY);
+
+    struct sockaddr_in6 a = mkaddr("2001:db8::1");
+
+    batch_add(ifconf, &a, false, 3600);
+    loop_drain(loop);
+
+    struct standin_stats stats;
+    standin_stats(standin, &stats);
+
+    expect(eq(u64, stats.badsig, 0));
+    expect(eq(sz, retry_count(servconf->retry), 0));
+
+    struct in6_addr addrs[1];
+    expect(eq(sz, zone_get(addrs, 1), 1));
+}
+
+Test(update, bad_signatures_are_retried) {
+    struct standin_opts opts = {
+        .cred = {
+            .algorithm = "hmac-sha256.",
+            .keyname = "ipup.",
+            .keydata = TEST_KEY
+        }
+    };
+
+    start(&opts, "d3JvbmcgdGVzdCBrZXk=");
+
+    struct sockaddr_in6 a = mkaddr("2001:db8::1");
+
+    batch_add(ifconf, &a, false, 3600);
+    loop_drain(loop);
+
+    struct standin_stats stats;
+    standin_stats(standin, &stats);
+
+    expect(eq(u64, stats.badsig, 1));
+    expect(eq(sz, retry_count(servconf->retry), 1));
+
+    struct in6_addr addrs[1];
+    expect(eq(sz, zone_get(addrs, 1), 0));
+}
+
+Test(update, servfail_is_retried) {
+    struct standin_opts opts = {
+        .servfail = 100
+    };
+
+    start(&opts, NULL);
+
+    struct sockaddr_in6 a = mkaddr("2001:db8::1");
+    struct sockaddr_in6 b = mkaddr("2001:db8::2");
+
+    batch_add(ifconf, &a, false, 3600);
+    batch_add(ifconf, &b, false, 3600);
+    loop_drain(loop);
+
+    expect(eq(sz, retry_count(servconf->retry), 2));
+
+    // A newer change replaces the one waiting to be retried
+    batch_add(ifconf, &a, true, 0);
+    expect(eq(sz, retry_count(servconf->retry), 1));
+}
+
+Test(update, truncated_replies_fall_back_to_tcp) {
+    struct standin_opts opts = {
+        .truncate = 100
+    };
+
+    start(&opts, NULL);
+
+    struct sockaddr_in6 a = mkaddr("2001:db8::1");
+
+    batch_add(ifconf, &a, false, 3600);
+    loop_drain(loop);
+
+    struct standin_stats stats;
+    standin_stats(standin, &stats);
+
+    expect(eq(u64, stats.truncated, 1));
+    expect(eq(u64, stats.tcp, 1));
+    expect(eq(u64, stats.updates, 2));
+    expect(eq(sz, retry_count(servconf->retry), 0));
+
+    struct in6_addr addrs[1];
+    expect(eq(sz, zone_get(addrs, 1), 1));
+}
+
+Test(update, other_zones_are_rejected) {
+    struct standin_opts opts = {
+        .zone = "example.org."
+    };
+
+    start(&opts, NULL);
+
+    struct sockaddr_in6 a = mkaddr("2001:db8::1");
+
+    batch_add(ifconf, &a, false, 3600);
+    loop_drain(loop);
+
+    expect(eq(sz, retry_count(servconf->retry), 1));
+    expect(eq(u32, standin_serial(standin), 1));
+}
+
+static void update_done(bool ok, void *arg)
+{
+    *(int *)arg = ok ? 1 : -1;
+}
+
+Test(update, send_update_calls_back) {
+    struct standin_opts opts = {
+        .latency = 20
+    };
+
+    start(&opts, NULL);
+
+    struct sockaddr_in6 a = mkaddr("2001:db8::1");
+
+    ldns_rr_list *list = ldns_rr_list_new();
+    ldns_rr_list_push_rr(list, dns_prepare_update_rr(ifconf->record,
+                (struct sockaddr *)&a, false, 60));
+
+    int done = 0;
+
+    dns_send_update(ifconf->zone, list, servconf->chan, update_done, &done);
+    ldns_rr_list_deep_free(list);
+
+    loop_drain(loop);
+
+    expect(eq(i32, done, 1));
+
+    struct in6_addr addrs[1];
+    expect(eq(sz, zone_get(addrs, 1), 1));
+}
+
+static void query_cb(ldns_pkt *reply, ldns_status status, void *arg)
+{
+    size_t *count = arg;
+
+    if (dns_reply_ok(reply, status))
+        *count = ldns_rr_list_rr_count(ldns_pkt_answer(reply));
+}
+
+// What the startup synchronization sees
+Test(update, queries_are_answered_from_the_zone) {
+    start(NULL, NULL);
+
+    struct sockaddr_in6 a = mkaddr("2001:db8::1");
+    struct sockaddr_in6 b = mkaddr("2001:db8::2");
+
+    standin_zone_add(standin, "foo.example.com.", &a.sin6_addr, 3600);
+    standin_zone_add(standin, "foo.example.com.", &b.sin6_addr, 3600);
+
+    ldns_pkt *query = ldns_pkt_query_new(ldns_rdf_clone(ifconf->record),
+            LDNS_RR_TYPE_AAAA, LDNS_RR_CLASS_IN, 0);
+
+    size_t count = 0;
+
+    assert(eq(i32, chan_send(servconf->chan, query, query_cb, &count), LDNS_STATUS_OK));
+    ldns_pkt_free(query);
+
+    loop_drain(loop);
+
+    expect(eq(sz, count, 2));
+}
+
+static void rcode_cb(ldns_pkt *reply, ldns_status status, void *arg)
+{
+    int *rcode = arg;
+    *rcode = reply && status == LDNS_STATUS_OK ? (int)ldns_pkt_get_rcode(reply) : -1;
+}
+
+// `addr` NULL asks for the RRset not to exist
+static ldns_rr *prereq(const char *name, const char *addr)
+{
+    ldns_rr *rr = ldns_rr_new();
+
+    ldns_rr_set_owner(rr, ldns_dname_new_frm_str(name));
+    ldns_rr_set_type(rr, LDNS_RR_TYPE_AAAA);
+    ldns_rr_set_class(rr, addr ? LDNS_RR_CLASS_IN : LDNS_RR_CLASS_NONE);
+    ldns_rr_set_ttl(rr, 0);
+
+    if (addr)
+        ldns_rr_push_rdf(rr, ldns_rdf_new_frm_str(LDNS_RDF_TYPE_AAAA, addr));
+
+    return rr;
+}
+
+static int check(ldns_rr *first, ...)
+{
+    ldns_rr_list *prereqs = ldns_rr_list_new();
+
+    va_list ap;
+    va_start(ap, first);
+
+    for (ldns_rr *rr = first; rr; rr = va_arg(ap, ldns_rr *))
+        ldns_rr_list_push_rr(prereqs, rr);
+
+    va_end(ap);
+
+    ldns_pkt *pkt = ldns_update_pkt_new(ldns_rdf_clone(ifconf->zone), LDNS_RR_CLASS_IN, prereqs, NULL, NULL);
+    int rcode = -1;
+
+    assert(eq(i32, chan_send(servconf->chan, pkt, rcode_cb, &rcode), LDNS_STATUS_OK));
+
+    ldns_pkt_free(pkt);
+    ldns_rr_list_deep_free(prereqs);
+
+    loop_drain(loop);
+
+    return rcode;
+}
+
+// What the startup synchronization relies on when the serial has moved
+Test(update, prerequisites_are_checked) {
+    start(NULL, NULL);
+
+    struct sockaddr_in6 a = mkaddr("2001:db8::1");
+    struct sockaddr_in6 b = mkaddr("2001:db8::2");
+
+    standin_zone_add(standin, "foo.example.com.", &a.sin6_addr, 3600);
+    standin_zone_add(standin, "foo.example.com.", &b.sin6_addr, 3600);
+
+    expect(eq(i32, check(prereq("foo.example.com.", "2001:db8::2"),
+                    prereq("foo.example.com.", "2001:db8::1"), NULL), LDNS_RCODE_NOERROR));
+    expect(eq(i32, check(prereq("foo.example.com.", "2001:db8::1"), NULL), LDNS_RCODE_NXRRSET));
+    expect(eq(i32, check(prereq("foo.example.com.", "2001:db8::1"), prereq("foo.example.com.", "2001:db8::2"),
+                    prereq("foo.example.com.", "2001:db8::3"), NULL), LDNS_RCODE_NXRRSET));
+    expect(eq(i32, check(prereq("foo.example.com.", NULL), NULL), LDNS_RCODE_YXRRSET));
+    expect(eq(i32, check(prereq("bar.example.com.", NULL), NULL), LDNS_RCODE_NOERROR));
+    expect(eq(i32, check(prereq("bar.example.com.", "2001:db8::1"), NULL), LDNS_RCODE_NXRRSET));
+    expect(eq(i32, check(prereq("foo.example.org.", NULL), NULL), LDNS_RCODE_NOTZONE));
+}
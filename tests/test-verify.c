@@ -0,0 +1,139 @@
+#include "common.h"
+
+#include "batch.c"
+#include "verify.c"
+
+static struct loop *loop;
+static conf_serv servconf = { .name = "example", .verify_ratio = 100 };
+static conf_if ifconf = { .name = "eth0", .server = &servconf };
+
+static ldns_pkt *mkreply(const char *rrstr)
+{
+    ldns_pkt *reply = ldns_pkt_new();
+    ldns_rr *rr;
+
+    ldns_pkt_set_qr(reply, true);
+
+    if (rrstr) {
+        assert(eq(ldns_rr_new_frm_str(&rr, rrstr, 0, NULL, NULL), (ldns_status)LDNS_STATUS_OK));
+        ldns_pkt_push_rr(reply, LDNS_SECTION_ANSWER, rr);
+    }
+
+    return reply;
+}
+
+static void setup(void)
+{
+    loop = loop_new();
+
+    servconf.resolv = ldns_resolver_new();
+    servconf.chan = chan_new(servconf.resolv, NULL, loop, 0);
+    servconf.batch = batch_new(&servconf, loop);
+    servconf.shadow = shadow_new();
+    servconf.verify = verify_new(&servconf, loop);
+
+    ifconf.zone = ldns_dname_new_frm_str("example.com.");
+    ifconf.record = ldns_dname_new_frm_str("foo.example.com.");
+}
+
+static void teardown(void)
+{
+    verify_free(servconf.verify);
+    batch_free(servconf.batch);
+    shadow_free(servconf.shadow);
+    chan_free(servconf.chan);
+    ldns_resolver_deep_free(servconf.resolv);
+
+    loop_free(loop);
+
+    ldns_rdf_deep_free(ifconf.zone);
+    ldns_rdf_deep_free(ifconf.record);
+}
+
+TestSuite(verify, .init = setup, .fini = teardown);
+
+Test(verify, records_are_queued_once) {
+    verify_add(servconf.verify, &ifconf);
+    verify_add(servconf.verify, &ifconf);
+
+    expect(eq(sz, servconf.verify->used, 1));
+    expect(loop_timer_armed(&servconf.verify->timer));
+}
+
+Test(verify, matching_answer_changes_nothing) {
+    struct sockaddr_in6 a = mkaddr("2001:db8::1");
+
+    shadow_apply(servconf.shadow, ifconf.record, &a.sin6_addr, false, 3600);
+
+    ldns_pkt *reply = mkreply("foo.example.com. 3600 IN AAAA 2001:db8::1");
+    verify_query_cb(reply, LDNS_STATUS_OK, &ifconf);
+    ldns_pkt_free(reply);
+
+    expect(eq(sz, servconf.batch->used, 0));
+}
+
+Test(verify, missing_address_is_sent_again) {
+    struct sockaddr_in6 a = mkaddr("2001:db8::1");
+
+    shadow_apply(servconf.shadow, ifconf.record, &a.sin6_addr, false, 3600);
+
+    ldns_pkt *reply = mkreply(NULL);
+    verify_query_cb(reply, LDNS_STATUS_OK, &ifconf);
+    ldns_pkt_free(reply);
+
+    struct batch *batch = servconf.batch;
+
+    assert(eq(sz, batch->used, 1));
+    assert(eq(sz, batch->zones[0].used, 1));
+    expect(not(batch->zones[0].ops[0].delete));
+
+    // The shadow now holds what the server answered, so the UPDATE is not skipped
+    expect(not(shadow_redundant(servconf.shadow, ifconf.record, &a.sin6_addr, false, 3600)));
+}
+
+Test(verify, only_missing_addresses_are_sent_again) {
+    struct sockaddr_in6 a = mkaddr("2001:db8::1");
+    struct sockaddr_in6 b = mkaddr("2001:db8::2");
+
+    shadow_apply(servconf.shadow, ifconf.record, &a.sin6_addr, false, 3600);
+    shadow_apply(servconf.shadow, ifconf.record, &b.sin6_addr, false, 3600);
+
+    ldns_pkt *reply = mkreply("foo.example.com. 3600 IN AAAA 2001:db8::1");
+    verify_query_cb(reply, LDNS_STATUS_OK, &ifconf);
+    ldns_pkt_free(reply);
+
+    struct batch *batch = servconf.batch;
+
+    assert(eq(sz, batch->used, 1));
+    assert(eq(sz, batch->zones[0].used, 1));
+    expect(eq(i32, memcmp(&batch->zones[0].ops[0].addr, &b, sizeof b), 0));
+}
+
+Test(verify, stale_address_is_deleted_again) {
+    struct sockaddr_in6 a = mkaddr("2001:db8::1");
+
+    shadow_apply(servconf.shadow, ifconf.record, &a.sin6_addr, true, 0);
+
+    ldns_pkt *reply = mkreply("foo.example.com. 3600 IN AAAA 2001:db8::1");
+    verify_query_cb(reply, LDNS_STATUS_OK, &ifconf);
+    ldns_pkt_free(reply);
+
+    struct batch *batch = servconf.batch;
+
+    assert(eq(sz, batch->used, 1));
+    assert(eq(sz, batch->zones[0].used, 1));
+    expect(batch->zones[0].ops[0].delete);
+}
+
+Test(verify, answer_during_update_is_ignored) {
+    struct sockaddr_in6 a = mkaddr("2001:db8::1");
+
+    shadow_apply(servconf.shadow, ifconf.record, &a.sin6_addr, false, 3600);
+    shadow_sent(servconf.shadow, ifconf.record);
+
+    ldns_pkt *reply = mkreply(NULL);
+    verify_query_cb(reply, LDNS_STATUS_OK, &ifconf);
+    ldns_pkt_free(reply);
+
+    expect(eq(sz, servconf.batch->used, 0));
+}